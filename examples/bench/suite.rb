@@ -0,0 +1,249 @@
+# frozen_string_literal: true
+
+# Reproducible benchmark suite: every workload of workloads.rb is scanned by every engine over every
+# dataset size, and the results are written as JSON so runs can be compared across mongory-core bumps.
+#
+#   rake bench
+#   SIZES=1000,100000 WORKLOADS=scalar,regex ENGINES=plain,c_matcher rake bench
+#   BASELINE=tmp/bench/before.json rake bench
+#
+# Environment:
+# - SIZES          dataset sizes, default 20,1000,10000,100000,1000000
+# - WORKLOADS      workload names, default all of them
+# - ENGINES        plain, query_matcher, fast, c_matcher and c_dataset, default all of them
+# - BENCH_SECONDS  time spent scanning each engine, default 1.0, at least MIN_SCANS scans are run
+# - SEED           seed of the generated records, default 42
+# - OUT            path of the JSON results, default tmp/bench/<timestamp>.json
+# - BASELINE       JSON results of an earlier run to compare the records per second with
+
+require_relative '../../lib/mongory'
+require 'json'
+require 'fileutils'
+require 'time'
+require_relative 'workloads'
+
+module MongoryBench
+  ROOT = File.expand_path('../..', __dir__)
+  CORE_DIR = File.join(ROOT, 'ext/mongory_ext/mongory-core')
+  DEFAULT_SIZES = [20, 1000, 10_000, 100_000, 1_000_000].freeze
+  MIN_SCANS = 20
+
+  # An engine builds, from a workload and its records, the scan the suite times.
+  # Building is timed apart as the setup: compiling the matcher or converting a dataset.
+  ENGINES = {
+    'plain' => ->(workload, records) { -> { records.select(&workload.plain) } },
+    'query_matcher' => lambda do |workload, records|
+      builder = records.mongory.where(workload.condition)
+      -> { builder.to_a }
+    end,
+    'fast' => lambda do |workload, records|
+      builder = records.mongory.where(workload.condition)
+      -> { quietly { builder.fast.to_a } }
+    end,
+    'c_matcher' => lambda do |workload, records|
+      matcher = Mongory::CMatcher.new(workload.condition)
+      -> { matcher.filter(records) }
+    end,
+    'c_dataset' => lambda do |workload, records|
+      matcher = Mongory::CMatcher.new(workload.condition)
+      dataset = Mongory::CDataset.new(records)
+      -> { matcher.filter(dataset) }
+    end
+  }.freeze
+
+  C_ENGINES = %w(c_matcher c_dataset).freeze
+
+  # @yield silences the deprecation warning `QueryBuilder#fast` prints on every scan
+  def self.quietly
+    verbose = $VERBOSE
+    $VERBOSE = nil
+    yield
+  ensure
+    $VERBOSE = verbose
+  end
+
+  # Runs the engines over the workloads and dataset sizes of its config.
+  class Suite
+    def initialize(env = ENV)
+      @sizes = list(env['SIZES'])&.map { |size| Integer(size.delete('_')) } || DEFAULT_SIZES
+      @workloads = MongoryBench.workloads(list(env['WORKLOADS']))
+      @engines = list(env['ENGINES']) || ENGINES.keys
+      unknown = @engines - ENGINES.keys
+      raise ArgumentError, "unknown engines: #{unknown.join(', ')}" unless unknown.empty?
+
+      @seconds = Float(env.fetch('BENCH_SECONDS', '1.0'))
+      @seed = Integer(env.fetch('SEED', '42'))
+      @out = env['OUT']
+      @baseline = env['BASELINE']
+    end
+
+    # @return [Hash] the written report
+    def run
+      Mongory.register(Array)
+      Mongory.enable_symbol_snippets!
+      started_at = Time.now
+      results = @sizes.flat_map do |size|
+        @workloads.flat_map { |workload| run_workload(workload, size) }
+      end
+      report = metadata(started_at).merge('results' => results)
+      write(report, started_at)
+      compare(results) if @baseline
+      report
+    end
+
+    private
+
+    # @param workload [Workload]
+    # @param size [Integer]
+    # @return [Array<Hash>] the result of every engine
+    def run_workload(workload, size)
+      rng = Random.new(@seed)
+      records = Array.new(size) { |i| workload.record.call(rng, i) }
+      expected = records.count(&workload.plain)
+      puts "\n#{workload.name} (#{workload.description}), #{size} records, #{expected} matching"
+      puts format('  %-14s %14s %12s %12s %12s %10s', 'engine', 'records/s', 'p50 scan ns', 'p99 scan ns',
+                  'allocs/rec', 'rss MB')
+
+      @engines.map do |engine|
+        result = { 'workload' => workload.name, 'size' => size, 'engine' => engine, 'matches' => expected }
+        result.merge!(measure(engine, workload, records, expected))
+        print_result(result)
+        result
+      end
+    end
+
+    # @return [Hash] the metrics of one engine, or its skip reason or error
+    def measure(engine, workload, records, expected)
+      return { 'skipped' => 'C extension not loaded' } if C_ENGINES.include?(engine) && !c_extension?
+
+      GC.start
+      setup_started = clock
+      scan = ENGINES.fetch(engine).call(workload, records)
+      setup_ns = clock - setup_started
+
+      count = scan.call.size
+      raise "count mismatch: #{count} matched, #{expected} expected" if count != expected
+
+      samples, allocated = timed_scans(scan)
+      metrics(samples, allocated, records.size).merge('setup_ms' => (setup_ns / 1e6).round(3))
+    rescue StandardError => e
+      { 'error' => "#{e.class}: #{e.message}" }
+    end
+
+    # @return [Array(Array<Integer>, Integer)] the nanoseconds of every scan and the objects they allocated
+    def timed_scans(scan)
+      samples = []
+      deadline = clock + (@seconds * 1e9)
+      allocated_before = GC.stat(:total_allocated_objects)
+      while samples.size < MIN_SCANS || clock < deadline
+        started = clock
+        scan.call
+        samples << (clock - started)
+      end
+      [samples, GC.stat(:total_allocated_objects) - allocated_before]
+    end
+
+    # The percentiles are taken over the scans, each divided by the dataset size: they tell how steady
+    # the scans are, not how long a single match takes, which is too short to be timed apart from the clock.
+    def metrics(samples, allocated, size)
+      per_record = samples.map { |ns| ns.fdiv([size, 1].max) }.sort
+      total_ns = samples.sum
+      {
+        'scans' => samples.size,
+        'scans_per_sec' => (samples.size * 1e9 / total_ns).round(3),
+        'records_per_sec' => (samples.size * size * 1e9 / total_ns).round,
+        'p50_scan_ns_per_record' => percentile(per_record, 0.50).round(2),
+        'p99_scan_ns_per_record' => percentile(per_record, 0.99).round(2),
+        'allocations_per_record' => allocated.fdiv(samples.size * [size, 1].max).round(3),
+        'rss_kb' => rss_kb
+      }
+    end
+
+    def percentile(sorted, rank)
+      sorted[((sorted.size - 1) * rank).round]
+    end
+
+    def print_result(result)
+      if result.key?('error') || result.key?('skipped')
+        puts format('  %-14s %s', result['engine'], result['error'] || result['skipped'])
+        return
+      end
+
+      puts format('  %-14s %14d %12.1f %12.1f %12.3f %10.1f', result['engine'], result['records_per_sec'],
+                  result['p50_scan_ns_per_record'], result['p99_scan_ns_per_record'], result['allocations_per_record'],
+                  result['rss_kb'].to_i / 1024.0)
+    end
+
+    def metadata(started_at)
+      {
+        'mongory_version' => Mongory::VERSION,
+        'ruby_version' => RUBY_DESCRIPTION,
+        'platform' => RUBY_PLATFORM,
+        'c_extension' => c_extension?,
+        'core_revision' => core_revision,
+        'started_at' => started_at.utc.iso8601,
+        'config' => {
+          'sizes' => @sizes, 'workloads' => @workloads.map(&:name), 'engines' => @engines,
+          'bench_seconds' => @seconds, 'seed' => @seed
+        }
+      }
+    end
+
+    def write(report, started_at)
+      dir = File.join(ROOT, 'tmp/bench')
+      path = @out || File.join(dir, "#{started_at.utc.strftime('%Y%m%dT%H%M%SZ')}.json")
+      FileUtils.mkdir_p(File.dirname(path))
+      json = JSON.pretty_generate(report)
+      File.write(path, json)
+      File.write(File.join(dir, 'latest.json'), json) unless @out
+      puts "\nResults written to #{path}"
+    end
+
+    # Prints the change of records per second against the results of an earlier run.
+    def compare(results)
+      baseline = JSON.parse(File.read(@baseline))['results'].to_h do |result|
+        [result.values_at('workload', 'size', 'engine'), result]
+      end
+      puts "\nCompared with #{@baseline}:"
+      results.each do |result|
+        before = baseline[result.values_at('workload', 'size', 'engine')]
+        next unless before&.key?('records_per_sec') && result.key?('records_per_sec')
+
+        change = (result['records_per_sec'].fdiv(before['records_per_sec']) - 1) * 100
+        puts format('  %-12s %8d %-14s %+7.1f%%', *result.values_at('workload', 'size', 'engine'), change)
+      end
+    end
+
+    def c_extension?
+      defined?(Mongory::CMatcher) ? true : false
+    end
+
+    # @return [String, nil] the mongory-core commit the extension was built from
+    def core_revision
+      return unless Dir.exist?(CORE_DIR)
+
+      revision = IO.popen(['git', '-C', CORE_DIR, 'rev-parse', 'HEAD'], err: File::NULL, &:read).strip
+      revision.empty? ? nil : revision
+    rescue SystemCallError
+      nil
+    end
+
+    # @return [Integer, nil] the resident set size of the process
+    def rss_kb
+      status = File.read('/proc/self/status')[/^VmRSS:\s+(\d+)/, 1] if File.readable?('/proc/self/status')
+      Integer(status || IO.popen(['ps', '-o', 'rss=', '-p', Process.pid.to_s], &:read).strip)
+    rescue StandardError
+      nil
+    end
+
+    def clock
+      Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+    end
+
+    def list(value)
+      value&.split(',')&.map(&:strip)&.reject(&:empty?)
+    end
+  end
+end
+
+MongoryBench::Suite.new.run if $PROGRAM_NAME == __FILE__
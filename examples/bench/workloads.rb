@@ -0,0 +1,92 @@
+# frozen_string_literal: true
+
+require 'set'
+
+# Query shapes of the benchmark suite. Every workload builds its own records, so a 1M record run only
+# holds the fields its condition reads, and gives the plain Ruby predicate every engine must agree with.
+module MongoryBench
+  # Custom operator of the `custom` workload, matched by calling back into Ruby
+  class DivisibleByMatcher < Mongory::Matchers::AbstractMatcher
+    def match(subject)
+      subject.is_a?(Integer) && (subject % @condition).zero?
+    end
+
+    def check_validity!
+      raise TypeError, '$divisibleBy needs a positive Integer' unless @condition.is_a?(Integer) && @condition.positive?
+    end
+  end
+
+  Mongory::Matchers.register(:divisible_by, '$divisibleBy', DivisibleByMatcher)
+
+  # A workload: the record generator, the condition and the equivalent plain Ruby predicate
+  Workload = Struct.new(:name, :description, :record, :condition, :plain)
+
+  STATUSES = %w(active inactive banned pending).freeze
+  CITIES = Array.new(500) { |i| "city-#{i}" }.freeze
+  PICKED_CITIES = CITIES.each_slice(5).map(&:first).freeze
+  PICKED_CITY_SET = PICKED_CITIES.to_set.freeze
+  PICKED_AGES = (1..100).step(3).to_a.freeze
+  PICKED_AGE_SET = PICKED_AGES.to_set.freeze
+  DOMAINS = %w(example.com example.org mail.test corp.test).freeze
+  EMAIL_PATTERN = /example\.org\z/.freeze
+
+  WORKLOADS = [
+    Workload.new(
+      'scalar',
+      'range and equality on top level fields',
+      ->(rng, _i) { { 'age' => rng.rand(10) < 9 ? rng.rand(1..100) : nil, 'status' => STATUSES.sample(random: rng) } },
+      { 'age' => { '$gte' => 18 }, 'status' => 'active' },
+      ->(r) { r['age'].is_a?(Numeric) && r['age'] >= 18 && r['status'] == 'active' }
+    ),
+    Workload.new(
+      'in_heavy',
+      '$in over 100 Strings and 34 Integers',
+      ->(rng, _i) { { 'city' => CITIES.sample(random: rng), 'age' => rng.rand(1..100) } },
+      { 'city' => { '$in' => PICKED_CITIES }, 'age' => { '$in' => PICKED_AGES } },
+      ->(r) { PICKED_CITY_SET.include?(r['city']) && PICKED_AGE_SET.include?(r['age']) }
+    ),
+    Workload.new(
+      'regex',
+      '$regex anchored at the end of a String',
+      ->(rng, i) { { 'email' => "user#{i}@#{DOMAINS.sample(random: rng)}" } },
+      { 'email' => { '$regex' => EMAIL_PATTERN } },
+      ->(r) { r['email'].is_a?(String) && EMAIL_PATTERN.match?(r['email']) }
+    ),
+    Workload.new(
+      'nested',
+      'dotted paths into nested Hashes',
+      lambda do |rng, _i|
+        { 'profile' => { 'address' => { 'city' => CITIES[rng.rand(10)] }, 'score' => rng.rand(100) } }
+      end,
+      { 'profile.address.city' => 'city-3', 'profile.score' => { '$gt' => 50 } },
+      ->(r) { r['profile']['address']['city'] == 'city-3' && r['profile']['score'] > 50 }
+    ),
+    Workload.new(
+      'elem_match',
+      '$elemMatch over an Array of Hashes',
+      lambda do |rng, _i|
+        orders = Array.new(rng.rand(4)) { { 'total' => rng.rand(200), 'status' => STATUSES.sample(random: rng) } }
+        { 'orders' => orders }
+      end,
+      { 'orders' => { '$elemMatch' => { 'total' => { '$gt' => 100 }, 'status' => 'active' } } },
+      ->(r) { r['orders'].any? { |order| order['total'] > 100 && order['status'] == 'active' } }
+    ),
+    Workload.new(
+      'custom',
+      'custom Ruby matcher next to a native comparison',
+      ->(rng, i) { { 'id' => i, 'age' => rng.rand(1..100) } },
+      { 'id' => { '$divisibleBy' => 7 }, 'age' => { '$lt' => 50 } },
+      ->(r) { (r['id'] % 7).zero? && r['age'] < 50 }
+    )
+  ].freeze
+
+  # @param names [Array<String>, nil] the workloads to run, all of them when nil
+  # @return [Array<Workload>]
+  def self.workloads(names = nil)
+    return WORKLOADS if names.nil?
+
+    names.map do |name|
+      WORKLOADS.find { |workload| workload.name == name } || raise(ArgumentError, "unknown workload: #{name}")
+    end
+  end
+end
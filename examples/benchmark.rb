@@ -72,6 +72,21 @@ end
     raise "count mismatch" if records.count { |r| matcher.match?(r) } != count_of_simple_query
   end
 
+  # Simple query (Mongory::CMatcher with sampled trace) test
+  puts "\nSimple query (Mongory::CMatcher with sampled trace) (#{size} records):"
+  gc_handler do
+    matcher = Mongory::CMatcher.new({:age.gte => 18})
+    matcher.enable_trace(sample: 0.001)
+    5.times do
+      result = Benchmark.measure do
+        records.select { |r| matcher.match?(r) }
+      end
+      puts result
+    end
+    raise "count mismatch" if records.count { |r| matcher.match?(r) } != count_of_simple_query
+    matcher.disable_trace
+  end
+
   # Simple query (Mongory::CQueryBuilder) test
   puts "\nSimple query (Mongory::CQueryBuilder) (#{size} records):"
   gc_handler do
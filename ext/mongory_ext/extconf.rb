@@ -54,6 +54,11 @@ $CFLAGS << ' -std=c99 -Wall -Wextra -Wno-incompatible-pointer-types -Wno-int-con
 $CFLAGS << ' -Wno-declaration-after-statement -Wno-discarded-qualifiers'
 $CFLAGS << ' -O2' unless ENV['DEBUG']
 $CFLAGS << ' -g -O0 -DDEBUG' if ENV['DEBUG']
+# Compile the per-match trace check out of the hot path, enable_trace then raises
+$CFLAGS << ' -DMONGORY_DISABLE_TRACE' if ENV['MONGORY_DISABLE_TRACE']
+
+# Ruby 2.7+ compacts the heap, matchers and datasets then let their condition and record objects move
+have_func('rb_gc_mark_movable', 'ruby.h')
 
 # --- macOS (darwin) linking: avoid hard-linking libruby, let symbols resolve at load time
 if RbConfig::CONFIG['host_os'] =~ /darwin/
@@ -9,12 +9,19 @@
 #include "mongory-core.h"
 #include <ruby.h>
 #include <ruby/encoding.h>
+#include <ruby/re.h>
+#include <ruby/thread.h>
+#include <ruby/util.h>
 #include <string.h>
+#include <time.h>
 
 // Ruby module and class definitions
 static VALUE mMongory;
 static VALUE cMongoryMatcher;
 static VALUE cMongoryMatcherContext;
+static VALUE cMongoryDataset;
+static VALUE cMongoryMatcherSlot;
+static VALUE cMongoryMatcherTrace;
 static VALUE mMongoryMatchers;
 
 // Error classes
@@ -25,24 +32,131 @@ static VALUE eMongoryTypeError;
 static VALUE inMongoryDataConverter;
 static VALUE inMongoryConditionConverter;
 
+// Regexp::FIXEDENCODING, used to compile the native regex clones
+static int rb_mongory_reg_fixed_encoding;
+
+// Operators Mongory::Matchers.lookup has answered, registrations are never withdrawn
+static st_table *rb_mongory_custom_operators;
+
+// Mongory::Converters::DataConverter#native_types ivar and its kinds
+static ID rb_mongory_id_native_types;
+static ID rb_mongory_id_native_symbol;
+static ID rb_mongory_id_native_date;
+static ID rb_mongory_id_native_time;
+static ID rb_mongory_id_native_number;
+
+// Mongory::Utils::Context ivar of the record of every fiber matching with it
+static ID rb_mongory_id_current_records;
+
+// How matches of a matcher are traced
+typedef enum rb_mongory_trace_mode {
+  RB_MONGORY_TRACE_OFF,
+  RB_MONGORY_TRACE_ALL,     // the core trace of every match is printed
+  RB_MONGORY_TRACE_SAMPLED, // sampled matches are recorded into the trace ring buffer
+  RB_MONGORY_TRACE_PROFILE, // matches are counted and timed, then the profile children are matched
+} rb_mongory_trace_mode;
+
+// Scratch state of the matches of one fiber: the arena records are converted into and the projection
+// of its running scan. The matcher tree is only read while matching, so fibers whose matches interleave
+// at a Ruby callback share the matcher, each with a scratch of its own.
+typedef struct rb_mongory_scratch_t {
+  mongory_memory_pool *pool;
+  VALUE fiber;                                // the fiber matching with it, Qnil when free
+  uintptr_t frame;                            // stack address of the claim, nested claims are deeper
+  struct rb_mongory_projection_t *projection; // fields read from every match of the running scan
+  VALUE projected;                            // the fields of the last match, collected right after it
+} rb_mongory_scratch_t;
+
 // Matcher wrapper structure
 typedef struct rb_mongory_matcher_t {
   mongory_matcher *matcher;
   mongory_value *condition;
   mongory_memory_pool *pool;
-  mongory_memory_pool *scratch_pool;
+  rb_mongory_scratch_t **scratches; // one per fiber matching concurrently, the first is built with the matcher
+  long scratch_count;
   mongory_memory_pool *trace_pool;
-  mongory_table *string_map;
-  mongory_table *symbol_map;
+  rb_mongory_trace_mode trace_mode;
+  double trace_sample;
+  uint64_t trace_state; // xorshift64 state of the sampler
+  VALUE trace_sink;
+  VALUE trace_buffer;
+  long trace_capacity;
+  long trace_count;
+  VALUE profile_children; // CMatchers of the sub-conditions, see Mongory::CMatcher#profile
+  bool profile_any;       // the children are $or branches, a match stops evaluating them
+  uint64_t profile_evals;
+  uint64_t profile_matches;
+  uint64_t profile_nanos;
+  mongory_table *key_map;
   mongory_array *mark_list;
+  size_t generation;
+  size_t key_hits;
+  size_t key_misses;
+  bool native_regex;
+  bool plan_checked;
+  struct rb_mongory_plan_t *plan;
+  long plan_leaves;
+  bool plan_batch; // the plan calls match_batch? and needs the GVL
+  VALUE plan_origin;
+  struct rb_mongory_slot_t *slots;
+  mongory_memory_pool *bind_pool;
+  VALUE bound;
+  long scanning;
   VALUE ctx;
 } rb_mongory_matcher_t;
 
+// Field key compiled once per matcher: both Ruby key forms of one condition key,
+// the key style that hit last, and the wrapped value of the last lookup
+typedef struct rb_mongory_field_key_t {
+  VALUE string_key;
+  VALUE symbol_key;
+  bool symbol_first;
+  VALUE last_hash;
+  mongory_value *last_value;
+  mongory_memory_pool *last_pool;
+  size_t last_generation;
+} rb_mongory_field_key_t;
+
+// Dataset wrapper structure: records converted once into rows owned by the dataset
+typedef struct rb_mongory_dataset_t {
+  mongory_memory_pool *pool;
+  mongory_value **rows;
+  long count;
+  long scanning;
+  struct rb_mongory_column_t *columns;
+  VALUE records;
+  VALUE rows_origin;
+  VALUE columns_origin;
+} rb_mongory_dataset_t;
+
 typedef struct rb_mongory_memory_pool_t {
   mongory_memory_pool base;
   rb_mongory_matcher_t *owner;
+  bool scratch; // a scratch arena of the owner, its field lookups are memoized for one match
 } rb_mongory_memory_pool_t;
 
+// Chunk of the scratch arena, a large allocation gets a chunk of its own
+typedef struct rb_mongory_arena_chunk_t {
+  struct rb_mongory_arena_chunk_t *next;
+  size_t size;
+  size_t used;
+} rb_mongory_arena_chunk_t;
+
+// Bump arena behind every pool of the bridge. Allocations are rounded up to 16 byte size classes
+// and carved out of fixed size chunks, larger ones get a chunk of their own. Reset keeps the chunks
+// up to the retained size and frees the rest, so one huge record does not pin the peak.
+// Allocations are zeroed like the core pool does, the bridge wrappers leave unused fields NULL.
+typedef struct rb_mongory_arena_t {
+  rb_mongory_memory_pool_t pool;
+  rb_mongory_arena_chunk_t *chunks; // retained chunks, reused in order after a reset
+  rb_mongory_arena_chunk_t *current;
+  rb_mongory_arena_chunk_t *large;  // freed on every reset
+  size_t retained;
+  size_t reserved;
+  size_t in_use;
+  size_t peak;
+} rb_mongory_arena_t;
+
 typedef struct rb_mongory_table_t {
   mongory_table base;
   VALUE rb_hash;
@@ -55,30 +169,333 @@ typedef struct rb_mongory_array_t {
   rb_mongory_matcher_t *owner;
 } rb_mongory_array_t;
 
+// Object of a raw JSON record, its members are read on demand by get.
+// The document was validated before matching, end only bounds the readers.
+typedef struct rb_mongory_json_table_t {
+  mongory_table base;
+  const char *start; // the opening brace
+  const char *end;   // the end of the document
+} rb_mongory_json_table_t;
+
+// Array of a raw JSON record, elements read in order are found in constant time from the cursor
+typedef struct rb_mongory_json_array_t {
+  mongory_array base;
+  const char *start; // the opening bracket
+  const char *end;   // the end of the document
+  size_t cursor_index;
+  const char *cursor; // the element at cursor_index
+} rb_mongory_json_array_t;
+
 typedef struct {
   mongory_table *table;
   mongory_memory_pool *pool;
 } hash_conv_ctx;
 
+// How a compiled $regex pattern is matched
+typedef enum rb_mongory_regex_kind {
+  RB_MONGORY_REGEX_RUBY,    // Regexp#match?
+  RB_MONGORY_REGEX_ONIG,    // onig_search on the UTF-8 clone
+  RB_MONGORY_REGEX_LITERAL, // byte search of an ASCII literal, skipping the regex engine
+} rb_mongory_regex_kind;
+
+// Anchors around a literal pattern
+typedef enum rb_mongory_regex_anchor {
+  RB_MONGORY_ANCHOR_NONE,
+  RB_MONGORY_ANCHOR_STRING, // \A or \z
+  RB_MONGORY_ANCHOR_LINE,   // ^ or $
+} rb_mongory_regex_anchor;
+
+// $regex pattern compiled once at CMatcher.new, stored in mongory_value.data.regex
+typedef struct rb_mongory_regex_t {
+  VALUE rb_re;
+  VALUE native_re;
+  rb_mongory_regex_kind kind;
+  rb_mongory_regex_anchor start_anchor;
+  rb_mongory_regex_anchor end_anchor;
+  char *literal;
+  long literal_len;
+} rb_mongory_regex_t;
+
+// $in / $nin lists at least this long are compiled into a hash set
+#define RB_MONGORY_IN_SET_THRESHOLD 16
+
+// Bridge-native operators the condition is rewritten to, matched without Ruby
+#define RB_MONGORY_IN_SET_OPERATOR "$mongoryInSet"
+#define RB_MONGORY_NIN_SET_OPERATOR "$mongoryNinSet"
+
+// One slot of the open-addressing value set, keyed by Ruby type
+typedef struct rb_mongory_set_entry_t {
+  st_index_t hash;
+  bool used;
+  bool is_string;
+  int64_t integer;
+  const char *bytes;
+  long len;
+} rb_mongory_set_entry_t;
+
+// Open-addressing hash set of the integer and string values of a $in / $nin list
+typedef struct rb_mongory_value_set_t {
+  rb_mongory_set_entry_t *entries;
+  size_t mask;
+  size_t count;
+} rb_mongory_value_set_t;
+
+// Bridge-native operator $intervals conditions are rewritten to
+#define RB_MONGORY_INTERVALS_OPERATOR "$mongoryIntervals"
+
+// One side of an interval, integers are kept exact
+typedef struct rb_mongory_bound_t {
+  bool bounded;
+  bool inclusive;
+  bool is_integer;
+  int64_t integer;
+  double number;
+} rb_mongory_bound_t;
+
+typedef struct rb_mongory_interval_t {
+  rb_mongory_bound_t lower;
+  rb_mongory_bound_t upper;
+} rb_mongory_interval_t;
+
+// Sorted, disjoint intervals of an $intervals condition
+typedef struct rb_mongory_interval_set_t {
+  rb_mongory_interval_t *intervals;
+  long count;
+} rb_mongory_interval_set_t;
+
+// What a custom matcher context points to
+typedef enum rb_mongory_custom_kind {
+  RB_MONGORY_CUSTOM_RUBY,      // a Ruby matcher registered in Mongory::Matchers
+  RB_MONGORY_CUSTOM_IN_SET,    // bridge-native $in over a value set
+  RB_MONGORY_CUSTOM_NIN_SET,   // bridge-native $nin over a value set
+  RB_MONGORY_CUSTOM_INTERVALS, // bridge-native $intervals
+} rb_mongory_custom_kind;
+
+typedef struct rb_mongory_custom_matcher_t {
+  rb_mongory_custom_kind kind;
+  VALUE rb_matcher;
+  rb_mongory_value_set_t *set;
+  rb_mongory_interval_set_t *intervals;
+} rb_mongory_custom_matcher_t;
+
+// Placeholder of a prepared matcher, #bind overwrites its value in place
+typedef struct rb_mongory_slot_t {
+  ID name;
+  bool literal; // a field value rather than a comparison operand
+  mongory_value *value;
+  struct rb_mongory_slot_t *next;
+} rb_mongory_slot_t;
+
+// Fields of Mongory::CMatcher#pluck and #project, their segments copied into a pool of the scan
+typedef struct rb_mongory_projection_t {
+  mongory_memory_pool *pool;
+  long count;
+  char ***segments; // NULL terminated segments of each field
+  VALUE key_paths;  // the frozen segment Strings, keys of the projected Hashes
+  bool nested;      // #project builds Hashes of the fields, #pluck Arrays or the single value
+  struct rb_mongory_sort_t *sort;           // the fields are sort keys, read into the sort instead of a row
+  struct rb_mongory_aggregate_t *aggregate; // the fields are group keys and a reduced value, accumulated
+} rb_mongory_projection_t;
+
+// Typed sort key of one field, ranked by type like a MongoDB sort
+typedef struct rb_mongory_sort_key_t {
+  int rank; // missing and null, numbers, strings, tables, arrays, booleans, other values
+  bool integer;
+  union {
+    int64_t i;
+    double d;
+    bool b;
+    long value; // index of the Ruby value in the values of the sort, compared with <=>
+    struct {
+      char *ptr;
+      size_t len;
+    } s;
+  } data;
+} rb_mongory_sort_key_t;
+
+// Sort keys of one matching record, the index keeps equal keys in record order
+typedef struct rb_mongory_sort_entry_t {
+  long index;
+  rb_mongory_sort_key_t keys[];
+} rb_mongory_sort_entry_t;
+
+// State of Mongory::CMatcher#sort: the matches kept so far, a max heap of the best top ones when bounded
+typedef struct rb_mongory_sort_t {
+  rb_mongory_projection_t *projection;
+  int *directions; // 1 ascending, -1 descending
+  long top;        // entries kept, -1 keeps every match
+  long count;
+  long capacity;
+  rb_mongory_sort_entry_t **entries;
+  rb_mongory_sort_entry_t *pending; // keys of the last match, read right after it
+  VALUE values;                     // Ruby values of keys without a native order
+} rb_mongory_sort_t;
+
+// Accumulators of one group of Mongory::CMatcher#__group__
+typedef struct rb_mongory_group_t {
+  uint64_t hash;
+  long id;      // position in the groups, in order of first match
+  long count;   // matching records
+  long numbers; // numeric values of the reduced field
+  bool integer; // the sum is exact in sum_i
+  int64_t sum_i;
+  double sum_d;
+  rb_mongory_sort_key_t min;
+  rb_mongory_sort_key_t max;
+  rb_mongory_sort_key_t keys[];
+} rb_mongory_group_t;
+
+// State of a grouped scan: an open addressing table of the groups, keyed by typed group keys
+typedef struct rb_mongory_aggregate_t {
+  rb_mongory_projection_t *projection; // the group fields, then the reduced field when given
+  long key_count;
+  bool reduce;
+  long count;
+  long capacity; // slots of the table, a power of two
+  rb_mongory_group_t **slots;
+  rb_mongory_group_t **groups;
+  rb_mongory_group_t *pending; // keys of the current match, before they are looked up
+  VALUE keys;                  // the Ruby group key of each group, from its first match
+  VALUE ids;                   // ids of group key values without native equality, by value
+} rb_mongory_aggregate_t;
+
+// Sampled traces kept per matcher unless enable_trace is given a capacity
+#define RB_MONGORY_TRACE_CAPACITY 100
+
+// Scratch arena chunk size and size class granularity, allocations above a quarter chunk get their own chunk
+#define RB_MONGORY_ARENA_CHUNK 8192
+#define RB_MONGORY_ARENA_ALIGN 16
+#define RB_MONGORY_ARENA_LARGE (RB_MONGORY_ARENA_CHUNK / 4)
+#define RB_MONGORY_ARENA_HEADER \
+  ((sizeof(rb_mongory_arena_chunk_t) + RB_MONGORY_ARENA_ALIGN - 1) & ~(size_t)(RB_MONGORY_ARENA_ALIGN - 1))
+
+// Scratch bytes a matcher keeps across resets, see Mongory::CMatcher.scratch_retained_bytes=
+static size_t rb_mongory_scratch_retained = 64 * 1024;
+
+// Rows evaluated per column plan pass, a multiple of 64 so chunks start on bitmap words
+#define RB_MONGORY_PLAN_CHUNK 1024
+#define RB_MONGORY_PLAN_WORDS (RB_MONGORY_PLAN_CHUNK / 64)
+
+typedef enum rb_mongory_plan_op {
+  RB_MONGORY_PLAN_AND,
+  RB_MONGORY_PLAN_OR,
+  RB_MONGORY_PLAN_EQ,
+  RB_MONGORY_PLAN_NE,
+  RB_MONGORY_PLAN_GT,
+  RB_MONGORY_PLAN_GTE,
+  RB_MONGORY_PLAN_LT,
+  RB_MONGORY_PLAN_LTE,
+  RB_MONGORY_PLAN_BATCH, // a Ruby custom matcher answering match_batch?
+} rb_mongory_plan_op;
+
+// Compiled column plan node, see Mongory::Converters::ColumnPlanner
+typedef struct rb_mongory_plan_t {
+  rb_mongory_plan_op op;
+  struct rb_mongory_plan_t **children; // $and / $or
+  long count;
+  VALUE key_path;                      // leaves
+  long leaf_index;
+  bool boolean;
+  bool bool_value;
+  rb_mongory_bound_t operand;
+  VALUE rb_matcher;                    // batch leaves
+  bool batch;                          // a batch leaf or a node holding one
+} rb_mongory_plan_t;
+
+typedef enum rb_mongory_column_kind {
+  RB_MONGORY_COLUMN_INTEGER,
+  RB_MONGORY_COLUMN_DOUBLE,
+} rb_mongory_column_kind;
+
+// Typed column of one key path over the rows of a dataset, one bitmap bit per row.
+// Rows that are not an Integer, Float or Boolean under plain hashes are left to the matcher.
+// The raw values are kept for match_batch?, opaque marks the rows it cannot be given.
+typedef struct rb_mongory_column_t {
+  VALUE key_path;
+  rb_mongory_column_kind kind;
+  int64_t *integers;
+  double *numbers;
+  uint64_t *numeric;
+  uint64_t *trues;
+  uint64_t *falses;
+  uint64_t *fallback;
+  uint64_t *opaque;
+  VALUE values;
+  struct rb_mongory_column_t *next;
+} rb_mongory_column_t;
+
 // Forward declarations
 static void rb_mongory_matcher_mark(void *ptr);
 static void rb_mongory_matcher_free(void *ptr);
+static void rb_mongory_dataset_mark(void *ptr);
+static void rb_mongory_dataset_free(void *ptr);
+static size_t rb_mongory_matcher_memsize(const void *ptr);
+static size_t rb_mongory_dataset_memsize(const void *ptr);
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void rb_mongory_matcher_compact(void *ptr);
+static void rb_mongory_dataset_compact(void *ptr);
+#else
+// Ruby 2.6 has no compaction, every marked object stays in place
+#define rb_gc_mark_movable(value) rb_gc_mark(value)
+#endif
 mongory_value *rb_to_mongory_value_deep(mongory_memory_pool *pool, VALUE rb_value);
 mongory_value *rb_to_mongory_value_shallow(mongory_memory_pool *pool, VALUE rb_value);
 mongory_value *rb_mongory_table_wrap(mongory_memory_pool *pool, VALUE rb_hash);
 mongory_value *rb_mongory_array_wrap(mongory_memory_pool *pool, VALUE rb_array);
-static VALUE cache_fetch_string(rb_mongory_matcher_t *owner, const char *key);
-static VALUE cache_fetch_symbol(rb_mongory_matcher_t *owner, const char *key);
+static mongory_value *rb_mongory_regex_wrap(mongory_memory_pool *pool, VALUE rb_re);
+static mongory_value *rb_mongory_value_set_wrap(mongory_memory_pool *pool, VALUE rb_array);
+static mongory_value *rb_mongory_interval_set_wrap(mongory_memory_pool *pool, VALUE rb_array);
+static rb_mongory_field_key_t *rb_mongory_field_key_fetch(rb_mongory_matcher_t *owner, char *key, VALUE rb_key);
 static rb_mongory_memory_pool_t *rb_mongory_memory_pool_new();
+static rb_mongory_memory_pool_t *rb_mongory_arena_new(size_t retained);
+static size_t rb_mongory_pool_memsize(mongory_memory_pool *pool);
 static void rb_mongory_matcher_parse_argv(rb_mongory_matcher_t *wrapper, int argc, VALUE *argv);
+static rb_mongory_scratch_t *rb_mongory_scratch_add(rb_mongory_matcher_t *wrapper, size_t retained);
 static bool rb_mongory_error_handling(mongory_memory_pool *pool, char *error_message);
+static rb_mongory_plan_t *rb_mongory_matcher_plan(VALUE self, rb_mongory_matcher_t *wrapper);
+static VALUE rb_mongory_custom_matcher_new(VALUE matcher_class, VALUE condition, VALUE ctx);
+static ID rb_mongory_native_kind(VALUE klass);
+#ifndef MONGORY_DISABLE_TRACE
+static bool rb_mongory_matcher_match_traced(rb_mongory_matcher_t *wrapper, mongory_value *data_value);
+#endif
+static VALUE rb_mongory_trace_enable_sampled(rb_mongory_matcher_t *wrapper, VALUE sample, VALUE sink, VALUE capacity);
+static VALUE rb_mongory_matcher_traces(VALUE self);
+static mongory_value *rb_mongory_native_data_wrap(mongory_memory_pool *pool, VALUE rb_value);
+static mongory_value *rb_mongory_slot_wrap(rb_mongory_matcher_t *owner, mongory_memory_pool *pool, char *key,
+                                           VALUE rb_slot);
+static void rb_mongory_plan_columns(rb_mongory_plan_t *plan, rb_mongory_dataset_t *dataset,
+                                    rb_mongory_column_t **columns);
+static void rb_mongory_plan_eval(rb_mongory_plan_t *plan, rb_mongory_column_t **columns, long start, long n,
+                                 const uint64_t *skip, uint64_t *match, uint64_t *uncertain);
+static mongory_value *rb_mongory_json_document(mongory_memory_pool *pool, VALUE rb_json);
+static char *rb_mongory_json_to_cstr(mongory_value *value, mongory_memory_pool *pool);
+static VALUE rb_mongory_value_origin(mongory_value *value);
+static VALUE rb_mongory_projection_row(rb_mongory_projection_t *projection, mongory_value *record);
+static void rb_mongory_sort_read(rb_mongory_sort_t *sort, mongory_value *record);
+static void rb_mongory_aggregate_add(rb_mongory_aggregate_t *aggregate, mongory_value *record);
 
 static const rb_data_type_t rb_mongory_matcher_type = {
   .wrap_struct_name = "mongory_matcher",
   .function = {
     .dmark = rb_mongory_matcher_mark,
     .dfree = rb_mongory_matcher_free,
-    .dsize = NULL,
+    .dsize = rb_mongory_matcher_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+    .dcompact = rb_mongory_matcher_compact,
+#endif
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static const rb_data_type_t rb_mongory_dataset_type = {
+  .wrap_struct_name = "mongory_dataset",
+  .function = {
+    .dmark = rb_mongory_dataset_mark,
+    .dfree = rb_mongory_dataset_free,
+    .dsize = rb_mongory_dataset_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+    .dcompact = rb_mongory_dataset_compact,
+#endif
   },
   .flags = RUBY_TYPED_FREE_IMMEDIATELY,
 };
@@ -91,544 +508,4693 @@ static const rb_data_type_t rb_mongory_matcher_type = {
 static VALUE rb_mongory_matcher_new(int argc, VALUE *argv, VALUE class) {
   rb_mongory_memory_pool_t *matcher_pool = rb_mongory_memory_pool_new();
   mongory_memory_pool *matcher_pool_base = &matcher_pool->base;
-  rb_mongory_memory_pool_t *scratch_pool = rb_mongory_memory_pool_new();
-  mongory_memory_pool *scratch_pool_base = &scratch_pool->base;
   rb_mongory_matcher_t *wrapper = ALLOC(rb_mongory_matcher_t);
   wrapper->pool = matcher_pool_base;
-  wrapper->scratch_pool = scratch_pool_base;
+  wrapper->scratches = NULL;
+  wrapper->scratch_count = 0;
   wrapper->trace_pool = NULL;
+  wrapper->trace_mode = RB_MONGORY_TRACE_OFF;
+  wrapper->trace_sample = 0.0;
+  wrapper->trace_state = 0;
+  wrapper->trace_sink = Qnil;
+  wrapper->trace_buffer = Qnil;
+  wrapper->trace_capacity = 0;
+  wrapper->trace_count = 0;
+  wrapper->profile_children = Qnil;
+  wrapper->profile_any = false;
+  wrapper->profile_evals = 0;
+  wrapper->profile_matches = 0;
+  wrapper->profile_nanos = 0;
   wrapper->ctx = NULL;
-  wrapper->string_map = mongory_table_new(matcher_pool_base);
-  wrapper->symbol_map = mongory_table_new(matcher_pool_base);
+  wrapper->key_map = mongory_table_new(matcher_pool_base);
   wrapper->mark_list = mongory_array_new(matcher_pool_base);
+  wrapper->generation = 0;
+  wrapper->key_hits = 0;
+  wrapper->key_misses = 0;
+  wrapper->native_regex = false;
+  wrapper->plan_checked = false;
+  wrapper->plan = NULL;
+  wrapper->plan_leaves = 0;
+  wrapper->plan_batch = false;
+  wrapper->plan_origin = Qnil;
+  wrapper->slots = NULL;
+  wrapper->bind_pool = NULL;
+  wrapper->bound = Qnil;
+  wrapper->scanning = 0;
   wrapper->condition = NULL;
   wrapper->matcher = NULL;
   matcher_pool->owner = wrapper;
-  scratch_pool->owner = wrapper;
+  rb_mongory_scratch_add(wrapper, rb_mongory_scratch_retained);
+  // Wrapped before the conversion, so the field keys compiled on the way are marked and a raise frees the pools
+  VALUE self = TypedData_Wrap_Struct(class, &rb_mongory_matcher_type, wrapper);
   rb_mongory_matcher_parse_argv(wrapper, argc, argv);
 
   mongory_matcher *matcher = mongory_matcher_new(matcher_pool_base, wrapper->condition, wrapper->ctx);
   if (rb_mongory_error_handling(matcher_pool_base, "Failed to create matcher")) {
-    matcher_pool_base->free(matcher_pool_base);
-    scratch_pool_base->free(scratch_pool_base);
-    xfree(wrapper);
     return Qnil;
   }
 
   wrapper->matcher = matcher;
-  return TypedData_Wrap_Struct(class, &rb_mongory_matcher_type, wrapper);
+  return self;
 }
 
 static void rb_mongory_matcher_parse_argv(rb_mongory_matcher_t *self, int argc, VALUE *argv) {
   VALUE condition, kw_hash;
   rb_scan_args(argc, argv, "1:", &condition, &kw_hash);
-  const ID ctx_id[1] = { rb_intern("context") };
-  VALUE kw_vals[1] = { Qundef };
+  const ID kw_ids[2] = { rb_intern("context"), rb_intern("native_regex") };
+  VALUE kw_vals[2] = { Qundef, Qundef };
   if (kw_hash != Qnil) {
-    rb_get_kwargs(kw_hash, ctx_id, 1, 0, kw_vals);
+    rb_get_kwargs(kw_hash, kw_ids, 0, 2, kw_vals);
   }
   if (kw_vals[0] != Qundef) {
     self->ctx = kw_vals[0];
   } else {
     self->ctx = rb_funcall(cMongoryMatcherContext, rb_intern("new"), 0);
   }
+  self->native_regex = kw_vals[1] != Qundef && RTEST(kw_vals[1]);
   VALUE converted_condition = rb_funcall(inMongoryConditionConverter, rb_intern("convert"), 1, condition);
+  // The condition and its compiled field keys are marked movable, see rb_mongory_matcher_compact
   self->condition = rb_to_mongory_value_deep(self->pool, converted_condition);
-  self->mark_list->push(self->mark_list, self->condition);
   mongory_value *store_ctx = mongory_value_wrap_u(self->pool, (void *)self->ctx);
   store_ctx->origin = (void *)self->ctx;
   self->mark_list->push(self->mark_list, store_ctx);
 }
 
-// Mongory::CMatcher#match(data)
-static VALUE rb_mongory_matcher_match(VALUE self, VALUE data) {
-  rb_mongory_matcher_t *self_wrapper;
-  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, self_wrapper);
-  mongory_matcher *matcher = self_wrapper->matcher;
-  mongory_memory_pool *scratch_pool = self_wrapper->scratch_pool;
-  mongory_memory_pool *trace_pool = self_wrapper->trace_pool;
-  mongory_value *data_value = rb_to_mongory_value_shallow(scratch_pool, data);
-
-  if (rb_mongory_error_handling(scratch_pool, "Match failed")) {
-    return Qnil;
+// Prepared matchers have placeholder values until their slots are bound
+static void rb_mongory_matcher_check_bound(rb_mongory_matcher_t *wrapper) {
+  if (wrapper->slots && NIL_P(wrapper->bound)) {
+    rb_raise(eMongoryError, "prepared matcher has unbound slots, call #bind first");
   }
+}
 
-  bool result = mongory_matcher_match(matcher, data_value);
-
-  if (trace_pool) {
-    mongory_matcher_print_trace(matcher);
-    trace_pool->reset(trace_pool);
-    mongory_matcher_enable_trace(matcher, trace_pool);
-  }
+// Add a free scratch, its arena keeps retained bytes across matches
+static rb_mongory_scratch_t *rb_mongory_scratch_add(rb_mongory_matcher_t *wrapper, size_t retained) {
+  REALLOC_N(wrapper->scratches, rb_mongory_scratch_t *, wrapper->scratch_count + 1);
+  rb_mongory_scratch_t *scratch = ALLOC(rb_mongory_scratch_t);
+  rb_mongory_memory_pool_t *arena = rb_mongory_arena_new(retained);
+  arena->owner = wrapper;
+  arena->scratch = true;
+  scratch->pool = &arena->base;
+  scratch->fiber = Qnil;
+  scratch->frame = 0;
+  scratch->projection = NULL;
+  scratch->projected = Qnil;
+  wrapper->scratches[wrapper->scratch_count++] = scratch;
+  return scratch;
+}
 
-  scratch_pool->reset(scratch_pool);
+// Whether the stack grows toward lower addresses, set once at load
+static bool rb_mongory_stack_grows_down = true;
 
-  return result ? Qtrue : Qfalse;
+static bool rb_mongory_stack_probe(volatile char *outer) {
+  volatile char inner = 0;
+  return (uintptr_t)&inner < (uintptr_t)outer;
 }
 
-// Mongory::CMatcher#explain
-static VALUE rb_mongory_matcher_explain(VALUE self) {
-  rb_mongory_matcher_t *wrapper;
-  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, wrapper);
-  mongory_matcher_explain(wrapper->matcher, wrapper->scratch_pool);
-  if (rb_mongory_error_handling(wrapper->scratch_pool, "Explain failed")) {
-    return Qnil;
+// Called through a volatile pointer so the probe gets a frame of its own
+static bool (*volatile rb_mongory_stack_probe_func)(volatile char *) = rb_mongory_stack_probe;
+
+// Claim a scratch for the matches of the current fiber. Another thread or fiber can be suspended in
+// the middle of a match, at a Regexp or custom matcher call, so a scratch claimed by a live fiber is
+// left alone. The current fiber can also be in the middle of a match, when a custom matcher matches
+// with the same matcher, so its claims made from an outer frame are left alone too. A raise leaves
+// the scratch claimed until its fiber claims again from the same depth or above, or dies.
+static rb_mongory_scratch_t *rb_mongory_scratch_claim(rb_mongory_matcher_t *wrapper) {
+  volatile char here = 0;
+  uintptr_t frame = (uintptr_t)&here;
+  VALUE fiber = rb_fiber_current();
+  rb_mongory_scratch_t *claimed = NULL;
+  for (long i = 0; i < wrapper->scratch_count; i++) {
+    rb_mongory_scratch_t *scratch = wrapper->scratches[i];
+    if (scratch->fiber == fiber) {
+      bool nested = rb_mongory_stack_grows_down ? frame < scratch->frame : frame > scratch->frame;
+      if (nested) continue;
+      claimed = scratch;
+      break;
+    }
+    if (!claimed && (NIL_P(scratch->fiber) || !RTEST(rb_fiber_alive_p(scratch->fiber)))) {
+      claimed = scratch;
+    }
   }
-  wrapper->scratch_pool->reset(wrapper->scratch_pool);
-  return Qnil;
+  if (!claimed) {
+    rb_mongory_arena_t *arena = (rb_mongory_arena_t *)wrapper->scratches[0]->pool;
+    claimed = rb_mongory_scratch_add(wrapper, arena->retained);
+  }
+  claimed->fiber = fiber;
+  claimed->frame = frame;
+  claimed->projection = NULL;
+  return claimed;
 }
 
-// Mongory::CMatcher#trace(data)
-static VALUE rb_mongory_matcher_trace(VALUE self, VALUE data) {
-  rb_mongory_matcher_t *wrapper;
-  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, wrapper);
-  mongory_memory_pool *trace_pool = mongory_memory_pool_new();
-  mongory_value *data_value = rb_to_mongory_value_shallow(trace_pool, data);
+static inline void rb_mongory_scratch_release(rb_mongory_scratch_t *scratch) {
+  scratch->fiber = Qnil;
+}
 
-  if (rb_mongory_error_handling(trace_pool, "Trace failed")) {
-    trace_pool->free(trace_pool);
+// Records by fiber of a Mongory::Utils::Context, Qnil when ctx is not one. A matcher shared by threads
+// or fibers, like a cached one, sets the current record of the scanning fiber only. The fiber is
+// registered through Context#current_record= once per scan, its records are then set in the Hash.
+static VALUE rb_mongory_current_records(VALUE ctx) {
+  if (!ctx || !RTEST(rb_obj_is_kind_of(ctx, cMongoryMatcherContext))) {
     return Qnil;
   }
-
-  bool matched = mongory_matcher_trace(wrapper->matcher, data_value);
-  trace_pool->free(trace_pool);
-
-  return matched ? Qtrue : Qfalse;
+  rb_funcall(ctx, rb_intern("current_record="), 1, Qnil);
+  VALUE records = rb_ivar_get(ctx, rb_mongory_id_current_records);
+  return RB_TYPE_P(records, T_HASH) ? records : Qnil;
 }
 
-// Mongory::CMatcher#enable_trace
-static VALUE rb_mongory_matcher_enable_trace(VALUE self) {
-  rb_mongory_matcher_t *wrapper;
-  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, wrapper);
-  mongory_memory_pool *trace_pool = rb_mongory_memory_pool_new();
-  mongory_matcher_enable_trace(wrapper->matcher, trace_pool);
-
-  if (rb_mongory_error_handling(trace_pool, "Enable trace failed")) {
-    trace_pool->free(trace_pool);
-    return Qnil;
+// Match one converted value, resetting the scratch pool afterwards.
+// Tracing costs one predicted branch here, and none when built with MONGORY_DISABLE_TRACE.
+static bool rb_mongory_matcher_match_value(rb_mongory_matcher_t *wrapper, rb_mongory_scratch_t *scratch,
+                                           mongory_value *data_value) {
+  mongory_memory_pool *scratch_pool = scratch->pool;
+  bool result;
+#ifdef MONGORY_DISABLE_TRACE
+  result = mongory_matcher_match(wrapper->matcher, data_value);
+#else
+  if (RB_UNLIKELY(wrapper->trace_mode != RB_MONGORY_TRACE_OFF)) {
+    result = rb_mongory_matcher_match_traced(wrapper, data_value);
+  } else {
+    result = mongory_matcher_match(wrapper->matcher, data_value);
+  }
+#endif
+  // Read the projected fields before the reset, field lookups of the match are still memoized.
+  // The row is pushed right after this returns, so it is not kept from the GC meanwhile.
+  if (result && scratch->projection) {
+    if (scratch->projection->sort) {
+      rb_mongory_sort_read(scratch->projection->sort, data_value);
+    } else if (scratch->projection->aggregate) {
+      rb_mongory_aggregate_add(scratch->projection->aggregate, data_value);
+    } else {
+      scratch->projected = rb_mongory_projection_row(scratch->projection, data_value);
+    }
   }
-  wrapper->trace_pool = trace_pool;
-
-  return Qnil;
-}
 
-// Mongory::CMatcher#disable_trace
-static VALUE rb_mongory_matcher_disable_trace(VALUE self) {
-  rb_mongory_matcher_t *wrapper;
-  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, wrapper);
-  mongory_memory_pool *trace_pool = wrapper->trace_pool;
-  mongory_matcher_disable_trace(wrapper->matcher);
-  rb_mongory_error_handling(trace_pool, "Disable trace failed");
-  trace_pool->free(trace_pool);
-  wrapper->trace_pool = NULL;
+  scratch_pool->reset(scratch_pool);
 
-  return Qnil;
+  return result;
 }
 
-// Mongory::CMatcher#print_trace
-static VALUE rb_mongory_matcher_print_trace(VALUE self) {
-  rb_mongory_matcher_t *wrapper;
-  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, wrapper);
-  mongory_matcher_print_trace(wrapper->matcher);
-  rb_mongory_error_handling(wrapper->trace_pool, "Print trace failed");
+// Match one record with the scratch pool
+static bool rb_mongory_matcher_match_record(rb_mongory_matcher_t *wrapper, rb_mongory_scratch_t *scratch,
+                                            VALUE data) {
+  mongory_memory_pool *scratch_pool = scratch->pool;
+  // Every match starts a new generation, so memoized field lookups never outlive one record
+  wrapper->generation++;
+  mongory_value *data_value = rb_to_mongory_value_shallow(scratch_pool, data);
 
-  return Qnil;
+  if (rb_mongory_error_handling(scratch_pool, "Match failed")) {
+    return false;
+  }
+
+  return rb_mongory_matcher_match_value(wrapper, scratch, data_value);
 }
 
-// Mongory::CMatcher#condition
-static VALUE rb_mongory_matcher_condition(VALUE self) {
-  rb_mongory_matcher_t *wrapper;
-  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, wrapper);
+// Match one raw JSON document with the scratch pool, its values are read from the JSON without Ruby objects
+static bool rb_mongory_matcher_match_json(rb_mongory_matcher_t *wrapper, rb_mongory_scratch_t *scratch,
+                                          VALUE json) {
+  mongory_memory_pool *scratch_pool = scratch->pool;
+  wrapper->generation++;
+  mongory_value *data_value = rb_mongory_json_document(scratch_pool, json);
+
+  if (!data_value) {
+    scratch_pool->reset(scratch_pool);
+    rb_raise(eMongoryError, "invalid JSON document");
+  }
 
-  return (VALUE)wrapper->condition->origin;
+  return rb_mongory_matcher_match_value(wrapper, scratch, data_value);
 }
 
-// Mongory::CMatcher#context
-static VALUE rb_mongory_matcher_context(VALUE self) {
-  rb_mongory_matcher_t *wrapper;
-  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, wrapper);
+// Mongory::CMatcher#match(data)
+static VALUE rb_mongory_matcher_match(VALUE self, VALUE data) {
+  rb_mongory_matcher_t *self_wrapper;
+  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, self_wrapper);
+  rb_mongory_matcher_check_bound(self_wrapper);
 
-  return wrapper->ctx ? wrapper->ctx : Qnil;
+  rb_mongory_scratch_t *scratch = rb_mongory_scratch_claim(self_wrapper);
+  bool matched = rb_mongory_matcher_match_record(self_wrapper, scratch, data);
+  rb_mongory_scratch_release(scratch);
+  return matched ? Qtrue : Qfalse;
 }
 
-// Mongory::CMatcher.trace_result_colorful=(colorful)
-static VALUE rb_mongory_matcher_trace_result_colorful(VALUE self, VALUE colorful) {
-  (void)self;
-  mongory_matcher_trace_result_colorful_set(RTEST(colorful));
+// Mongory::CMatcher#match_json?(json)
+static VALUE rb_mongory_matcher_match_json_p(VALUE self, VALUE json) {
+  rb_mongory_matcher_t *self_wrapper;
+  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, self_wrapper);
+  rb_mongory_matcher_check_bound(self_wrapper);
 
-  return Qnil;
+  rb_mongory_scratch_t *scratch = rb_mongory_scratch_claim(self_wrapper);
+  bool matched = rb_mongory_matcher_match_json(self_wrapper, scratch, json);
+  rb_mongory_scratch_release(scratch);
+  return matched ? Qtrue : Qfalse;
 }
 
 /**
- * Create a new memory pool
+ * Batch matching
+ *
+ * Walks a Ruby Array in C and matches every element without going back
+ * through the Ruby method dispatch, collecting the result by scan mode.
  */
-static rb_mongory_memory_pool_t *rb_mongory_memory_pool_new() {
-  rb_mongory_memory_pool_t *pool = malloc(sizeof(rb_mongory_memory_pool_t));
-  mongory_memory_pool *base = mongory_memory_pool_new();
-  memcpy(&pool->base, base, sizeof(mongory_memory_pool));
-  free(base);
+typedef enum rb_mongory_scan_mode {
+  RB_MONGORY_SCAN_RECORDS,
+  RB_MONGORY_SCAN_INDICES,
+  RB_MONGORY_SCAN_COUNT,
+  RB_MONGORY_SCAN_PROJECTION,
+  RB_MONGORY_SCAN_SORT,
+  RB_MONGORY_SCAN_AGGREGATE,
+} rb_mongory_scan_mode;
+
+// State of one batch scan
+typedef struct rb_mongory_scan_t {
+  rb_mongory_matcher_t *wrapper;
+  VALUE records;
+  rb_mongory_dataset_t *dataset;
+  rb_mongory_plan_t *plan;
+  rb_mongory_column_t **columns;
+  long offset;
+  long limit;
+  long threads;
+  rb_mongory_scan_mode mode;
+  long skipped;
+  long matched;
+  VALUE result;
+  bool json; // records are JSON Strings
+  rb_mongory_projection_t *projection;
+  rb_mongory_scratch_t *scratch; // claimed for the whole scan
+} rb_mongory_scan_t;
+
+static VALUE rb_mongory_project_record(rb_mongory_matcher_t *wrapper, rb_mongory_scratch_t *scratch,
+                                       rb_mongory_projection_t *projection, VALUE record);
+static void rb_mongory_sort_push(rb_mongory_matcher_t *wrapper, rb_mongory_scratch_t *scratch, rb_mongory_sort_t *sort,
+                                 bool dataset, long index, VALUE record);
 
-  return pool;
+// Collect one matching record by scan mode, honoring the offset
+static void rb_mongory_scan_collect(rb_mongory_scan_t *scan, long index, VALUE record) {
+  if (scan->skipped < scan->offset) {
+    scan->skipped++;
+    return;
+  }
+  scan->matched++;
+  if (scan->mode == RB_MONGORY_SCAN_RECORDS) {
+    rb_ary_push(scan->result, record);
+  } else if (scan->mode == RB_MONGORY_SCAN_INDICES) {
+    rb_ary_push(scan->result, LONG2NUM(index));
+  } else if (scan->mode == RB_MONGORY_SCAN_PROJECTION) {
+    // Dataset rows skip the match or hold only some fields, their raw records are projected instead
+    VALUE row = scan->dataset ? rb_mongory_project_record(scan->wrapper, scan->scratch, scan->projection, record)
+                              : scan->scratch->projected;
+    rb_ary_push(scan->result, row);
+  } else if (scan->mode == RB_MONGORY_SCAN_SORT) {
+    rb_mongory_sort_push(scan->wrapper, scan->scratch, scan->projection->sort, scan->dataset != NULL, index, record);
+  } else if (scan->mode == RB_MONGORY_SCAN_AGGREGATE && scan->dataset) {
+    // Other records were accumulated right after their match
+    mongory_memory_pool *scratch_pool = scan->scratch->pool;
+    scan->wrapper->generation++;
+    rb_mongory_aggregate_add(scan->projection->aggregate, rb_to_mongory_value_shallow(scratch_pool, record));
+    scratch_pool->reset(scratch_pool);
+  }
 }
 
-/**
- * Ruby GC management functions
- */
-static void rb_mongory_matcher_free(void *ptr) {
-  rb_mongory_matcher_t *wrapper = (rb_mongory_matcher_t *)ptr;
-  mongory_memory_pool *pool = wrapper->pool;
-  mongory_memory_pool *scratch_pool = wrapper->scratch_pool;
-  mongory_memory_pool *trace_pool = wrapper->trace_pool;
-  pool->free(pool);
-  scratch_pool->free(scratch_pool);
-  if (trace_pool) {
-    trace_pool->free(trace_pool);
+// Index of the lowest set bit of a non-zero word
+static inline int rb_mongory_lowest_bit(uint64_t word) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctzll(word);
+#else
+  int bit = 0;
+  while (!(word & 1)) {
+    word >>= 1;
+    bit++;
   }
-  xfree(wrapper);
+  return bit;
+#endif
 }
 
-/**
- * GC marking callback for mongory_array
- */
-static bool gc_mark_array_cb(mongory_value *value, void *acc) {
-  (void)acc;
-  if (value && value->origin) rb_gc_mark((VALUE)value->origin);
-  return true;
+// Collect the rows of one evaluated chunk: the plan settles every typed row with bitmaps,
+// only rows the columns could not type go through the matcher
+static void rb_mongory_scan_chunk(rb_mongory_scan_t *scan, long start, long n, uint64_t *match, uint64_t *uncertain,
+                                  VALUE fiber, VALUE current_records) {
+  long words = (n + 63) / 64;
+  for (long w = 0; w < words && scan->matched != scan->limit; w++) {
+    uint64_t candidates = match[w] | uncertain[w];
+    if (w == words - 1 && n % 64) {
+      candidates &= (UINT64_C(1) << (n % 64)) - 1;
+    }
+    while (candidates && scan->matched != scan->limit) {
+      int bit = rb_mongory_lowest_bit(candidates);
+      candidates &= candidates - 1;
+      long i = start + w * 64 + bit;
+      VALUE record = RARRAY_AREF(scan->records, i);
+      if (uncertain[w] & (UINT64_C(1) << bit)) {
+        if (!NIL_P(current_records)) {
+          rb_hash_aset(current_records, fiber, record);
+        }
+        if (!rb_mongory_matcher_match_value(scan->wrapper, scan->scratch, scan->dataset->rows[i])) {
+          continue;
+        }
+      }
+      rb_mongory_scan_collect(scan, i, record);
+    }
+  }
 }
 
-/**
- * GC marking callback for mongory_matcher
- */
-static void rb_mongory_matcher_mark(void *ptr) {
-  rb_mongory_matcher_t *self = (rb_mongory_matcher_t *)ptr;
-  if (!self) return;
-  self->mark_list->each(self->mark_list, NULL, gc_mark_array_cb);
+// Column scan of a dataset, one chunk at a time so a limit stops the evaluation early
+static void rb_mongory_scan_columns(rb_mongory_scan_t *scan, VALUE fiber, VALUE current_records) {
+  rb_mongory_dataset_t *dataset = scan->dataset;
+  uint64_t match[RB_MONGORY_PLAN_WORDS];
+  uint64_t uncertain[RB_MONGORY_PLAN_WORDS];
+
+  for (long start = 0; start < dataset->count && scan->matched != scan->limit; start += RB_MONGORY_PLAN_CHUNK) {
+    long n = dataset->count - start < RB_MONGORY_PLAN_CHUNK ? dataset->count - start : RB_MONGORY_PLAN_CHUNK;
+    rb_mongory_plan_eval(scan->plan, scan->columns, start, n, NULL, match, uncertain);
+    rb_mongory_scan_chunk(scan, start, n, match, uncertain, fiber, current_records);
+  }
 }
 
 /**
- * Helper functions for Ruby/C conversion
+ * Parallel column scan
+ *
+ * Column plans only read the dataset columns, which live in C memory and never call
+ * back into Ruby, so the chunks are evaluated by several threads without the GVL.
+ * Plans with match_batch? leaves call into Ruby and stay on the calling thread.
+ * The bitmaps are then collected in order under the GVL, where the rows the columns
+ * could not type are matched as usual.
+ *
+ * The shares of a scan are handed to a pool of worker threads shared by every matcher,
+ * started by the first parallel scan and grown to the largest thread count asked for,
+ * so a scan does not pay for starting threads. The workers only read columns and
+ * write bitmaps, so they need no scratch pool.
  */
+typedef struct rb_mongory_parallel_scan_t {
+  rb_mongory_scan_t *scan;
+  long workers;
+  long chunks;
+  uint64_t *match;
+  uint64_t *uncertain;
+  struct rb_mongory_scan_worker_t *worker_list;
+  VALUE done;    // Thread::Queue the pool workers push to once their share is evaluated
+  long pending;  // shares handed to the pool and not yet done
+  volatile bool interrupted;
+} rb_mongory_parallel_scan_t;
 
-// Helper function to convert Ruby value to C string
-static char *rb_mongory_value_to_cstr(mongory_value *value, mongory_memory_pool *pool) {
-  (void)pool;
-  VALUE rb_value = (VALUE)value->origin;
-  VALUE rb_str = rb_funcall(rb_value, rb_intern("inspect"), 0);
-  return StringValueCStr(rb_str);
-}
+typedef struct rb_mongory_scan_worker_t {
+  rb_mongory_parallel_scan_t *parallel;
+  long first_chunk;
+  long last_chunk;
+} rb_mongory_scan_worker_t;
 
-// Helper function for primitive conversion of Ruby value to mongory_value
-static mongory_value *rb_to_mongory_value_primitive(mongory_memory_pool *pool, VALUE rb_value) {
-  mongory_value *mg_value = NULL;
-  switch (TYPE(rb_value)) {
-  case T_NIL:
-    mg_value = mongory_value_wrap_n(pool, NULL);
-    break;
+// Worker pool of the parallel scans, the shares are queued as Integer addresses
+static VALUE rb_mongory_pool_jobs = Qnil;
+static VALUE rb_mongory_pool_threads = Qnil;
+static VALUE rb_mongory_pool_pid = Qnil; // a forked child starts a pool of its own
 
-  case T_TRUE:
-    mg_value = mongory_value_wrap_b(pool, true);
-    break;
+// Evaluate the chunks of one worker, runs without the GVL
+static void *rb_mongory_scan_worker_nogvl(void *ptr) {
+  rb_mongory_scan_worker_t *worker = (rb_mongory_scan_worker_t *)ptr;
+  rb_mongory_parallel_scan_t *parallel = worker->parallel;
+  rb_mongory_scan_t *scan = parallel->scan;
+  long count = scan->dataset->count;
 
-  case T_FALSE:
-    mg_value = mongory_value_wrap_b(pool, false);
-    break;
+  for (long chunk = worker->first_chunk; chunk < worker->last_chunk && !parallel->interrupted; chunk++) {
+    long start = chunk * RB_MONGORY_PLAN_CHUNK;
+    long n = count - start < RB_MONGORY_PLAN_CHUNK ? count - start : RB_MONGORY_PLAN_CHUNK;
+    long word = chunk * RB_MONGORY_PLAN_WORDS;
+    rb_mongory_plan_eval(scan->plan, scan->columns, start, n, NULL, parallel->match + word,
+                         parallel->uncertain + word);
+  }
+  return NULL;
+}
 
-  case T_FIXNUM:
-    mg_value = mongory_value_wrap_i(pool, rb_num2long_inline(rb_value));
-    break;
+// Stop the workers when a thread is interrupted
+static void rb_mongory_scan_worker_unblock(void *ptr) {
+  rb_mongory_scan_worker_t *worker = (rb_mongory_scan_worker_t *)ptr;
+  worker->parallel->interrupted = true;
+}
 
-  case T_BIGNUM:
-    mg_value = mongory_value_wrap_i(pool, rb_num2ll_inline(rb_value));
-    break;
+static void rb_mongory_scan_worker_run(rb_mongory_scan_worker_t *worker) {
+  rb_thread_call_without_gvl(rb_mongory_scan_worker_nogvl, worker, rb_mongory_scan_worker_unblock, worker);
+}
 
-  case T_FLOAT:
-    mg_value = mongory_value_wrap_d(pool, rb_num2dbl(rb_value));
-    break;
+static inline rb_mongory_scan_worker_t *rb_mongory_pool_job_worker(VALUE job) {
+  return (rb_mongory_scan_worker_t *)(uintptr_t)NUM2ULL(job);
+}
 
-  case T_STRING:
-    mg_value = mongory_value_wrap_s(pool, StringValueCStr(rb_value));
-    break;
+static VALUE rb_mongory_pool_run(VALUE job) {
+  rb_mongory_scan_worker_run(rb_mongory_pool_job_worker(job));
+  return Qnil;
+}
 
-  case T_SYMBOL:
-    mg_value = mongory_value_wrap_s(pool, (char *)rb_id2name(rb_sym2id(rb_value)));
-    break;
+// Report a share as done even when the pool thread is killed, the scan waits for it
+static VALUE rb_mongory_pool_done(VALUE job) {
+  rb_funcall(rb_mongory_pool_job_worker(job)->parallel->done, rb_intern("push"), 1, Qtrue);
+  return Qnil;
+}
 
-  case T_REGEXP:
-    mg_value = mongory_value_wrap_regex(pool, (void *)rb_value);
-    break;
+// Pool thread, evaluates the queued shares until the queue is closed
+static VALUE rb_mongory_pool_worker(void *unused) {
+  (void)unused;
+  VALUE jobs = rb_mongory_pool_jobs;
+  for (;;) {
+    VALUE job = rb_funcall(jobs, rb_intern("pop"), 0);
+    if (NIL_P(job)) break;
+    rb_ensure(rb_mongory_pool_run, job, rb_mongory_pool_done, job);
   }
-  return mg_value;
+  return Qnil;
 }
-// Shallow conversion: Convert Ruby value to mongory_value (fully materialize arrays/tables)
-static mongory_value *rb_to_mongory_value_shallow_rec(mongory_memory_pool *pool, VALUE rb_value, bool converted) {
-  mongory_value *mg_value = rb_to_mongory_value_primitive(pool, rb_value);
-  if (mg_value) {
-    mg_value->origin = rb_value;
-    return mg_value;
-  }
 
-  switch (TYPE(rb_value)) {
-  case T_ARRAY: {
-    mg_value = rb_mongory_array_wrap(pool, rb_value);
-    break;
+// Start pool threads until count of them are alive
+static void rb_mongory_pool_reserve(long count) {
+  VALUE pid = rb_funcall(rb_mProcess, rb_intern("pid"), 0);
+  if (NIL_P(rb_mongory_pool_jobs) || !RTEST(rb_equal(pid, rb_mongory_pool_pid))) {
+    // The threads of the parent are gone after a fork, and so are the scans of its queued shares
+    rb_mongory_pool_jobs = rb_class_new_instance(0, NULL, rb_path2class("Thread::Queue"));
+    rb_mongory_pool_threads = rb_ary_new();
+    rb_mongory_pool_pid = pid;
   }
-
-  case T_HASH: {
-    mg_value = rb_mongory_table_wrap(pool, rb_value);
-    break;
+  VALUE alive = rb_ary_new();
+  for (long i = 0; i < RARRAY_LEN(rb_mongory_pool_threads); i++) {
+    VALUE thread = RARRAY_AREF(rb_mongory_pool_threads, i);
+    if (RTEST(rb_funcall(thread, rb_intern("alive?"), 0))) rb_ary_push(alive, thread);
+  }
+  rb_mongory_pool_threads = alive;
+  while (RARRAY_LEN(rb_mongory_pool_threads) < count) {
+    VALUE thread = rb_thread_create(rb_mongory_pool_worker, NULL);
+    rb_funcall(thread, rb_intern("name="), 1, rb_str_new_cstr("mongory-scan"));
+    rb_ary_push(rb_mongory_pool_threads, thread);
   }
+}
 
-  default:
+// Wait for one share handed to the pool
+static VALUE rb_mongory_parallel_scan_wait(VALUE ptr) {
+  rb_mongory_parallel_scan_t *parallel = (rb_mongory_parallel_scan_t *)ptr;
+  rb_funcall(parallel->done, rb_intern("pop"), 0);
+  parallel->pending--;
+  return Qnil;
+}
+
+// Split the chunks over the workers, evaluate them and collect the bitmaps in record order
+static VALUE rb_mongory_parallel_scan_body(VALUE ptr) {
+  rb_mongory_parallel_scan_t *parallel = (rb_mongory_parallel_scan_t *)ptr;
+  rb_mongory_scan_t *scan = parallel->scan;
+  rb_mongory_scan_worker_t *workers = parallel->worker_list;
+  long per_worker = parallel->chunks / parallel->workers;
+  long remainder = parallel->chunks % parallel->workers;
+  long chunk = 0;
+  for (long i = 0; i < parallel->workers; i++) {
+    workers[i].parallel = parallel;
+    workers[i].first_chunk = chunk;
+    chunk += per_worker + (i < remainder ? 1 : 0);
+    workers[i].last_chunk = chunk;
+  }
+
+  // The calling thread takes the first share itself
+  rb_mongory_pool_reserve(parallel->workers - 1);
+  for (long i = 1; i < parallel->workers; i++) {
+    rb_funcall(rb_mongory_pool_jobs, rb_intern("push"), 1, ULL2NUM((uintptr_t)&workers[i]));
+    parallel->pending++;
+  }
+  rb_mongory_scan_worker_run(&workers[0]);
+  while (parallel->pending > 0) {
+    rb_mongory_parallel_scan_wait(ptr);
+  }
+  if (parallel->interrupted) {
+    rb_raise(eMongoryError, "parallel scan interrupted");
+  }
+
+  VALUE fiber = rb_fiber_current();
+  VALUE current_records = rb_mongory_current_records(scan->wrapper->ctx);
+  long count = scan->dataset->count;
+  for (chunk = 0; chunk < parallel->chunks && scan->matched != scan->limit; chunk++) {
+    long start = chunk * RB_MONGORY_PLAN_CHUNK;
+    long n = count - start < RB_MONGORY_PLAN_CHUNK ? count - start : RB_MONGORY_PLAN_CHUNK;
+    long word = chunk * RB_MONGORY_PLAN_WORDS;
+    rb_mongory_scan_chunk(scan, start, n, parallel->match + word, parallel->uncertain + word, fiber, current_records);
+  }
+  return Qnil;
+}
+
+// Stop and wait for the shares still evaluated by the pool before their bitmaps are freed
+static VALUE rb_mongory_parallel_scan_ensure(VALUE ptr) {
+  rb_mongory_parallel_scan_t *parallel = (rb_mongory_parallel_scan_t *)ptr;
+  parallel->interrupted = true;
+  while (parallel->pending > 0) {
+    int state = 0;
+    rb_protect(rb_mongory_parallel_scan_wait, ptr, &state);
+  }
+  xfree(parallel->worker_list);
+  xfree(parallel->match);
+  xfree(parallel->uncertain);
+  return Qnil;
+}
+
+// Evaluate the column plan of a dataset with up to threads workers
+static void rb_mongory_scan_columns_parallel(rb_mongory_scan_t *scan) {
+  rb_mongory_parallel_scan_t parallel;
+  parallel.scan = scan;
+  parallel.chunks = (scan->dataset->count + RB_MONGORY_PLAN_CHUNK - 1) / RB_MONGORY_PLAN_CHUNK;
+  parallel.workers = scan->threads < parallel.chunks ? scan->threads : parallel.chunks;
+  parallel.match = ALLOC_N(uint64_t, parallel.chunks * RB_MONGORY_PLAN_WORDS);
+  parallel.uncertain = ALLOC_N(uint64_t, parallel.chunks * RB_MONGORY_PLAN_WORDS);
+  parallel.worker_list = ALLOC_N(rb_mongory_scan_worker_t, parallel.workers);
+  parallel.done = rb_class_new_instance(0, NULL, rb_path2class("Thread::Queue"));
+  parallel.pending = 0;
+  parallel.interrupted = false;
+  rb_ensure(rb_mongory_parallel_scan_body, (VALUE)&parallel, rb_mongory_parallel_scan_ensure, (VALUE)&parallel);
+  RB_GC_GUARD(parallel.done);
+}
+
+// Scan loop, dataset rows are matched as converted, other records are converted one by one
+static VALUE rb_mongory_scan_body(VALUE ptr) {
+  rb_mongory_scan_t *scan = (rb_mongory_scan_t *)ptr;
+  rb_mongory_matcher_t *wrapper = scan->wrapper;
+  rb_mongory_dataset_t *dataset = scan->dataset;
+  VALUE records = scan->records;
+  VALUE fiber = rb_fiber_current();
+  VALUE current_records = rb_mongory_current_records(wrapper->ctx);
+  scan->result = scan->mode == RB_MONGORY_SCAN_COUNT ? Qnil : rb_ary_new();
+
+  if (scan->plan && scan->threads > 1 && !wrapper->plan_batch && dataset->count > RB_MONGORY_PLAN_CHUNK) {
+    rb_mongory_scan_columns_parallel(scan);
+    return scan->mode == RB_MONGORY_SCAN_COUNT ? LONG2NUM(scan->matched) : scan->result;
+  }
+  if (scan->plan) {
+    rb_mongory_scan_columns(scan, fiber, current_records);
+    return scan->mode == RB_MONGORY_SCAN_COUNT ? LONG2NUM(scan->matched) : scan->result;
+  }
+
+  long count = dataset ? dataset->count : RARRAY_LEN(records);
+  for (long i = 0; i < count && scan->matched != scan->limit; i++) {
+    VALUE record = RARRAY_AREF(records, i);
+    if (!NIL_P(current_records)) {
+      rb_hash_aset(current_records, fiber, record);
+    }
+    bool record_matched;
+    if (scan->projection && !dataset) {
+      // Matches skipped by the offset are not projected
+      scan->scratch->projection = scan->skipped < scan->offset ? NULL : scan->projection;
+    }
+    if (dataset) {
+      record_matched = rb_mongory_matcher_match_value(wrapper, scan->scratch, dataset->rows[i]);
+    } else if (scan->json) {
+      record_matched = rb_mongory_matcher_match_json(wrapper, scan->scratch, record);
+    } else {
+      record_matched = rb_mongory_matcher_match_record(wrapper, scan->scratch, record);
+    }
+    if (record_matched) {
+      rb_mongory_scan_collect(scan, i, record);
+    }
+  }
+
+  return scan->mode == RB_MONGORY_SCAN_COUNT ? LONG2NUM(scan->matched) : scan->result;
+}
+
+// Releases the matcher and the dataset once the scan returns or raises
+static VALUE rb_mongory_scan_ensure(VALUE ptr) {
+  rb_mongory_scan_t *scan = (rb_mongory_scan_t *)ptr;
+  scan->wrapper->scanning--;
+  scan->scratch->projection = NULL;
+  scan->scratch->projected = Qnil;
+  rb_mongory_scratch_release(scan->scratch);
+  if (scan->dataset) {
+    scan->dataset->scanning--;
+  }
+  return Qnil;
+}
+
+// Scan records, skipping the first offset matches and stopping after limit matches (limit < 0 means no limit)
+static VALUE rb_mongory_matcher_scan(VALUE self, VALUE records, long offset, long limit, long threads,
+                                     rb_mongory_scan_mode mode, rb_mongory_projection_t *projection) {
+  rb_mongory_scan_t scan = {
+    NULL, records, NULL, NULL, NULL, offset, limit, threads, mode, 0, 0, Qnil, false, projection, NULL,
+  };
+  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, scan.wrapper);
+  rb_mongory_matcher_check_bound(scan.wrapper);
+
+  if (!rb_typeddata_is_kind_of(records, &rb_mongory_dataset_type)) {
+    Check_Type(records, T_ARRAY);
+    if (threads > 1) rb_warn("threads: is ignored for an Array, only CDataset column plans are scanned in parallel");
+    // #bind refuses to run while the matcher is scanning
+    scan.wrapper->scanning++;
+    scan.scratch = rb_mongory_scratch_claim(scan.wrapper);
+    return rb_ensure(rb_mongory_scan_body, (VALUE)&scan, rb_mongory_scan_ensure, (VALUE)&scan);
+  }
+
+  TypedData_Get_Struct(records, rb_mongory_dataset_t, &rb_mongory_dataset_type, scan.dataset);
+  if (!scan.dataset->rows) {
+    rb_raise(eMongoryError, "dataset has been invalidated");
+  }
+  scan.records = scan.dataset->records;
+  // Traced and profiled matches must visit every record, so they skip the column plan
+  bool visit_all = scan.wrapper->trace_pool || scan.wrapper->trace_mode == RB_MONGORY_TRACE_PROFILE;
+  scan.plan = visit_all ? NULL : rb_mongory_matcher_plan(self, scan.wrapper);
+  if (threads > 1 && !scan.plan) {
+    rb_warn("threads: is ignored, %s", visit_all ? "the matcher is traced or profiled" : "the condition has no column plan");
+  } else if (threads > 1 && scan.wrapper->plan_batch) {
+    rb_warn("threads: is ignored, the column plan calls match_batch?");
+  }
+  VALUE columns_buffer = 0;
+  if (scan.plan) {
+    scan.columns = ALLOCV_N(rb_mongory_column_t *, columns_buffer, scan.wrapper->plan_leaves);
+    rb_mongory_plan_columns(scan.plan, scan.dataset, scan.columns);
+  }
+  // Keep the rows alive while matching, invalidate, rebuild and #bind refuse to run meanwhile
+  scan.wrapper->scanning++;
+  scan.dataset->scanning++;
+  scan.scratch = rb_mongory_scratch_claim(scan.wrapper);
+  VALUE result = rb_ensure(rb_mongory_scan_body, (VALUE)&scan, rb_mongory_scan_ensure, (VALUE)&scan);
+  if (columns_buffer) {
+    ALLOCV_END(columns_buffer);
+  }
+  RB_GC_GUARD(records);
+  return result;
+}
+
+// Scan an Array of JSON Strings like rb_mongory_matcher_scan
+static VALUE rb_mongory_matcher_scan_json(VALUE self, VALUE records, long offset, long limit,
+                                          rb_mongory_scan_mode mode) {
+  rb_mongory_scan_t scan = { NULL, records, NULL, NULL, NULL, offset, limit, 1, mode, 0, 0, Qnil, true, NULL, NULL };
+  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, scan.wrapper);
+  rb_mongory_matcher_check_bound(scan.wrapper);
+  Check_Type(records, T_ARRAY);
+
+  scan.wrapper->scanning++;
+  scan.scratch = rb_mongory_scratch_claim(scan.wrapper);
+  return rb_ensure(rb_mongory_scan_body, (VALUE)&scan, rb_mongory_scan_ensure, (VALUE)&scan);
+}
+
+// Parse (records, offset: 0, limit: nil, threads: nil) arguments of the batch methods
+static VALUE rb_mongory_scan_parse_argv(int argc, VALUE *argv, long *offset, long *limit, long *threads) {
+  VALUE records, kw_hash;
+  rb_scan_args(argc, argv, "1:", &records, &kw_hash);
+  *offset = 0;
+  *limit = -1;
+  *threads = 1;
+  if (NIL_P(kw_hash)) {
+    return records;
+  }
+
+  const ID window_ids[3] = { rb_intern("offset"), rb_intern("limit"), rb_intern("threads") };
+  VALUE window[3] = { Qundef, Qundef, Qundef };
+  rb_get_kwargs(kw_hash, window_ids, 0, 3, window);
+  if (window[0] != Qundef && !NIL_P(window[0])) {
+    *offset = NUM2LONG(window[0]);
+    if (*offset < 0) rb_raise(rb_eArgError, "negative offset");
+  }
+  if (window[1] != Qundef && !NIL_P(window[1])) {
+    *limit = NUM2LONG(window[1]);
+    if (*limit < 0) rb_raise(rb_eArgError, "negative limit");
+  }
+  if (window[2] != Qundef && !NIL_P(window[2])) {
+    *threads = NUM2LONG(window[2]);
+    if (*threads < 1) rb_raise(rb_eArgError, "threads must be positive");
+  }
+  return records;
+}
+
+// Mongory::CMatcher#filter(records, offset: 0, limit: nil, threads: nil)
+static VALUE rb_mongory_matcher_filter(int argc, VALUE *argv, VALUE self) {
+  long offset, limit, threads;
+  VALUE records = rb_mongory_scan_parse_argv(argc, argv, &offset, &limit, &threads);
+  return rb_mongory_matcher_scan(self, records, offset, limit, threads, RB_MONGORY_SCAN_RECORDS, NULL);
+}
+
+// Mongory::CMatcher#count(records, offset: 0, limit: nil, threads: nil)
+static VALUE rb_mongory_matcher_count(int argc, VALUE *argv, VALUE self) {
+  long offset, limit, threads;
+  VALUE records = rb_mongory_scan_parse_argv(argc, argv, &offset, &limit, &threads);
+  return rb_mongory_matcher_scan(self, records, offset, limit, threads, RB_MONGORY_SCAN_COUNT, NULL);
+}
+
+// Mongory::CMatcher#first(records, n = nil)
+static VALUE rb_mongory_matcher_first(int argc, VALUE *argv, VALUE self) {
+  VALUE records, n;
+  rb_scan_args(argc, argv, "11", &records, &n);
+  if (NIL_P(n)) {
+    VALUE found = rb_mongory_matcher_scan(self, records, 0, 1, 1, RB_MONGORY_SCAN_RECORDS, NULL);
+    return rb_ary_entry(found, 0);
+  }
+
+  long limit = NUM2LONG(n);
+  if (limit < 0) {
+    rb_raise(rb_eArgError, "negative array size");
+  }
+  return rb_mongory_matcher_scan(self, records, 0, limit, 1, RB_MONGORY_SCAN_RECORDS, NULL);
+}
+
+// Mongory::CMatcher#match_indices(records, offset: 0, limit: nil, threads: nil)
+static VALUE rb_mongory_matcher_match_indices(int argc, VALUE *argv, VALUE self) {
+  long offset, limit, threads;
+  VALUE records = rb_mongory_scan_parse_argv(argc, argv, &offset, &limit, &threads);
+  return rb_mongory_matcher_scan(self, records, offset, limit, threads, RB_MONGORY_SCAN_INDICES, NULL);
+}
+
+// Mongory::CMatcher#filter_json(jsons, offset: 0, limit: nil)
+static VALUE rb_mongory_matcher_filter_json(int argc, VALUE *argv, VALUE self) {
+  long offset, limit, threads;
+  VALUE records = rb_mongory_scan_parse_argv(argc, argv, &offset, &limit, &threads);
+  return rb_mongory_matcher_scan_json(self, records, offset, limit, RB_MONGORY_SCAN_RECORDS);
+}
+
+// Mongory::CMatcher#count_json(jsons, offset: 0, limit: nil)
+static VALUE rb_mongory_matcher_count_json(int argc, VALUE *argv, VALUE self) {
+  long offset, limit, threads;
+  VALUE records = rb_mongory_scan_parse_argv(argc, argv, &offset, &limit, &threads);
+  return rb_mongory_matcher_scan_json(self, records, offset, limit, RB_MONGORY_SCAN_COUNT);
+}
+
+// Mongory::CMatcher#explain
+static VALUE rb_mongory_matcher_explain(VALUE self) {
+  rb_mongory_matcher_t *wrapper;
+  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, wrapper);
+  rb_mongory_scratch_t *scratch = rb_mongory_scratch_claim(wrapper);
+  mongory_matcher_explain(wrapper->matcher, scratch->pool);
+  if (rb_mongory_error_handling(scratch->pool, "Explain failed")) {
+    return Qnil;
+  }
+  scratch->pool->reset(scratch->pool);
+  rb_mongory_scratch_release(scratch);
+  return Qnil;
+}
+
+// Mongory::CMatcher#trace(data)
+static VALUE rb_mongory_matcher_trace(VALUE self, VALUE data) {
+  rb_mongory_matcher_t *wrapper;
+  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, wrapper);
+  rb_mongory_matcher_check_bound(wrapper);
+  rb_mongory_memory_pool_t *rb_trace_pool = rb_mongory_memory_pool_new();
+  mongory_memory_pool *trace_pool = &rb_trace_pool->base;
+  rb_trace_pool->owner = wrapper;
+  mongory_value *data_value = rb_to_mongory_value_shallow(trace_pool, data);
+
+  if (rb_mongory_error_handling(trace_pool, "Trace failed")) {
+    trace_pool->free(trace_pool);
+    return Qnil;
+  }
+
+  bool matched = mongory_matcher_trace(wrapper->matcher, data_value);
+  trace_pool->free(trace_pool);
+
+  return matched ? Qtrue : Qfalse;
+}
+
+// Mongory::CMatcher#disable_trace
+static VALUE rb_mongory_matcher_disable_trace(VALUE self) {
+  rb_mongory_matcher_t *wrapper;
+  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, wrapper);
+  mongory_memory_pool *trace_pool = wrapper->trace_pool;
+  wrapper->trace_mode = RB_MONGORY_TRACE_OFF;
+  wrapper->trace_sink = Qnil;
+  wrapper->profile_children = Qnil;
+  if (!trace_pool) {
+    return Qnil;
+  }
+  mongory_matcher_disable_trace(wrapper->matcher);
+  rb_mongory_error_handling(trace_pool, "Disable trace failed");
+  trace_pool->free(trace_pool);
+  wrapper->trace_pool = NULL;
+
+  return Qnil;
+}
+
+// Mongory::CMatcher#enable_trace(sample: nil, sink: nil, capacity: 100)
+static VALUE rb_mongory_matcher_enable_trace(int argc, VALUE *argv, VALUE self) {
+  rb_mongory_matcher_t *wrapper;
+  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, wrapper);
+  VALUE kw_hash;
+  rb_scan_args(argc, argv, "0:", &kw_hash);
+  const ID kw_ids[3] = { rb_intern("sample"), rb_intern("sink"), rb_intern("capacity") };
+  VALUE kw_vals[3] = { Qundef, Qundef, Qundef };
+  if (kw_hash != Qnil) {
+    rb_get_kwargs(kw_hash, kw_ids, 0, 3, kw_vals);
+  }
+#ifdef MONGORY_DISABLE_TRACE
+  rb_raise(eMongoryError, "tracing is compiled out of this build (MONGORY_DISABLE_TRACE)");
+#endif
+  rb_mongory_matcher_disable_trace(self);
+
+  if (kw_vals[0] != Qundef && !NIL_P(kw_vals[0])) {
+    return rb_mongory_trace_enable_sampled(wrapper, kw_vals[0], kw_vals[1], kw_vals[2]);
+  }
+  if ((kw_vals[1] != Qundef && !NIL_P(kw_vals[1])) || (kw_vals[2] != Qundef && !NIL_P(kw_vals[2]))) {
+    rb_raise(rb_eArgError, "sink and capacity need sample");
+  }
+
+  rb_mongory_memory_pool_t *rb_trace_pool = rb_mongory_memory_pool_new();
+  mongory_memory_pool *trace_pool = &rb_trace_pool->base;
+  rb_trace_pool->owner = wrapper;
+  mongory_matcher_enable_trace(wrapper->matcher, trace_pool);
+
+  if (rb_mongory_error_handling(trace_pool, "Enable trace failed")) {
+    trace_pool->free(trace_pool);
+    return Qnil;
+  }
+  wrapper->trace_pool = trace_pool;
+  wrapper->trace_mode = RB_MONGORY_TRACE_ALL;
+
+  return Qnil;
+}
+
+// Mongory::CMatcher#print_trace
+static VALUE rb_mongory_matcher_print_trace(VALUE self) {
+  rb_mongory_matcher_t *wrapper;
+  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, wrapper);
+  if (!wrapper->trace_pool) {
+    // Sampled traces are kept in the ring buffer
+    VALUE traces = rb_mongory_matcher_traces(self);
+    for (long i = 0; i < RARRAY_LEN(traces); i++) {
+      rb_funcall(rb_stdout, rb_intern("puts"), 1, RARRAY_AREF(traces, i));
+    }
+    return Qnil;
+  }
+  mongory_matcher_print_trace(wrapper->matcher);
+  rb_mongory_error_handling(wrapper->trace_pool, "Print trace failed");
+
+  return Qnil;
+}
+
+// Mongory::CMatcher#condition
+static VALUE rb_mongory_matcher_condition(VALUE self) {
+  rb_mongory_matcher_t *wrapper;
+  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, wrapper);
+
+  return NIL_P(wrapper->bound) ? (VALUE)wrapper->condition->origin : wrapper->bound;
+}
+
+// Mongory::CMatcher#context
+static VALUE rb_mongory_matcher_context(VALUE self) {
+  rb_mongory_matcher_t *wrapper;
+  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, wrapper);
+
+  return wrapper->ctx ? wrapper->ctx : Qnil;
+}
+
+// Mongory::CMatcher#stats
+static VALUE rb_mongory_matcher_stats(VALUE self) {
+  rb_mongory_matcher_t *wrapper;
+  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, wrapper);
+  size_t lookups = wrapper->key_hits + wrapper->key_misses;
+  VALUE stats = rb_hash_new();
+  rb_hash_aset(stats, ID2SYM(rb_intern("key_hits")), SIZET2NUM(wrapper->key_hits));
+  rb_hash_aset(stats, ID2SYM(rb_intern("key_misses")), SIZET2NUM(wrapper->key_misses));
+  rb_hash_aset(stats, ID2SYM(rb_intern("key_hit_rate")),
+               DBL2NUM(lookups ? (double)wrapper->key_hits / (double)lookups : 0.0));
+
+  return stats;
+}
+
+// Mongory::CMatcher#memory_stats
+static VALUE rb_mongory_matcher_memory_stats(VALUE self) {
+  rb_mongory_matcher_t *wrapper;
+  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, wrapper);
+  size_t reserved = 0, in_use = 0, peak = 0;
+  for (long i = 0; i < wrapper->scratch_count; i++) {
+    rb_mongory_arena_t *arena = (rb_mongory_arena_t *)wrapper->scratches[i]->pool;
+    reserved += arena->reserved;
+    in_use += arena->in_use;
+    peak = arena->peak > peak ? arena->peak : peak;
+  }
+  rb_mongory_arena_t *arena = (rb_mongory_arena_t *)wrapper->scratches[0]->pool;
+  VALUE stats = rb_hash_new();
+  rb_hash_aset(stats, ID2SYM(rb_intern("reserved_bytes")), SIZET2NUM(reserved));
+  rb_hash_aset(stats, ID2SYM(rb_intern("in_use_bytes")), SIZET2NUM(in_use));
+  rb_hash_aset(stats, ID2SYM(rb_intern("peak_bytes")), SIZET2NUM(peak));
+  rb_hash_aset(stats, ID2SYM(rb_intern("retained_bytes")), SIZET2NUM(arena->retained));
+  rb_hash_aset(stats, ID2SYM(rb_intern("scratches")), LONG2NUM(wrapper->scratch_count));
+
+  return stats;
+}
+
+// Mongory::CMatcher.scratch_retained_bytes
+static VALUE rb_mongory_matcher_scratch_retained(VALUE self) {
+  (void)self;
+  return SIZET2NUM(rb_mongory_scratch_retained);
+}
+
+// Mongory::CMatcher.scratch_retained_bytes=(bytes)
+static VALUE rb_mongory_matcher_scratch_retained_set(VALUE self, VALUE bytes) {
+  (void)self;
+  if (NUM2LL(bytes) < 0) {
+    rb_raise(rb_eArgError, "scratch_retained_bytes must not be negative");
+  }
+  rb_mongory_scratch_retained = NUM2SIZET(bytes);
+
+  return bytes;
+}
+
+// Mongory::CMatcher.trace_result_colorful=(colorful)
+static VALUE rb_mongory_matcher_trace_result_colorful(VALUE self, VALUE colorful) {
+  (void)self;
+  mongory_matcher_trace_result_colorful_set(RTEST(colorful));
+
+  return Qnil;
+}
+
+/**
+ * Dataset method implementations
+ */
+
+// Allocate an empty dataset, rows are loaded by Mongory::CDataset#initialize
+static VALUE rb_mongory_dataset_alloc(VALUE class) {
+  rb_mongory_dataset_t *dataset = ALLOC(rb_mongory_dataset_t);
+  dataset->pool = NULL;
+  dataset->rows = NULL;
+  dataset->count = 0;
+  dataset->scanning = 0;
+  dataset->columns = NULL;
+  dataset->records = Qnil;
+  dataset->rows_origin = Qnil;
+  dataset->columns_origin = Qnil;
+
+  return TypedData_Wrap_Struct(class, &rb_mongory_dataset_type, dataset);
+}
+
+// Release the rows of a dataset, refusing while a scan is using them
+static void rb_mongory_dataset_release(rb_mongory_dataset_t *dataset) {
+  if (dataset->scanning) {
+    rb_raise(eMongoryError, "dataset is being scanned");
+  }
+  if (dataset->pool) {
+    dataset->pool->free(dataset->pool);
+  }
+  dataset->pool = NULL;
+  dataset->rows = NULL;
+  dataset->count = 0;
+  dataset->columns = NULL;
+  dataset->records = Qnil;
+  dataset->rows_origin = Qnil;
+  dataset->columns_origin = Qnil;
+}
+
+// Mongory::CDataset#__load__(records, rows)
+static VALUE rb_mongory_dataset_load(VALUE self, VALUE records, VALUE rows) {
+  rb_mongory_dataset_t *dataset;
+  TypedData_Get_Struct(self, rb_mongory_dataset_t, &rb_mongory_dataset_type, dataset);
+  Check_Type(records, T_ARRAY);
+  Check_Type(rows, T_ARRAY);
+  long count = RARRAY_LEN(rows);
+  if (RARRAY_LEN(records) != count) {
+    rb_raise(rb_eArgError, "records and rows differ in size");
+  }
+
+  rb_mongory_dataset_release(dataset);
+  // The pool has no owner, rows are plain data and never compiled like conditions
+  dataset->pool = &rb_mongory_memory_pool_new()->base;
+  dataset->records = records;
+  dataset->rows_origin = rows;
+  dataset->columns_origin = rb_ary_new();
+  mongory_memory_pool *pool = dataset->pool;
+  mongory_value **converted = MG_ALLOC(pool, sizeof(mongory_value *) * (count > 0 ? count : 1));
+  for (long i = 0; i < count; i++) {
+    converted[i] = rb_to_mongory_value_deep(pool, RARRAY_AREF(rows, i));
+  }
+  rb_mongory_error_handling(pool, "Dataset conversion failed");
+  dataset->rows = converted;
+  dataset->count = count;
+
+  return self;
+}
+
+// Mongory::CDataset#invalidate
+static VALUE rb_mongory_dataset_invalidate(VALUE self) {
+  rb_mongory_dataset_t *dataset;
+  TypedData_Get_Struct(self, rb_mongory_dataset_t, &rb_mongory_dataset_type, dataset);
+  rb_mongory_dataset_release(dataset);
+
+  return Qnil;
+}
+
+// Mongory::CDataset#valid?
+static VALUE rb_mongory_dataset_valid(VALUE self) {
+  rb_mongory_dataset_t *dataset;
+  TypedData_Get_Struct(self, rb_mongory_dataset_t, &rb_mongory_dataset_type, dataset);
+
+  return dataset->rows ? Qtrue : Qfalse;
+}
+
+/**
+ * Create a new memory pool, an arena keeping every chunk so its size can be reported to the GC
+ */
+static rb_mongory_memory_pool_t *rb_mongory_memory_pool_new() {
+  return rb_mongory_arena_new(SIZE_MAX);
+}
+
+// Bytes held by a pool, for ObjectSpace.memsize_of
+static size_t rb_mongory_pool_memsize(mongory_memory_pool *pool) {
+  if (!pool) return 0;
+  rb_mongory_arena_t *arena = (rb_mongory_arena_t *)pool;
+  return sizeof(rb_mongory_arena_t) + arena->reserved;
+}
+
+// Carve size bytes out of the arena, raises NoMemoryError when a chunk cannot be allocated.
+// Every pool allocation happens under the GVL, the parallel scan workers only read columns.
+static void *rb_mongory_arena_alloc(void *ctx, size_t size) {
+  rb_mongory_arena_t *arena = (rb_mongory_arena_t *)ctx;
+  size = (size + RB_MONGORY_ARENA_ALIGN - 1) & ~(size_t)(RB_MONGORY_ARENA_ALIGN - 1);
+  rb_mongory_arena_chunk_t *chunk = arena->current;
+
+  if (size > RB_MONGORY_ARENA_LARGE) {
+    chunk = calloc(1, RB_MONGORY_ARENA_HEADER + size);
+    if (!chunk) rb_memerror();
+    chunk->size = size;
+    chunk->used = size;
+    chunk->next = arena->large;
+    arena->large = chunk;
+    arena->reserved += size;
+  } else {
+    // Move on to the next retained chunk, or grow the list at the current chunk
+    while (chunk && chunk->used + size > chunk->size && chunk->next) {
+      chunk = chunk->next;
+    }
+    if (!chunk || chunk->used + size > chunk->size) {
+      size_t chunk_size = RB_MONGORY_ARENA_HEADER + RB_MONGORY_ARENA_CHUNK;
+      rb_mongory_arena_chunk_t *fresh = calloc(1, chunk_size);
+      if (!fresh) rb_memerror();
+      fresh->size = RB_MONGORY_ARENA_CHUNK;
+      fresh->used = 0;
+      fresh->next = NULL;
+      if (chunk) {
+        chunk->next = fresh;
+      } else {
+        arena->chunks = fresh;
+      }
+      chunk = fresh;
+      arena->reserved += RB_MONGORY_ARENA_CHUNK;
+    }
+    arena->current = chunk;
+    chunk->used += size;
+  }
+
+  arena->in_use += size;
+  if (arena->in_use > arena->peak) {
+    arena->peak = arena->in_use;
+  }
+  return (char *)chunk + RB_MONGORY_ARENA_HEADER + chunk->used - size;
+}
+
+// Free the large chunks, and the chunks past the retained size
+static void rb_mongory_arena_reset(mongory_memory_pool *self) {
+  rb_mongory_arena_t *arena = (rb_mongory_arena_t *)self;
+  while (arena->large) {
+    rb_mongory_arena_chunk_t *next = arena->large->next;
+    arena->reserved -= arena->large->size;
+    free(arena->large);
+    arena->large = next;
+  }
+
+  size_t kept = 0;
+  rb_mongory_arena_chunk_t **link = &arena->chunks;
+  while (*link) {
+    rb_mongory_arena_chunk_t *chunk = *link;
+    if (kept + chunk->size > arena->retained && kept > 0) {
+      *link = chunk->next;
+      arena->reserved -= chunk->size;
+      free(chunk);
+      continue;
+    }
+    kept += chunk->size;
+    memset((char *)chunk + RB_MONGORY_ARENA_HEADER, 0, chunk->used);
+    chunk->used = 0;
+    link = &chunk->next;
+  }
+  arena->current = arena->chunks;
+  arena->in_use = 0;
+  self->error = NULL;
+}
+
+static void rb_mongory_arena_free(mongory_memory_pool *self) {
+  rb_mongory_arena_t *arena = (rb_mongory_arena_t *)self;
+  arena->retained = 0;
+  rb_mongory_arena_reset(self);
+  free(arena->chunks);
+  free(arena);
+}
+
+/**
+ * Create an arena keeping retained bytes across resets, at least one chunk
+ */
+static rb_mongory_memory_pool_t *rb_mongory_arena_new(size_t retained) {
+  rb_mongory_arena_t *arena = malloc(sizeof(rb_mongory_arena_t));
+  if (!arena) rb_memerror();
+  arena->pool.base.ctx = arena;
+  arena->pool.base.alloc = rb_mongory_arena_alloc;
+  arena->pool.base.reset = rb_mongory_arena_reset;
+  arena->pool.base.free = rb_mongory_arena_free;
+  arena->pool.base.error = NULL;
+  arena->pool.owner = NULL;
+  arena->pool.scratch = false;
+  arena->chunks = NULL;
+  arena->current = NULL;
+  arena->large = NULL;
+  arena->retained = retained;
+  arena->reserved = 0;
+  arena->in_use = 0;
+  arena->peak = 0;
+
+  return &arena->pool;
+}
+
+/**
+ * Ruby GC management functions
+ */
+static void rb_mongory_matcher_free(void *ptr) {
+  rb_mongory_matcher_t *wrapper = (rb_mongory_matcher_t *)ptr;
+  mongory_memory_pool *pool = wrapper->pool;
+  mongory_memory_pool *trace_pool = wrapper->trace_pool;
+  pool->free(pool);
+  for (long i = 0; i < wrapper->scratch_count; i++) {
+    wrapper->scratches[i]->pool->free(wrapper->scratches[i]->pool);
+    xfree(wrapper->scratches[i]);
+  }
+  xfree(wrapper->scratches);
+  if (trace_pool) {
+    trace_pool->free(trace_pool);
+  }
+  if (wrapper->bind_pool) {
+    wrapper->bind_pool->free(wrapper->bind_pool);
+  }
+  xfree(wrapper);
+}
+
+static void rb_mongory_dataset_free(void *ptr) {
+  rb_mongory_dataset_t *dataset = (rb_mongory_dataset_t *)ptr;
+  if (dataset->pool) {
+    dataset->pool->free(dataset->pool);
+  }
+  xfree(dataset);
+}
+
+static size_t rb_mongory_matcher_memsize(const void *ptr) {
+  const rb_mongory_matcher_t *wrapper = (const rb_mongory_matcher_t *)ptr;
+  size_t size = sizeof(rb_mongory_matcher_t) + rb_mongory_pool_memsize(wrapper->pool) +
+                rb_mongory_pool_memsize(wrapper->trace_pool) + rb_mongory_pool_memsize(wrapper->bind_pool);
+  for (long i = 0; i < wrapper->scratch_count; i++) {
+    size += sizeof(rb_mongory_scratch_t *) + sizeof(rb_mongory_scratch_t) +
+            rb_mongory_pool_memsize(wrapper->scratches[i]->pool);
+  }
+  return size;
+}
+
+static size_t rb_mongory_dataset_memsize(const void *ptr) {
+  const rb_mongory_dataset_t *dataset = (const rb_mongory_dataset_t *)ptr;
+  return sizeof(rb_mongory_dataset_t) + rb_mongory_pool_memsize(dataset->pool);
+}
+
+/**
+ * GC marking callback for mongory_array, these objects are pinned
+ */
+static bool gc_mark_array_cb(mongory_value *value, void *acc) {
+  (void)acc;
+  if (value && value->origin) rb_gc_mark((VALUE)value->origin);
+  return true;
+}
+
+/**
+ * GC marking callback for the key map, field keys are only read through their field key struct
+ */
+static bool gc_mark_field_key_cb(char *key, mongory_value *value, void *acc) {
+  (void)key;
+  (void)acc;
+  rb_mongory_field_key_t *field_key = (rb_mongory_field_key_t *)value->data.u;
+  rb_gc_mark_movable(field_key->string_key);
+  rb_gc_mark_movable(field_key->symbol_key);
+  return true;
+}
+
+// Plan leaves read key paths of plan_origin directly, pin them
+static void rb_mongory_plan_mark(rb_mongory_plan_t *plan) {
+  rb_gc_mark(plan->key_path);
+  rb_gc_mark(plan->rb_matcher);
+  for (long i = 0; i < plan->count; i++) {
+    rb_mongory_plan_mark(plan->children[i]);
+  }
+}
+
+/**
+ * GC marking callback for mongory_matcher. The condition, the field keys and the VALUE fields can move,
+ * while the context, regexes, custom matchers and everything else in mark_list is held by the core
+ * or by native state and stays pinned.
+ */
+static void rb_mongory_matcher_mark(void *ptr) {
+  rb_mongory_matcher_t *self = (rb_mongory_matcher_t *)ptr;
+  if (!self) return;
+  self->mark_list->each(self->mark_list, NULL, gc_mark_array_cb);
+  self->key_map->each(self->key_map, NULL, gc_mark_field_key_cb);
+  if (self->condition) rb_gc_mark_movable((VALUE)self->condition->origin);
+  if (self->plan) rb_mongory_plan_mark(self->plan);
+  rb_gc_mark_movable(self->plan_origin);
+  rb_gc_mark_movable(self->bound);
+  rb_gc_mark_movable(self->trace_sink);
+  rb_gc_mark_movable(self->trace_buffer);
+  rb_gc_mark_movable(self->profile_children);
+  for (long i = 0; i < self->scratch_count; i++) {
+    rb_gc_mark_movable(self->scratches[i]->fiber);
+  }
+}
+
+/**
+ * GC marking callback for mongory dataset, the rows reference strings of these arrays.
+ * Column key paths and values are read directly and stay pinned.
+ */
+static void rb_mongory_dataset_mark(void *ptr) {
+  rb_mongory_dataset_t *dataset = (rb_mongory_dataset_t *)ptr;
+  for (rb_mongory_column_t *column = dataset->columns; column; column = column->next) {
+    rb_gc_mark(column->key_path);
+    rb_gc_mark(column->values);
+  }
+  rb_gc_mark_movable(dataset->records);
+  rb_gc_mark_movable(dataset->rows_origin);
+  rb_gc_mark_movable(dataset->columns_origin);
+}
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void rb_mongory_value_compact(mongory_value *value);
+
+static bool gc_compact_array_cb(mongory_value *value, void *acc) {
+  (void)acc;
+  rb_mongory_value_compact(value);
+  return true;
+}
+
+static bool gc_compact_table_cb(char *key, mongory_value *value, void *acc) {
+  (void)key;
+  (void)acc;
+  rb_mongory_value_compact(value);
+  return true;
+}
+
+// Point the origins of a deep converted value at the moved objects, strings were copied on conversion
+static void rb_mongory_value_compact(mongory_value *value) {
+  if (!value) return;
+  value->origin = (void *)rb_gc_location((VALUE)value->origin);
+  if (value->type == MONGORY_TYPE_ARRAY) {
+    value->data.a->each(value->data.a, NULL, gc_compact_array_cb);
+  } else if (value->type == MONGORY_TYPE_TABLE) {
+    value->data.t->each(value->data.t, NULL, gc_compact_table_cb);
+  }
+}
+
+static bool gc_compact_field_key_cb(char *key, mongory_value *value, void *acc) {
+  (void)key;
+  (void)acc;
+  rb_mongory_field_key_t *field_key = (rb_mongory_field_key_t *)value->data.u;
+  field_key->string_key = rb_gc_location(field_key->string_key);
+  field_key->symbol_key = rb_gc_location(field_key->symbol_key);
+  value->origin = (void *)field_key->string_key;
+  return true;
+}
+
+/**
+ * GC compaction callback for mongory_matcher, updates what rb_mongory_matcher_mark marked movable
+ */
+static void rb_mongory_matcher_compact(void *ptr) {
+  rb_mongory_matcher_t *self = (rb_mongory_matcher_t *)ptr;
+  // Slot values, bound or not, sit inside the condition tree
+  rb_mongory_value_compact(self->condition);
+  self->key_map->each(self->key_map, NULL, gc_compact_field_key_cb);
+  self->plan_origin = rb_gc_location(self->plan_origin);
+  self->bound = rb_gc_location(self->bound);
+  self->trace_sink = rb_gc_location(self->trace_sink);
+  self->trace_buffer = rb_gc_location(self->trace_buffer);
+  self->profile_children = rb_gc_location(self->profile_children);
+  for (long i = 0; i < self->scratch_count; i++) {
+    self->scratches[i]->fiber = rb_gc_location(self->scratches[i]->fiber);
+  }
+}
+
+/**
+ * GC compaction callback for mongory dataset
+ */
+static void rb_mongory_dataset_compact(void *ptr) {
+  rb_mongory_dataset_t *dataset = (rb_mongory_dataset_t *)ptr;
+  for (long i = 0; dataset->rows && i < dataset->count; i++) {
+    rb_mongory_value_compact(dataset->rows[i]);
+  }
+  dataset->records = rb_gc_location(dataset->records);
+  dataset->rows_origin = rb_gc_location(dataset->rows_origin);
+  dataset->columns_origin = rb_gc_location(dataset->columns_origin);
+}
+#endif
+
+/**
+ * Helper functions for Ruby/C conversion
+ */
+
+// C string of a Ruby String kept by a pool value. Embedded strings hold their bytes inside the object,
+// which compaction can move, so these are copied into the pool.
+static char *rb_mongory_string_cstr(mongory_memory_pool *pool, VALUE rb_str) {
+  char *cstr = StringValueCStr(rb_str);
+  if (FL_TEST_RAW(rb_str, RSTRING_NOEMBED)) return cstr;
+  size_t size = (size_t)RSTRING_LEN(rb_str) + 1;
+  char *copy = MG_ALLOC(pool, size);
+  memcpy(copy, cstr, size);
+  return copy;
+}
+
+// Helper function to convert Ruby value to C string
+static char *rb_mongory_value_to_cstr(mongory_value *value, mongory_memory_pool *pool) {
+  (void)pool;
+  VALUE rb_value = (VALUE)value->origin;
+  VALUE rb_str = rb_funcall(rb_value, rb_intern("inspect"), 0);
+  return StringValueCStr(rb_str);
+}
+
+// Helper function for primitive conversion of Ruby value to mongory_value
+static mongory_value *rb_to_mongory_value_primitive(mongory_memory_pool *pool, VALUE rb_value) {
+  mongory_value *mg_value = NULL;
+  switch (TYPE(rb_value)) {
+  case T_NIL:
+    mg_value = mongory_value_wrap_n(pool, NULL);
+    break;
+
+  case T_TRUE:
+    mg_value = mongory_value_wrap_b(pool, true);
+    break;
+
+  case T_FALSE:
+    mg_value = mongory_value_wrap_b(pool, false);
+    break;
+
+  case T_FIXNUM:
+    mg_value = mongory_value_wrap_i(pool, rb_num2long_inline(rb_value));
+    break;
+
+  case T_BIGNUM:
+    mg_value = mongory_value_wrap_i(pool, rb_num2ll_inline(rb_value));
+    break;
+
+  case T_FLOAT:
+    mg_value = mongory_value_wrap_d(pool, rb_num2dbl(rb_value));
+    break;
+
+  case T_STRING:
+    mg_value = mongory_value_wrap_s(pool, rb_mongory_string_cstr(pool, rb_value));
+    break;
+
+  case T_SYMBOL:
+    // A Symbol converter registered by the user goes through the data converter instead
+    if (rb_mongory_native_kind(rb_cSymbol) == rb_mongory_id_native_symbol) {
+      mg_value = mongory_value_wrap_s(pool, rb_mongory_string_cstr(pool, rb_sym2str(rb_value)));
+    }
+    break;
+
+  case T_DATA:
+  case T_RATIONAL:
+    mg_value = rb_mongory_native_data_wrap(pool, rb_value);
+    break;
+
+  case T_REGEXP:
+    mg_value = mongory_value_wrap_regex(pool, (void *)rb_value);
+    break;
+  }
+  return mg_value;
+}
+// Shallow conversion: Convert Ruby value to mongory_value (fully materialize arrays/tables)
+static mongory_value *rb_to_mongory_value_shallow_rec(mongory_memory_pool *pool, VALUE rb_value, bool converted) {
+  mongory_value *mg_value = rb_to_mongory_value_primitive(pool, rb_value);
+  if (mg_value) {
+    mg_value->origin = rb_value;
+    return mg_value;
+  }
+
+  switch (TYPE(rb_value)) {
+  case T_ARRAY: {
+    mg_value = rb_mongory_array_wrap(pool, rb_value);
+    break;
+  }
+
+  case T_HASH: {
+    mg_value = rb_mongory_table_wrap(pool, rb_value);
+    break;
+  }
+
+  default:
     if (converted) {
       mg_value = mongory_value_wrap_u(pool, (void *)rb_value);
       break;
     } else {
-      VALUE converted_value = rb_funcall(inMongoryDataConverter, rb_intern("convert"), 1, rb_value);
-      return rb_to_mongory_value_shallow_rec(pool, converted_value, true);
+      VALUE converted_value = rb_funcall(inMongoryDataConverter, rb_intern("convert"), 1, rb_value);
+      return rb_to_mongory_value_shallow_rec(pool, converted_value, true);
+    }
+  }
+  mg_value->origin = rb_value;
+  return mg_value;
+}
+
+// Shallow conversion: Convert Ruby value to mongory_value (fully materialize arrays/tables)
+mongory_value *rb_to_mongory_value_shallow(mongory_memory_pool *pool, VALUE rb_value) {
+  return rb_to_mongory_value_shallow_rec(pool, rb_value, false);
+}
+
+// Helper function for deep conversion of hash values
+static int hash_foreach_deep_convert_cb(VALUE key, VALUE val, VALUE ptr) {
+  hash_conv_ctx *ctx = (hash_conv_ctx *)ptr;
+  rb_mongory_memory_pool_t *rb_pool = (rb_mongory_memory_pool_t *)ctx->pool;
+  rb_mongory_matcher_t *owner = rb_pool->owner;
+  char *key_str;
+  if (SYMBOL_P(key)) {
+    key_str = rb_mongory_string_cstr(ctx->pool, rb_sym2str(key));
+  } else {
+    key_str = rb_mongory_string_cstr(ctx->pool, key);
+  }
+  if (owner) {
+    // Compile the field key up front so matching never builds key objects
+    rb_mongory_field_key_fetch(owner, key_str, key);
+  }
+  if (owner && ctx->pool == owner->pool && RB_TYPE_P(val, T_STRUCT) && rb_obj_is_kind_of(val, cMongoryMatcherSlot)) {
+    // Slots of a prepared matcher get a placeholder value that #bind overwrites in place
+    ctx->table->set(ctx->table, key_str, rb_mongory_slot_wrap(owner, ctx->pool, key_str, val));
+    return ST_CONTINUE;
+  }
+  if (owner && RB_TYPE_P(val, T_STRING) && strcmp(key_str, "$regex") == 0) {
+    // Compile String patterns once instead of on the first match
+    val = rb_reg_new_str(val, 0);
+  }
+  if (owner && RB_TYPE_P(val, T_ARRAY) && (strcmp(key_str, "$in") == 0 || strcmp(key_str, "$nin") == 0)) {
+    // Large $in / $nin lists become a bridge-native hash set operator
+    mongory_value *set_value = rb_mongory_value_set_wrap(ctx->pool, val);
+    if (set_value) {
+      char *set_key = key_str[1] == 'i' ? RB_MONGORY_IN_SET_OPERATOR : RB_MONGORY_NIN_SET_OPERATOR;
+      ctx->table->set(ctx->table, set_key, set_value);
+      return ST_CONTINUE;
+    }
+  }
+  if (owner && RB_TYPE_P(val, T_ARRAY) && strcmp(key_str, "$intervals") == 0) {
+    // Intervals of Integer / Float bounds are searched in C, others keep the Ruby IntervalMatcher
+    mongory_value *intervals_value = rb_mongory_interval_set_wrap(ctx->pool, val);
+    if (intervals_value) {
+      ctx->table->set(ctx->table, RB_MONGORY_INTERVALS_OPERATOR, intervals_value);
+      return ST_CONTINUE;
+    }
+  }
+  mongory_value *cval = rb_to_mongory_value_deep(ctx->pool, val);
+  ctx->table->set(ctx->table, key_str, cval);
+  return ST_CONTINUE;
+}
+
+// Deep conversion: Convert Ruby value to mongory_value (fully materialize arrays/tables)
+static mongory_value *rb_to_mongory_value_deep_rec(mongory_memory_pool *pool, VALUE rb_value, bool converted) {
+  if (RB_TYPE_P(rb_value, T_REGEXP)) {
+    return rb_mongory_regex_wrap(pool, rb_value);
+  }
+  mongory_value *mg_value = rb_to_mongory_value_primitive(pool, rb_value);
+  if (mg_value) {
+    mg_value->origin = rb_value;
+    return mg_value;
+  }
+  switch (TYPE(rb_value)) {
+  case T_ARRAY: {
+    mongory_array *array = mongory_array_new(pool);
+
+    for (long i = 0; i < RARRAY_LEN(rb_value); i++) {
+      array->push(array, rb_to_mongory_value_deep(pool, RARRAY_AREF(rb_value, i)));
+    }
+    mg_value = mongory_value_wrap_a(pool, array);
+    break;
+  }
+
+  case T_HASH: {
+    mongory_table *table = mongory_table_new(pool);
+
+    hash_conv_ctx ctx = {table, pool};
+    rb_hash_foreach(rb_value, hash_foreach_deep_convert_cb, (VALUE)&ctx);
+
+    mg_value = mongory_value_wrap_t(pool, table);
+    break;
+  }
+
+  default:
+    if (RB_TYPE_P(rb_value, T_STRUCT) && rb_obj_is_kind_of(rb_value, cMongoryMatcherSlot)) {
+      rb_raise(eMongoryTypeError, "slots are only supported as a field value or a comparison operand");
+    }
+    if (converted) {
+      mg_value = mongory_value_wrap_u(pool, (void *)rb_value);
+      break;
+    } else {
+      VALUE converted_value = rb_funcall(inMongoryDataConverter, rb_intern("convert"), 1, rb_value);
+      mg_value = rb_to_mongory_value_deep_rec(pool, converted_value, true);
+      break;
+    }
+  }
+  mg_value->origin = rb_value;
+  return mg_value;
+}
+
+// Deep conversion: Convert Ruby value to mongory_value (fully materialize arrays/tables)
+mongory_value *rb_to_mongory_value_deep(mongory_memory_pool *pool, VALUE rb_value) {
+  return rb_to_mongory_value_deep_rec(pool, rb_value, false);
+}
+
+// Get value from Ruby hash via mongory_table
+mongory_value *rb_mongory_table_get(mongory_table *self, char *key) {
+  rb_mongory_table_t *table = (rb_mongory_table_t *)self;
+  VALUE rb_hash = table->rb_hash;
+  rb_mongory_matcher_t *owner = table->owner;
+
+  if (!owner) {
+    // Pools without owner have no key map, look up with throwaway keys
+    VALUE rb_value = rb_hash_lookup2(rb_hash, rb_utf8_str_new_cstr(key), Qundef);
+    if (rb_value == Qundef) {
+      rb_value = rb_hash_lookup2(rb_hash, rb_str_intern(rb_utf8_str_new_cstr(key)), Qundef);
+    }
+    return rb_value == Qundef ? NULL : rb_to_mongory_value_shallow(self->pool, rb_value);
+  }
+
+  rb_mongory_field_key_t *field_key = rb_mongory_field_key_fetch(owner, key, Qundef);
+  // Only scratch pool lookups are memoized, the scratch pool lives exactly one match
+  bool memoize = ((rb_mongory_memory_pool_t *)self->pool)->scratch;
+
+  if (memoize && field_key->last_generation == owner->generation && field_key->last_hash == rb_hash &&
+      field_key->last_pool == self->pool) {
+    return field_key->last_value;
+  }
+
+  // Try the key style that hit last first, records of one shape use the same style
+  VALUE first_key = field_key->symbol_first ? field_key->symbol_key : field_key->string_key;
+  VALUE second_key = field_key->symbol_first ? field_key->string_key : field_key->symbol_key;
+  VALUE rb_value = rb_hash_lookup2(rb_hash, first_key, Qundef);
+
+  if (rb_value != Qundef) {
+    owner->key_hits++;
+  } else {
+    owner->key_misses++;
+    rb_value = rb_hash_lookup2(rb_hash, second_key, Qundef);
+    if (rb_value != Qundef) {
+      field_key->symbol_first = !field_key->symbol_first;
+    }
+  }
+
+  mongory_value *value = rb_value == Qundef ? NULL : rb_to_mongory_value_shallow(self->pool, rb_value);
+  if (memoize) {
+    field_key->last_generation = owner->generation;
+    field_key->last_hash = rb_hash;
+    field_key->last_value = value;
+    field_key->last_pool = self->pool;
+  }
+  return value;
+}
+
+// Shallow conversion: Wrap Ruby hash as mongory_table
+mongory_value *rb_mongory_table_wrap(mongory_memory_pool *pool, VALUE rb_hash) {
+  rb_mongory_table_t *table = MG_ALLOC_PTR(pool, rb_mongory_table_t);
+  rb_mongory_memory_pool_t *rb_pool = (rb_mongory_memory_pool_t *)pool;
+  table->base.pool = pool;
+  table->base.get = rb_mongory_table_get;
+  table->rb_hash = rb_hash;
+  table->base.count = RHASH_SIZE(rb_hash);
+  table->owner = rb_pool->owner;
+  mongory_value *mg_value = mongory_value_wrap_t(pool, &table->base);
+  mg_value->origin = (void *)rb_hash;
+  mg_value->to_str = rb_mongory_value_to_cstr;
+  return mg_value;
+}
+
+// Get value from Ruby array via mongory_array
+static mongory_value *rb_mongory_array_get(mongory_array *self, size_t index) {
+  rb_mongory_array_t *array = (rb_mongory_array_t *)self;
+  VALUE rb_array = array->rb_array;
+  if (index >= (size_t)RARRAY_LEN(rb_array)) {
+    return NULL;
+  }
+  VALUE rb_value = rb_ary_entry(rb_array, index);
+  return rb_to_mongory_value_shallow(self->pool, rb_value);
+}
+
+// Shallow conversion: Wrap Ruby array as mongory_array
+mongory_value *rb_mongory_array_wrap(mongory_memory_pool *pool, VALUE rb_array) {
+  rb_mongory_array_t *array = MG_ALLOC_PTR(pool, rb_mongory_array_t);
+  rb_mongory_memory_pool_t *rb_pool = (rb_mongory_memory_pool_t *)pool;
+  array->base.pool = pool;
+  array->base.get = rb_mongory_array_get;
+  array->rb_array = rb_array;
+  array->base.count = RARRAY_LEN(rb_array);
+  array->owner = rb_pool->owner;
+  mongory_value *mg_value = mongory_value_wrap_a(pool, &array->base);
+  mg_value->origin = (void *)rb_array;
+  mg_value->to_str = rb_mongory_value_to_cstr;
+  return mg_value;
+}
+
+// Convert mongory_value to Ruby value (returns the original Ruby value where binding in below conversion is needed)
+void *mongory_value_to_ruby(mongory_memory_pool *pool, mongory_value *value) {
+  (void)pool;
+  if (!value)
+    return NULL;
+  return (void *)rb_mongory_value_origin(value);
+}
+
+// ===== Raw JSON record implementations =====
+
+// Deepest nesting of a raw JSON record, the max_nesting default of JSON.parse
+#define RB_MONGORY_JSON_MAX_NESTING 100
+
+static const char *rb_mongory_json_skip(const char *p, const char *end, int depth);
+static mongory_value *rb_mongory_json_wrap(mongory_memory_pool *pool, const char *p, const char *end);
+
+// Skip JSON whitespace
+static inline const char *rb_mongory_json_space(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) p++;
+  return p;
+}
+
+// Value of a hex digit, -1 for other characters
+static inline int rb_mongory_json_hex(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Code unit of the 4 hex digits at p, validated by rb_mongory_json_skip_string
+static uint32_t rb_mongory_json_hex4(const char *p) {
+  uint32_t unit = 0;
+  for (int i = 0; i < 4; i++) unit = (unit << 4) | (uint32_t)rb_mongory_json_hex(p[i]);
+  return unit;
+}
+
+// Length of the valid UTF-8 sequence at p, 0 when the bytes are malformed
+static int rb_mongory_json_utf8_length(const unsigned char *p, const unsigned char *end) {
+  int n;
+  uint32_t code, min;
+  if (p[0] < 0x80) return 1;
+  if (p[0] >= 0xc2 && p[0] <= 0xdf) {
+    n = 2, code = p[0] & 0x1f, min = 0x80;
+  } else if ((p[0] & 0xf0) == 0xe0) {
+    n = 3, code = p[0] & 0x0f, min = 0x800;
+  } else if (p[0] >= 0xf0 && p[0] <= 0xf4) {
+    n = 4, code = p[0] & 0x07, min = 0x10000;
+  } else {
+    return 0;
+  }
+  if (end - p < n) return 0;
+  for (int i = 1; i < n; i++) {
+    if ((p[i] & 0xc0) != 0x80) return 0;
+    code = (code << 6) | (p[i] & 0x3f);
+  }
+  if (code < min || code > 0x10ffff || (code >= 0xd800 && code <= 0xdfff)) return 0;
+  return n;
+}
+
+// Write a code point as UTF-8, returning the number of bytes written
+static int rb_mongory_json_utf8_write(uint32_t code, char *out) {
+  if (code < 0x80) {
+    out[0] = (char)code;
+    return 1;
+  }
+  if (code < 0x800) {
+    out[0] = (char)(0xc0 | (code >> 6));
+    out[1] = (char)(0x80 | (code & 0x3f));
+    return 2;
+  }
+  if (code < 0x10000) {
+    out[0] = (char)(0xe0 | (code >> 12));
+    out[1] = (char)(0x80 | ((code >> 6) & 0x3f));
+    out[2] = (char)(0x80 | (code & 0x3f));
+    return 3;
+  }
+  out[0] = (char)(0xf0 | (code >> 18));
+  out[1] = (char)(0x80 | ((code >> 12) & 0x3f));
+  out[2] = (char)(0x80 | ((code >> 6) & 0x3f));
+  out[3] = (char)(0x80 | (code & 0x3f));
+  return 4;
+}
+
+// Skip a string from its opening quote, NULL when it is malformed
+static const char *rb_mongory_json_skip_string(const char *p, const char *end) {
+  for (p++; p < end;) {
+    unsigned char c = (unsigned char)*p;
+    if (c == '"') return p + 1;
+    if (c < 0x20) return NULL;
+    if (c == '\\') {
+      if (++p >= end) return NULL;
+      if (*p == 'u') {
+        if (end - p < 5) return NULL;
+        for (int i = 1; i <= 4; i++) {
+          if (rb_mongory_json_hex(p[i]) < 0) return NULL;
+        }
+        p += 5;
+      } else if (*p && strchr("\"\\/bfnrt", *p)) {
+        p++;
+      } else {
+        return NULL;
+      }
+      continue;
+    }
+    int n = rb_mongory_json_utf8_length((const unsigned char *)p, (const unsigned char *)end);
+    if (!n) return NULL;
+    p += n;
+  }
+  return NULL;
+}
+
+// Decode the string between p and string_end into the pool, lone surrogates become U+FFFD
+static char *rb_mongory_json_string(mongory_memory_pool *pool, const char *p, const char *string_end) {
+  const char *last = string_end - 1;
+  // Decoding never grows a string, the closing quote leaves room for the terminator
+  char *out = MG_ALLOC(pool, (size_t)(last - p));
+  char *o = out;
+  for (p++; p < last; p++) {
+    if (*p != '\\') {
+      *o++ = *p;
+      continue;
+    }
+    switch (*++p) {
+    case 'b': *o++ = '\b'; break;
+    case 'f': *o++ = '\f'; break;
+    case 'n': *o++ = '\n'; break;
+    case 'r': *o++ = '\r'; break;
+    case 't': *o++ = '\t'; break;
+    case 'u': {
+      uint32_t code = rb_mongory_json_hex4(p + 1);
+      p += 4;
+      if (code >= 0xd800 && code <= 0xdbff && last - p > 6 && p[1] == '\\' && p[2] == 'u') {
+        uint32_t low = rb_mongory_json_hex4(p + 3);
+        if (low >= 0xdc00 && low <= 0xdfff) {
+          code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+          p += 6;
+        }
+      }
+      if (code >= 0xd800 && code <= 0xdfff) code = 0xfffd;
+      o += rb_mongory_json_utf8_write(code, o);
+      break;
+    }
+    default:
+      *o++ = *p;
+      break;
+    }
+  }
+  *o = '\0';
+  return out;
+}
+
+// Skip a number, telling whether it has neither fraction nor exponent, NULL when it is malformed
+static const char *rb_mongory_json_skip_number(const char *p, const char *end, bool *integral) {
+  if (p < end && *p == '-') p++;
+  if (p >= end || *p < '0' || *p > '9') return NULL;
+  if (*p == '0') {
+    p++;
+  } else {
+    while (p < end && *p >= '0' && *p <= '9') p++;
+  }
+  *integral = true;
+  if (p < end && *p == '.') {
+    *integral = false;
+    if (++p >= end || *p < '0' || *p > '9') return NULL;
+    while (p < end && *p >= '0' && *p <= '9') p++;
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    *integral = false;
+    if (++p < end && (*p == '+' || *p == '-')) p++;
+    if (p >= end || *p < '0' || *p > '9') return NULL;
+    while (p < end && *p >= '0' && *p <= '9') p++;
+  }
+  return p;
+}
+
+// Skip true, false or null
+static const char *rb_mongory_json_skip_literal(const char *p, const char *end, const char *literal) {
+  size_t len = strlen(literal);
+  return (size_t)(end - p) >= len && memcmp(p, literal, len) == 0 ? p + len : NULL;
+}
+
+// Skip the value at p, NULL when it is malformed
+static const char *rb_mongory_json_skip(const char *p, const char *end, int depth) {
+  bool integral;
+  if (p >= end) return NULL;
+  switch (*p) {
+  case '"':
+    return rb_mongory_json_skip_string(p, end);
+  case '{':
+  case '[': {
+    bool object = *p == '{';
+    char close = object ? '}' : ']';
+    if (depth >= RB_MONGORY_JSON_MAX_NESTING) return NULL;
+    p = rb_mongory_json_space(p + 1, end);
+    if (p < end && *p == close) return p + 1;
+    while (p < end) {
+      if (object) {
+        if (*p != '"' || !(p = rb_mongory_json_skip_string(p, end))) return NULL;
+        p = rb_mongory_json_space(p, end);
+        if (p >= end || *p != ':') return NULL;
+        p = rb_mongory_json_space(p + 1, end);
+      }
+      if (!(p = rb_mongory_json_skip(p, end, depth + 1))) return NULL;
+      p = rb_mongory_json_space(p, end);
+      if (p >= end) return NULL;
+      if (*p == close) return p + 1;
+      if (*p != ',') return NULL;
+      p = rb_mongory_json_space(p + 1, end);
+    }
+    return NULL;
+  }
+  case 't':
+    return rb_mongory_json_skip_literal(p, end, "true");
+  case 'f':
+    return rb_mongory_json_skip_literal(p, end, "false");
+  case 'n':
+    return rb_mongory_json_skip_literal(p, end, "null");
+  default:
+    return rb_mongory_json_skip_number(p, end, &integral);
+  }
+}
+
+// Read the object member at p, returning the next member (or the closing brace) after its value
+static const char *rb_mongory_json_member(const char *p, const char *end, const char **key_end, const char **value) {
+  *key_end = rb_mongory_json_skip_string(p, end);
+  *value = rb_mongory_json_space(rb_mongory_json_space(*key_end, end) + 1, end);
+  const char *next = rb_mongory_json_space(rb_mongory_json_skip(*value, end, 0), end);
+  return next < end && *next == ',' ? rb_mongory_json_space(next + 1, end) : next;
+}
+
+// Skip the array element at p, returning the next element (or the closing bracket)
+static const char *rb_mongory_json_element(const char *p, const char *end) {
+  const char *next = rb_mongory_json_space(rb_mongory_json_skip(p, end, 0), end);
+  return next < end && *next == ',' ? rb_mongory_json_space(next + 1, end) : next;
+}
+
+// Get a member of a raw JSON object, scanning its keys. Duplicate keys resolve to the last one, like JSON.parse.
+static mongory_value *rb_mongory_json_table_get(mongory_table *self, char *key) {
+  rb_mongory_json_table_t *table = (rb_mongory_json_table_t *)self;
+  const char *end = table->end;
+  size_t key_len = strlen(key);
+  const char *found = NULL;
+  const char *p = rb_mongory_json_space(table->start + 1, end);
+  while (p < end && *p == '"') {
+    const char *key_end, *value;
+    const char *next = rb_mongory_json_member(p, end, &key_end, &value);
+    size_t raw_len = (size_t)(key_end - p - 2);
+    // Escaped keys are rare, they are decoded to compare
+    bool same = memchr(p + 1, '\\', raw_len) ? strcmp(rb_mongory_json_string(self->pool, p, key_end), key) == 0
+                                             : raw_len == key_len && memcmp(p + 1, key, key_len) == 0;
+    if (same) found = value;
+    p = next;
+  }
+  return found ? rb_mongory_json_wrap(self->pool, found, end) : NULL;
+}
+
+// Get an element of a raw JSON array from the cursor
+static mongory_value *rb_mongory_json_array_get(mongory_array *self, size_t index) {
+  rb_mongory_json_array_t *array = (rb_mongory_json_array_t *)self;
+  if (index >= self->count) {
+    return NULL;
+  }
+  if (index < array->cursor_index) {
+    array->cursor_index = 0;
+    array->cursor = rb_mongory_json_space(array->start + 1, array->end);
+  }
+  for (; array->cursor_index < index; array->cursor_index++) {
+    array->cursor = rb_mongory_json_element(array->cursor, array->end);
+  }
+  return rb_mongory_json_wrap(self->pool, array->cursor, array->end);
+}
+
+// Wrap a raw JSON object, counting its members
+static mongory_value *rb_mongory_json_table_wrap(mongory_memory_pool *pool, const char *start, const char *end) {
+  rb_mongory_json_table_t *table = MG_ALLOC_PTR(pool, rb_mongory_json_table_t);
+  table->base.pool = pool;
+  table->base.get = rb_mongory_json_table_get;
+  table->start = start;
+  table->end = end;
+  size_t count = 0;
+  const char *key_end, *value;
+  for (const char *p = rb_mongory_json_space(start + 1, end); p < end && *p == '"';) {
+    p = rb_mongory_json_member(p, end, &key_end, &value);
+    count++;
+  }
+  table->base.count = count;
+  return mongory_value_wrap_t(pool, &table->base);
+}
+
+// Wrap a raw JSON array, counting its elements
+static mongory_value *rb_mongory_json_array_wrap(mongory_memory_pool *pool, const char *start, const char *end) {
+  rb_mongory_json_array_t *array = MG_ALLOC_PTR(pool, rb_mongory_json_array_t);
+  array->base.pool = pool;
+  array->base.get = rb_mongory_json_array_get;
+  array->start = start;
+  array->end = end;
+  array->cursor_index = 0;
+  array->cursor = rb_mongory_json_space(start + 1, end);
+  size_t count = 0;
+  for (const char *p = array->cursor; p < end && *p != ']'; p = rb_mongory_json_element(p, end)) {
+    count++;
+  }
+  array->base.count = count;
+  return mongory_value_wrap_a(pool, &array->base);
+}
+
+// Wrap a raw JSON number, integers beyond 64 bits and numbers with a fraction or an exponent are doubles
+static mongory_value *rb_mongory_json_number(mongory_memory_pool *pool, const char *p, const char *end) {
+  bool integral;
+  const char *number_end = rb_mongory_json_skip_number(p, end, &integral);
+  if (integral) {
+    bool negative = *p == '-';
+    uint64_t magnitude = 0;
+    const char *digit = negative ? p + 1 : p;
+    for (; digit < number_end; digit++) {
+      uint64_t d = (uint64_t)(*digit - '0');
+      if (magnitude > (UINT64_MAX - d) / 10) break;
+      magnitude = magnitude * 10 + d;
+    }
+    if (digit == number_end && magnitude <= (uint64_t)INT64_MAX + negative) {
+      return mongory_value_wrap_i(pool, negative && magnitude ? -(int64_t)(magnitude - 1) - 1 : (int64_t)magnitude);
+    }
+  }
+  size_t len = (size_t)(number_end - p);
+  char *text = MG_ALLOC(pool, len + 1);
+  memcpy(text, p, len);
+  text[len] = '\0';
+  return mongory_value_wrap_d(pool, ruby_strtod(text, NULL));
+}
+
+// Wrap the validated JSON value at p as a typed mongory_value, tables and arrays read their contents on demand
+static mongory_value *rb_mongory_json_wrap(mongory_memory_pool *pool, const char *p, const char *end) {
+  mongory_value *mg_value;
+  switch (*p) {
+  case '"':
+    mg_value = mongory_value_wrap_s(pool, rb_mongory_json_string(pool, p, rb_mongory_json_skip_string(p, end)));
+    break;
+  case '{':
+    mg_value = rb_mongory_json_table_wrap(pool, p, end);
+    break;
+  case '[':
+    mg_value = rb_mongory_json_array_wrap(pool, p, end);
+    break;
+  case 't':
+    mg_value = mongory_value_wrap_b(pool, true);
+    break;
+  case 'f':
+    mg_value = mongory_value_wrap_b(pool, false);
+    break;
+  case 'n':
+    mg_value = mongory_value_wrap_n(pool, NULL);
+    break;
+  default:
+    mg_value = rb_mongory_json_number(pool, p, end);
+    break;
+  }
+  mg_value->origin = NULL;
+  mg_value->to_str = rb_mongory_json_to_cstr;
+  return mg_value;
+}
+
+// Validate a JSON String and wrap its document, NULL when it is not valid JSON.
+// The document is read in place, embedded strings are copied first since compaction can move them.
+static mongory_value *rb_mongory_json_document(mongory_memory_pool *pool, VALUE rb_json) {
+  StringValue(rb_json);
+  const char *start = RSTRING_PTR(rb_json);
+  long len = RSTRING_LEN(rb_json);
+  if (!FL_TEST_RAW(rb_json, RSTRING_NOEMBED)) {
+    char *copy = MG_ALLOC(pool, (size_t)len + 1);
+    memcpy(copy, start, (size_t)len);
+    copy[len] = '\0';
+    start = copy;
+  }
+  const char *end = start + len;
+  const char *p = rb_mongory_json_space(start, end);
+  const char *value_end = rb_mongory_json_skip(p, end, 0);
+  if (!value_end || rb_mongory_json_space(value_end, end) != end) {
+    return NULL;
+  }
+  mongory_value *mg_value = rb_mongory_json_wrap(pool, p, end);
+  mg_value->origin = (void *)rb_json;
+  return mg_value;
+}
+
+// Start and end of the source of a raw JSON table or array
+static const char *rb_mongory_json_source(mongory_value *value, const char **source_end) {
+  const char *start, *end;
+  if (value->type == MONGORY_TYPE_TABLE) {
+    rb_mongory_json_table_t *table = (rb_mongory_json_table_t *)value->data.t;
+    start = table->start, end = table->end;
+  } else {
+    rb_mongory_json_array_t *array = (rb_mongory_json_array_t *)value->data.a;
+    start = array->start, end = array->end;
+  }
+  *source_end = rb_mongory_json_skip(start, end, 0);
+  return start;
+}
+
+// Raw JSON values print as JSON in explain and trace output
+static char *rb_mongory_json_to_cstr(mongory_value *value, mongory_memory_pool *pool) {
+  char number[32];
+  const char *text;
+  size_t len;
+  switch (value->type) {
+  case MONGORY_TYPE_TABLE:
+  case MONGORY_TYPE_ARRAY: {
+    const char *source_end;
+    text = rb_mongory_json_source(value, &source_end);
+    len = (size_t)(source_end - text);
+    break;
+  }
+  case MONGORY_TYPE_STRING: {
+    VALUE rb_str = rb_str_inspect(rb_utf8_str_new_cstr(value->data.s));
+    return rb_mongory_string_cstr(pool, rb_str);
+  }
+  case MONGORY_TYPE_INT:
+    len = (size_t)snprintf(number, sizeof(number), "%lld", (long long)value->data.i);
+    text = number;
+    break;
+  case MONGORY_TYPE_DOUBLE:
+    len = (size_t)snprintf(number, sizeof(number), "%.17g", value->data.d);
+    text = number;
+    break;
+  case MONGORY_TYPE_BOOL:
+    text = value->data.b ? "true" : "false";
+    len = strlen(text);
+    break;
+  default:
+    text = "null";
+    len = 4;
+    break;
+  }
+  char *cstr = MG_ALLOC(pool, len + 1);
+  memcpy(cstr, text, len);
+  cstr[len] = '\0';
+  return cstr;
+}
+
+// Ruby value of a raw JSON value, tables and arrays are parsed from their source by JSON.parse
+static VALUE rb_mongory_json_to_ruby(mongory_value *value) {
+  switch (value->type) {
+  case MONGORY_TYPE_BOOL:
+    return value->data.b ? Qtrue : Qfalse;
+  case MONGORY_TYPE_INT:
+    return LL2NUM(value->data.i);
+  case MONGORY_TYPE_DOUBLE:
+    return DBL2NUM(value->data.d);
+  case MONGORY_TYPE_STRING:
+    return rb_utf8_str_new_cstr(value->data.s);
+  case MONGORY_TYPE_TABLE:
+  case MONGORY_TYPE_ARRAY: {
+    const char *source_end;
+    const char *source = rb_mongory_json_source(value, &source_end);
+    VALUE rb_source = rb_utf8_str_new(source, source_end - source);
+    return rb_funcall(rb_path2class("JSON"), rb_intern("parse"), 1, rb_source);
+  }
+  default:
+    return Qnil;
+  }
+}
+
+// Ruby value behind a mongory_value, built on demand for raw JSON values
+static VALUE rb_mongory_value_origin(mongory_value *value) {
+  if (value->to_str == rb_mongory_json_to_cstr) {
+    return rb_mongory_json_to_ruby(value);
+  }
+  return (VALUE)value->origin;
+}
+
+// Whether value holds the string or double a native type (Time, Date, Rational, BigDecimal) was
+// converted to, while its origin is still the Ruby object: adapters match the payload instead
+static bool rb_mongory_value_native_p(mongory_value *value) {
+  if (value->type != MONGORY_TYPE_STRING && value->type != MONGORY_TYPE_DOUBLE) {
+    return false;
+  }
+  VALUE rb_value = (VALUE)value->origin;
+  return rb_value && (RB_TYPE_P(rb_value, T_DATA) || RB_TYPE_P(rb_value, T_RATIONAL));
+}
+
+// ===== Native data conversion helper implementations =====
+
+// Kind of Mongory.data_converter.native_types for exactly klass, 0 when values of klass go through #convert
+static ID rb_mongory_native_kind(VALUE klass) {
+  VALUE types = rb_ivar_get(inMongoryDataConverter, rb_mongory_id_native_types);
+  if (!RB_TYPE_P(types, T_HASH)) {
+    return 0;
+  }
+  VALUE kind = rb_hash_lookup2(types, klass, Qundef);
+  return SYMBOL_P(kind) ? SYM2ID(kind) : 0;
+}
+
+// Civil date of a day count since 1970-01-01 in the proleptic Gregorian calendar
+static void rb_mongory_civil_from_days(int64_t days, int64_t *year, int *month, int *day) {
+  days += 719468;
+  int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+  int64_t day_of_era = days - era * 146097;
+  int64_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+  int64_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+  int64_t shifted_month = (5 * day_of_year + 2) / 153;
+  *day = (int)(day_of_year - (153 * shifted_month + 2) / 5 + 1);
+  *month = (int)(shifted_month < 10 ? shifted_month + 3 : shifted_month - 9);
+  *year = year_of_era + era * 400 + (*month <= 2 ? 1 : 0);
+}
+
+// Time#iso8601 into the pool, NULL for times it formats differently (years past 0..9999, sub-minute offsets)
+static char *rb_mongory_time_iso8601(mongory_memory_pool *pool, VALUE time) {
+  VALUE rb_offset = rb_time_utc_offset(time);
+  if (!FIXNUM_P(rb_offset) || FIX2LONG(rb_offset) % 60 != 0) {
+    return NULL;
+  }
+  long offset = FIX2LONG(rb_offset);
+  // Only Integers come back from Ruby, the string itself is formatted into the pool
+  int64_t local = (int64_t)NUM2LL(rb_funcall(time, rb_intern("to_i"), 0)) + offset;
+  int64_t days = (local >= 0 ? local : local - 86399) / 86400;
+  int64_t seconds = local - days * 86400;
+  int64_t year;
+  int month, day;
+  rb_mongory_civil_from_days(days, &year, &month, &day);
+  if (year < 0 || year > 9999) {
+    return NULL;
+  }
+
+  char *out = MG_ALLOC(pool, 32);
+  if (!out) {
+    return NULL;
+  }
+  int length = snprintf(out, 32, "%04d-%02d-%02dT%02d:%02d:%02d", (int)year, month, day, (int)(seconds / 3600),
+                        (int)(seconds / 60 % 60), (int)(seconds % 60));
+  if (RTEST(rb_funcall(time, rb_intern("utc?"), 0))) {
+    snprintf(out + length, 32 - length, "Z");
+  } else {
+    long minutes = (offset < 0 ? -offset : offset) / 60;
+    snprintf(out + length, 32 - length, "%c%02ld:%02ld", offset < 0 ? '-' : '+', minutes / 60, minutes % 60);
+  }
+  return out;
+}
+
+// Date#to_s into the pool, NULL for years it formats differently
+static char *rb_mongory_date_string(mongory_memory_pool *pool, VALUE date) {
+  VALUE rb_year = rb_funcall(date, rb_intern("year"), 0);
+  if (!FIXNUM_P(rb_year) || FIX2LONG(rb_year) < 0 || FIX2LONG(rb_year) > 9999) {
+    return NULL;
+  }
+  int month = NUM2INT(rb_funcall(date, rb_intern("mon"), 0));
+  int day = NUM2INT(rb_funcall(date, rb_intern("mday"), 0));
+  char *out = MG_ALLOC(pool, 16);
+  if (!out) {
+    return NULL;
+  }
+  snprintf(out, 16, "%04ld-%02d-%02d", FIX2LONG(rb_year), month, day);
+  return out;
+}
+
+// Convert the data converter's native types without calling it: Time and Date become the
+// strings #convert returns, formatted into the pool, and numbers a double.
+// NULL leaves the value to Mongory.data_converter.
+static mongory_value *rb_mongory_native_data_wrap(mongory_memory_pool *pool, VALUE rb_value) {
+  ID kind = rb_mongory_native_kind(rb_obj_class(rb_value));
+  if (kind == 0) {
+    return NULL;
+  }
+  if (kind == rb_mongory_id_native_number) {
+    return mongory_value_wrap_d(pool, rb_num2dbl(rb_value));
+  }
+  char *string = NULL;
+  if (kind == rb_mongory_id_native_time) {
+    string = rb_mongory_time_iso8601(pool, rb_value);
+  } else if (kind == rb_mongory_id_native_date) {
+    string = rb_mongory_date_string(pool, rb_value);
+  }
+  return string ? mongory_value_wrap_s(pool, string) : NULL;
+}
+
+// ===== Field key helper implementations =====
+
+// Intern a Ruby key object, dynamic Symbols stay collectable once the matcher is gone
+static VALUE rb_mongory_field_key_object(VALUE rb_key, char *key, bool symbol) {
+  if (symbol) {
+    if (SYMBOL_P(rb_key)) return rb_key;
+    return rb_str_intern(rb_utf8_str_new_cstr(key));
+  }
+  if (RB_TYPE_P(rb_key, T_STRING)) return rb_str_new_frozen(rb_key);
+  return rb_obj_freeze(rb_utf8_str_new_cstr(key));
+}
+
+// Fetch the compiled field key of owner, compiling it on first use.
+// rb_key is the original Ruby key when known, Qundef otherwise.
+static rb_mongory_field_key_t *rb_mongory_field_key_fetch(rb_mongory_matcher_t *owner, char *key, VALUE rb_key) {
+  mongory_value *entry = owner->key_map->get(owner->key_map, key);
+  if (entry) return (rb_mongory_field_key_t *)entry->data.u;
+
+  VALUE string_key = rb_mongory_field_key_object(rb_key, key, false);
+  VALUE symbol_key = rb_mongory_field_key_object(rb_key, key, true);
+  rb_mongory_field_key_t *field_key = MG_ALLOC_PTR(owner->pool, rb_mongory_field_key_t);
+  field_key->string_key = string_key;
+  field_key->symbol_key = symbol_key;
+  field_key->symbol_first = SYMBOL_P(rb_key);
+  field_key->last_hash = Qnil;
+  field_key->last_value = NULL;
+  field_key->last_pool = NULL;
+  field_key->last_generation = 0;
+
+  entry = mongory_value_wrap_u(owner->pool, (void *)field_key);
+  entry->origin = (void *)field_key->string_key;
+  owner->key_map->set(owner->key_map, key, entry);
+  RB_GC_GUARD(string_key);
+  RB_GC_GUARD(symbol_key);
+  return field_key;
+}
+
+// ===== Regex helper implementations =====
+
+// Tag of compiled regex values, data.regex holds a rb_mongory_regex_t
+static char *rb_mongory_regex_to_cstr(mongory_value *value, mongory_memory_pool *pool) {
+  (void)pool;
+  rb_mongory_regex_t *re = (rb_mongory_regex_t *)value->data.regex;
+  VALUE rb_str = rb_funcall(re->rb_re, rb_intern("inspect"), 0);
+  return StringValueCStr(rb_str);
+}
+
+// Extract the ASCII literal of patterns like /foo/, /^foo/, /\Afoo\z/ or /foo$/
+static bool rb_mongory_regex_literal_parse(mongory_memory_pool *pool, rb_mongory_regex_t *re) {
+  if (rb_reg_options(re->rb_re) & (ONIG_OPTION_IGNORECASE | ONIG_OPTION_EXTEND)) {
+    return false;
+  }
+  const char *src = RREGEXP_SRC_PTR(re->rb_re);
+  long len = RREGEXP_SRC_LEN(re->rb_re);
+  char *literal = MG_ALLOC(pool, len + 1);
+  long literal_len = 0;
+  long i = 0;
+
+  if (len >= 2 && src[0] == '\\' && src[1] == 'A') {
+    re->start_anchor = RB_MONGORY_ANCHOR_STRING;
+    i = 2;
+  } else if (len >= 1 && src[0] == '^') {
+    re->start_anchor = RB_MONGORY_ANCHOR_LINE;
+    i = 1;
+  }
+
+  for (; i < len; i++) {
+    unsigned char c = (unsigned char)src[i];
+    if (c >= 0x80) {
+      return false;
+    }
+    if (c == '\\') {
+      if (i + 1 >= len) {
+        return false;
+      }
+      unsigned char escaped = (unsigned char)src[++i];
+      if (escaped == 'z' && i + 1 == len) {
+        re->end_anchor = RB_MONGORY_ANCHOR_STRING;
+      } else if (escaped == 'n') {
+        literal[literal_len++] = '\n';
+      } else if (escaped == 't') {
+        literal[literal_len++] = '\t';
+      } else if (rb_ispunct(escaped)) {
+        literal[literal_len++] = (char)escaped;
+      } else {
+        return false;
+      }
+      continue;
+    }
+    if (c == '$' && i + 1 == len) {
+      re->end_anchor = RB_MONGORY_ANCHOR_LINE;
+      continue;
+    }
+    if (strchr(".^$|?*+()[]{}", c)) {
+      return false;
+    }
+    literal[literal_len++] = (char)c;
+  }
+
+  literal[literal_len] = '\0';
+  re->literal = literal;
+  re->literal_len = literal_len;
+  return true;
+}
+
+// Clone the pattern as a fixed encoding UTF-8 Regexp, so onig_search sees UTF-8 semantics
+static VALUE rb_mongory_regex_native_clone(VALUE rb_re) {
+  VALUE source = RREGEXP_SRC(rb_re);
+  int enc_index = ENCODING_GET(source);
+  if (enc_index != rb_utf8_encindex() && enc_index != rb_usascii_encindex()) {
+    return Qnil;
+  }
+  int options = rb_reg_options(rb_re) & (ONIG_OPTION_IGNORECASE | ONIG_OPTION_EXTEND | ONIG_OPTION_MULTILINE);
+  VALUE utf8_source = rb_enc_associate_index(rb_str_dup(source), rb_utf8_encindex());
+  return rb_reg_new_str(utf8_source, options | rb_mongory_reg_fixed_encoding);
+}
+
+// Wrap a $regex pattern, compiling the native matching plan when the matcher opted in
+static mongory_value *rb_mongory_regex_wrap(mongory_memory_pool *pool, VALUE rb_re) {
+  rb_mongory_matcher_t *owner = ((rb_mongory_memory_pool_t *)pool)->owner;
+  if (!owner) {
+    mongory_value *mg_value = mongory_value_wrap_regex(pool, (void *)rb_re);
+    mg_value->origin = (void *)rb_re;
+    return mg_value;
+  }
+
+  rb_mongory_regex_t *re = MG_ALLOC_PTR(pool, rb_mongory_regex_t);
+  re->rb_re = rb_re;
+  re->native_re = Qnil;
+  re->kind = RB_MONGORY_REGEX_RUBY;
+  re->start_anchor = RB_MONGORY_ANCHOR_NONE;
+  re->end_anchor = RB_MONGORY_ANCHOR_NONE;
+  re->literal = NULL;
+  re->literal_len = 0;
+
+  if (owner->native_regex) {
+    if (rb_mongory_regex_literal_parse(pool, re)) {
+      re->kind = RB_MONGORY_REGEX_LITERAL;
+    } else {
+      re->start_anchor = RB_MONGORY_ANCHOR_NONE;
+      re->end_anchor = RB_MONGORY_ANCHOR_NONE;
+      re->native_re = rb_mongory_regex_native_clone(rb_re);
+      if (re->native_re != Qnil) {
+        re->kind = RB_MONGORY_REGEX_ONIG;
+      }
+    }
+  }
+
+  // Patterns compiled from Strings and native clones are not referenced by the condition hash
+  mongory_value *store = mongory_value_wrap_u(pool, NULL);
+  store->origin = (void *)rb_re;
+  owner->mark_list->push(owner->mark_list, store);
+  if (re->native_re != Qnil) {
+    mongory_value *native_store = mongory_value_wrap_u(pool, NULL);
+    native_store->origin = (void *)re->native_re;
+    owner->mark_list->push(owner->mark_list, native_store);
+  }
+
+  mongory_value *mg_value = mongory_value_wrap_regex(pool, (void *)re);
+  mg_value->origin = (void *)rb_re;
+  mg_value->to_str = rb_mongory_regex_to_cstr;
+  return mg_value;
+}
+
+// Only valid UTF-8 or US-ASCII strings take the native paths, others keep Ruby's semantics
+static bool rb_mongory_regex_native_subject(VALUE rb_str) {
+  int enc_index = ENCODING_GET(rb_str);
+  if (enc_index != rb_utf8_encindex() && enc_index != rb_usascii_encindex()) {
+    return false;
+  }
+  return rb_enc_str_coderange(rb_str) != ENC_CODERANGE_BROKEN;
+}
+
+// Find needle in haystack, memchr on the first byte then compare the rest
+static const char *rb_mongory_memfind(const char *haystack, long len, const char *needle, long n) {
+  if (n == 0) return haystack;
+  const char *end = haystack + len - n;
+  for (const char *p = haystack; p <= end; p++) {
+    p = memchr(p, needle[0], (size_t)(end - p + 1));
+    if (!p) return NULL;
+    if (memcmp(p, needle, (size_t)n) == 0) return p;
+  }
+  return NULL;
+}
+
+// Check the anchors of one literal occurrence at pos
+static bool rb_mongory_regex_literal_at(rb_mongory_regex_t *re, const char *str, long len, long pos) {
+  long tail = pos + re->literal_len;
+  switch (re->start_anchor) {
+  case RB_MONGORY_ANCHOR_STRING:
+    if (pos != 0) return false;
+    break;
+  case RB_MONGORY_ANCHOR_LINE:
+    if (pos != 0 && str[pos - 1] != '\n') return false;
+    break;
+  default:
+    break;
+  }
+  switch (re->end_anchor) {
+  case RB_MONGORY_ANCHOR_STRING:
+    return tail == len;
+  case RB_MONGORY_ANCHOR_LINE:
+    return tail == len || str[tail] == '\n';
+  default:
+    return true;
+  }
+}
+
+// Match an ASCII literal pattern against a valid UTF-8 or US-ASCII string
+static bool rb_mongory_regex_literal_match(rb_mongory_regex_t *re, const char *str, long len) {
+  long n = re->literal_len;
+  if (n > len) return false;
+  if (re->start_anchor == RB_MONGORY_ANCHOR_STRING) {
+    return memcmp(str, re->literal, (size_t)n) == 0 && rb_mongory_regex_literal_at(re, str, len, 0);
+  }
+  if (re->end_anchor == RB_MONGORY_ANCHOR_STRING) {
+    return memcmp(str + len - n, re->literal, (size_t)n) == 0 && rb_mongory_regex_literal_at(re, str, len, len - n);
+  }
+  const char *p = str;
+  while ((p = rb_mongory_memfind(p, len - (p - str), re->literal, n))) {
+    if (rb_mongory_regex_literal_at(re, str, len, p - str)) return true;
+    if (p - str >= len) break;
+    p++;
+  }
+  return false;
+}
+
+// Match a compiled pattern natively against valid UTF-8 bytes, -1 when the match is left to Ruby
+static int rb_mongory_regex_native_match(rb_mongory_regex_t *re, const char *str, long len) {
+  if (re->kind == RB_MONGORY_REGEX_LITERAL) {
+    return rb_mongory_regex_literal_match(re, str, len);
+  }
+  const OnigUChar *start = (const OnigUChar *)str;
+  const OnigUChar *end = start + len;
+  OnigPosition pos = onig_search(RREGEXP_PTR(re->native_re), start, end, start, end, NULL, ONIG_OPTION_NONE);
+  if (pos >= 0) return 1;
+  if (pos == ONIG_MISMATCH) return 0;
+  // Engine errors fall back to Ruby, raising the same error Regexp#match? would
+  return -1;
+}
+
+// Match a compiled pattern, taking the native path when the string allows it
+static bool rb_mongory_regex_compiled_match(rb_mongory_regex_t *re, VALUE rb_str) {
+  if (re->kind != RB_MONGORY_REGEX_RUBY && RB_TYPE_P(rb_str, T_STRING) && rb_mongory_regex_native_subject(rb_str)) {
+    int matched = rb_mongory_regex_native_match(re, RSTRING_PTR(rb_str), RSTRING_LEN(rb_str));
+    if (matched >= 0) return matched;
+  }
+  return RTEST(rb_funcall(re->rb_re, rb_intern("match?"), 1, rb_str));
+}
+
+// Regex adapter bridging to Ruby's Regexp
+static bool rb_mongory_regex_match_adapter(mongory_memory_pool *pool, mongory_value *pattern, mongory_value *value) {
+  (void)pool;
+  if (!pattern || !value) {
+    return false;
+  }
+  if (value->type != MONGORY_TYPE_STRING) {
+    return false;
+  }
+
+  bool compiled = pattern->type == MONGORY_TYPE_REGEX && pattern->to_str == rb_mongory_regex_to_cstr;
+  VALUE rb_str;
+  if (value->to_str == rb_mongory_json_to_cstr || rb_mongory_value_native_p(value)) {
+    // Raw JSON strings are decoded as valid UTF-8 and native Time and Date strings are ASCII,
+    // a Ruby String is only built for the Ruby path
+    rb_mongory_regex_t *re = (rb_mongory_regex_t *)pattern->data.regex;
+    if (compiled && re->kind != RB_MONGORY_REGEX_RUBY) {
+      int matched = rb_mongory_regex_native_match(re, value->data.s, (long)strlen(value->data.s));
+      if (matched >= 0) return matched;
+    }
+    rb_str = rb_utf8_str_new_cstr(value->data.s);
+  } else {
+    rb_str = (VALUE)value->origin;
+  }
+
+  if (compiled) {
+    return rb_mongory_regex_compiled_match((rb_mongory_regex_t *)pattern->data.regex, rb_str);
+  }
+
+  VALUE rb_re = Qnil;
+  if (pattern->type == MONGORY_TYPE_REGEX && pattern->data.regex) {
+    rb_re = (VALUE)pattern->data.regex;
+  } else if (pattern->type == MONGORY_TYPE_STRING) {
+    // Conditions compile String patterns up front, this only serves patterns built elsewhere
+    rb_re = rb_reg_new_str(rb_obj_as_string((VALUE)pattern->origin), 0);
+  } else {
+    return false;
+  }
+
+  VALUE matched = rb_funcall(rb_re, rb_intern("match?"), 1, rb_str);
+  return RTEST(matched);
+}
+
+// Regex adapter bridging to Ruby's Regexp
+static char *rb_mongory_regex_stringify_adapter(mongory_memory_pool *pool, mongory_value *pattern) {
+  (void)pool;
+  if (pattern->type != MONGORY_TYPE_REGEX) {
+    return NULL;
+  }
+  VALUE rb_re = (VALUE)pattern->origin;
+  VALUE rb_str = rb_funcall(rb_re, rb_intern("inspect"), 0);
+  return StringValueCStr(rb_str);
+}
+
+// ===== Value set helper implementations =====
+
+// Spread the bits of an integer key
+static inline st_index_t rb_mongory_set_hash_integer(int64_t integer) {
+  uint64_t x = (uint64_t)integer + 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return (st_index_t)(x ^ (x >> 31));
+}
+
+// Find the slot of a key, either holding the key or the empty slot it would go to
+static rb_mongory_set_entry_t *rb_mongory_set_slot(rb_mongory_value_set_t *set, st_index_t hash, bool is_string,
+                                                   int64_t integer, const char *bytes, long len) {
+  for (size_t i = (size_t)hash & set->mask;; i = (i + 1) & set->mask) {
+    rb_mongory_set_entry_t *entry = &set->entries[i];
+    if (!entry->used) return entry;
+    if (entry->hash != hash || entry->is_string != is_string) continue;
+    if (is_string ? (entry->len == len && memcmp(entry->bytes, bytes, (size_t)len) == 0) : entry->integer == integer) {
+      return entry;
+    }
+  }
+}
+
+// Read a Ruby value as a set key, the same way the core compares values:
+// integers (and integral floats) by value, Strings and Symbols by their bytes
+static bool rb_mongory_set_key(VALUE rb_value, bool *is_string, int64_t *integer, const char **bytes, long *len) {
+  switch (TYPE(rb_value)) {
+  case T_FIXNUM:
+    *is_string = false;
+    *integer = (int64_t)FIX2LONG(rb_value);
+    return true;
+  case T_BIGNUM:
+    *is_string = false;
+    // rb_integer_pack returns +-2 when the value does not fit
+    return abs(rb_integer_pack(rb_value, integer, 1, sizeof(int64_t), 0,
+                               INTEGER_PACK_NATIVE_BYTE_ORDER | INTEGER_PACK_2COMP)) < 2;
+  case T_FLOAT: {
+    double d = RFLOAT_VALUE(rb_value);
+    if (d != d || d < -9223372036854775808.0 || d >= 9223372036854775808.0 || d != (double)(int64_t)d) {
+      return false;
+    }
+    *is_string = false;
+    *integer = (int64_t)d;
+    return true;
+  }
+  case T_SYMBOL:
+    rb_value = rb_sym2str(rb_value);
+    // fall through
+  case T_STRING:
+    *is_string = true;
+    *bytes = RSTRING_PTR(rb_value);
+    *len = RSTRING_LEN(rb_value);
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Check membership of one Ruby value without allocating
+static bool rb_mongory_value_set_has(rb_mongory_value_set_t *set, VALUE rb_value) {
+  bool is_string;
+  int64_t integer = 0;
+  const char *bytes = NULL;
+  long len = 0;
+  if (!rb_mongory_set_key(rb_value, &is_string, &integer, &bytes, &len)) {
+    return false;
+  }
+  st_index_t hash = is_string ? rb_memhash(bytes, len) : rb_mongory_set_hash_integer(integer);
+  return rb_mongory_set_slot(set, hash, is_string, integer, bytes, len)->used;
+}
+
+// Check membership of a raw JSON or natively converted value, without building a Ruby value
+static bool rb_mongory_value_set_match_json(rb_mongory_value_set_t *set, mongory_value *value, bool element) {
+  switch (value->type) {
+  case MONGORY_TYPE_INT:
+    return rb_mongory_set_slot(set, rb_mongory_set_hash_integer(value->data.i), false, value->data.i, NULL, 0)->used;
+  case MONGORY_TYPE_DOUBLE: {
+    double d = value->data.d;
+    if (d != d || d < -9223372036854775808.0 || d >= 9223372036854775808.0 || d != (double)(int64_t)d) {
+      return false;
+    }
+    int64_t integer = (int64_t)d;
+    return rb_mongory_set_slot(set, rb_mongory_set_hash_integer(integer), false, integer, NULL, 0)->used;
+  }
+  case MONGORY_TYPE_STRING: {
+    long len = (long)strlen(value->data.s);
+    return rb_mongory_set_slot(set, rb_memhash(value->data.s, len), true, 0, value->data.s, len)->used;
+  }
+  case MONGORY_TYPE_ARRAY: {
+    if (element) return false;
+    mongory_array *array = value->data.a;
+    for (size_t i = 0; i < array->count; i++) {
+      if (rb_mongory_value_set_match_json(set, array->get(array, i), true)) {
+        return true;
+      }
+    }
+    return false;
+  }
+  default:
+    return false;
+  }
+}
+
+// Check membership of a record value, any element matches for Array records
+static bool rb_mongory_value_set_match(rb_mongory_value_set_t *set, mongory_value *value) {
+  if (value && (value->to_str == rb_mongory_json_to_cstr || rb_mongory_value_native_p(value))) {
+    return rb_mongory_value_set_match_json(set, value, false);
+  }
+  if (!value || !value->origin) {
+    return false;
+  }
+  VALUE rb_value = (VALUE)value->origin;
+  if (!RB_TYPE_P(rb_value, T_ARRAY)) {
+    return rb_mongory_value_set_has(set, rb_value);
+  }
+  for (long i = 0; i < RARRAY_LEN(rb_value); i++) {
+    if (rb_mongory_value_set_has(set, RARRAY_AREF(rb_value, i))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Compile a $in / $nin list into a value set, NULL when the list is short or holds other types
+static mongory_value *rb_mongory_value_set_wrap(mongory_memory_pool *pool, VALUE rb_array) {
+  long size = RARRAY_LEN(rb_array);
+  if (size < RB_MONGORY_IN_SET_THRESHOLD) {
+    return NULL;
+  }
+  for (long i = 0; i < size; i++) {
+    VALUE item = RARRAY_AREF(rb_array, i);
+    if (!FIXNUM_P(item) && !RB_TYPE_P(item, T_BIGNUM) && !RB_TYPE_P(item, T_STRING) && !SYMBOL_P(item)) {
+      return NULL;
+    }
+  }
+
+  size_t capacity = 16;
+  while (capacity < (size_t)size * 2) capacity <<= 1;
+  rb_mongory_value_set_t *set = MG_ALLOC_PTR(pool, rb_mongory_value_set_t);
+  set->entries = MG_ALLOC(pool, capacity * sizeof(rb_mongory_set_entry_t));
+  memset(set->entries, 0, capacity * sizeof(rb_mongory_set_entry_t));
+  set->mask = capacity - 1;
+  set->count = 0;
+
+  for (long i = 0; i < size; i++) {
+    bool is_string;
+    int64_t integer = 0;
+    const char *bytes = NULL;
+    long len = 0;
+    if (!rb_mongory_set_key(RARRAY_AREF(rb_array, i), &is_string, &integer, &bytes, &len)) {
+      // Integers beyond 64 bits can never equal a core integer
+      continue;
+    }
+    st_index_t hash = is_string ? rb_memhash(bytes, len) : rb_mongory_set_hash_integer(integer);
+    rb_mongory_set_entry_t *entry = rb_mongory_set_slot(set, hash, is_string, integer, bytes, len);
+    if (entry->used) continue;
+    entry->used = true;
+    entry->hash = hash;
+    entry->is_string = is_string;
+    entry->integer = integer;
+    if (is_string) {
+      // Copy the bytes, the condition strings may be compacted or mutated
+      char *copy = MG_ALLOC(pool, (size_t)len + 1);
+      memcpy(copy, bytes, (size_t)len);
+      copy[len] = '\0';
+      entry->bytes = copy;
+      entry->len = len;
+    }
+    set->count++;
+  }
+
+  mongory_value *mg_value = mongory_value_wrap_u(pool, (void *)set);
+  mg_value->origin = (void *)rb_array;
+  mg_value->to_str = rb_mongory_value_to_cstr;
+  return mg_value;
+}
+
+// ===== Interval helper implementations =====
+
+// Read an interval bound, nil is unbounded, only Integer and Float bounds are supported
+static bool rb_mongory_bound_parse(VALUE rb_value, VALUE rb_inclusive, rb_mongory_bound_t *bound) {
+  bound->bounded = !NIL_P(rb_value);
+  bound->inclusive = RTEST(rb_inclusive);
+  bound->is_integer = false;
+  bound->integer = 0;
+  bound->number = 0.0;
+  if (!bound->bounded) {
+    return true;
+  }
+  if (FIXNUM_P(rb_value)) {
+    bound->is_integer = true;
+    bound->integer = (int64_t)FIX2LONG(rb_value);
+    bound->number = (double)bound->integer;
+    return true;
+  }
+  if (RB_FLOAT_TYPE_P(rb_value)) {
+    bound->number = RFLOAT_VALUE(rb_value);
+    return bound->number == bound->number;
+  }
+  return false;
+}
+
+// Compare a record number with a bound, integers exactly, others as doubles
+static inline int rb_mongory_bound_compare(bool is_integer, int64_t integer, double number, rb_mongory_bound_t *bound) {
+  if (is_integer && bound->is_integer) {
+    return integer < bound->integer ? -1 : integer > bound->integer;
+  }
+  return number < bound->number ? -1 : number > bound->number;
+}
+
+// Check whether a record value falls in one of the intervals, with a binary search over the lower bounds
+static bool rb_mongory_interval_set_match(rb_mongory_interval_set_t *set, mongory_value *value) {
+  if (!value) {
+    return false;
+  }
+  VALUE rb_value = (VALUE)value->origin;
+  bool is_integer = false;
+  int64_t integer = 0;
+  double number;
+  if (value->to_str == rb_mongory_json_to_cstr || rb_mongory_value_native_p(value)) {
+    if (value->type == MONGORY_TYPE_INT) {
+      is_integer = true;
+      integer = value->data.i;
+      number = (double)integer;
+    } else if (value->type == MONGORY_TYPE_DOUBLE) {
+      number = value->data.d;
+      if (number != number) return false;
+    } else {
+      return false;
+    }
+  } else if (!rb_value) {
+    return false;
+  } else if (FIXNUM_P(rb_value)) {
+    is_integer = true;
+    integer = (int64_t)FIX2LONG(rb_value);
+    number = (double)integer;
+  } else if (RB_FLOAT_TYPE_P(rb_value)) {
+    number = RFLOAT_VALUE(rb_value);
+    if (number != number) return false;
+  } else if (RB_TYPE_P(rb_value, T_BIGNUM)) {
+    number = rb_big2dbl(rb_value);
+  } else {
+    return false;
+  }
+
+  // Find the first interval whose lower bound excludes the value
+  long low = 0;
+  long high = set->count;
+  while (low < high) {
+    long mid = low + (high - low) / 2;
+    rb_mongory_bound_t *lower = &set->intervals[mid].lower;
+    int cmp = lower->bounded ? rb_mongory_bound_compare(is_integer, integer, number, lower) : 1;
+    bool excluded = lower->bounded && (cmp < 0 || (cmp == 0 && !lower->inclusive));
+    if (excluded) {
+      high = mid;
+    } else {
+      low = mid + 1;
+    }
+  }
+  if (low == 0) {
+    return false;
+  }
+
+  rb_mongory_bound_t *upper = &set->intervals[low - 1].upper;
+  if (!upper->bounded) {
+    return true;
+  }
+  int cmp = rb_mongory_bound_compare(is_integer, integer, number, upper);
+  return cmp < 0 || (cmp == 0 && upper->inclusive);
+}
+
+// Compile an $intervals condition, NULL when a bound is not an Integer or Float
+static mongory_value *rb_mongory_interval_set_wrap(mongory_memory_pool *pool, VALUE rb_array) {
+  long count = RARRAY_LEN(rb_array);
+  rb_mongory_interval_set_t *set = MG_ALLOC_PTR(pool, rb_mongory_interval_set_t);
+  set->intervals = MG_ALLOC(pool, (count ? count : 1) * sizeof(rb_mongory_interval_t));
+  set->count = count;
+
+  for (long i = 0; i < count; i++) {
+    VALUE interval = RARRAY_AREF(rb_array, i);
+    if (!RB_TYPE_P(interval, T_ARRAY) || RARRAY_LEN(interval) != 4) {
+      return NULL;
+    }
+    rb_mongory_interval_t *target = &set->intervals[i];
+    if (!rb_mongory_bound_parse(RARRAY_AREF(interval, 0), RARRAY_AREF(interval, 1), &target->lower) ||
+        !rb_mongory_bound_parse(RARRAY_AREF(interval, 2), RARRAY_AREF(interval, 3), &target->upper)) {
+      return NULL;
+    }
+  }
+
+  mongory_value *mg_value = mongory_value_wrap_u(pool, (void *)set);
+  mg_value->origin = (void *)rb_array;
+  mg_value->to_str = rb_mongory_value_to_cstr;
+  return mg_value;
+}
+
+// ===== Sampled trace helper implementations =====
+
+// Switch a matcher to sampled tracing into a ring buffer of capacity entries
+static VALUE rb_mongory_trace_enable_sampled(rb_mongory_matcher_t *wrapper, VALUE sample, VALUE sink, VALUE capacity) {
+  double rate = NUM2DBL(sample);
+  if (!(rate > 0.0 && rate <= 1.0)) {
+    rb_raise(rb_eArgError, "sample must be greater than 0 and at most 1");
+  }
+  long size = capacity == Qundef || NIL_P(capacity) ? RB_MONGORY_TRACE_CAPACITY : NUM2LONG(capacity);
+  if (size <= 0) {
+    rb_raise(rb_eArgError, "capacity must be positive");
+  }
+  if (sink == Qundef) {
+    sink = Qnil;
+  }
+  if (!NIL_P(sink) && !rb_respond_to(sink, rb_intern("call")) && !rb_respond_to(sink, rb_intern("puts"))) {
+    rb_raise(rb_eArgError, "sink must respond to call or puts");
+  }
+
+  uint64_t seed = ((uint64_t)rb_genrand_int32() << 32) | (uint64_t)rb_genrand_int32();
+  wrapper->trace_state = seed ? seed : UINT64_C(0x9E3779B97F4A7C15);
+  wrapper->trace_sample = rate;
+  wrapper->trace_sink = sink;
+  wrapper->trace_buffer = rb_ary_new_capa(size);
+  wrapper->trace_capacity = size;
+  wrapper->trace_count = 0;
+  wrapper->trace_mode = RB_MONGORY_TRACE_SAMPLED;
+  return Qnil;
+}
+
+#ifndef MONGORY_DISABLE_TRACE
+// Monotonic nanoseconds, read without going through Ruby
+static uint64_t rb_mongory_clock_nanos(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * UINT64_C(1000000000) + (uint64_t)now.tv_nsec;
+}
+
+// Match a sampled record, timing it into a Mongory::CMatcher::Trace for the ring buffer and the sink
+static bool rb_mongory_trace_record(rb_mongory_matcher_t *wrapper, mongory_value *data_value) {
+  uint64_t started = rb_mongory_clock_nanos();
+  bool result = mongory_matcher_match(wrapper->matcher, data_value);
+  uint64_t finished = rb_mongory_clock_nanos();
+
+  VALUE record = data_value ? (VALUE)data_value->origin : Qnil;
+  VALUE nanos = ULL2NUM(finished - started);
+  VALUE trace = rb_struct_new(cMongoryMatcherTrace, record, result ? Qtrue : Qfalse, nanos);
+  rb_obj_freeze(trace);
+  long slot = wrapper->trace_count % wrapper->trace_capacity;
+  rb_ary_store(wrapper->trace_buffer, slot, trace);
+  wrapper->trace_count++;
+
+  VALUE sink = wrapper->trace_sink;
+  if (!NIL_P(sink)) {
+    rb_funcall(sink, rb_respond_to(sink, rb_intern("call")) ? rb_intern("call") : rb_intern("puts"), 1, trace);
+  }
+  return result;
+}
+
+// Match a record for Mongory::CMatcher#profile: count and time the match, then match the children
+// of the node in condition order, stopping where $and or $or would
+static bool rb_mongory_profile_record(rb_mongory_matcher_t *wrapper, mongory_value *data_value) {
+  uint64_t started = rb_mongory_clock_nanos();
+  bool result = mongory_matcher_match(wrapper->matcher, data_value);
+  wrapper->profile_nanos += rb_mongory_clock_nanos() - started;
+  wrapper->profile_evals++;
+  if (result) {
+    wrapper->profile_matches++;
+  }
+
+  VALUE children = wrapper->profile_children;
+  VALUE record = data_value ? (VALUE)data_value->origin : Qnil;
+  // Raw JSON records keep their String as origin, the children match it raw as well
+  bool json = data_value && data_value->to_str == rb_mongory_json_to_cstr;
+  for (long i = 0; i < RARRAY_LEN(children); i++) {
+    rb_mongory_matcher_t *child;
+    TypedData_Get_Struct(RARRAY_AREF(children, i), rb_mongory_matcher_t, &rb_mongory_matcher_type, child);
+    rb_mongory_scratch_t *scratch = rb_mongory_scratch_claim(child);
+    bool child_result = json ? rb_mongory_matcher_match_json(child, scratch, record)
+                             : rb_mongory_matcher_match_record(child, scratch, record);
+    rb_mongory_scratch_release(scratch);
+    if (child_result == wrapper->profile_any) {
+      break;
+    }
+  }
+  return result;
+}
+
+// Match one converted value with tracing on, see rb_mongory_matcher_match_value
+static bool rb_mongory_matcher_match_traced(rb_mongory_matcher_t *wrapper, mongory_value *data_value) {
+  mongory_matcher *matcher = wrapper->matcher;
+  if (wrapper->trace_mode == RB_MONGORY_TRACE_PROFILE) {
+    return rb_mongory_profile_record(wrapper, data_value);
+  }
+  if (wrapper->trace_mode == RB_MONGORY_TRACE_ALL) {
+    mongory_memory_pool *trace_pool = wrapper->trace_pool;
+    bool result = mongory_matcher_match(matcher, data_value);
+    mongory_matcher_print_trace(matcher);
+    trace_pool->reset(trace_pool);
+    mongory_matcher_enable_trace(matcher, trace_pool);
+    return result;
+  }
+
+  // xorshift64, a record is sampled when the top 53 bits fall below the sample rate
+  uint64_t state = wrapper->trace_state;
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  wrapper->trace_state = state;
+  if ((double)(state >> 11) * 0x1.0p-53 >= wrapper->trace_sample) {
+    return mongory_matcher_match(matcher, data_value);
+  }
+  return rb_mongory_trace_record(wrapper, data_value);
+}
+#endif
+
+// Mongory::CMatcher#traces
+static VALUE rb_mongory_matcher_traces(VALUE self) {
+  rb_mongory_matcher_t *wrapper;
+  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, wrapper);
+  VALUE buffer = wrapper->trace_buffer;
+  if (NIL_P(buffer)) {
+    return rb_ary_new();
+  }
+  // Oldest first, the slot after the newest entry once the buffer wrapped around
+  long size = RARRAY_LEN(buffer);
+  long first = wrapper->trace_count > size ? wrapper->trace_count % size : 0;
+  VALUE traces = rb_ary_new_capa(size);
+  for (long i = 0; i < size; i++) {
+    rb_ary_push(traces, RARRAY_AREF(buffer, (first + i) % size));
+  }
+  return traces;
+}
+
+// Mongory::CMatcher#__profile__(children, any)
+static VALUE rb_mongory_matcher_profile(VALUE self, VALUE children, VALUE any) {
+  rb_mongory_matcher_t *wrapper;
+  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, wrapper);
+#ifdef MONGORY_DISABLE_TRACE
+  if (!NIL_P(children)) {
+    rb_raise(eMongoryError, "profiling is compiled out of this build (MONGORY_DISABLE_TRACE)");
+  }
+#endif
+  rb_mongory_matcher_disable_trace(self);
+  wrapper->profile_evals = 0;
+  wrapper->profile_matches = 0;
+  wrapper->profile_nanos = 0;
+  if (NIL_P(children)) {
+    return Qnil;
+  }
+
+  Check_Type(children, T_ARRAY);
+  children = rb_ary_dup(children);
+  for (long i = 0; i < RARRAY_LEN(children); i++) {
+    rb_check_typeddata(RARRAY_AREF(children, i), &rb_mongory_matcher_type);
+  }
+  rb_obj_freeze(children);
+  wrapper->profile_children = children;
+  wrapper->profile_any = RTEST(any);
+  wrapper->trace_mode = RB_MONGORY_TRACE_PROFILE;
+  return Qnil;
+}
+
+// Mongory::CMatcher#__profile_stats__
+static VALUE rb_mongory_matcher_profile_stats(VALUE self) {
+  rb_mongory_matcher_t *wrapper;
+  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, wrapper);
+  return rb_ary_new_from_args(3, ULL2NUM(wrapper->profile_evals), ULL2NUM(wrapper->profile_matches),
+                              ULL2NUM(wrapper->profile_nanos));
+}
+
+// Mongory::CMatcher#native_regex?
+static VALUE rb_mongory_matcher_native_regex_p(VALUE self) {
+  rb_mongory_matcher_t *wrapper;
+  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, wrapper);
+  return wrapper->native_regex ? Qtrue : Qfalse;
+}
+
+// ===== Prepared matcher helper implementations =====
+
+// Comparison operators whose operand can be a slot
+static bool rb_mongory_slot_operator_p(const char *key) {
+  static const char *const operators[] = { "$eq", "$ne", "$gt", "$gte", "$lt", "$lte" };
+  for (size_t i = 0; i < sizeof(operators) / sizeof(operators[0]); i++) {
+    if (strcmp(key, operators[i]) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Placeholder value of a slot met while converting the condition of a matcher
+static mongory_value *rb_mongory_slot_wrap(rb_mongory_matcher_t *owner, mongory_memory_pool *pool, char *key,
+                                           VALUE rb_slot) {
+  VALUE rb_name = rb_struct_aref(rb_slot, INT2FIX(0));
+  if (!SYMBOL_P(rb_name)) {
+    rb_raise(eMongoryTypeError, "slot name must be a Symbol");
+  }
+  bool literal = key[0] != '$';
+  if (!literal && !rb_mongory_slot_operator_p(key)) {
+    rb_raise(eMongoryTypeError, "slot :%s is not supported under %s", rb_id2name(SYM2ID(rb_name)), key);
+  }
+  if (!owner->bind_pool) {
+    owner->bind_pool = &rb_mongory_memory_pool_new()->base;
+  }
+
+  rb_mongory_slot_t *slot = MG_ALLOC_PTR(pool, rb_mongory_slot_t);
+  slot->name = rb_sym2id(rb_name);
+  slot->literal = literal;
+  // A field value placeholder must not be nil, the core matches a nil field value against missing fields too
+  slot->value = literal ? mongory_value_wrap_u(pool, NULL) : mongory_value_wrap_n(pool, NULL);
+  slot->value->origin = (void *)rb_slot;
+  slot->next = NULL;
+
+  rb_mongory_slot_t **tail = &owner->slots;
+  while (*tail) {
+    tail = &(*tail)->next;
+  }
+  *tail = slot;
+  return slot->value;
+}
+
+// Raise unless the value can replace the placeholder of the slot, before any slot is changed
+static void rb_mongory_slot_check(rb_mongory_slot_t *slot, VALUE rb_value) {
+  switch (TYPE(rb_value)) {
+  case T_TRUE:
+  case T_FALSE:
+  case T_FIXNUM:
+  case T_FLOAT:
+  case T_SYMBOL:
+    return;
+
+  case T_BIGNUM:
+    (void)rb_num2ll_inline(rb_value);
+    return;
+
+  case T_STRING:
+    (void)StringValueCStr(rb_value);
+    return;
+
+  case T_NIL:
+    if (!slot->literal) {
+      return;
+    }
+    break;
+  }
+  rb_raise(eMongoryTypeError, "slot :%s cannot be bound to %s", rb_id2name(slot->name), rb_obj_classname(rb_value));
+}
+
+// Mongory::CMatcher#slots
+static VALUE rb_mongory_matcher_slots(VALUE self) {
+  rb_mongory_matcher_t *wrapper;
+  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, wrapper);
+  VALUE names = rb_ary_new();
+
+  for (rb_mongory_slot_t *slot = wrapper->slots; slot; slot = slot->next) {
+    VALUE name = ID2SYM(slot->name);
+    if (!RTEST(rb_ary_includes(names, name))) {
+      rb_ary_push(names, name);
+    }
+  }
+  return names;
+}
+
+// Mongory::CMatcher#__bind__(values, condition)
+static VALUE rb_mongory_matcher_bind(VALUE self, VALUE values, VALUE condition) {
+  rb_mongory_matcher_t *wrapper;
+  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, wrapper);
+  Check_Type(values, T_HASH);
+  if (!wrapper->slots) {
+    rb_raise(eMongoryError, "matcher has no slots");
+  }
+  if (wrapper->scanning > 0) {
+    rb_raise(eMongoryError, "matcher is being scanned");
+  }
+  for (rb_mongory_slot_t *slot = wrapper->slots; slot; slot = slot->next) {
+    VALUE rb_value = rb_hash_lookup2(values, ID2SYM(slot->name), Qundef);
+    if (rb_value == Qundef) {
+      rb_raise(rb_eArgError, "missing value for slot :%s", rb_id2name(slot->name));
+    }
+    rb_mongory_slot_check(slot, rb_value);
+  }
+
+  // The values of the previous bind and the column plan compiled for them go away together
+  mongory_memory_pool *bind_pool = wrapper->bind_pool;
+  bind_pool->reset(bind_pool);
+  wrapper->plan_checked = false;
+  wrapper->plan = NULL;
+  wrapper->plan_leaves = 0;
+  wrapper->plan_batch = false;
+  wrapper->plan_origin = Qnil;
+
+  for (rb_mongory_slot_t *slot = wrapper->slots; slot; slot = slot->next) {
+    VALUE rb_value = rb_hash_lookup2(values, ID2SYM(slot->name), Qnil);
+    mongory_value *bound = rb_to_mongory_value_primitive(bind_pool, rb_value);
+    bound->origin = (void *)rb_value;
+    // The matcher tree keeps pointing at the slot value, only its contents change
+    mongory_memory_pool *pool = slot->value->pool;
+    *slot->value = *bound;
+    slot->value->pool = pool;
+  }
+  wrapper->bound = condition;
+  return self;
+}
+
+// ===== Projection helper implementations =====
+
+// Copy a Ruby String into a pool
+static char *rb_mongory_string_copy(mongory_memory_pool *pool, VALUE rb_str) {
+  size_t len = (size_t)RSTRING_LEN(rb_str);
+  char *copy = MG_ALLOC(pool, len + 1);
+  memcpy(copy, RSTRING_PTR(rb_str), len);
+  copy[len] = '\0';
+  return copy;
+}
+
+// Compile the key paths of a projection. The segments are registered in the key map of the owner,
+// so records of the scan look them up with the same predicted key style as condition fields.
+static rb_mongory_projection_t *rb_mongory_projection_new(rb_mongory_matcher_t *owner, VALUE key_paths, bool nested) {
+  Check_Type(key_paths, T_ARRAY);
+  long count = RARRAY_LEN(key_paths);
+  for (long i = 0; i < count; i++) {
+    VALUE key_path = RARRAY_AREF(key_paths, i);
+    Check_Type(key_path, T_ARRAY);
+    if (RARRAY_LEN(key_path) == 0) rb_raise(rb_eArgError, "empty field");
+    for (long d = 0; d < RARRAY_LEN(key_path); d++) {
+      Check_Type(RARRAY_AREF(key_path, d), T_STRING);
+    }
+  }
+
+  mongory_memory_pool *pool = &rb_mongory_memory_pool_new()->base;
+  rb_mongory_projection_t *projection = MG_ALLOC_PTR(pool, rb_mongory_projection_t);
+  projection->pool = pool;
+  projection->count = count;
+  projection->key_paths = key_paths;
+  projection->nested = nested;
+  projection->sort = NULL;
+  projection->aggregate = NULL;
+  projection->segments = MG_ALLOC(pool, (count ? count : 1) * sizeof(char **));
+  for (long i = 0; i < count; i++) {
+    VALUE key_path = RARRAY_AREF(key_paths, i);
+    long depth = RARRAY_LEN(key_path);
+    char **segments = MG_ALLOC(pool, (depth + 1) * sizeof(char *));
+    for (long d = 0; d < depth; d++) {
+      VALUE rb_segment = RARRAY_AREF(key_path, d);
+      segments[d] = rb_mongory_string_copy(pool, rb_segment);
+      if (!owner->key_map->get(owner->key_map, segments[d])) {
+        rb_mongory_field_key_fetch(owner, rb_mongory_string_copy(owner->pool, rb_segment), rb_segment);
+      }
+    }
+    segments[depth] = NULL;
+    projection->segments[i] = segments;
+  }
+  return projection;
+}
+
+// Read an Array index segment, only plain decimal digits are indices
+static bool rb_mongory_projection_index(const char *segment, size_t *index) {
+  if (!*segment) return false;
+  size_t value = 0;
+  for (const char *p = segment; *p; p++) {
+    if (*p < '0' || *p > '9' || value > (SIZE_MAX - 9) / 10) return false;
+    value = value * 10 + (size_t)(*p - '0');
+  }
+  *index = value;
+  return true;
+}
+
+// Value under the segments of a field, read with the get of each table or array, NULL when missing
+static mongory_value *rb_mongory_projection_dig(mongory_value *value, char **segments) {
+  for (; value && *segments; segments++) {
+    size_t index;
+    if (value->type == MONGORY_TYPE_TABLE) {
+      value = value->data.t->get(value->data.t, *segments);
+    } else if (value->type == MONGORY_TYPE_ARRAY && rb_mongory_projection_index(*segments, &index)) {
+      value = value->data.a->get(value->data.a, index);
+    } else {
+      return NULL;
+    }
+  }
+  return value;
+}
+
+// Project the fields of one matched record: the value of a single plucked field, an Array of the plucked
+// fields, or for #project a Hash nesting the found fields under their segments
+static VALUE rb_mongory_projection_row(rb_mongory_projection_t *projection, mongory_value *record) {
+  if (!projection->nested && projection->count == 1) {
+    mongory_value *value = rb_mongory_projection_dig(record, projection->segments[0]);
+    return value ? rb_mongory_value_origin(value) : Qnil;
+  }
+
+  VALUE row = projection->nested ? rb_hash_new() : rb_ary_new_capa(projection->count);
+  for (long i = 0; i < projection->count; i++) {
+    mongory_value *value = rb_mongory_projection_dig(record, projection->segments[i]);
+    if (!projection->nested) {
+      rb_ary_push(row, value ? rb_mongory_value_origin(value) : Qnil);
+      continue;
+    }
+    if (!value) continue;
+
+    // Fields never prefix each other, so the Hashes descended into are the ones built here
+    VALUE key_path = RARRAY_AREF(projection->key_paths, i);
+    long depth = RARRAY_LEN(key_path);
+    VALUE target = row;
+    for (long d = 0; d < depth - 1; d++) {
+      VALUE key = RARRAY_AREF(key_path, d);
+      VALUE child = rb_hash_lookup2(target, key, Qundef);
+      if (child == Qundef) {
+        child = rb_hash_new();
+        rb_hash_aset(target, key, child);
+      }
+      target = child;
+    }
+    rb_hash_aset(target, RARRAY_AREF(key_path, depth - 1), rb_mongory_value_origin(value));
+  }
+  return row;
+}
+
+// Project a raw record, converted again in the scratch pool
+static VALUE rb_mongory_project_record(rb_mongory_matcher_t *wrapper, rb_mongory_scratch_t *scratch,
+                                       rb_mongory_projection_t *projection, VALUE record) {
+  mongory_memory_pool *scratch_pool = scratch->pool;
+  wrapper->generation++;
+  mongory_value *value = rb_to_mongory_value_shallow(scratch_pool, record);
+  VALUE row = rb_mongory_projection_row(projection, value);
+  scratch_pool->reset(scratch_pool);
+  return row;
+}
+
+// Arguments of a projected scan
+typedef struct rb_mongory_project_args_t {
+  VALUE self;
+  VALUE records;
+  long offset;
+  long limit;
+  rb_mongory_projection_t *projection;
+} rb_mongory_project_args_t;
+
+static VALUE rb_mongory_project_body(VALUE ptr) {
+  rb_mongory_project_args_t *args = (rb_mongory_project_args_t *)ptr;
+  return rb_mongory_matcher_scan(args->self, args->records, args->offset, args->limit, 1, RB_MONGORY_SCAN_PROJECTION,
+                                 args->projection);
+}
+
+static VALUE rb_mongory_project_ensure(VALUE ptr) {
+  rb_mongory_project_args_t *args = (rb_mongory_project_args_t *)ptr;
+  args->projection->pool->free(args->projection->pool);
+  return Qnil;
+}
+
+// Mongory::CMatcher#__project__(records, key_paths, nested, offset, limit), see Mongory::CMatcher#pluck
+static VALUE rb_mongory_matcher_project(VALUE self, VALUE records, VALUE key_paths, VALUE nested, VALUE offset,
+                                        VALUE limit) {
+  rb_mongory_matcher_t *wrapper;
+  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, wrapper);
+  rb_mongory_project_args_t args = { self, records, NIL_P(offset) ? 0 : NUM2LONG(offset),
+                                     NIL_P(limit) ? -1 : NUM2LONG(limit), NULL };
+  if (args.offset < 0) rb_raise(rb_eArgError, "negative offset");
+  if (!NIL_P(limit) && args.limit < 0) rb_raise(rb_eArgError, "negative limit");
+
+  args.projection = rb_mongory_projection_new(wrapper, key_paths, RTEST(nested));
+  VALUE result = rb_ensure(rb_mongory_project_body, (VALUE)&args, rb_mongory_project_ensure, (VALUE)&args);
+  RB_GC_GUARD(key_paths);
+  return result;
+}
+
+// ===== Sort helper implementations =====
+
+// Read the typed key of one field, strings are copied since the record is reset after the match
+static void rb_mongory_sort_key_read(rb_mongory_sort_t *sort, rb_mongory_sort_key_t *key, mongory_value *value) {
+  memset(key, 0, sizeof(*key));
+  if (!value) return;
+
+  switch (value->type) {
+  case MONGORY_TYPE_NULL:
+    return;
+  case MONGORY_TYPE_INT:
+    key->rank = 1;
+    key->integer = true;
+    key->data.i = value->data.i;
+    return;
+  case MONGORY_TYPE_DOUBLE:
+    key->rank = 1;
+    key->data.d = value->data.d;
+    return;
+  case MONGORY_TYPE_STRING:
+    key->rank = 2;
+    key->data.s.len = strlen(value->data.s);
+    key->data.s.ptr = ALLOC_N(char, key->data.s.len ? key->data.s.len : 1);
+    memcpy(key->data.s.ptr, value->data.s, key->data.s.len);
+    return;
+  case MONGORY_TYPE_BOOL:
+    key->rank = 5;
+    key->data.b = value->data.b;
+    return;
+  default:
+    key->rank = value->type == MONGORY_TYPE_TABLE ? 3 : value->type == MONGORY_TYPE_ARRAY ? 4 : 6;
+    key->data.value = RARRAY_LEN(sort->values);
+    rb_ary_push(sort->values, rb_mongory_value_origin(value));
+  }
+}
+
+// Free the copied strings of an entry
+static void rb_mongory_sort_entry_clear(rb_mongory_sort_t *sort, rb_mongory_sort_entry_t *entry) {
+  for (long i = 0; i < sort->projection->count; i++) {
+    if (entry->keys[i].rank == 2) {
+      xfree(entry->keys[i].data.s.ptr);
+    }
+    entry->keys[i].rank = 0;
+  }
+}
+
+static rb_mongory_sort_entry_t *rb_mongory_sort_entry_new(rb_mongory_sort_t *sort) {
+  size_t size = sizeof(rb_mongory_sort_entry_t) + (size_t)sort->projection->count * sizeof(rb_mongory_sort_key_t);
+  return (rb_mongory_sort_entry_t *)ruby_xcalloc(1, size);
+}
+
+// Read the sort keys of one matched record into the pending entry
+static void rb_mongory_sort_read(rb_mongory_sort_t *sort, mongory_value *record) {
+  rb_mongory_sort_entry_t *pending = sort->pending;
+  rb_mongory_sort_entry_clear(sort, pending);
+  for (long i = 0; i < sort->projection->count; i++) {
+    rb_mongory_sort_key_read(sort, &pending->keys[i], rb_mongory_projection_dig(record, sort->projection->segments[i]));
+  }
+}
+
+// Order of two numbers, NaN below every other number
+static int rb_mongory_sort_number_cmp(const rb_mongory_sort_key_t *a, const rb_mongory_sort_key_t *b) {
+  if (a->integer && b->integer) {
+    return (a->data.i > b->data.i) - (a->data.i < b->data.i);
+  }
+  double x = a->integer ? (double)a->data.i : a->data.d;
+  double y = b->integer ? (double)b->data.i : b->data.d;
+  if (isnan(x) || isnan(y)) {
+    return isnan(y) - isnan(x);
+  }
+  return (x > y) - (x < y);
+}
+
+// Order of two keys: by type rank, then by value. Values without a native order use <=>,
+// keys it cannot compare are equal and keep their record order.
+static int rb_mongory_sort_key_cmp(rb_mongory_sort_t *sort, const rb_mongory_sort_key_t *a,
+                                   const rb_mongory_sort_key_t *b) {
+  if (a->rank != b->rank) {
+    return a->rank < b->rank ? -1 : 1;
+  }
+  switch (a->rank) {
+  case 0:
+    return 0;
+  case 1:
+    return rb_mongory_sort_number_cmp(a, b);
+  case 2: {
+    size_t len = a->data.s.len < b->data.s.len ? a->data.s.len : b->data.s.len;
+    int result = memcmp(a->data.s.ptr, b->data.s.ptr, len);
+    if (result) return result < 0 ? -1 : 1;
+    return (a->data.s.len > b->data.s.len) - (a->data.s.len < b->data.s.len);
+  }
+  case 5:
+    return (int)a->data.b - (int)b->data.b;
+  default: {
+    VALUE x = RARRAY_AREF(sort->values, a->data.value);
+    VALUE y = RARRAY_AREF(sort->values, b->data.value);
+    VALUE result = rb_funcall(x, rb_intern("<=>"), 1, y);
+    if (!FIXNUM_P(result)) return 0;
+    return (FIX2LONG(result) > 0) - (FIX2LONG(result) < 0);
+  }
+  }
+}
+
+// Order of two entries by their keys and directions, ties in record order
+static int rb_mongory_sort_entry_cmp(rb_mongory_sort_t *sort, const rb_mongory_sort_entry_t *a,
+                                     const rb_mongory_sort_entry_t *b) {
+  for (long i = 0; i < sort->projection->count; i++) {
+    int result = rb_mongory_sort_key_cmp(sort, &a->keys[i], &b->keys[i]);
+    if (result) return result * sort->directions[i];
+  }
+  return (a->index > b->index) - (a->index < b->index);
+}
+
+// Restore the max heap below position i of the first count entries
+static void rb_mongory_sort_sift_down(rb_mongory_sort_t *sort, long i, long count) {
+  rb_mongory_sort_entry_t **entries = sort->entries;
+  for (;;) {
+    long largest = i;
+    long left = 2 * i + 1;
+    long right = left + 1;
+    if (left < count && rb_mongory_sort_entry_cmp(sort, entries[left], entries[largest]) > 0) largest = left;
+    if (right < count && rb_mongory_sort_entry_cmp(sort, entries[right], entries[largest]) > 0) largest = right;
+    if (largest == i) return;
+
+    rb_mongory_sort_entry_t *entry = entries[i];
+    entries[i] = entries[largest];
+    entries[largest] = entry;
+    i = largest;
+  }
+}
+
+// Restore the max heap above the last entry
+static void rb_mongory_sort_sift_up(rb_mongory_sort_t *sort, long i) {
+  rb_mongory_sort_entry_t **entries = sort->entries;
+  while (i > 0) {
+    long parent = (i - 1) / 2;
+    if (rb_mongory_sort_entry_cmp(sort, entries[i], entries[parent]) <= 0) return;
+
+    rb_mongory_sort_entry_t *entry = entries[i];
+    entries[i] = entries[parent];
+    entries[parent] = entry;
+    i = parent;
+  }
+}
+
+// Keep one matching record. A bounded sort keeps the top entries in a max heap, so a match
+// worse than every kept one costs one comparison. Dataset rows are read from their raw records.
+static void rb_mongory_sort_push(rb_mongory_matcher_t *wrapper, rb_mongory_scratch_t *scratch, rb_mongory_sort_t *sort,
+                                 bool dataset, long index, VALUE record) {
+  if (dataset) {
+    mongory_memory_pool *scratch_pool = scratch->pool;
+    wrapper->generation++;
+    rb_mongory_sort_read(sort, rb_to_mongory_value_shallow(scratch_pool, record));
+    scratch_pool->reset(scratch_pool);
+  }
+  sort->pending->index = index;
+
+  if (sort->top < 0 || sort->count < sort->top) {
+    if (sort->count == sort->capacity) {
+      sort->capacity = sort->capacity ? sort->capacity * 2 : 64;
+      REALLOC_N(sort->entries, rb_mongory_sort_entry_t *, sort->capacity);
+    }
+    sort->entries[sort->count] = sort->pending;
+    sort->pending = rb_mongory_sort_entry_new(sort);
+    if (sort->top >= 0) rb_mongory_sort_sift_up(sort, sort->count);
+    sort->count++;
+    return;
+  }
+  if (rb_mongory_sort_entry_cmp(sort, sort->pending, sort->entries[0]) < 0) {
+    rb_mongory_sort_entry_t *worst = sort->entries[0];
+    sort->entries[0] = sort->pending;
+    sort->pending = worst;
+    rb_mongory_sort_sift_down(sort, 0, sort->count);
+  }
+}
+
+// Sort the kept entries in place with a heap sort, the index tie break makes it stable
+static void rb_mongory_sort_finish(rb_mongory_sort_t *sort) {
+  for (long i = sort->count / 2 - 1; i >= 0; i--) {
+    rb_mongory_sort_sift_down(sort, i, sort->count);
+  }
+  for (long end = sort->count - 1; end > 0; end--) {
+    rb_mongory_sort_entry_t *entry = sort->entries[0];
+    sort->entries[0] = sort->entries[end];
+    sort->entries[end] = entry;
+    rb_mongory_sort_sift_down(sort, 0, end);
+  }
+}
+
+// Arguments of a sorted scan
+typedef struct rb_mongory_sort_args_t {
+  VALUE self;
+  VALUE records;
+  long offset;
+  long limit;
+  rb_mongory_sort_t *sort;
+} rb_mongory_sort_args_t;
+
+static VALUE rb_mongory_sort_body(VALUE ptr) {
+  rb_mongory_sort_args_t *args = (rb_mongory_sort_args_t *)ptr;
+  rb_mongory_sort_t *sort = args->sort;
+  rb_mongory_matcher_scan(args->self, args->records, 0, -1, 1, RB_MONGORY_SCAN_SORT, sort->projection);
+  rb_mongory_sort_finish(sort);
+
+  VALUE records = args->records;
+  if (rb_typeddata_is_kind_of(records, &rb_mongory_dataset_type)) {
+    records = ((rb_mongory_dataset_t *)RTYPEDDATA_DATA(records))->records;
+  }
+  long end = args->limit < 0 || sort->count - args->offset < args->limit ? sort->count : args->offset + args->limit;
+  VALUE result = rb_ary_new_capa(end > args->offset ? end - args->offset : 0);
+  for (long i = args->offset; i < end; i++) {
+    rb_ary_push(result, RARRAY_AREF(records, sort->entries[i]->index));
+  }
+  return result;
+}
+
+static VALUE rb_mongory_sort_ensure(VALUE ptr) {
+  rb_mongory_sort_t *sort = ((rb_mongory_sort_args_t *)ptr)->sort;
+  for (long i = 0; i < sort->count; i++) {
+    rb_mongory_sort_entry_clear(sort, sort->entries[i]);
+    xfree(sort->entries[i]);
+  }
+  rb_mongory_sort_entry_clear(sort, sort->pending);
+  xfree(sort->pending);
+  xfree(sort->entries);
+  xfree(sort->directions);
+  sort->projection->pool->free(sort->projection->pool);
+  return Qnil;
+}
+
+// Mongory::CMatcher#__sort__(records, key_paths, directions, offset, limit), see Mongory::CMatcher#sort
+static VALUE rb_mongory_matcher_sort(VALUE self, VALUE records, VALUE key_paths, VALUE directions, VALUE offset,
+                                     VALUE limit) {
+  rb_mongory_matcher_t *wrapper;
+  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, wrapper);
+  rb_mongory_sort_args_t args = { self, records, NIL_P(offset) ? 0 : NUM2LONG(offset),
+                                  NIL_P(limit) ? -1 : NUM2LONG(limit), NULL };
+  if (args.offset < 0) rb_raise(rb_eArgError, "negative offset");
+  if (!NIL_P(limit) && args.limit < 0) rb_raise(rb_eArgError, "negative limit");
+  Check_Type(key_paths, T_ARRAY);
+  Check_Type(directions, T_ARRAY);
+  long count = RARRAY_LEN(key_paths);
+  if (count == 0 || RARRAY_LEN(directions) != count) rb_raise(rb_eArgError, "one direction per sort field expected");
+  for (long i = 0; i < count; i++) {
+    int direction = NUM2INT(RARRAY_AREF(directions, i));
+    if (direction != 1 && direction != -1) rb_raise(rb_eArgError, "sort direction must be 1 or -1");
+  }
+  if (args.limit == 0) return rb_ary_new();
+
+  rb_mongory_sort_t sort = { NULL, NULL, args.limit < 0 ? -1 : args.offset + args.limit, 0, 0, NULL, NULL,
+                             rb_ary_new() };
+  sort.projection = rb_mongory_projection_new(wrapper, key_paths, false);
+  sort.projection->sort = &sort;
+  sort.directions = ALLOC_N(int, count);
+  for (long i = 0; i < count; i++) {
+    sort.directions[i] = NUM2INT(RARRAY_AREF(directions, i));
+  }
+  sort.pending = rb_mongory_sort_entry_new(&sort);
+  args.sort = &sort;
+  VALUE result = rb_ensure(rb_mongory_sort_body, (VALUE)&args, rb_mongory_sort_ensure, (VALUE)&args);
+  RB_GC_GUARD(key_paths);
+  RB_GC_GUARD(sort.values);
+  return result;
+}
+
+// ===== Aggregation helper implementations =====
+
+// Read a group key of the current match. Integral doubles become integers so 1 and 1.0 share a group,
+// and strings point into the matched record until a new group copies them. Values without native
+// equality are keyed by the id of an eql? value.
+static void rb_mongory_group_key_read(rb_mongory_aggregate_t *aggregate, rb_mongory_sort_key_t *key,
+                                      mongory_value *value) {
+  memset(key, 0, sizeof(*key));
+  if (!value) return;
+
+  switch (value->type) {
+  case MONGORY_TYPE_NULL:
+    return;
+  case MONGORY_TYPE_INT:
+    key->rank = 1;
+    key->integer = true;
+    key->data.i = value->data.i;
+    return;
+  case MONGORY_TYPE_DOUBLE: {
+    double d = value->data.d;
+    key->rank = 1;
+    if (d >= -9223372036854775808.0 && d < 9223372036854775808.0 && d == (double)(int64_t)d) {
+      key->integer = true;
+      key->data.i = (int64_t)d;
+    } else {
+      key->data.d = d;
+    }
+    return;
+  }
+  case MONGORY_TYPE_STRING:
+    key->rank = 2;
+    key->data.s.ptr = value->data.s;
+    key->data.s.len = strlen(value->data.s);
+    return;
+  case MONGORY_TYPE_BOOL:
+    key->rank = 5;
+    key->data.b = value->data.b;
+    return;
+  default: {
+    key->rank = value->type == MONGORY_TYPE_TABLE ? 3 : value->type == MONGORY_TYPE_ARRAY ? 4 : 6;
+    VALUE origin = rb_mongory_value_origin(value);
+    VALUE id = rb_hash_lookup2(aggregate->ids, origin, Qundef);
+    if (id == Qundef) {
+      id = LONG2NUM((long)RHASH_SIZE(aggregate->ids));
+      rb_hash_aset(aggregate->ids, origin, id);
+    }
+    key->data.value = NUM2LONG(id);
+  }
+  }
+}
+
+static inline uint64_t rb_mongory_group_mix(uint64_t hash, uint64_t word) {
+  return hash ^ (word + UINT64_C(0x9e3779b97f4a7c15) + (hash << 6) + (hash >> 2));
+}
+
+// Hash of the group keys, equal keys hash alike
+static uint64_t rb_mongory_group_hash(rb_mongory_aggregate_t *aggregate, rb_mongory_group_t *group) {
+  uint64_t hash = 0;
+  for (long i = 0; i < aggregate->key_count; i++) {
+    rb_mongory_sort_key_t *key = &group->keys[i];
+    hash = rb_mongory_group_mix(hash, (uint64_t)key->rank);
+    switch (key->rank) {
+    case 0:
+      break;
+    case 1: {
+      uint64_t word = (uint64_t)key->data.i;
+      if (!key->integer) {
+        double d = isnan(key->data.d) ? NAN : key->data.d;
+        memcpy(&word, &d, sizeof(word));
+      }
+      hash = rb_mongory_group_mix(hash, word);
+      break;
+    }
+    case 2: {
+      // FNV-1a over the bytes
+      uint64_t word = UINT64_C(0xcbf29ce484222325);
+      for (size_t b = 0; b < key->data.s.len; b++) {
+        word = (word ^ (unsigned char)key->data.s.ptr[b]) * UINT64_C(0x100000001b3);
+      }
+      hash = rb_mongory_group_mix(hash, word);
+      break;
+    }
+    case 5:
+      hash = rb_mongory_group_mix(hash, (uint64_t)key->data.b);
+      break;
+    default:
+      hash = rb_mongory_group_mix(hash, (uint64_t)key->data.value);
+    }
+  }
+  return hash;
+}
+
+static bool rb_mongory_group_key_eq(const rb_mongory_sort_key_t *a, const rb_mongory_sort_key_t *b) {
+  if (a->rank != b->rank) return false;
+
+  switch (a->rank) {
+  case 0:
+    return true;
+  case 1:
+    if (a->integer != b->integer) return false;
+    if (a->integer) return a->data.i == b->data.i;
+    return a->data.d == b->data.d || (isnan(a->data.d) && isnan(b->data.d));
+  case 2:
+    return a->data.s.len == b->data.s.len && memcmp(a->data.s.ptr, b->data.s.ptr, a->data.s.len) == 0;
+  case 5:
+    return a->data.b == b->data.b;
+  default:
+    return a->data.value == b->data.value;
+  }
+}
+
+static rb_mongory_group_t *rb_mongory_group_new(rb_mongory_aggregate_t *aggregate) {
+  size_t size = sizeof(rb_mongory_group_t) + (size_t)aggregate->key_count * sizeof(rb_mongory_sort_key_t);
+  rb_mongory_group_t *group = (rb_mongory_group_t *)ruby_xcalloc(1, size);
+  group->integer = true;
+  return group;
+}
+
+// Double the slots of the table, keeping room in the groups for every group it can hold
+static void rb_mongory_aggregate_grow(rb_mongory_aggregate_t *aggregate) {
+  long capacity = aggregate->capacity * 2;
+  rb_mongory_group_t **slots = ZALLOC_N(rb_mongory_group_t *, capacity);
+  for (long i = 0; i < aggregate->count; i++) {
+    rb_mongory_group_t *group = aggregate->groups[i];
+    long slot = (long)(group->hash & (uint64_t)(capacity - 1));
+    while (slots[slot]) {
+      slot = (slot + 1) & (capacity - 1);
+    }
+    slots[slot] = group;
+  }
+  xfree(aggregate->slots);
+  aggregate->slots = slots;
+  aggregate->capacity = capacity;
+  REALLOC_N(aggregate->groups, rb_mongory_group_t *, capacity / 2 + 1);
+}
+
+// Keep the pending keys as a new group in the slot, with the Ruby values of its keys
+static rb_mongory_group_t *rb_mongory_aggregate_insert(rb_mongory_aggregate_t *aggregate, mongory_value *record,
+                                                       long slot) {
+  rb_mongory_projection_t *projection = aggregate->projection;
+  rb_mongory_group_t *group = aggregate->pending;
+  aggregate->pending = rb_mongory_group_new(aggregate);
+  VALUE key = aggregate->key_count == 1 ? Qnil : rb_ary_new_capa(aggregate->key_count);
+  for (long i = 0; i < aggregate->key_count; i++) {
+    rb_mongory_sort_key_t *group_key = &group->keys[i];
+    if (group_key->rank == 2) {
+      char *copy = ALLOC_N(char, group_key->data.s.len ? group_key->data.s.len : 1);
+      memcpy(copy, group_key->data.s.ptr, group_key->data.s.len);
+      group_key->data.s.ptr = copy;
+    }
+    mongory_value *value = rb_mongory_projection_dig(record, projection->segments[i]);
+    VALUE origin = value ? rb_mongory_value_origin(value) : Qnil;
+    if (aggregate->key_count == 1) {
+      key = origin;
+    } else {
+      rb_ary_push(key, origin);
     }
   }
-  mg_value->origin = rb_value;
-  return mg_value;
+  rb_ary_push(aggregate->keys, key);
+
+  group->id = aggregate->count;
+  aggregate->slots[slot] = group;
+  aggregate->groups[aggregate->count++] = group;
+  if (aggregate->count * 2 > aggregate->capacity) {
+    rb_mongory_aggregate_grow(aggregate);
+  }
+  return group;
+}
+
+static inline bool rb_mongory_add_overflow(int64_t a, int64_t b, int64_t *sum) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_add_overflow(a, b, sum);
+#else
+  if ((b > 0 && a > INT64_MAX - b) || (b < 0 && a < INT64_MIN - b)) return true;
+  *sum = a + b;
+  return false;
+#endif
+}
+
+// Reduce a numeric value into a group, other values are left out like in a MongoDB $sum.
+// The sum stays an exact integer until a Float or an overflow.
+static void rb_mongory_group_reduce(rb_mongory_group_t *group, mongory_value *value) {
+  if (!value || (value->type != MONGORY_TYPE_INT && value->type != MONGORY_TYPE_DOUBLE)) return;
+
+  rb_mongory_sort_key_t number;
+  memset(&number, 0, sizeof(number));
+  number.rank = 1;
+  number.integer = value->type == MONGORY_TYPE_INT;
+  if (number.integer) {
+    number.data.i = value->data.i;
+  } else {
+    number.data.d = value->data.d;
+  }
+  if (group->numbers == 0 || rb_mongory_sort_number_cmp(&number, &group->min) < 0) group->min = number;
+  if (group->numbers == 0 || rb_mongory_sort_number_cmp(&number, &group->max) > 0) group->max = number;
+  group->numbers++;
+
+  int64_t sum;
+  if (group->integer && number.integer && !rb_mongory_add_overflow(group->sum_i, number.data.i, &sum)) {
+    group->sum_i = sum;
+    return;
+  }
+  if (group->integer) {
+    group->integer = false;
+    group->sum_d = (double)group->sum_i;
+  }
+  group->sum_d += number.integer ? (double)number.data.i : number.data.d;
+}
+
+// Accumulate one matched record into its group
+static void rb_mongory_aggregate_add(rb_mongory_aggregate_t *aggregate, mongory_value *record) {
+  rb_mongory_projection_t *projection = aggregate->projection;
+  rb_mongory_group_t *pending = aggregate->pending;
+  for (long i = 0; i < aggregate->key_count; i++) {
+    mongory_value *value = rb_mongory_projection_dig(record, projection->segments[i]);
+    rb_mongory_group_key_read(aggregate, &pending->keys[i], value);
+  }
+  pending->hash = rb_mongory_group_hash(aggregate, pending);
+
+  long mask = aggregate->capacity - 1;
+  long slot = (long)(pending->hash & (uint64_t)mask);
+  rb_mongory_group_t *group = NULL;
+  for (; aggregate->slots[slot]; slot = (slot + 1) & mask) {
+    rb_mongory_group_t *candidate = aggregate->slots[slot];
+    if (candidate->hash != pending->hash) continue;
+
+    long i = 0;
+    while (i < aggregate->key_count && rb_mongory_group_key_eq(&candidate->keys[i], &pending->keys[i])) i++;
+    if (i == aggregate->key_count) {
+      group = candidate;
+      break;
+    }
+  }
+  if (!group) {
+    group = rb_mongory_aggregate_insert(aggregate, record, slot);
+  }
+  group->count++;
+  if (aggregate->reduce) {
+    rb_mongory_group_reduce(group, rb_mongory_projection_dig(record, projection->segments[aggregate->key_count]));
+  }
+}
+
+static VALUE rb_mongory_group_number(const rb_mongory_sort_key_t *number) {
+  return number->integer ? LL2NUM(number->data.i) : DBL2NUM(number->data.d);
+}
+
+// Arguments of a grouped scan
+typedef struct rb_mongory_aggregate_args_t {
+  VALUE self;
+  VALUE records;
+  long offset;
+  long limit;
+  rb_mongory_aggregate_t *aggregate;
+} rb_mongory_aggregate_args_t;
+
+static VALUE rb_mongory_aggregate_body(VALUE ptr) {
+  rb_mongory_aggregate_args_t *args = (rb_mongory_aggregate_args_t *)ptr;
+  rb_mongory_aggregate_t *aggregate = args->aggregate;
+  rb_mongory_matcher_scan(args->self, args->records, args->offset, args->limit, 1, RB_MONGORY_SCAN_AGGREGATE,
+                          aggregate->projection);
+
+  VALUE rows = rb_ary_new_capa(aggregate->count);
+  for (long i = 0; i < aggregate->count; i++) {
+    rb_mongory_group_t *group = aggregate->groups[i];
+    VALUE sum = group->numbers == 0 ? INT2FIX(0) : group->integer ? LL2NUM(group->sum_i) : DBL2NUM(group->sum_d);
+    VALUE min = group->numbers == 0 ? Qnil : rb_mongory_group_number(&group->min);
+    VALUE max = group->numbers == 0 ? Qnil : rb_mongory_group_number(&group->max);
+    VALUE row = rb_ary_new_from_args(6, RARRAY_AREF(aggregate->keys, i), LONG2NUM(group->count),
+                                     LONG2NUM(group->numbers), sum, min, max);
+    rb_ary_push(rows, row);
+  }
+  return rows;
+}
+
+static VALUE rb_mongory_aggregate_ensure(VALUE ptr) {
+  rb_mongory_aggregate_t *aggregate = ((rb_mongory_aggregate_args_t *)ptr)->aggregate;
+  for (long i = 0; i < aggregate->count; i++) {
+    rb_mongory_group_t *group = aggregate->groups[i];
+    for (long k = 0; k < aggregate->key_count; k++) {
+      if (group->keys[k].rank == 2) xfree(group->keys[k].data.s.ptr);
+    }
+    xfree(group);
+  }
+  // The pending keys still point into the records
+  xfree(aggregate->pending);
+  xfree(aggregate->slots);
+  xfree(aggregate->groups);
+  aggregate->projection->pool->free(aggregate->projection->pool);
+  return Qnil;
+}
+
+// Mongory::CMatcher#__group__(records, key_paths, value_path, offset, limit), see Mongory::CGrouping
+static VALUE rb_mongory_matcher_group(VALUE self, VALUE records, VALUE key_paths, VALUE value_path, VALUE offset,
+                                      VALUE limit) {
+  rb_mongory_matcher_t *wrapper;
+  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, wrapper);
+  rb_mongory_aggregate_args_t args = { self, records, NIL_P(offset) ? 0 : NUM2LONG(offset),
+                                       NIL_P(limit) ? -1 : NUM2LONG(limit), NULL };
+  if (args.offset < 0) rb_raise(rb_eArgError, "negative offset");
+  if (!NIL_P(limit) && args.limit < 0) rb_raise(rb_eArgError, "negative limit");
+  Check_Type(key_paths, T_ARRAY);
+  if (RARRAY_LEN(key_paths) == 0) rb_raise(rb_eArgError, "no group fields given");
+
+  VALUE paths = rb_ary_dup(key_paths);
+  if (!NIL_P(value_path)) {
+    rb_ary_push(paths, value_path);
+  }
+  rb_mongory_aggregate_t aggregate = { NULL, RARRAY_LEN(key_paths), !NIL_P(value_path), 0, 64, NULL, NULL, NULL,
+                                       rb_ary_new(), rb_hash_new() };
+  aggregate.projection = rb_mongory_projection_new(wrapper, paths, false);
+  aggregate.projection->aggregate = &aggregate;
+  aggregate.slots = ZALLOC_N(rb_mongory_group_t *, aggregate.capacity);
+  aggregate.groups = ALLOC_N(rb_mongory_group_t *, aggregate.capacity / 2 + 1);
+  aggregate.pending = rb_mongory_group_new(&aggregate);
+  args.aggregate = &aggregate;
+  VALUE rows = rb_ensure(rb_mongory_aggregate_body, (VALUE)&args, rb_mongory_aggregate_ensure, (VALUE)&args);
+  RB_GC_GUARD(paths);
+  RB_GC_GUARD(aggregate.keys);
+  RB_GC_GUARD(aggregate.ids);
+  return rows;
+}
+
+// ===== Dump helper implementations =====
+
+/**
+ * Matcher dumps
+ *
+ * A dump holds the converted condition of a matcher, so loading it skips the condition
+ * converter. It is position independent: an 8 byte header ("MGRY", the format version,
+ * flags and a reserved byte pair), the payload length as a little endian u32, then the
+ * condition as tagged values. Integers are little endian, lengths u32.
+ */
+#define RB_MONGORY_DUMP_MAGIC "MGRY"
+#define RB_MONGORY_DUMP_VERSION 1
+#define RB_MONGORY_DUMP_HEADER 12
+#define RB_MONGORY_DUMP_NATIVE_REGEX 0x01
+#define RB_MONGORY_DUMP_MAX_DEPTH 100
+
+typedef enum rb_mongory_dump_tag {
+  RB_MONGORY_DUMP_NIL,
+  RB_MONGORY_DUMP_FALSE,
+  RB_MONGORY_DUMP_TRUE,
+  RB_MONGORY_DUMP_INT,    // int64
+  RB_MONGORY_DUMP_BIGNUM, // decimal digits
+  RB_MONGORY_DUMP_FLOAT,  // IEEE 754 double
+  RB_MONGORY_DUMP_STRING, // encoding, bytes
+  RB_MONGORY_DUMP_SYMBOL, // UTF-8 bytes
+  RB_MONGORY_DUMP_ARRAY,  // count, values
+  RB_MONGORY_DUMP_HASH,   // count, keys and values
+  RB_MONGORY_DUMP_REGEXP, // options, source String
+  RB_MONGORY_DUMP_RANGE,  // begin, end, exclude_end
+} rb_mongory_dump_tag;
+
+// Encoding of a dumped String, others are dumped by name
+typedef enum rb_mongory_dump_encoding {
+  RB_MONGORY_DUMP_UTF8,
+  RB_MONGORY_DUMP_US_ASCII,
+  RB_MONGORY_DUMP_BINARY,
+  RB_MONGORY_DUMP_NAMED,
+} rb_mongory_dump_encoding;
+
+static void rb_mongory_dump_value(VALUE out, VALUE value, int depth);
+
+static void rb_mongory_dump_u8(VALUE out, uint8_t byte) {
+  rb_str_buf_cat(out, (const char *)&byte, 1);
+}
+
+static void rb_mongory_dump_u32(VALUE out, uint32_t word) {
+  unsigned char bytes[4] = { (unsigned char)word, (unsigned char)(word >> 8), (unsigned char)(word >> 16),
+                             (unsigned char)(word >> 24) };
+  rb_str_buf_cat(out, (const char *)bytes, 4);
+}
+
+static void rb_mongory_dump_u64(VALUE out, uint64_t word) {
+  unsigned char bytes[8];
+  for (int i = 0; i < 8; i++) {
+    bytes[i] = (unsigned char)(word >> (8 * i));
+  }
+  rb_str_buf_cat(out, (const char *)bytes, 8);
+}
+
+static void rb_mongory_dump_bytes(VALUE out, const char *bytes, long len) {
+  if ((unsigned long)len > UINT32_MAX) rb_raise(eMongoryError, "value too large to dump");
+  rb_mongory_dump_u32(out, (uint32_t)len);
+  rb_str_buf_cat(out, bytes, len);
+}
+
+static void rb_mongory_dump_string(VALUE out, VALUE string) {
+  rb_encoding *encoding = rb_enc_get(string);
+  if (encoding == rb_utf8_encoding()) {
+    rb_mongory_dump_u8(out, RB_MONGORY_DUMP_UTF8);
+  } else if (encoding == rb_usascii_encoding()) {
+    rb_mongory_dump_u8(out, RB_MONGORY_DUMP_US_ASCII);
+  } else if (encoding == rb_ascii8bit_encoding()) {
+    rb_mongory_dump_u8(out, RB_MONGORY_DUMP_BINARY);
+  } else {
+    const char *name = rb_enc_name(encoding);
+    rb_mongory_dump_u8(out, RB_MONGORY_DUMP_NAMED);
+    rb_mongory_dump_bytes(out, name, (long)strlen(name));
+  }
+  rb_mongory_dump_bytes(out, RSTRING_PTR(string), RSTRING_LEN(string));
+}
+
+// Arguments of dumping the pairs of a Hash
+typedef struct rb_mongory_dump_ctx_t {
+  VALUE out;
+  int depth;
+} rb_mongory_dump_ctx_t;
+
+static int rb_mongory_dump_pair(VALUE key, VALUE value, VALUE ptr) {
+  rb_mongory_dump_ctx_t *ctx = (rb_mongory_dump_ctx_t *)ptr;
+  rb_mongory_dump_value(ctx->out, key, ctx->depth);
+  rb_mongory_dump_value(ctx->out, value, ctx->depth);
+  return ST_CONTINUE;
+}
+
+// Append one tagged value of a converted condition
+static void rb_mongory_dump_value(VALUE out, VALUE value, int depth) {
+  if (depth > RB_MONGORY_DUMP_MAX_DEPTH) rb_raise(eMongoryError, "condition nested too deeply to dump");
+
+  if (NIL_P(value)) {
+    rb_mongory_dump_u8(out, RB_MONGORY_DUMP_NIL);
+  } else if (value == Qfalse || value == Qtrue) {
+    rb_mongory_dump_u8(out, value == Qtrue ? RB_MONGORY_DUMP_TRUE : RB_MONGORY_DUMP_FALSE);
+  } else if (FIXNUM_P(value)) {
+    rb_mongory_dump_u8(out, RB_MONGORY_DUMP_INT);
+    rb_mongory_dump_u64(out, (uint64_t)(int64_t)FIX2LONG(value));
+  } else if (SYMBOL_P(value)) {
+    rb_mongory_dump_u8(out, RB_MONGORY_DUMP_SYMBOL);
+    VALUE name = rb_sym2str(value);
+    rb_mongory_dump_bytes(out, RSTRING_PTR(name), RSTRING_LEN(name));
+  } else if (RB_FLOAT_TYPE_P(value)) {
+    double d = RFLOAT_VALUE(value);
+    uint64_t word;
+    memcpy(&word, &d, sizeof(word));
+    rb_mongory_dump_u8(out, RB_MONGORY_DUMP_FLOAT);
+    rb_mongory_dump_u64(out, word);
+  } else if (RB_TYPE_P(value, T_BIGNUM)) {
+    VALUE digits = rb_big2str(value, 10);
+    rb_mongory_dump_u8(out, RB_MONGORY_DUMP_BIGNUM);
+    rb_mongory_dump_bytes(out, RSTRING_PTR(digits), RSTRING_LEN(digits));
+  } else if (RB_TYPE_P(value, T_STRING)) {
+    rb_mongory_dump_u8(out, RB_MONGORY_DUMP_STRING);
+    rb_mongory_dump_string(out, value);
+  } else if (RB_TYPE_P(value, T_ARRAY)) {
+    rb_mongory_dump_u8(out, RB_MONGORY_DUMP_ARRAY);
+    rb_mongory_dump_u32(out, (uint32_t)RARRAY_LEN(value));
+    for (long i = 0; i < RARRAY_LEN(value); i++) {
+      rb_mongory_dump_value(out, RARRAY_AREF(value, i), depth + 1);
+    }
+  } else if (RB_TYPE_P(value, T_HASH)) {
+    rb_mongory_dump_ctx_t ctx = { out, depth + 1 };
+    rb_mongory_dump_u8(out, RB_MONGORY_DUMP_HASH);
+    rb_mongory_dump_u32(out, (uint32_t)RHASH_SIZE(value));
+    rb_hash_foreach(value, rb_mongory_dump_pair, (VALUE)&ctx);
+  } else if (RB_TYPE_P(value, T_REGEXP)) {
+    rb_mongory_dump_u8(out, RB_MONGORY_DUMP_REGEXP);
+    rb_mongory_dump_u32(out, (uint32_t)rb_reg_options(value));
+    rb_mongory_dump_string(out, rb_funcall(value, rb_intern("source"), 0));
+  } else if (rb_obj_is_kind_of(value, rb_cRange)) {
+    VALUE range_begin, range_end;
+    int exclude_end;
+    rb_range_values(value, &range_begin, &range_end, &exclude_end);
+    rb_mongory_dump_u8(out, RB_MONGORY_DUMP_RANGE);
+    rb_mongory_dump_value(out, range_begin, depth + 1);
+    rb_mongory_dump_value(out, range_end, depth + 1);
+    rb_mongory_dump_u8(out, exclude_end ? 1 : 0);
+  } else {
+    rb_raise(eMongoryTypeError, "cannot dump condition value of %" PRIsVALUE, rb_obj_class(value));
+  }
+}
+
+// Mongory::CMatcher#dump
+static VALUE rb_mongory_matcher_dump(VALUE self) {
+  rb_mongory_matcher_t *wrapper;
+  TypedData_Get_Struct(self, rb_mongory_matcher_t, &rb_mongory_matcher_type, wrapper);
+  rb_mongory_matcher_check_bound(wrapper);
+
+  VALUE payload = rb_str_buf_new(256);
+  rb_mongory_dump_value(payload, rb_mongory_matcher_condition(self), 0);
+  if ((unsigned long)RSTRING_LEN(payload) > UINT32_MAX) rb_raise(eMongoryError, "condition too large to dump");
+
+  VALUE out = rb_str_buf_new(RB_MONGORY_DUMP_HEADER + RSTRING_LEN(payload));
+  rb_str_buf_cat(out, RB_MONGORY_DUMP_MAGIC, 4);
+  rb_mongory_dump_u8(out, RB_MONGORY_DUMP_VERSION);
+  rb_mongory_dump_u8(out, wrapper->native_regex ? RB_MONGORY_DUMP_NATIVE_REGEX : 0);
+  rb_mongory_dump_u8(out, 0);
+  rb_mongory_dump_u8(out, 0);
+  rb_mongory_dump_u32(out, (uint32_t)RSTRING_LEN(payload));
+  rb_str_buf_append(out, payload);
+  rb_enc_associate(out, rb_ascii8bit_encoding());
+  return rb_obj_freeze(out);
+}
+
+// Reader of a dump, bounds checked on every read
+typedef struct rb_mongory_load_t {
+  const unsigned char *ptr;
+  const unsigned char *end;
+  VALUE hash_class;
+  VALUE array_class;
+} rb_mongory_load_t;
+
+static VALUE rb_mongory_load_value(rb_mongory_load_t *load, int depth);
+
+static const unsigned char *rb_mongory_load_take(rb_mongory_load_t *load, size_t len) {
+  if ((size_t)(load->end - load->ptr) < len) rb_raise(eMongoryError, "truncated matcher dump");
+  const unsigned char *bytes = load->ptr;
+  load->ptr += len;
+  return bytes;
 }
 
-// Shallow conversion: Convert Ruby value to mongory_value (fully materialize arrays/tables)
-mongory_value *rb_to_mongory_value_shallow(mongory_memory_pool *pool, VALUE rb_value) {
-  return rb_to_mongory_value_shallow_rec(pool, rb_value, false);
+static uint8_t rb_mongory_load_u8(rb_mongory_load_t *load) {
+  return *rb_mongory_load_take(load, 1);
 }
 
-// Helper function for deep conversion of hash values
-static int hash_foreach_deep_convert_cb(VALUE key, VALUE val, VALUE ptr) {
-  hash_conv_ctx *ctx = (hash_conv_ctx *)ptr;
-  rb_mongory_memory_pool_t *rb_pool = (rb_mongory_memory_pool_t *)ctx->pool;
-  rb_mongory_matcher_t *owner = rb_pool->owner;
-  mongory_table *store_map;
-  char *key_str;
-  if (SYMBOL_P(key)) {
-    key_str = (char *)rb_id2name(SYM2ID(key));
-    store_map = owner->symbol_map;
-  } else {
-    key_str = StringValueCStr(key);
-    store_map = owner->string_map;
-  }
-  mongory_value *store = mongory_value_wrap_u(ctx->pool, NULL);
-  store->origin = (void *)key;
-  store_map->set(store_map, key_str, store);
-  mongory_value *cval = rb_to_mongory_value_deep(ctx->pool, val);
-  ctx->table->set(ctx->table, key_str, cval);
-  return ST_CONTINUE;
+static uint32_t rb_mongory_load_u32(rb_mongory_load_t *load) {
+  const unsigned char *b = rb_mongory_load_take(load, 4);
+  return (uint32_t)b[0] | (uint32_t)b[1] << 8 | (uint32_t)b[2] << 16 | (uint32_t)b[3] << 24;
 }
 
-// Deep conversion: Convert Ruby value to mongory_value (fully materialize arrays/tables)
-static mongory_value *rb_to_mongory_value_deep_rec(mongory_memory_pool *pool, VALUE rb_value, bool converted) {
-  mongory_value *mg_value = rb_to_mongory_value_primitive(pool, rb_value);
-  if (mg_value) {
-    mg_value->origin = rb_value;
-    return mg_value;
+static uint64_t rb_mongory_load_u64(rb_mongory_load_t *load) {
+  const unsigned char *b = rb_mongory_load_take(load, 8);
+  uint64_t word = 0;
+  for (int i = 7; i >= 0; i--) {
+    word = word << 8 | b[i];
   }
-  switch (TYPE(rb_value)) {
-  case T_ARRAY: {
-    mongory_array *array = mongory_array_new(pool);
+  return word;
+}
 
-    for (long i = 0; i < RARRAY_LEN(rb_value); i++) {
-      array->push(array, rb_to_mongory_value_deep(pool, RARRAY_AREF(rb_value, i)));
-    }
-    mg_value = mongory_value_wrap_a(pool, array);
+// Count of an Array or Hash, each element takes at least one byte
+static long rb_mongory_load_count(rb_mongory_load_t *load) {
+  uint32_t count = rb_mongory_load_u32(load);
+  if ((size_t)(load->end - load->ptr) < count) rb_raise(eMongoryError, "truncated matcher dump");
+  return (long)count;
+}
+
+static VALUE rb_mongory_load_string(rb_mongory_load_t *load) {
+  rb_encoding *encoding;
+  switch (rb_mongory_load_u8(load)) {
+  case RB_MONGORY_DUMP_UTF8:
+    encoding = rb_utf8_encoding();
     break;
+  case RB_MONGORY_DUMP_US_ASCII:
+    encoding = rb_usascii_encoding();
+    break;
+  case RB_MONGORY_DUMP_BINARY:
+    encoding = rb_ascii8bit_encoding();
+    break;
+  case RB_MONGORY_DUMP_NAMED: {
+    uint32_t len = rb_mongory_load_u32(load);
+    VALUE name = rb_str_new((const char *)rb_mongory_load_take(load, len), len);
+    int index = rb_enc_find_index(StringValueCStr(name));
+    if (index < 0) rb_raise(eMongoryError, "unknown encoding in matcher dump: %" PRIsVALUE, name);
+    encoding = rb_enc_from_index(index);
+    break;
+  }
+  default:
+    rb_raise(eMongoryError, "invalid matcher dump");
   }
+  uint32_t len = rb_mongory_load_u32(load);
+  const char *bytes = (const char *)rb_mongory_load_take(load, len);
+  return rb_obj_freeze(rb_enc_str_new(bytes, len, encoding));
+}
 
-  case T_HASH: {
-    mongory_table *table = mongory_table_new(pool);
+// Read one tagged value, Hashes and Arrays as the Converted classes the condition converter returns
+static VALUE rb_mongory_load_value(rb_mongory_load_t *load, int depth) {
+  if (depth > RB_MONGORY_DUMP_MAX_DEPTH) rb_raise(eMongoryError, "invalid matcher dump");
 
-    hash_conv_ctx ctx = {table, pool};
-    rb_hash_foreach(rb_value, hash_foreach_deep_convert_cb, (VALUE)&ctx);
+  switch (rb_mongory_load_u8(load)) {
+  case RB_MONGORY_DUMP_NIL:
+    return Qnil;
+  case RB_MONGORY_DUMP_FALSE:
+    return Qfalse;
+  case RB_MONGORY_DUMP_TRUE:
+    return Qtrue;
+  case RB_MONGORY_DUMP_INT:
+    return LL2NUM((int64_t)rb_mongory_load_u64(load));
+  case RB_MONGORY_DUMP_BIGNUM: {
+    uint32_t len = rb_mongory_load_u32(load);
+    VALUE digits = rb_str_new((const char *)rb_mongory_load_take(load, len), len);
+    return rb_str_to_inum(digits, 10, TRUE);
+  }
+  case RB_MONGORY_DUMP_FLOAT: {
+    uint64_t word = rb_mongory_load_u64(load);
+    double d;
+    memcpy(&d, &word, sizeof(d));
+    return DBL2NUM(d);
+  }
+  case RB_MONGORY_DUMP_STRING:
+    return rb_mongory_load_string(load);
+  case RB_MONGORY_DUMP_SYMBOL: {
+    uint32_t len = rb_mongory_load_u32(load);
+    return rb_to_symbol(rb_utf8_str_new((const char *)rb_mongory_load_take(load, len), len));
+  }
+  case RB_MONGORY_DUMP_ARRAY: {
+    long count = rb_mongory_load_count(load);
+    VALUE array = rb_obj_alloc(load->array_class);
+    for (long i = 0; i < count; i++) {
+      rb_ary_push(array, rb_mongory_load_value(load, depth + 1));
+    }
+    return array;
+  }
+  case RB_MONGORY_DUMP_HASH: {
+    long count = rb_mongory_load_count(load);
+    VALUE hash = rb_obj_alloc(load->hash_class);
+    for (long i = 0; i < count; i++) {
+      VALUE key = rb_mongory_load_value(load, depth + 1);
+      rb_hash_aset(hash, key, rb_mongory_load_value(load, depth + 1));
+    }
+    return hash;
+  }
+  case RB_MONGORY_DUMP_REGEXP: {
+    int options = (int)rb_mongory_load_u32(load);
+    return rb_reg_new_str(rb_mongory_load_string(load), options);
+  }
+  case RB_MONGORY_DUMP_RANGE: {
+    VALUE range_begin = rb_mongory_load_value(load, depth + 1);
+    VALUE range_end = rb_mongory_load_value(load, depth + 1);
+    return rb_range_new(range_begin, range_end, rb_mongory_load_u8(load));
+  }
+  default:
+    rb_raise(eMongoryError, "invalid matcher dump");
+  }
+}
 
-    mg_value = mongory_value_wrap_t(pool, table);
-    break;
+// rb_protect body decoding the condition of a dump
+static VALUE rb_mongory_load_body(VALUE ptr) {
+  return rb_mongory_load_value((rb_mongory_load_t *)ptr, 0);
+}
+
+// Mongory::CMatcher.__load_condition__(bytes), see Mongory::CMatcher.load
+static VALUE rb_mongory_matcher_load_condition(VALUE class, VALUE bytes) {
+  (void)class;
+  StringValue(bytes);
+  rb_mongory_load_t load;
+  load.ptr = (const unsigned char *)RSTRING_PTR(bytes);
+  load.end = load.ptr + RSTRING_LEN(bytes);
+  const unsigned char *header = rb_mongory_load_take(&load, RB_MONGORY_DUMP_HEADER);
+  if (memcmp(header, RB_MONGORY_DUMP_MAGIC, 4) != 0) rb_raise(eMongoryError, "not a matcher dump");
+  if (header[4] != RB_MONGORY_DUMP_VERSION) {
+    rb_raise(eMongoryError, "unsupported matcher dump version %d, expected %d", header[4], RB_MONGORY_DUMP_VERSION);
   }
+  load.ptr -= 4;
+  uint32_t length = rb_mongory_load_u32(&load);
+  if ((size_t)(load.end - load.ptr) < length) rb_raise(eMongoryError, "truncated matcher dump");
+  if ((size_t)(load.end - load.ptr) > length) rb_raise(eMongoryError, "invalid matcher dump");
 
-  default:
-    if (converted) {
-      mg_value = mongory_value_wrap_u(pool, (void *)rb_value);
-      break;
-    } else {
-      VALUE converted_value = rb_funcall(inMongoryDataConverter, rb_intern("convert"), 1, rb_value);
-      mg_value = rb_to_mongory_value_deep_rec(pool, converted_value, true);
-      break;
+  load.hash_class = rb_path2class("Mongory::Converters::Converted::Hash");
+  load.array_class = rb_path2class("Mongory::Converters::Converted::Array");
+  // Corrupt bignum digits, symbol bytes or regexp sources raise ArgumentError, EncodingError
+  // or RegexpError while decoding, they surface as Mongory::Error like any other corruption
+  int state = 0;
+  VALUE condition = rb_protect(rb_mongory_load_body, (VALUE)&load, &state);
+  if (state) {
+    VALUE error = rb_errinfo();
+    if (rb_obj_is_kind_of(error, eMongoryError) || !rb_obj_is_kind_of(error, rb_eStandardError)) {
+      rb_jump_tag(state);
     }
+    rb_set_errinfo(Qnil);
+    rb_raise(eMongoryError, "invalid matcher dump: %" PRIsVALUE, rb_funcall(error, rb_intern("message"), 0));
   }
-  mg_value->origin = rb_value;
-  return mg_value;
-}
+  if (load.ptr != load.end) rb_raise(eMongoryError, "invalid matcher dump");
+  if (!rb_obj_is_kind_of(condition, rb_cHash)) rb_raise(eMongoryError, "invalid matcher dump");
 
-// Deep conversion: Convert Ruby value to mongory_value (fully materialize arrays/tables)
-mongory_value *rb_to_mongory_value_deep(mongory_memory_pool *pool, VALUE rb_value) {
-  return rb_to_mongory_value_deep_rec(pool, rb_value, false);
+  RB_GC_GUARD(bytes);
+  return rb_assoc_new(condition, (header[5] & RB_MONGORY_DUMP_NATIVE_REGEX) ? Qtrue : Qfalse);
 }
 
-// Get value from Ruby hash via mongory_table
-mongory_value *rb_mongory_table_get(mongory_table *self, char *key) {
-  rb_mongory_table_t *table = (rb_mongory_table_t *)self;
-  VALUE rb_hash = table->rb_hash;
-  VALUE rb_value = Qundef;
+// ===== Column plan helper implementations =====
 
-  // Use cached Ruby String key if possible
-  VALUE key_str = cache_fetch_string(table->owner, key);
-  rb_value = rb_hash_lookup2(rb_hash, key_str, Qundef);
+// Compile one node of a Ruby column plan, NULL when the plan has an unexpected shape
+static rb_mongory_plan_t *rb_mongory_plan_compile(rb_mongory_matcher_t *wrapper, VALUE rb_plan) {
+  if (!RB_TYPE_P(rb_plan, T_ARRAY) || RARRAY_LEN(rb_plan) < 2 || !SYMBOL_P(RARRAY_AREF(rb_plan, 0))) {
+    return NULL;
+  }
+  // The plan of a prepared matcher changes with its values, so it lives until the next #bind
+  mongory_memory_pool *pool = wrapper->bind_pool ? wrapper->bind_pool : wrapper->pool;
+  ID op = SYM2ID(RARRAY_AREF(rb_plan, 0));
+  rb_mongory_plan_t *plan = MG_ALLOC_PTR(pool, rb_mongory_plan_t);
+  plan->children = NULL;
+  plan->count = 0;
+  plan->key_path = Qnil;
+  plan->leaf_index = -1;
+  plan->boolean = false;
+  plan->bool_value = false;
+  plan->rb_matcher = Qnil;
+  plan->batch = false;
 
-  if (rb_value == Qundef) {
-    // Fallback to Symbol key, using cache
-    VALUE key_sym = cache_fetch_symbol(table->owner, key);
-    rb_value = rb_hash_lookup2(rb_hash, key_sym, Qundef);
+  if (op == rb_intern("and") || op == rb_intern("or")) {
+    VALUE rb_children = RARRAY_AREF(rb_plan, 1);
+    if (RARRAY_LEN(rb_plan) != 2 || !RB_TYPE_P(rb_children, T_ARRAY) || RARRAY_LEN(rb_children) == 0) {
+      return NULL;
+    }
+    plan->op = op == rb_intern("and") ? RB_MONGORY_PLAN_AND : RB_MONGORY_PLAN_OR;
+    plan->count = RARRAY_LEN(rb_children);
+    plan->children = MG_ALLOC(pool, sizeof(rb_mongory_plan_t *) * plan->count);
+    for (long i = 0; i < plan->count; i++) {
+      plan->children[i] = rb_mongory_plan_compile(wrapper, RARRAY_AREF(rb_children, i));
+      if (!plan->children[i]) {
+        return NULL;
+      }
+      plan->batch = plan->batch || plan->children[i]->batch;
+    }
+    return plan;
   }
 
-  if (rb_value == Qundef) {
+  if (op == rb_intern("eq")) {
+    plan->op = RB_MONGORY_PLAN_EQ;
+  } else if (op == rb_intern("ne")) {
+    plan->op = RB_MONGORY_PLAN_NE;
+  } else if (op == rb_intern("gt")) {
+    plan->op = RB_MONGORY_PLAN_GT;
+  } else if (op == rb_intern("gte")) {
+    plan->op = RB_MONGORY_PLAN_GTE;
+  } else if (op == rb_intern("lt")) {
+    plan->op = RB_MONGORY_PLAN_LT;
+  } else if (op == rb_intern("lte")) {
+    plan->op = RB_MONGORY_PLAN_LTE;
+  } else if (op == rb_intern("batch")) {
+    plan->op = RB_MONGORY_PLAN_BATCH;
+  } else {
     return NULL;
   }
-  return rb_to_mongory_value_shallow(table->base.pool, rb_value);
-}
-
-// Shallow conversion: Wrap Ruby hash as mongory_table
-mongory_value *rb_mongory_table_wrap(mongory_memory_pool *pool, VALUE rb_hash) {
-  rb_mongory_table_t *table = MG_ALLOC_PTR(pool, rb_mongory_table_t);
-  rb_mongory_memory_pool_t *rb_pool = (rb_mongory_memory_pool_t *)pool;
-  table->base.pool = pool;
-  table->base.get = rb_mongory_table_get;
-  table->rb_hash = rb_hash;
-  table->base.count = RHASH_SIZE(rb_hash);
-  table->owner = rb_pool->owner;
-  mongory_value *mg_value = mongory_value_wrap_t(pool, &table->base);
-  mg_value->origin = (void *)rb_hash;
-  mg_value->to_str = rb_mongory_value_to_cstr;
-  return mg_value;
+  long size = plan->op == RB_MONGORY_PLAN_BATCH ? 4 : 3;
+  VALUE key_path = RARRAY_AREF(rb_plan, 1);
+  if (RARRAY_LEN(rb_plan) != size || !RB_TYPE_P(key_path, T_ARRAY) || RARRAY_LEN(key_path) == 0) {
+    return NULL;
+  }
+  for (long i = 0; i < RARRAY_LEN(key_path); i++) {
+    if (!RB_TYPE_P(RARRAY_AREF(key_path, i), T_STRING)) {
+      return NULL;
+    }
+  }
+  if (plan->op == RB_MONGORY_PLAN_BATCH) {
+    // [:batch, key_path, operator, condition], a matcher of its own kept alive by plan_origin
+    VALUE matcher_class = rb_funcall(mMongoryMatchers, rb_intern("lookup"), 1, RARRAY_AREF(rb_plan, 2));
+    if (NIL_P(matcher_class)) {
+      return NULL;
+    }
+    plan->rb_matcher = rb_mongory_custom_matcher_new(matcher_class, RARRAY_AREF(rb_plan, 3), wrapper->ctx);
+    if (NIL_P(plan->rb_matcher)) {
+      return NULL;
+    }
+    rb_ary_push(wrapper->plan_origin, plan->rb_matcher);
+    wrapper->plan_batch = true;
+    plan->batch = true;
+    plan->key_path = key_path;
+    plan->leaf_index = wrapper->plan_leaves++;
+    return plan;
+  }
+  VALUE operand = RARRAY_AREF(rb_plan, 2);
+  if (operand == Qtrue || operand == Qfalse) {
+    if (plan->op != RB_MONGORY_PLAN_EQ && plan->op != RB_MONGORY_PLAN_NE) {
+      return NULL;
+    }
+    plan->boolean = true;
+    plan->bool_value = operand == Qtrue;
+  } else if (!rb_mongory_bound_parse(operand, Qtrue, &plan->operand)) {
+    return NULL;
+  }
+  plan->key_path = key_path;
+  plan->leaf_index = wrapper->plan_leaves++;
+  return plan;
 }
 
-// Get value from Ruby array via mongory_array
-static mongory_value *rb_mongory_array_get(mongory_array *self, size_t index) {
-  rb_mongory_array_t *array = (rb_mongory_array_t *)self;
-  VALUE rb_array = array->rb_array;
-  if (index >= (size_t)RARRAY_LEN(rb_array)) {
+// Column plan of a matcher, asked from Mongory::CMatcher#column_plan once (per #bind) and compiled
+static rb_mongory_plan_t *rb_mongory_matcher_plan(VALUE self, rb_mongory_matcher_t *wrapper) {
+  if (wrapper->plan_checked) {
+    return wrapper->plan;
+  }
+  VALUE rb_plan = rb_funcall(self, rb_intern("column_plan"), 0);
+  wrapper->plan_checked = true;
+  if (NIL_P(rb_plan)) {
     return NULL;
   }
-  VALUE rb_value = rb_ary_entry(rb_array, index);
-  return rb_to_mongory_value_shallow(self->pool, rb_value);
+  // The plan and the matchers of its batch leaves
+  wrapper->plan_origin = rb_ary_new_from_args(1, rb_plan);
+  wrapper->plan = rb_mongory_plan_compile(wrapper, rb_plan);
+  if (!wrapper->plan) {
+    wrapper->plan_leaves = 0;
+    wrapper->plan_batch = false;
+  }
+  return wrapper->plan;
 }
 
-// Shallow conversion: Wrap Ruby array as mongory_array
-mongory_value *rb_mongory_array_wrap(mongory_memory_pool *pool, VALUE rb_array) {
-  rb_mongory_array_t *array = MG_ALLOC_PTR(pool, rb_mongory_array_t);
-  rb_mongory_memory_pool_t *rb_pool = (rb_mongory_memory_pool_t *)pool;
-  array->base.pool = pool;
-  array->base.get = rb_mongory_array_get;
-  array->rb_array = rb_array;
-  array->base.count = RARRAY_LEN(rb_array);
-  array->owner = rb_pool->owner;
-  mongory_value *mg_value = mongory_value_wrap_a(pool, &array->base);
-  mg_value->origin = (void *)rb_array;
-  mg_value->to_str = rb_mongory_value_to_cstr;
-  return mg_value;
+// Look up the value under a key path of a dataset row, Qundef when the path leaves plain hashes
+static VALUE rb_mongory_column_dig(VALUE row, VALUE keys) {
+  VALUE value = row;
+  for (long i = 0; i < RARRAY_LEN(keys); i += 2) {
+    if (!RB_TYPE_P(value, T_HASH)) {
+      return Qundef;
+    }
+    VALUE found = rb_hash_lookup2(value, RARRAY_AREF(keys, i), Qundef);
+    if (found == Qundef) {
+      found = rb_hash_lookup2(value, RARRAY_AREF(keys, i + 1), Qundef);
+    }
+    if (found == Qundef) {
+      return Qundef;
+    }
+    value = found;
+  }
+  return value;
 }
 
-// Convert mongory_value to Ruby value (returns the original Ruby value where binding in below conversion is needed)
-void *mongory_value_to_ruby(mongory_memory_pool *pool, mongory_value *value) {
-  (void)pool;
-  if (!value)
-    return NULL;
-  return value->origin;
-}
-
-// ===== Cache helper implementations =====
-static VALUE cache_fetch_string(rb_mongory_matcher_t *owner, const char *key) {
-  if (!owner || !owner->string_map) return rb_utf8_str_new_cstr(key);
-  mongory_value *v = owner->string_map->get(owner->string_map, (char *)key);
-  if (v && v->origin) return (VALUE)v->origin;
-  VALUE s = rb_utf8_str_new_cstr(key);
-  mongory_value *store = mongory_value_wrap_u(owner->pool, NULL);
-  store->origin = (void *)s;
-  owner->string_map->set(owner->string_map, (char *)key, store);
-  owner->mark_list->push(owner->mark_list, store);
-  return s;
+// Check whether a dataset value reaches a custom matcher as it is: missing values, arrays
+// (matched element by element) and objects the data converter turns into something else do not
+static bool rb_mongory_batch_value_p(VALUE value) {
+  if (value == Qundef) {
+    return false;
+  }
+  switch (TYPE(value)) {
+  case T_NIL:
+  case T_TRUE:
+  case T_FALSE:
+  case T_FIXNUM:
+  case T_BIGNUM:
+  case T_FLOAT:
+  case T_STRING:
+  case T_SYMBOL:
+  case T_REGEXP:
+  case T_HASH:
+    return true;
+  default:
+    return false;
+  }
 }
 
-// Helper function to convert char* key to Ruby symbol
-static inline VALUE char_key_to_symbol(const char *key, rb_encoding *enc) {
-  ID id = rb_check_id_cstr(key, (long)strlen(key), enc);
-  if (!id) id = rb_intern3(key, (long)strlen(key), enc);
-  return ID2SYM(id);
+// Extract the typed column of a key path from the dataset rows into the dataset pool
+static rb_mongory_column_t *rb_mongory_column_build(rb_mongory_dataset_t *dataset, VALUE key_path) {
+  mongory_memory_pool *pool = dataset->pool;
+  long count = dataset->count;
+  long words = (count + 63) / 64 + 1;
+  rb_mongory_column_t *column = MG_ALLOC_PTR(pool, rb_mongory_column_t);
+  uint64_t *bitmaps = MG_ALLOC(pool, sizeof(uint64_t) * words * 5);
+  memset(bitmaps, 0, sizeof(uint64_t) * words * 5);
+  column->numeric = bitmaps;
+  column->trues = bitmaps + words;
+  column->falses = bitmaps + words * 2;
+  column->fallback = bitmaps + words * 3;
+  column->opaque = bitmaps + words * 4;
+
+  // String and Symbol form of every segment, rows keep the key style of their records
+  VALUE keys = rb_ary_new_capa(RARRAY_LEN(key_path) * 2);
+  for (long i = 0; i < RARRAY_LEN(key_path); i++) {
+    VALUE segment = rb_str_new_frozen(RARRAY_AREF(key_path, i));
+    rb_ary_push(keys, segment);
+    rb_ary_push(keys, rb_str_intern(segment));
+  }
+  VALUE values = rb_ary_new_capa(count);
+  bool has_float = false;
+  for (long i = 0; i < count; i++) {
+    VALUE value = rb_mongory_column_dig(RARRAY_AREF(dataset->rows_origin, i), keys);
+    has_float = has_float || RB_FLOAT_TYPE_P(value);
+    rb_ary_push(values, value == Qundef ? Qnil : value);
+    if (value == Qundef) {
+      // Missing keys and intermediate arrays keep the matcher semantics
+      column->fallback[i / 64] |= UINT64_C(1) << (i % 64);
+    }
+    if (!rb_mongory_batch_value_p(value)) {
+      column->opaque[i / 64] |= UINT64_C(1) << (i % 64);
+    }
+  }
+
+  column->kind = has_float ? RB_MONGORY_COLUMN_DOUBLE : RB_MONGORY_COLUMN_INTEGER;
+  column->integers = has_float ? NULL : MG_ALLOC(pool, sizeof(int64_t) * (count + 1));
+  column->numbers = has_float ? MG_ALLOC(pool, sizeof(double) * (count + 1)) : NULL;
+  for (long i = 0; i < count; i++) {
+    VALUE value = RARRAY_AREF(values, i);
+    uint64_t bit = UINT64_C(1) << (i % 64);
+    int64_t integer = 0;
+    double number = 0.0;
+    if (column->fallback[i / 64] & bit) {
+      // already left to the matcher
+    } else if (FIXNUM_P(value)) {
+      column->numeric[i / 64] |= bit;
+      integer = (int64_t)FIX2LONG(value);
+      number = (double)integer;
+    } else if (RB_FLOAT_TYPE_P(value)) {
+      column->numeric[i / 64] |= bit;
+      number = RFLOAT_VALUE(value);
+    } else if (value == Qtrue) {
+      column->trues[i / 64] |= bit;
+    } else if (value == Qfalse) {
+      column->falses[i / 64] |= bit;
+    } else {
+      column->fallback[i / 64] |= bit;
+    }
+    if (has_float) {
+      column->numbers[i] = number;
+    } else {
+      column->integers[i] = integer;
+    }
+  }
+
+  column->key_path = key_path;
+  column->values = values;
+  rb_ary_push(dataset->columns_origin, key_path);
+  rb_ary_push(dataset->columns_origin, values);
+  column->next = dataset->columns;
+  dataset->columns = column;
+  RB_GC_GUARD(keys);
+  return column;
 }
 
-// Cache helper for Ruby symbol keys
-static VALUE cache_fetch_symbol(rb_mongory_matcher_t *owner, const char *key) {
-  rb_encoding *enc = rb_utf8_encoding();
-  if (!owner || !owner->symbol_map) {
-    return char_key_to_symbol(key, enc);
+// Resolve the column of every plan leaf, building the columns the dataset does not have yet
+static void rb_mongory_plan_columns(rb_mongory_plan_t *plan, rb_mongory_dataset_t *dataset,
+                                    rb_mongory_column_t **columns) {
+  if (plan->op == RB_MONGORY_PLAN_AND || plan->op == RB_MONGORY_PLAN_OR) {
+    for (long i = 0; i < plan->count; i++) {
+      rb_mongory_plan_columns(plan->children[i], dataset, columns);
+    }
+    return;
   }
-  mongory_value *v = owner->symbol_map->get(owner->symbol_map, (char *)key);
-  if (v && v->origin) return (VALUE)v->origin;
-  VALUE sym = char_key_to_symbol(key, enc);
-  mongory_value *store = mongory_value_wrap_u(owner->pool, NULL);
-  store->origin = (void *)sym;
-  owner->symbol_map->set(owner->symbol_map, (char *)key, store);
-  owner->mark_list->push(owner->mark_list, store);
-  return sym;
+  rb_mongory_column_t *column = dataset->columns;
+  while (column && !rb_equal(column->key_path, plan->key_path)) {
+    column = column->next;
+  }
+  columns[plan->leaf_index] = column ? column : rb_mongory_column_build(dataset, plan->key_path);
 }
 
-// Regex adapter bridging to Ruby's Regexp
-static bool rb_mongory_regex_match_adapter(mongory_memory_pool *pool, mongory_value *pattern, mongory_value *value) {
-  if (!pattern || !value) {
-    return false;
+// Compare n column values with the operand into bitmap words, branch free so the compiler can vectorize it
+#define RB_MONGORY_COLUMN_KERNEL(values, n, out, cmp, operand)                                  \
+  do {                                                                                          \
+    for (long w = 0; w * 64 < (n); w++) {                                                       \
+      long base = w * 64;                                                                       \
+      long size = (n) - base < 64 ? (n) - base : 64;                                            \
+      uint64_t word = 0;                                                                        \
+      for (long j = 0; j < size; j++) {                                                         \
+        word |= (uint64_t)((values)[base + j] cmp (operand)) << j;                              \
+      }                                                                                         \
+      (out)[w] = word;                                                                          \
+    }                                                                                           \
+  } while (0)
+
+#define RB_MONGORY_COLUMN_KERNELS(values, n, out, op, operand)                                  \
+  do {                                                                                          \
+    switch (op) {                                                                               \
+    case RB_MONGORY_PLAN_GT: RB_MONGORY_COLUMN_KERNEL(values, n, out, >, operand); break;       \
+    case RB_MONGORY_PLAN_GTE: RB_MONGORY_COLUMN_KERNEL(values, n, out, >=, operand); break;     \
+    case RB_MONGORY_PLAN_LT: RB_MONGORY_COLUMN_KERNEL(values, n, out, <, operand); break;       \
+    case RB_MONGORY_PLAN_LTE: RB_MONGORY_COLUMN_KERNEL(values, n, out, <=, operand); break;     \
+    default: RB_MONGORY_COLUMN_KERNEL(values, n, out, ==, operand); break;                      \
+    }                                                                                           \
+  } while (0)
+
+// rb_protect body of the match_batch? call, args are the matcher and the values
+static VALUE rb_mongory_plan_batch_call(VALUE args) {
+  return rb_funcall(RARRAY_AREF(args, 0), rb_intern("match_batch?"), 1, RARRAY_AREF(args, 1));
+}
+
+// Evaluate a batch leaf over one chunk of rows with a single match_batch? call, skipping the rows
+// already decided elsewhere. Rows it cannot be given stay uncertain, and so does the whole chunk
+// when it raises a StandardError.
+static void rb_mongory_plan_eval_batch(rb_mongory_plan_t *plan, rb_mongory_column_t *column, long start, long n,
+                                       const uint64_t *skip, uint64_t *match, uint64_t *uncertain) {
+  long words = (n + 63) / 64;
+  long offset = start / 64;
+  uint64_t sent[RB_MONGORY_PLAN_WORDS];
+  VALUE values = rb_ary_new_capa(n);
+  for (long w = 0; w < words; w++) {
+    match[w] = 0;
+    uncertain[w] = column->opaque[offset + w] & ~(skip ? skip[w] : 0);
+    sent[w] = ~(column->opaque[offset + w] | (skip ? skip[w] : 0));
   }
-  if (value->type != MONGORY_TYPE_STRING) {
-    return false;
+  for (long i = 0; i < n; i++) {
+    if (sent[i / 64] & (UINT64_C(1) << (i % 64))) {
+      rb_ary_push(values, RARRAY_AREF(column->values, start + i));
+    }
+  }
+  long count = RARRAY_LEN(values);
+  if (count == 0) {
+    return;
   }
 
-  VALUE rb_str = (VALUE)value->origin;
-  VALUE rb_re = Qnil;
+  int state = 0;
+  VALUE result = rb_protect(rb_mongory_plan_batch_call, rb_assoc_new(plan->rb_matcher, values), &state);
+  if (state) {
+    VALUE error = rb_errinfo();
+    if (!rb_obj_is_kind_of(error, rb_eStandardError)) {
+      rb_jump_tag(state);
+    }
+    rb_set_errinfo(Qnil);
+    for (long w = 0; w < words; w++) {
+      uncertain[w] = ~UINT64_C(0);
+    }
+    return;
+  }
 
-  if (pattern->type == MONGORY_TYPE_REGEX && pattern->data.regex) {
-    rb_re = (VALUE)pattern->data.regex;
-  } else if (pattern->type == MONGORY_TYPE_STRING) {
-    rb_re = rb_funcall(rb_cRegexp, rb_intern("new"), 1, (VALUE)pattern->origin);
-    mongory_value *temp_value = mongory_value_wrap_regex(pool, (void *)rb_re);
-    memcpy(pattern, temp_value, sizeof(mongory_value));
-    pattern->origin = (void *)rb_re;
+  // An Array of results, or an Integer whose bit j is the result of values[j]
+  uint64_t bits[RB_MONGORY_PLAN_WORDS];
+  if (RB_INTEGER_TYPE_P(result)) {
+    int flags = INTEGER_PACK_LSWORD_FIRST | INTEGER_PACK_NATIVE_BYTE_ORDER;
+    rb_integer_pack(result, bits, words, sizeof(uint64_t), 0, flags);
+  } else if (!RB_TYPE_P(result, T_ARRAY) || RARRAY_LEN(result) != count) {
+    rb_raise(eMongoryTypeError, "%" PRIsVALUE "#match_batch? must return an Array of %ld results or an Integer",
+             rb_obj_class(plan->rb_matcher), count);
+  }
+  long j = 0;
+  for (long i = 0; i < n; i++) {
+    uint64_t bit = UINT64_C(1) << (i % 64);
+    if (!(sent[i / 64] & bit)) {
+      continue;
+    }
+    bool matched = RB_INTEGER_TYPE_P(result) ? (bits[j / 64] >> (j % 64)) & 1 : RTEST(RARRAY_AREF(result, j));
+    if (matched) {
+      match[i / 64] |= bit;
+    }
+    j++;
+  }
+  RB_GC_GUARD(values);
+  RB_GC_GUARD(result);
+}
+
+// Evaluate a plan leaf over one chunk of rows
+static void rb_mongory_plan_eval_leaf(rb_mongory_plan_t *plan, rb_mongory_column_t *column, long start, long n,
+                                      const uint64_t *skip, uint64_t *match, uint64_t *uncertain) {
+  long words = (n + 63) / 64;
+  long offset = start / 64;
+  bool negate = plan->op == RB_MONGORY_PLAN_NE;
+
+  if (plan->op == RB_MONGORY_PLAN_BATCH) {
+    rb_mongory_plan_eval_batch(plan, column, start, n, skip, match, uncertain);
+    return;
+  }
+  if (plan->boolean) {
+    uint64_t *bitmap = plan->bool_value ? column->trues : column->falses;
+    for (long w = 0; w < words; w++) {
+      match[w] = negate ? ~bitmap[offset + w] : bitmap[offset + w];
+    }
   } else {
-    return false;
+    rb_mongory_bound_t *operand = &plan->operand;
+    if (column->kind == RB_MONGORY_COLUMN_DOUBLE) {
+      RB_MONGORY_COLUMN_KERNELS(column->numbers + start, n, match, plan->op, operand->number);
+    } else if (operand->is_integer) {
+      RB_MONGORY_COLUMN_KERNELS(column->integers + start, n, match, plan->op, operand->integer);
+    } else {
+      RB_MONGORY_COLUMN_KERNELS(column->integers + start, n, match, plan->op, operand->number);
+    }
+    for (long w = 0; w < words; w++) {
+      uint64_t matched = match[w] & column->numeric[offset + w];
+      match[w] = negate ? ~matched : matched;
+    }
+  }
+  for (long w = 0; w < words; w++) {
+    uncertain[w] = column->fallback[offset + w];
   }
+}
 
-  VALUE matched = rb_funcall(rb_re, rb_intern("match?"), 1, rb_str);
-  return RTEST(matched);
+// Evaluate a plan over one chunk of rows: rows without an uncertain bit are settled by match,
+// $and / $or rows stay uncertain only when the certain children do not decide them.
+// The result of skip rows does not matter to the caller. Children holding batch leaves run
+// last, so match_batch? only sees the rows the kernels left open.
+static void rb_mongory_plan_eval(rb_mongory_plan_t *plan, rb_mongory_column_t **columns, long start, long n,
+                                 const uint64_t *skip, uint64_t *match, uint64_t *uncertain) {
+  if (plan->op != RB_MONGORY_PLAN_AND && plan->op != RB_MONGORY_PLAN_OR) {
+    rb_mongory_plan_eval_leaf(plan, columns[plan->leaf_index], start, n, skip, match, uncertain);
+    return;
+  }
+
+  long words = (n + 63) / 64;
+  bool conjunction = plan->op == RB_MONGORY_PLAN_AND;
+  uint64_t child_match[RB_MONGORY_PLAN_WORDS];
+  uint64_t child_uncertain[RB_MONGORY_PLAN_WORDS];
+  uint64_t settled_false[RB_MONGORY_PLAN_WORDS];
+  uint64_t child_skip[RB_MONGORY_PLAN_WORDS];
+  for (long w = 0; w < words; w++) {
+    match[w] = conjunction ? ~UINT64_C(0) : 0;
+    settled_false[w] = conjunction ? 0 : ~UINT64_C(0);
+  }
+
+  for (long i = 0; i < plan->count * 2; i++) {
+    rb_mongory_plan_t *child = plan->children[i % plan->count];
+    if (child->batch != (i >= plan->count)) {
+      continue;
+    }
+    if (child->batch) {
+      // Rows a sibling already decided: false for $and, true for $or
+      for (long w = 0; w < words; w++) {
+        child_skip[w] = (conjunction ? settled_false[w] : match[w]) | (skip ? skip[w] : 0);
+      }
+    }
+    rb_mongory_plan_eval(child, columns, start, n, child->batch ? child_skip : NULL, child_match, child_uncertain);
+    for (long w = 0; w < words; w++) {
+      uint64_t certain_true = child_match[w] & ~child_uncertain[w];
+      uint64_t certain_false = ~child_match[w] & ~child_uncertain[w];
+      if (conjunction) {
+        match[w] &= certain_true;
+        settled_false[w] |= certain_false;
+      } else {
+        match[w] |= certain_true;
+        settled_false[w] &= certain_false;
+      }
+    }
+  }
+  for (long w = 0; w < words; w++) {
+    uncertain[w] = ~(match[w] | settled_false[w]);
+  }
 }
 
-// Regex adapter bridging to Ruby's Regexp
-static char *rb_mongory_regex_stringify_adapter(mongory_memory_pool *pool, mongory_value *pattern) {
-  (void)pool;
-  if (pattern->type != MONGORY_TYPE_REGEX) {
+// ===== Bridge-native operator helper implementations =====
+
+// Check whether key is one of the bridge-native operators
+static inline bool rb_mongory_native_operator_p(const char *key) {
+  return strcmp(key, RB_MONGORY_IN_SET_OPERATOR) == 0 || strcmp(key, RB_MONGORY_NIN_SET_OPERATOR) == 0 ||
+         strcmp(key, RB_MONGORY_INTERVALS_OPERATOR) == 0;
+}
+
+// Build the custom context of a bridge-native operator
+static mongory_matcher_custom_context *rb_mongory_native_matcher_build(char *key, mongory_value *condition) {
+  mongory_memory_pool *pool = condition->pool;
+  rb_mongory_custom_matcher_t *custom = MG_ALLOC_PTR(pool, rb_mongory_custom_matcher_t);
+  mongory_matcher_custom_context *return_ctx = MG_ALLOC_PTR(pool, mongory_matcher_custom_context);
+  if (custom == NULL || return_ctx == NULL) {
     return NULL;
   }
-  VALUE rb_re = (VALUE)pattern->data.regex;
-  VALUE rb_str = rb_funcall(rb_re, rb_intern("inspect"), 0);
-  return StringValueCStr(rb_str);
+  custom->rb_matcher = Qnil;
+  custom->set = NULL;
+  custom->intervals = NULL;
+  if (strcmp(key, RB_MONGORY_INTERVALS_OPERATOR) == 0) {
+    custom->kind = RB_MONGORY_CUSTOM_INTERVALS;
+    custom->intervals = (rb_mongory_interval_set_t *)condition->data.u;
+    return_ctx->name = "Intervals";
+  } else {
+    bool in = strcmp(key, RB_MONGORY_IN_SET_OPERATOR) == 0;
+    custom->kind = in ? RB_MONGORY_CUSTOM_IN_SET : RB_MONGORY_CUSTOM_NIN_SET;
+    custom->set = (rb_mongory_value_set_t *)condition->data.u;
+    return_ctx->name = in ? "InSet" : "NinSet";
+  }
+  return_ctx->external_matcher = (void *)custom;
+  return return_ctx;
+}
+
+// Instantiate a Ruby custom matcher as matcher_class.new(condition, context: ctx)
+static VALUE rb_mongory_custom_matcher_new(VALUE matcher_class, VALUE condition, VALUE ctx) {
+  VALUE kw_hash = rb_hash_new();
+  rb_hash_aset(kw_hash, ID2SYM(rb_intern("context")), ctx);
+
+  #ifdef RB_PASS_KEYWORDS
+    VALUE argv_new[2] = { condition, kw_hash };
+    return rb_funcallv_kw(matcher_class, rb_intern("new"), 2, argv_new, RB_PASS_KEYWORDS);
+  #else
+    return rb_funcall(matcher_class, rb_intern("new"), 2, condition, kw_hash);
+  #endif
 }
 
 // Custom matcher adapter bridging to Ruby's custom matcher
 static mongory_matcher_custom_context *rb_mongory_custom_matcher_build(char *key, mongory_value *condition, void *ctx) {
+  if (rb_mongory_native_operator_p(key)) {
+    return rb_mongory_native_matcher_build(key, condition);
+  }
   mongory_memory_pool *pool = condition->pool;
   rb_mongory_memory_pool_t *rb_pool = (rb_mongory_memory_pool_t *)pool;
   rb_mongory_matcher_t *owner = rb_pool->owner;
-  VALUE matcher_class = rb_funcall(mMongoryMatchers, rb_intern("lookup"), 1, cache_fetch_string(owner, key));
+  VALUE matcher_class = rb_funcall(mMongoryMatchers, rb_intern("lookup"), 1, rb_mongory_field_key_fetch(owner, key, Qundef)->string_key);
   if (matcher_class == Qnil) {
     return NULL;
   }
-  VALUE kw_hash = rb_hash_new();
-  rb_hash_aset(kw_hash, ID2SYM(rb_intern("context")), (VALUE)ctx);
-
-  #ifdef RB_PASS_KEYWORDS
-    VALUE argv_new[2] = { (VALUE)condition->origin, kw_hash };
-    VALUE matcher = rb_funcallv_kw(matcher_class, rb_intern("new"), 2, argv_new, RB_PASS_KEYWORDS);
-  #else
-    VALUE matcher = rb_funcall(matcher_class, rb_intern("new"), 2, (VALUE)condition->origin, kw_hash);
-  #endif
-
+  VALUE matcher = rb_mongory_custom_matcher_new(matcher_class, (VALUE)condition->origin, (VALUE)ctx);
   if (matcher == Qnil) {
     return NULL;
   }
@@ -636,33 +5202,66 @@ static mongory_matcher_custom_context *rb_mongory_custom_matcher_build(char *key
   matcher_value->origin = (void *)matcher;
   owner->mark_list->push(owner->mark_list, matcher_value);
   VALUE class_name = rb_funcall(matcher_class, rb_intern("name"), 0);
+  rb_mongory_custom_matcher_t *custom = MG_ALLOC_PTR(pool, rb_mongory_custom_matcher_t);
   mongory_matcher_custom_context *return_ctx = MG_ALLOC_PTR(pool, mongory_matcher_custom_context);
-  if (return_ctx == NULL) {
+  if (custom == NULL || return_ctx == NULL) {
     return NULL;
   }
-  return_ctx->name = StringValueCStr(class_name);
-  return_ctx->external_matcher = (void *)matcher;
+  custom->kind = RB_MONGORY_CUSTOM_RUBY;
+  custom->rb_matcher = matcher;
+  custom->set = NULL;
+  custom->intervals = NULL;
+  return_ctx->name = rb_mongory_string_cstr(pool, class_name);
+  return_ctx->external_matcher = (void *)custom;
   return return_ctx;
 }
 
 // Custom matcher adapter bridging to Ruby's custom matcher
-static bool rb_mongory_custom_matcher_match(void *ruby_matcher, mongory_value *value) {
-  VALUE matcher = (VALUE)ruby_matcher;
-  VALUE match_result = rb_funcall(matcher, rb_intern("match?"), 1, value->origin);
+static bool rb_mongory_custom_matcher_match(void *external_matcher, mongory_value *value) {
+  rb_mongory_custom_matcher_t *custom = (rb_mongory_custom_matcher_t *)external_matcher;
+  switch (custom->kind) {
+  case RB_MONGORY_CUSTOM_IN_SET:
+    return rb_mongory_value_set_match(custom->set, value);
+  case RB_MONGORY_CUSTOM_NIN_SET:
+    return !rb_mongory_value_set_match(custom->set, value);
+  case RB_MONGORY_CUSTOM_INTERVALS:
+    return rb_mongory_interval_set_match(custom->intervals, value);
+  default:
+    break;
+  }
+  VALUE rb_value = value ? rb_mongory_value_origin(value) : Qnil;
+  if (value && value->type == MONGORY_TYPE_STRING && RB_TYPE_P(rb_value, T_DATA)) {
+    // Natively formatted Time and Date values, Ruby matchers see what the data converter returns
+    rb_value = rb_funcall(inMongoryDataConverter, rb_intern("convert"), 1, rb_value);
+  }
+  VALUE match_result = rb_funcall(custom->rb_matcher, rb_intern("match?"), 1, rb_value);
   return RTEST(match_result);
 }
 
 // Custom matcher adapter bridging to Ruby's custom matcher
 static bool rb_mongory_custom_matcher_lookup(char *key) {
+  if (rb_mongory_native_operator_p(key)) {
+    return true;
+  }
+  if (st_is_member(rb_mongory_custom_operators, (st_data_t)key)) {
+    return true;
+  }
+  // Only known operators are remembered, an unknown one may still be registered later
   VALUE matcher_class = rb_funcall(mMongoryMatchers, rb_intern("lookup"), 1, rb_str_new_cstr(key));
-  return RTEST(matcher_class);
+  if (!RTEST(matcher_class)) {
+    return false;
+  }
+  st_insert(rb_mongory_custom_operators, (st_data_t)ruby_strdup(key), 1);
+  return true;
 }
 
 // Error handling for mongory_memory_pool
 static bool rb_mongory_error_handling(mongory_memory_pool *pool, char *error_message) {
   if (pool->error) {
-    rb_raise(eMongoryTypeError, "%s: %s", error_message, pool->error->message);
+    mongory_error *error = pool->error;
+    // rb_raise does not return, so clear the error first to keep the pool reusable
     pool->error = NULL;
+    rb_raise(eMongoryTypeError, "%s: %s", error_message, error->message);
     return true;
   }
   return false;
@@ -675,15 +5274,36 @@ void Init_mongory_ext(void) {
   // Initialize mongory core
   mongory_init();
 
+  volatile char frame = 0;
+  rb_mongory_stack_grows_down = rb_mongory_stack_probe_func(&frame);
+
   // Define modules and classes
   mMongory = rb_define_module("Mongory");
   cMongoryMatcher = rb_define_class_under(mMongory, "CMatcher", rb_cObject);
   mMongoryMatchers = rb_define_module_under(mMongory, "Matchers");
   VALUE mMongoryUtils = rb_define_module_under(mMongory, "Utils");
   cMongoryMatcherContext = rb_define_class_under(mMongoryUtils, "Context", rb_cObject);
+  cMongoryDataset = rb_define_class_under(mMongory, "CDataset", rb_cObject);
+  cMongoryMatcherSlot = rb_struct_define_under(cMongoryMatcher, "Slot", "name", NULL);
+  cMongoryMatcherTrace = rb_struct_define_under(cMongoryMatcher, "Trace", "record", "matched", "nanos", NULL);
   // Mongory converters
   inMongoryDataConverter = rb_funcall(mMongory, rb_intern("data_converter"), 0);
   inMongoryConditionConverter = rb_funcall(mMongory, rb_intern("condition_converter"), 0);
+  // Kept in C globals, registering them pins them under compaction
+  rb_global_variable(&inMongoryDataConverter);
+  rb_global_variable(&inMongoryConditionConverter);
+  rb_global_variable(&rb_mongory_pool_jobs);
+  rb_global_variable(&rb_mongory_pool_threads);
+  rb_global_variable(&rb_mongory_pool_pid);
+
+  rb_mongory_reg_fixed_encoding = NUM2INT(rb_const_get(rb_cRegexp, rb_intern("FIXEDENCODING")));
+  rb_mongory_custom_operators = st_init_strtable();
+  rb_mongory_id_native_types = rb_intern("@native_types");
+  rb_mongory_id_native_symbol = rb_intern("symbol");
+  rb_mongory_id_native_date = rb_intern("date");
+  rb_mongory_id_native_time = rb_intern("time");
+  rb_mongory_id_native_number = rb_intern("number");
+  rb_mongory_id_current_records = rb_intern("@current_records");
 
   // Define error classes
   eMongoryError = rb_define_class_under(mMongory, "Error", rb_eStandardError);
@@ -692,14 +5312,44 @@ void Init_mongory_ext(void) {
   // Define Matcher methods
   rb_define_singleton_method(cMongoryMatcher, "new", rb_mongory_matcher_new, -1);
   rb_define_singleton_method(cMongoryMatcher, "trace_result_colorful=", rb_mongory_matcher_trace_result_colorful, 1);
+  rb_define_singleton_method(cMongoryMatcher, "scratch_retained_bytes", rb_mongory_matcher_scratch_retained, 0);
+  rb_define_singleton_method(cMongoryMatcher, "scratch_retained_bytes=", rb_mongory_matcher_scratch_retained_set, 1);
   rb_define_method(cMongoryMatcher, "match?", rb_mongory_matcher_match, 1);
+  rb_define_method(cMongoryMatcher, "filter", rb_mongory_matcher_filter, -1);
+  rb_define_method(cMongoryMatcher, "count", rb_mongory_matcher_count, -1);
+  rb_define_method(cMongoryMatcher, "first", rb_mongory_matcher_first, -1);
+  rb_define_method(cMongoryMatcher, "match_indices", rb_mongory_matcher_match_indices, -1);
+  rb_define_method(cMongoryMatcher, "match_json?", rb_mongory_matcher_match_json_p, 1);
+  rb_define_method(cMongoryMatcher, "filter_json", rb_mongory_matcher_filter_json, -1);
+  rb_define_method(cMongoryMatcher, "count_json", rb_mongory_matcher_count_json, -1);
   rb_define_method(cMongoryMatcher, "explain", rb_mongory_matcher_explain, 0);
   rb_define_method(cMongoryMatcher, "condition", rb_mongory_matcher_condition, 0);
   rb_define_method(cMongoryMatcher, "context", rb_mongory_matcher_context, 0);
+  rb_define_method(cMongoryMatcher, "stats", rb_mongory_matcher_stats, 0);
+  rb_define_method(cMongoryMatcher, "memory_stats", rb_mongory_matcher_memory_stats, 0);
   rb_define_method(cMongoryMatcher, "trace", rb_mongory_matcher_trace, 1);
-  rb_define_method(cMongoryMatcher, "enable_trace", rb_mongory_matcher_enable_trace, 0);
+  rb_define_method(cMongoryMatcher, "enable_trace", rb_mongory_matcher_enable_trace, -1);
   rb_define_method(cMongoryMatcher, "disable_trace", rb_mongory_matcher_disable_trace, 0);
   rb_define_method(cMongoryMatcher, "print_trace", rb_mongory_matcher_print_trace, 0);
+  rb_define_method(cMongoryMatcher, "traces", rb_mongory_matcher_traces, 0);
+  rb_define_method(cMongoryMatcher, "slots", rb_mongory_matcher_slots, 0);
+  rb_define_method(cMongoryMatcher, "native_regex?", rb_mongory_matcher_native_regex_p, 0);
+  rb_define_method(cMongoryMatcher, "dump", rb_mongory_matcher_dump, 0);
+  rb_define_private_method(cMongoryMatcher, "__profile__", rb_mongory_matcher_profile, 2);
+  rb_define_private_method(cMongoryMatcher, "__profile_stats__", rb_mongory_matcher_profile_stats, 0);
+  rb_define_private_method(cMongoryMatcher, "__bind__", rb_mongory_matcher_bind, 2);
+  rb_define_private_method(cMongoryMatcher, "__project__", rb_mongory_matcher_project, 5);
+  rb_define_private_method(cMongoryMatcher, "__sort__", rb_mongory_matcher_sort, 5);
+  rb_define_private_method(cMongoryMatcher, "__group__", rb_mongory_matcher_group, 5);
+  rb_define_private_method(rb_singleton_class(cMongoryMatcher), "__load_condition__", rb_mongory_matcher_load_condition,
+                           1);
+  rb_define_const(cMongoryMatcher, "DUMP_VERSION", INT2FIX(RB_MONGORY_DUMP_VERSION));
+
+  // Define Dataset methods
+  rb_define_alloc_func(cMongoryDataset, rb_mongory_dataset_alloc);
+  rb_define_private_method(cMongoryDataset, "__load__", rb_mongory_dataset_load, 2);
+  rb_define_method(cMongoryDataset, "invalidate", rb_mongory_dataset_invalidate, 0);
+  rb_define_method(cMongoryDataset, "valid?", rb_mongory_dataset_valid, 0);
 
   // Set regex adapter to use Ruby's Regexp
   mongory_regex_func_set(rb_mongory_regex_match_adapter);
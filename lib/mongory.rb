@@ -9,6 +9,8 @@ require_relative 'mongory/utils'
 require_relative 'mongory/matchers'
 require_relative 'mongory/query_matcher'
 require_relative 'mongory/query_builder'
+require_relative 'mongory/index'
+require_relative 'mongory/live_query'
 require_relative 'mongory/query_operator'
 require_relative 'mongory/converters'
 require_relative 'mongory/rails' if defined?(Rails::Railtie)
@@ -84,6 +86,21 @@ module Mongory
     QueryBuilder.new(records)
   end
 
+  # Builds a new query over records read from a stream, without loading the whole stream.
+  #
+  # @example Filtering an NDJSON log in C
+  #   File.open('audit.ndjson') { |io| Mongory.stream(io).c.where(:status.gte => 500).count }
+  #
+  # @param source [IO, String] an IO or a file path
+  # @param format [Symbol] the format of the stream, only `:ndjson` for now
+  # @return [QueryBuilder] a new query builder
+  # @raise [ArgumentError] if the format is unknown
+  def self.stream(source, format: :ndjson)
+    raise ArgumentError, "unknown stream format: #{format.inspect}" unless format == :ndjson
+
+    QueryBuilder.new(Utils::NdjsonStream.new(source))
+  end
+
   # Registers a class to support `.mongory` query DSL.
   # This injects a `#mongory` method into the given class.
   #
@@ -109,9 +126,10 @@ module Mongory
   module ClassExtention
     # Returns a query builder scoped to `self`.
     #
+    # @param indexes [Array<Index, String, Symbol>, nil] indexes of `self`, or fields to index
     # @return [QueryBuilder]
-    def mongory
-      Mongory::QueryBuilder.new(self)
+    def mongory(indexes: nil)
+      Mongory::QueryBuilder.new(self, indexes: indexes)
     end
   end
 end
@@ -121,6 +139,9 @@ begin
   require_relative "core/#{abi}/mongory_ext"
   require_relative 'mongory/c_query_builder'
   require_relative 'mongory/c_matcher'
+  require_relative 'mongory/c_matcher_cache'
+  require_relative 'mongory/c_dataset'
+  require_relative 'mongory/c_grouping'
 rescue LoadError => e
   warn("Mongory C extension is disabled because mongory_ext is not loaded: #{e.message}")
 end
@@ -0,0 +1,156 @@
+# frozen_string_literal: true
+
+module Mongory
+  # Mongory::CDataset is a snapshot of records converted once for Mongory::CMatcher.
+  #
+  # Every `CMatcher#match?` converts its record again, so querying the same records
+  # with many conditions pays the conversion for every query. A dataset converts the
+  # records a single time into C rows, and every later scan of the dataset reuses them.
+  #
+  # The rows are a snapshot: mutating a record after the dataset was built is not seen
+  # by the scans until {#rebuild} is called.
+  #
+  # @example Reusing converted records
+  #   dataset = Mongory::CDataset.new(users)
+  #   Mongory::CMatcher.new({ :age.gte => 18 }).filter(dataset)
+  #   Mongory::CMatcher.new({ status: 'active' }).count(dataset)
+  #   dataset.mongory.c.where(:name.regex => /^A/).to_a
+  #
+  # @example Converting only the fields the queries use
+  #   dataset = Mongory::CDataset.new(users, fields: %w(age profile.city))
+  class CDataset
+    include Enumerable
+
+    # @return [Array<String>, nil] the projected dotted field paths, or nil for whole records
+    attr_reader :fields
+
+    # @!method valid?
+    #   @return [Boolean] false once the dataset has been invalidated
+    #   @note This method is implemented in the C extension
+    # @!method invalidate
+    #   Releases the converted rows. Scanning an invalidated dataset raises Mongory::Error
+    #   until {#rebuild} is called.
+    #   @return [void]
+    #   @raise [Mongory::Error] if a scan of this dataset is in progress
+    #   @note This method is implemented in the C extension
+
+    # @param records [Enumerable] the records to convert
+    # @param fields [Array<String, Symbol>, nil] dotted field paths to keep, nil keeps whole records.
+    #   Conditions scanned against a projected dataset only see the projected fields.
+    def initialize(records, fields: nil)
+      @fields = fields&.map(&:to_s)&.freeze
+      @field_paths = build_field_paths(@fields)
+      rebuild(records)
+    end
+
+    # Converts the records again, replacing the current rows.
+    #
+    # @param records [Enumerable] the records to convert, defaults to the current records
+    # @return [CDataset] self
+    # @raise [Mongory::Error] if a scan of this dataset is in progress
+    def rebuild(records = @records)
+      records = records.to_a.dup.freeze
+      __load__(records, records.map { |record| snapshot_record(record) })
+      @records = records
+      self
+    end
+
+    # @yieldparam record [Object] each original record
+    # @return [Enumerator, CDataset]
+    def each(&block)
+      return to_enum(:each) unless block_given?
+
+      @records.each(&block)
+      self
+    end
+
+    # @return [Array<Object>] the original records, frozen
+    def to_a
+      @records
+    end
+
+    # @return [Integer] the number of records
+    def size
+      @records.size
+    end
+
+    alias_method :length, :size
+
+    # Returns a query builder scoped to this dataset.
+    #
+    # @return [QueryBuilder]
+    def mongory
+      Mongory::QueryBuilder.new(self)
+    end
+
+    private
+
+    # @private
+    # Splits the fields into key paths, dropping paths already covered by a shorter one.
+    #
+    # @param fields [Array<String>, nil]
+    # @return [Array<Array<String>>, nil]
+    def build_field_paths(fields)
+      return unless fields
+
+      key_converter = Mongory.condition_converter.key_converter
+      paths = fields.map { |field| key_converter.key_path(field) }.uniq.sort_by(&:size)
+      paths.each_with_object([]) do |path, kept|
+        kept << path if kept.none? { |prefix| path.first(prefix.size) == prefix }
+      end
+    end
+
+    # @private
+    # Converts one record, keeping only the projected fields.
+    #
+    # @param record [Object]
+    # @return [Object] the converted record
+    def snapshot_record(record)
+      value = snapshot(record)
+      return value unless @field_paths && value.is_a?(Hash)
+
+      @field_paths.each_with_object({}) do |path, row|
+        project(value, path, row)
+      end
+    end
+
+    # @private
+    # Converts a value with the data converter, recursing into hashes and arrays,
+    # so the rows keep a reference to every converted object.
+    #
+    # @param value [Object]
+    # @return [Object]
+    def snapshot(value)
+      value = Mongory.data_converter.convert(value)
+      case value
+      when Hash
+        value.each_with_object({}) { |(key, sub_value), hash| hash[key] = snapshot(sub_value) }
+      when Array
+        value.map { |sub_value| snapshot(sub_value) }
+      else
+        value
+      end
+    end
+
+    # @private
+    # Copies the value under a key path into the row. A path that runs into a non-Hash
+    # value keeps that whole value, so array and scalar semantics stay with the matcher.
+    # Missing keys are left out of the row.
+    #
+    # @param record [Hash] the converted record
+    # @param path [Array<String>] the key path
+    # @param row [Hash] the projected row
+    # @return [void]
+    def project(record, path, row)
+      value = record
+      path.each_with_index do |key, index|
+        value = value.fetch(key) { value.fetch(key.to_sym) { return } }
+        next if value.is_a?(Hash) && index < path.size - 1
+
+        target = path.first(index).reduce(row) { |hash, sub_key| hash[sub_key] ||= {} }
+        target[key] = value
+        return
+      end
+    end
+  end
+end
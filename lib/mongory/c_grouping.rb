@@ -0,0 +1,104 @@
+# frozen_string_literal: true
+
+module Mongory
+  # Mongory::CGrouping groups the matching records of a {CQueryBuilder} by fields and reduces every group.
+  #
+  # The groups are accumulated in a C hash table during the matching scan: the group keys and the
+  # reduced value are read right after each match, like {CMatcher#pluck} reads fields, so neither the
+  # matching records nor the records of a group are collected into Arrays. Groups keep the order of
+  # their first match.
+  #
+  # Group keys compare like MongoDB `$group` keys, so `1` and `1.0` share a group, and the key of a
+  # group is the value of its first match. Records missing a group field are grouped under nil, and a
+  # reduction only reads the numeric values of its field, like MongoDB `$sum`.
+  #
+  # @example
+  #   orders.mongory.c.where(:total.gt => 0).group(:status).count
+  #   #=> { 'paid' => 812, 'pending' => 64 }
+  #   orders.mongory.c.where(:total.gt => 0).group(:status, :currency).sum(:total)
+  #   #=> { ['paid', 'EUR'] => 12430.5, ['paid', 'USD'] => 9120, ... }
+  #
+  # @see CMatcher#group
+  class CGrouping
+    # Accumulators of one group
+    #
+    # @!attribute key
+    #   @return [Object] the value of the group field, an Array of them for several group fields
+    # @!attribute count
+    #   @return [Integer] the number of matching records of the group
+    # @!attribute numbers
+    #   @return [Integer] the number of numeric values of the reduced field
+    # @!attribute sum
+    #   @return [Numeric] the sum of the numeric values, an Integer while they all are
+    # @!attribute min
+    #   @return [Numeric, nil] the smallest numeric value
+    # @!attribute max
+    #   @return [Numeric, nil] the largest numeric value
+    Group = Struct.new(:key, :count, :numbers, :sum, :min, :max) do
+      # @return [Float, nil] the mean of the numeric values, nil without any
+      def avg
+        numbers.zero? ? nil : sum.fdiv(numbers)
+      end
+
+      # Combines the accumulators of the same group from another batch of records.
+      #
+      # @param other [Group]
+      # @return [Group] a new group
+      def merge(other)
+        Group.new(key, count + other.count, numbers + other.numbers, sum + other.sum,
+                  [min, other.min].compact.min, [max, other.max].compact.max)
+      end
+    end
+
+    # @yieldparam value_field [String, nil] the reduced field, nil when only counting
+    # @yieldreturn [Array<Group>] the groups of the matching records
+    def initialize(&groups)
+      @groups = groups
+    end
+
+    # @return [Hash{Object => Integer}] the number of matching records of every group
+    def count
+      @groups.call(nil).to_h { |group| [group.key, group.count] }
+    end
+
+    # @param field [String, Symbol] the dotted field to sum
+    # @return [Hash{Object => Numeric}] the sum of the field in every group
+    def sum(field)
+      reduce(field, &:sum)
+    end
+
+    # @param field [String, Symbol] the dotted field to average
+    # @return [Hash{Object => Float, nil}] the mean of the field in every group
+    def avg(field)
+      reduce(field, &:avg)
+    end
+
+    # @param field [String, Symbol] the dotted field
+    # @return [Hash{Object => Numeric, nil}] the smallest value of the field in every group
+    def min(field)
+      reduce(field, &:min)
+    end
+
+    # @param field [String, Symbol] the dotted field
+    # @return [Hash{Object => Numeric, nil}] the largest value of the field in every group
+    def max(field)
+      reduce(field, &:max)
+    end
+
+    # @param field [String, Symbol, nil] the reduced field, nil when only counting
+    # @return [Array<Group>] the accumulators of every group, in order of first match
+    def groups(field = nil)
+      @groups.call(field&.to_s)
+    end
+
+    private
+
+    # @private
+    # @param field [String, Symbol]
+    # @yieldparam group [Group]
+    # @return [Hash{Object => Object}]
+    def reduce(field)
+      groups(field).to_h { |group| [group.key, yield(group)] }
+    end
+  end
+end
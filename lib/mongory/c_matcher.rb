@@ -1,5 +1,7 @@
 # frozen_string_literal: true
 
+require 'json'
+
 module Mongory
   # This class is the C extension of Mongory::QueryMatcher.
   # It is used to match records using the C extension.
@@ -8,31 +10,114 @@ module Mongory
   #   matcher.match?(record) #=> true
   #   # or
   #   collection.mongory.c.where(condition).to_a
+  #
+  # A matcher can be shared by threads and fibers: its compiled tree is only read while matching,
+  # and every match running concurrently, or nested in a match by a custom matcher, gets a scratch
+  # arena of its own.
+  # Binding, tracing and profiling change the matcher and stay single threaded.
   class CMatcher
-    # @!method self.new(condition)
+    # @!method self.new(condition, context: Utils::Context.new, native_regex: false)
     #   @param condition [Hash] the condition
+    #   @param context [Utils::Context] the matching context
+    #   @param native_regex [Boolean] match `$regex` without calling `Regexp#match?`:
+    #     ASCII literal patterns such as `/foo/`, `/^foo/` or `/foo\z/` use a plain byte search,
+    #     other patterns run Onigmo directly. Strings that are not valid UTF-8 or US-ASCII
+    #     still go through `Regexp#match?`.
     #   @return [Mongory::CMatcher] a new matcher
     #   @note This method is implemented in the C extension
     # @!method self.trace_result_colorful=(colorful)
     #   @param colorful [Boolean] whether to enable colorful trace result
     #   @return [void]
     #   @note This method is implemented in the C extension
+    # @!method self.scratch_retained_bytes
+    #   @return [Integer] the scratch arena bytes a matcher keeps after a match, 64 KiB by default
+    #   @note This method is implemented in the C extension
+    # @!method self.scratch_retained_bytes=(bytes)
+    #   @param bytes [Integer] the scratch arena bytes matchers built afterwards keep after a match
+    #   @return [Integer]
+    #   @raise [ArgumentError] if bytes is negative
+    #   @note This method is implemented in the C extension
     #
     #   @!method match?(record)
     #     @param record [Object] the record to match against
     #     @return [Boolean] true if the record matches the condition, false otherwise
     #     @note This method is implemented in the C extension
+    #   @!method filter(records, offset: 0, limit: nil, threads: nil)
+    #     @param records [Array, CDataset] the records to match against
+    #     @param offset [Integer] how many matching records to skip
+    #     @param limit [Integer, nil] the maximum number of records to return
+    #     @param threads [Integer, nil] how many threads of a shared pool evaluate the column plan of a
+    #       CDataset, without holding the GVL; warns and scans on the calling thread for Arrays,
+    #       conditions without a {#column_plan} and plans calling `match_batch?`
+    #     @return [Array] the records that match the condition, in their original order
+    #     @note The whole array is scanned in C without a Ruby method call per record
+    #     @note This method is implemented in the C extension
+    #   @!method count(records, offset: 0, limit: nil, threads: nil)
+    #     @param records [Array, CDataset] the records to match against
+    #     @param offset [Integer] how many matching records to skip
+    #     @param limit [Integer, nil] stop counting after this many matches
+    #     @param threads [Integer, nil] how many threads of a shared pool evaluate the column plan of a
+    #       CDataset, without holding the GVL; warns and scans on the calling thread for Arrays,
+    #       conditions without a {#column_plan} and plans calling `match_batch?`
+    #     @return [Integer] the number of records that match the condition
+    #     @note This method is implemented in the C extension
+    #   @!method first(records, n = nil)
+    #     @param records [Array, CDataset] the records to match against
+    #     @param n [Integer, nil] how many matching records to return
+    #     @return [Object, nil] the first matching record when n is omitted
+    #     @return [Array] up to n matching records when n is given
+    #     @note The scan stops as soon as enough records have matched
+    #     @note This method is implemented in the C extension
+    #   @!method match_indices(records, offset: 0, limit: nil, threads: nil)
+    #     @param records [Array, CDataset] the records to match against
+    #     @param offset [Integer] how many matching records to skip
+    #     @param limit [Integer, nil] the maximum number of indices to return
+    #     @param threads [Integer, nil] how many threads of a shared pool evaluate the column plan of a
+    #       CDataset, without holding the GVL; warns and scans on the calling thread for Arrays,
+    #       conditions without a {#column_plan} and plans calling `match_batch?`
+    #     @return [Array<Integer>] the indices of the matching records
+    #     @note This method is implemented in the C extension
+    #   @!method match_json?(json)
+    #     @param json [String] a JSON document
+    #     @return [Boolean] true if the document matches the condition, false otherwise
+    #     @raise [Mongory::Error] if the String is not valid JSON
+    #     @note The fields are read from the JSON as the condition asks for them; Ruby objects are only
+    #       built for the values of custom operators and of `$regex` patterns not matched natively
+    #     @note This method is implemented in the C extension
+    #   @!method filter_json(jsons, offset: 0, limit: nil)
+    #     @param jsons [Array<String>] the JSON documents to match against
+    #     @param offset [Integer] how many matching documents to skip
+    #     @param limit [Integer, nil] the maximum number of documents to return
+    #     @return [Array<String>] the matching JSON Strings, in their original order
+    #     @raise [Mongory::Error] if a String is not valid JSON
+    #     @note Only the returned Strings need `JSON.parse`
+    #     @note This method is implemented in the C extension
+    #   @!method count_json(jsons, offset: 0, limit: nil)
+    #     @param jsons [Array<String>] the JSON documents to match against
+    #     @param offset [Integer] how many matching documents to skip
+    #     @param limit [Integer, nil] stop counting after this many matches
+    #     @return [Integer] the number of documents that match the condition
+    #     @raise [Mongory::Error] if a String is not valid JSON
+    #     @note This method is implemented in the C extension
     #   @!method explain
     #     @return [void]
     #     @note This method will print matcher tree structure
+    #     @note The tree is in the static order of mongory-core. The `adaptive` context config
+    #       reorders {QueryMatcher} only and is ignored here, so the printed order never changes.
     #     @note This method is implemented in the C extension
     #   @!method trace
     #     @return [Boolean] true if the record matches the condition, false otherwise
     #     @note This method will print matching process
     #     @note This method is implemented in the C extension
-    #   @!method enable_trace
+    #   @!method enable_trace(sample: nil, sink: nil, capacity: 100)
+    #     @param sample [Float, nil] the share of records to trace, greater than 0 and at most 1;
+    #       without it every match prints its trace tree to stdout
+    #     @param sink [#call, #puts, nil] receives every sampled {Trace} as it is recorded
+    #     @param capacity [Integer] how many sampled traces {#traces} keeps
     #     @return [void]
-    #     @note This method will enable trace
+    #     @raise [ArgumentError] if sink or capacity are given without sample
+    #     @raise [Mongory::Error] if the extension was built with `MONGORY_DISABLE_TRACE`
+    #     @note Sampled tracing keeps the column plan of a CDataset scan, rows it decides are not traced
     #     @note This method is implemented in the C extension
     #   @!method disable_trace
     #     @return [void]
@@ -42,16 +127,369 @@ module Mongory
     #     @return [void]
     #     @note This method will print trace result
     #     @note This method is implemented in the C extension
+    #   @!method traces
+    #     @return [Array<Trace>] the latest sampled traces, oldest first, as frozen `Mongory::CMatcher::Trace`
+    #       Structs of the `record`, whether it `matched` and the match time in `nanos`
+    #     @note This method is implemented in the C extension
     #   @!method condition
     #     @return [Hash] the condition
     #     @note This method is implemented in the C extension
     #   @!method context
     #     @return [Utils::Context] the context
     #     @note This method is implemented in the C extension
+    #   @!method stats
+    #     @return [Hash] field key lookup counters of this matcher:
+    #       `:key_hits` lookups served by the predicted key style,
+    #       `:key_misses` lookups that fell back to the other style,
+    #       and `:key_hit_rate` the share of hits
+    #     @note The key style (String or Symbol) that hit last is tried first for each field
+    #     @note This method is implemented in the C extension
+    #   @!method memory_stats
+    #     @return [Hash] scratch arena bytes of this matcher: `:reserved_bytes` held from the system,
+    #       `:in_use_bytes` allocated by the running matches, `:peak_bytes` the most any match allocated,
+    #       `:retained_bytes` kept after a match and `:scratches` the number of scratch arenas, one per match
+    #       that ran concurrently with others
+    #     @note This method is implemented in the C extension
+    #   @!method slots
+    #     @return [Array<Symbol>] the slot names of a prepared matcher, in condition order
+    #     @note This method is implemented in the C extension
+    #   @!method native_regex?
+    #     @return [Boolean] whether the matcher was built with `native_regex: true`
+    #     @note This method is implemented in the C extension
+    #   @!method dump
+    #     @return [String] a frozen binary String of the converted condition and the `native_regex` flag,
+    #       versioned by {DUMP_VERSION}; {.load} builds the matcher again without converting the condition
+    #     @raise [Mongory::Error] if the matcher has unbound slots
+    #     @raise [Mongory::TypeError] if the condition holds a value other than nil, Booleans, Numerics,
+    #       Strings, Symbols, Regexps, Ranges, Arrays and Hashes
+    #     @note A bound prepared matcher dumps its bound condition. The context is not dumped.
+    #     @note This method is implemented in the C extension
+
+    # A node of {#profile}: the matcher of a sub-condition and its own nodes
+    ProfileNode = Struct.new(:matcher, :children)
+    private_constant :ProfileNode
+
+    class << self
+      # The compiled matcher cache used by {CQueryBuilder}, nil disables caching.
+      #
+      # @return [CMatcherCache, nil]
+      attr_accessor :cache
+
+      # Returns a named placeholder for {.prepare}, a frozen `Mongory::CMatcher::Slot` Struct.
+      #
+      # @param name [Symbol, String] the slot name
+      # @return [Slot]
+      def slot(name)
+        Slot.new(name.to_sym).freeze
+      end
+
+      # Builds a matcher whose literal values are placeholders bound later with {#bind}.
+      # Slots can stand for a field value or an `$eq`/`$ne`/`$gt`/`$gte`/`$lt`/`$lte` operand.
+      #
+      # @example
+      #   matcher = Mongory::CMatcher.prepare({ status: Mongory::CMatcher.slot(:status),
+      #                                         :age.gte => Mongory::CMatcher.slot(:age) })
+      #   matcher.bind(status: 'active', age: 18).filter(records)
+      #   matcher.bind(status: 'banned', age: 21).count(records)
+      #
+      # @param template [Hash] the condition, holding {Slot}s
+      # @param options [Hash] the options of {.new}
+      # @return [CMatcher] a matcher that raises Mongory::Error on matching until bound
+      # @raise [Mongory::TypeError] if a slot is used under another operator
+      def prepare(template, **options)
+        new(template, **options)
+      end
+
+      # Builds a matcher from the bytes of {#dump}.
+      #
+      # The dump holds the condition already converted, so loading decodes it straight into the
+      # converted Hashes the matcher tree is built from, skipping the key, value and condition
+      # converters. The bytes hold no pointers: a dump written once can be read from a shared file,
+      # or loaded by the parent process before forking its workers.
+      #
+      # @example
+      #   File.binwrite('tmp/active_users.mgry', Mongory::CMatcher.new(condition).dump)
+      #   matcher = Mongory::CMatcher.load(File.binread('tmp/active_users.mgry'))
+      #
+      # @param bytes [String] the bytes of {#dump}
+      # @param context [Utils::Context] the matching context
+      # @return [CMatcher] a new matcher, with the `native_regex` flag of the dumped one
+      # @raise [Mongory::Error] if the bytes are not a dump, are truncated, corrupt or of another {DUMP_VERSION}
+      def load(bytes, context: Utils::Context.new)
+        condition, native_regex = __load_condition__(bytes)
+        begin
+          new(condition, context: context, native_regex: native_regex)
+        rescue Mongory::Error
+          raise
+        rescue StandardError => e
+          # A dumped condition built once already, so a corrupt one can fail with any error
+          raise Mongory::Error, "invalid matcher dump: #{e.message}"
+        end
+      end
+    end
+
+    # Binds the slots of a prepared matcher to new values, in place.
+    #
+    # The matcher tree, the field key caches and the context are kept; only the placeholder
+    # values change, so binding costs about one value conversion per slot.
+    #
+    # @param values [Hash{Symbol, String => Object}] a value for every slot, Booleans, Numerics
+    #   and Strings, or anything the value converter turns into one of those; nil only for operands
+    # @return [CMatcher] self
+    # @raise [ArgumentError] if a slot value is missing or a key names no slot
+    # @raise [Mongory::TypeError] if a value cannot be bound
+    # @raise [Mongory::Error] if the matcher has no slots or is being scanned
+    # @note A bound matcher is shared state, bind it from one thread at a time
+    def bind(values)
+      values = values.each_with_object({}) { |(name, value), hash| hash[name.to_sym] = bind_value(value) }
+      unknown = values.keys - slots
+      raise ArgumentError, "unknown slots: #{unknown.map(&:inspect).join(', ')}" unless unknown.empty?
+
+      @template ||= condition
+      __bind__(values, Converters::Converted::Hash.new(fill_slots(@template, values)))
+      remove_instance_variable(:@column_plan) if defined?(@column_plan)
+      self
+    end
+
+    # Returns the column plan used to scan a {CDataset} with typed column kernels.
+    #
+    # @return [Array, nil] the plan, or nil when the condition is matched row by row
+    # @see Converters::ColumnPlanner
+    def column_plan
+      return @column_plan if defined?(@column_plan)
+
+      @column_plan = Converters::ColumnPlanner.plan(condition)
+    end
+
+    # Profiles the matches made in the block, node by node.
+    #
+    # The mongory-core matcher tree cannot be read from Ruby, so every sub-condition (each key of a Hash,
+    # each branch of `$and` / `$or` and each operator of a field) is compiled into its own matcher.
+    # After each real match, these node matchers are evaluated in condition order, stopping where
+    # `$and` or `$or` would, and count their evaluations, matches and time.
+    #
+    # @example Find the slow branches of an `$or`
+    #   matcher = Mongory::CMatcher.new({ '$or' => [{ name: /smith/i }, { :age.gt => 20 }] })
+    #   matcher.profile { matcher.filter(records) }
+    #   #=> { condition: { '$or' => [...] }, evals: 3, matches: 2, nanos: 4210, children: [
+    #   #     { condition: { 'name' => { '$regex' => /smith/i } }, evals: 3, matches: 1, nanos: 2870, children: [] },
+    #   #     { condition: { 'age' => { '$gt' => 20 } }, evals: 2, matches: 1, nanos: 610, children: [] }] }
+    #
+    # @yieldparam matcher [CMatcher] self
+    # @return [Hash] `:condition` of the node, `:evals` matches, `:matches` that matched, their time in `:nanos`
+    #   and the same for the `:children` nodes; child times include converting the record
+    # @raise [Mongory::Error] if the extension was built with `MONGORY_DISABLE_TRACE`
+    # @note Profiling replaces an enabled trace and skips the column plan of a CDataset scan
+    def profile
+      root = start_profile(condition)
+      yield self
+      profile_result(root)
+    ensure
+      __profile__(nil, false)
+    end
+
+    # Matches records and reads fields of the matching ones in the same C pass.
+    #
+    # The fields are read right after each match with the accessors the match used, so fields the condition
+    # also reads cost no second lookup. Dotted fields dig into nested Hashes, and numeric segments into Arrays.
+    # Values are read like the condition reads them, after {Mongory.data_converter}.
+    #
+    # @example
+    #   matcher = Mongory::CMatcher.new({ :age.gte => 18 })
+    #   matcher.pluck(users, :name, 'profile.city') #=> [['Jack', 'Taipei'], ['Bob', nil]]
+    #   matcher.pluck(users, :name)                 #=> ['Jack', 'Bob']
+    #
+    # @param records [Array, CDataset] the records to match against
+    # @param fields [Array<String, Symbol>] the fields to read
+    # @param offset [Integer] how many matching records to skip
+    # @param limit [Integer, nil] the maximum number of records to read
+    # @return [Array<Object>] the value of each match when one field is given
+    # @return [Array<Array<Object>>] the values of each match, nil for missing fields
+    # @raise [ArgumentError] if no field is given
+    def pluck(records, *fields, offset: 0, limit: nil)
+      raise ArgumentError, 'no fields given' if fields.empty?
+
+      __project__(records, projection_paths(fields), false, offset, limit)
+    end
+
+    # Matches records and builds Hashes of the given fields of the matching ones, in the same C pass.
+    # Dotted fields are nested like a MongoDB projection, missing fields are left out.
+    #
+    # @example
+    #   matcher.project(users, %w(name profile.city)) #=> [{ 'name' => 'Jack', 'profile' => { 'city' => 'Taipei' } }]
+    #
+    # @param records [Array, CDataset] the records to match against
+    # @param fields [Array<String, Symbol>] the fields to keep
+    # @param offset [Integer] how many matching records to skip
+    # @param limit [Integer, nil] the maximum number of records to project
+    # @return [Array<Hash{String => Object}>]
+    # @raise [ArgumentError] if no field is given or a field is a prefix of another
+    # @see #pluck
+    def project(records, fields, offset: 0, limit: nil)
+      raise ArgumentError, 'no fields given' if fields.empty?
+
+      paths = projection_paths(fields)
+      paths.combination(2) do |path, other|
+        shorter, longer = [path, other].sort_by(&:size)
+        next unless longer.first(shorter.size) == shorter
+
+        raise ArgumentError, "fields collide: #{shorter.join('.')} and #{longer.join('.')}"
+      end
+      __project__(records, paths, true, offset, limit)
+    end
+
+    # Matches records and sorts the matching ones by fields, in the same C pass.
+    #
+    # Sort keys are read right after each match like {#pluck} reads fields. A limit keeps only the
+    # `offset + limit` best matches in a bounded heap, so a top-K query never holds every match.
+    # The sort is stable. Values are ordered by type like a MongoDB sort: missing and nil, numbers, Strings,
+    # Hashes, Arrays, booleans, then other values; values of one type without a native order use `<=>`.
+    #
+    # @example
+    #   matcher = Mongory::CMatcher.new({ :status => 'active' })
+    #   matcher.sort(players, { 'score' => :desc, 'name' => :asc }, limit: 50)
+    #
+    # @param records [Array, CDataset] the records to match against
+    # @param order [Hash{String, Symbol => Symbol, String, Integer}] the fields to sort by, each
+    #   `:asc`/`1` or `:desc`/`-1`, the first field deciding first
+    # @param offset [Integer] how many sorted matching records to skip
+    # @param limit [Integer, nil] the maximum number of records to return
+    # @return [Array<Object>] the matching records, sorted
+    # @raise [ArgumentError] if no field is given or a direction is invalid
+    def sort(records, order, offset: 0, limit: nil)
+      raise ArgumentError, 'no sort fields given' if order.empty?
+
+      fields = order.map(&:first)
+      directions = order.map { |field, direction| sort_direction(field, direction) }
+      __sort__(records, projection_paths(fields), directions, offset, limit)
+    end
+
+    # Matches records and accumulates the matching ones by group in the same C pass.
+    #
+    # Group keys and the reduced field are read right after each match like {#pluck} reads fields,
+    # and accumulated in a C hash table, see {CGrouping} for how keys compare and values reduce.
+    #
+    # @example
+    #   matcher = Mongory::CMatcher.new({ :total.gt => 0 })
+    #   matcher.group(orders, %w(status), 'total').map { |group| [group.key, group.sum] }
+    #
+    # @param records [Array, CDataset] the records to match against
+    # @param fields [Array<String, Symbol>] the dotted fields to group by
+    # @param value_field [String, Symbol, nil] the dotted field to reduce, nil when only counting
+    # @param offset [Integer] how many matching records to skip
+    # @param limit [Integer, nil] the maximum number of matching records to group
+    # @return [Array<CGrouping::Group>] the groups, in order of first match
+    # @raise [ArgumentError] if no group field is given
+    def group(records, fields, value_field = nil, offset: 0, limit: nil)
+      raise ArgumentError, 'no group fields given' if fields.empty?
+
+      value_path = projection_paths([value_field]).first if value_field
+      rows = __group__(records, projection_paths(fields), value_path, offset, limit)
+      rows.map { |row| CGrouping::Group.new(*row) }
+    end
 
     # @return [Proc] a Proc that performs the matching operation
     def to_proc
       Proc.new { |record| match?(record) }
     end
+
+    private
+
+    # @private
+    # @param fields [Array<String, Symbol>]
+    # @return [Array<Array<String>>] the frozen key paths of the fields
+    def projection_paths(fields)
+      key_converter = Mongory.condition_converter.key_converter
+      fields.map { |field| key_converter.key_path(field.to_s) }
+    end
+
+    # @private
+    # @param field [String, Symbol]
+    # @param direction [Symbol, String, Integer]
+    # @return [Integer] 1 ascending, -1 descending
+    # @raise [ArgumentError] if the direction is invalid
+    def sort_direction(field, direction)
+      case direction.to_s.downcase
+      when 'asc', 'ascending', '1' then 1
+      when 'desc', 'descending', '-1' then -1
+      else raise ArgumentError, "invalid sort direction #{direction.inspect} for #{field}"
+      end
+    end
+
+    # @private
+    # Converts a slot value like a condition value, freezing Strings so the bound value cannot change.
+    #
+    # @param value [Object]
+    # @return [Object]
+    def bind_value(value)
+      value = Mongory.condition_converter.value_converter.convert(value)
+      value.is_a?(String) && !value.frozen? ? value.dup.freeze : value
+    end
+
+    # @private
+    # Compiles and enables the profile nodes under a condition, this matcher being the node of condition.
+    #
+    # @param condition [Hash] the converted condition of this matcher
+    # @return [ProfileNode]
+    def start_profile(condition)
+      sub_conditions, any = profile_split(condition)
+      children = sub_conditions.map do |sub_condition|
+        self.class.new(sub_condition, context: context, native_regex: native_regex?).send(:start_profile, sub_condition)
+      end
+      __profile__(children.map(&:matcher), any)
+      ProfileNode.new(self, children)
+    end
+
+    # @private
+    # Splits a converted condition into the sub-conditions profiled under it.
+    #
+    # @param condition [Object]
+    # @return [Array(Array<Hash>, Boolean)] the sub-conditions, and whether they are `$or` branches
+    def profile_split(condition)
+      return [[], false] unless condition.is_a?(::Hash)
+      return [condition.map { |key, value| { key => value } }, false] if condition.size > 1
+
+      key, value = condition.first
+      if %w($and $or).include?(key) && value.is_a?(::Array)
+        [value, key == '$or']
+      elsif value.is_a?(::Hash) && value.size > 1 && value.keys.all? { |op| op.is_a?(String) && op.start_with?('$') }
+        [value.map { |op, operand| { key => { op => operand } } }, false]
+      else
+        [[], false]
+      end
+    end
+
+    # @private
+    # @param node [ProfileNode]
+    # @return [Hash] the profile counters of the node and its children
+    def profile_result(node)
+      evals, matches, nanos = node.matcher.send(:__profile_stats__)
+      {
+        condition: node.matcher.condition,
+        evals: evals,
+        matches: matches,
+        nanos: nanos,
+        children: node.children.map { |child| profile_result(child) }
+      }
+    end
+
+    # @private
+    # Copies the template, replacing its slots with the bound values.
+    #
+    # @param value [Object] the template or one of its values
+    # @param values [Hash{Symbol => Object}]
+    # @return [Object]
+    def fill_slots(value, values)
+      case value
+      when Slot
+        values.fetch(value.name, value)
+      when ::Hash
+        value.each_with_object({}) { |(key, sub_value), hash| hash[key] = fill_slots(sub_value, values) }
+      when ::Array
+        value.map { |sub_value| fill_slots(sub_value, values) }
+      else
+        value
+      end
+    end
   end
 end
@@ -0,0 +1,202 @@
+# frozen_string_literal: true
+
+module Mongory
+  # Mongory::CMatcherCache is a process-wide LRU cache of compiled Mongory::CMatcher instances.
+  #
+  # Building a CMatcher converts the condition, converts it again into C values and
+  # builds the core matcher tree. Request-scoped queries usually come in a handful of
+  # shapes, so the cache keys matchers by their converted condition (and the context
+  # config) and hands out the already built matcher for a repeated condition.
+  #
+  # The cache is bounded by entry count and by an estimate of the bytes held by the
+  # matchers; the least recently used matchers are evicted first.
+  #
+  # @example Enable the cache for CQueryBuilder
+  #   Mongory::CMatcher.cache = Mongory::CMatcherCache.new(max_size: 512, max_bytes: 32 * 1024 * 1024)
+  #   records.mongory.c.where(:age.gte => 18).to_a # builds the matcher
+  #   records.mongory.c.where(:age.gte => 18).to_a # reuses it
+  #   Mongory::CMatcher.cache.stats # => { hits: 1, misses: 1, evictions: 0, size: 1, bytes: 1351 }
+  #
+  # @note Cached matchers are shared by every caller of the same condition, each with the
+  #   context it was built with. Use {Mongory::CMatcher#context} to reach it.
+  class CMatcherCache
+    # Default maximum number of cached matchers.
+    DEFAULT_MAX_SIZE = 256
+
+    # Default maximum of estimated bytes held by cached matchers.
+    DEFAULT_MAX_BYTES = 16 * 1024 * 1024
+
+    # @private
+    # Estimated bytes of one matcher without its condition: wrapper, pools and Ruby object.
+    MATCHER_BYTES = 1024
+
+    # @private
+    # Estimated bytes of one condition node: converted value, table slot and matcher node.
+    NODE_BYTES = 64
+
+    Entry = Struct.new(:matcher, :bytes)
+    private_constant :Entry
+
+    # @return [Integer] the maximum number of cached matchers
+    attr_reader :max_size
+
+    # @return [Integer] the maximum of estimated bytes held by cached matchers
+    attr_reader :max_bytes
+
+    # @param max_size [Integer] the maximum number of cached matchers
+    # @param max_bytes [Integer] the maximum of estimated bytes held by cached matchers
+    def initialize(max_size: DEFAULT_MAX_SIZE, max_bytes: DEFAULT_MAX_BYTES)
+      raise ArgumentError, 'max_size must be positive' unless max_size.positive?
+      raise ArgumentError, 'max_bytes must be positive' unless max_bytes.positive?
+
+      @max_size = max_size
+      @max_bytes = max_bytes
+      @mutex = Mutex.new
+      @entries = {}
+      @bytes = 0
+      @hits = 0
+      @misses = 0
+      @evictions = 0
+    end
+
+    # Returns the cached matcher of the condition, building and caching it on a miss.
+    #
+    # @param condition [Hash] the condition
+    # @param context [Utils::Context] the context, its config and need_convert are part of the key
+    # @return [CMatcher]
+    def fetch(condition, context: Utils::Context.new)
+      condition = Mongory.condition_converter.convert(condition)
+      key = [condition, context.config, context.need_convert]
+      matcher = lookup(key)
+      return matcher if matcher
+
+      matcher = build(condition, context)
+      store(deep_freeze(key), Entry.new(matcher, estimate_bytes(condition)))
+      matcher
+    end
+
+    # Removes every cached matcher, the counters are kept.
+    #
+    # @return [void]
+    def clear
+      @mutex.synchronize do
+        @entries.clear
+        @bytes = 0
+      end
+    end
+
+    # @return [Integer] the number of cached matchers
+    def size
+      @mutex.synchronize { @entries.size }
+    end
+
+    # @return [Integer] the estimated bytes held by cached matchers
+    def bytes
+      @mutex.synchronize { @bytes }
+    end
+
+    # @return [Hash] `:hits`, `:misses` and `:evictions` counters, with the current `:size` and `:bytes`
+    def stats
+      @mutex.synchronize do
+        { hits: @hits, misses: @misses, evictions: @evictions, size: @entries.size, bytes: @bytes }
+      end
+    end
+
+    private
+
+    # @private
+    # Finds a cached matcher and marks it as the most recently used.
+    #
+    # @param key [Array]
+    # @return [CMatcher, nil]
+    def lookup(key)
+      @mutex.synchronize do
+        entry = @entries.delete(key)
+        if entry
+          @entries[key] = entry
+          @hits += 1
+          entry.matcher
+        else
+          @misses += 1
+          nil
+        end
+      end
+    end
+
+    # @private
+    # Caches a matcher, evicting the least recently used ones beyond the bounds.
+    # The newest matcher is kept even when it alone exceeds max_bytes.
+    #
+    # @param key [Array]
+    # @param entry [Entry]
+    # @return [void]
+    def store(key, entry)
+      @mutex.synchronize do
+        previous = @entries.delete(key)
+        @bytes -= previous.bytes if previous
+        @entries[key] = entry
+        @bytes += entry.bytes
+        while @entries.size > 1 && (@entries.size > @max_size || @bytes > @max_bytes)
+          _, evicted = @entries.shift
+          @bytes -= evicted.bytes
+          @evictions += 1
+        end
+      end
+    end
+
+    # @private
+    # Builds the matcher with a context of its own, so it stays valid for later callers.
+    #
+    # @param condition [Converted::Hash]
+    # @param context [Utils::Context]
+    # @return [CMatcher]
+    def build(condition, context)
+      matcher_context = Utils::Context.new(context.config.dup)
+      matcher_context.need_convert = context.need_convert
+      CMatcher.new(condition, context: matcher_context)
+    end
+
+    # @private
+    # Copies and freezes a key, so later changes to a condition never alter a cached key.
+    #
+    # @param value [Object]
+    # @return [Object]
+    def deep_freeze(value)
+      case value
+      when ::Hash
+        value.each_with_object({}) { |(k, v), hash| hash[deep_freeze(k)] = deep_freeze(v) }.freeze
+      when ::Array
+        value.map { |v| deep_freeze(v) }.freeze
+      when ::String
+        value.frozen? ? value : value.dup.freeze
+      else
+        value
+      end
+    end
+
+    # @private
+    # Estimates the bytes a matcher of the condition holds.
+    #
+    # @param condition [Object]
+    # @return [Integer]
+    def estimate_bytes(condition)
+      MATCHER_BYTES + node_bytes(condition)
+    end
+
+    # @private
+    # @param value [Object]
+    # @return [Integer]
+    def node_bytes(value)
+      case value
+      when ::Hash
+        value.sum(NODE_BYTES) { |key, sub_value| node_bytes(key) + node_bytes(sub_value) }
+      when ::Array
+        value.sum(NODE_BYTES) { |sub_value| node_bytes(sub_value) }
+      when ::String
+        NODE_BYTES + value.bytesize
+      else
+        NODE_BYTES
+      end
+    end
+  end
+end
@@ -5,40 +5,525 @@ require_relative 'query_builder'
 module Mongory
   # Mongory::CQueryBuilder is a query builder for Mongory::CMatcher.
   # It is used to build a query for a Mongory::CMatcher.
+  #
+  # `limit` and `offset` are kept as a pending window instead of materializing records,
+  # so the C scan can stop as soon as the window is filled.
+  #
+  # Records that are neither an Array nor a {CDataset}, like lazy Enumerators or {Mongory.stream},
+  # are matched by `CMatcher#filter` in batches of the `batch_size` context config, so only one batch
+  # is held in memory at a time. `each` walks an Array in batches of the same size too, so leaving
+  # the block early stops the scan after the current batch.
+  #
+  # @example Early terminating queries
+  #   records.mongory.c.where(:age.gte => 18).offset(10).limit(20).to_a
+  #   records.mongory.c.where(:status => 'active').any?
+  #
+  # @example Repeated queries over a converted dataset
+  #   dataset = Mongory::CDataset.new(records)
+  #   dataset.mongory.c.where(:age.gte => 18).count
+  #
+  # @example Top matches, kept in a bounded heap during the scan
+  #   players.mongory.c.where(status: 'online').order_by(score: :desc).limit(50).to_a
+  #
+  # @example Reusing compiled matchers across builders
+  #   Mongory::CMatcher.cache = Mongory::CMatcherCache.new
+  #
+  # @example Streaming an ActiveRecord relation, plucking only `id` and `age`
+  #   User.all.mongory.c.where(:age.gte => 18).count
+  #
+  # @example Scanning only the candidates of an index
+  #   records.mongory(indexes: %w(status)).c.where(status: 'vip', :age.gte => 18).count
+  #
+  # @see Utils::RelationStream
+  # @see Index
   class CQueryBuilder < QueryBuilder
-    def each
+    def each(&block)
       return to_enum(:each) unless block_given?
 
-      @records.each do |record|
-        @context.current_record = record
-        yield record if @matcher.match?(record)
-      end
+      records = candidate_records
+      return scan(@limit, records).each(&block) if @order || records.is_a?(CDataset)
+      return each_in_window(@limit, &block) unless records.is_a?(Array)
+      return if @limit&.zero?
+
+      each_matched_batch(records.each_slice(batch_size), @limit) { |matched| matched.each(&block) }
     end
 
     alias_method :fast, :each
 
+    # Returns all matching records within the current window.
+    #
+    # @return [Array<Object>]
+    def to_a
+      scan(@limit)
+    end
+
+    # Returns the first matching record, or the first `count` matching records.
+    # The scan stops once enough records have matched.
+    #
+    # @param count [Integer, nil] the number of records to return
+    # @return [Object, nil] the first matching record when count is omitted
+    # @return [Array<Object>] up to `count` matching records when count is given
+    def first(count = nil)
+      found = scan(window_limit(count || 1))
+      count ? found : found.first
+    end
+
+    # Counts matching records in C when neither argument nor block is given.
+    # Batches of non-Array records stop being read once the window is filled.
+    #
+    # @return [Integer]
+    def count(*args, &block)
+      return super if !args.empty? || block
+
+      records = candidate_records
+      return @matcher.count(records, offset: @offset, limit: @limit) if scannable?(records)
+      return 0 if @limit&.zero?
+
+      total = 0
+      batches = record_batches(relation_stream)
+      if @limit || @offset
+        each_matched_batch(batches, @limit) { |matched| total += matched.size }
+      else
+        batches.each { |batch| total += ndjson_stream? ? @matcher.count_json(batch) : @matcher.count(batch) }
+      end
+      total
+    end
+
+    # Checks whether any record matches, stopping at the first match.
+    #
+    # @return [Boolean]
+    def any?(*args, &block)
+      return super if !args.empty? || block
+
+      !first(1).empty?
+    end
+
+    alias_method :exists?, :any?
+
+    # Checks whether no record matches, stopping at the first match.
+    #
+    # @return [Boolean]
+    def none?(*args, &block)
+      return super if !args.empty? || block
+
+      first(1).empty?
+    end
+
+    # Limits the number of records returned by the query.
+    # The limit is applied during the C scan instead of materializing records.
+    #
+    # @param count [Integer] the maximum number of records to return
+    # @return [CQueryBuilder] a new builder instance
+    def limit(count)
+      raise ArgumentError, 'negative limit' if count.negative?
+
+      dup_instance_exec do
+        @limit = window_limit(count)
+      end
+    end
+
+    # Skips the first matching records of the query.
+    # The offset is applied during the C scan instead of materializing records.
+    #
+    # @param count [Integer] the number of matching records to skip
+    # @return [CQueryBuilder] a new builder instance
+    def offset(count)
+      raise ArgumentError, 'negative offset' if count.negative?
+
+      dup_instance_exec do
+        @offset = @offset.to_i + count
+        @limit = [@limit - count, 0].max if @limit
+      end
+    end
+
+    # Extracts selected fields from matching records, in the same C pass as the matching.
+    # A streamed relation plucks these fields with the condition fields, without loading records.
+    #
+    # Hash records, CDataset rows, relation rows and NDJSON documents are read like {CMatcher#pluck}
+    # reads them, which differs from {QueryBuilder#pluck}:
+    # - dotted fields dig into nested records, so a literal key containing `.` is not read as one field;
+    # - values come back after {Mongory.data_converter}, so a type with a registered converter is
+    #   plucked converted.
+    # Other records, such as Structs or loaded models in an Array or a lazy Enumerable, are matched in C
+    # and read with `record[field]`, like {QueryBuilder#pluck}.
+    #
+    # @see QueryBuilder#pluck
+    def pluck(field, *fields)
+      keys = [field, *fields].map(&:to_s)
+      return super unless c_pluckable?(candidate_records, keys)
+
+      project_matches(:pluck, keys)
+    end
+
+    # Builds Hashes of selected fields of matching records, in the same C pass as the matching.
+    # Dotted fields are nested like a MongoDB projection, missing fields are left out.
+    #
+    # @example
+    #   users.mongory.c.where(:age.gte => 18).project(:name, 'profile.city')
+    #   #=> [{ 'name' => 'Jack', 'profile' => { 'city' => 'Taipei' } }, ...]
+    #
+    # @param fields [Array<String, Symbol>] the fields to keep
+    # @return [Array<Hash{String => Object}>]
+    # @see CMatcher#project
+    def project(*fields)
+      project_matches(:project, fields.map(&:to_s))
+    end
+
+    # Sorts the matching records by fields, in the same C pass as the matching.
+    # With a limit only the best `offset + limit` matches are kept in a bounded heap, so a top-K
+    # query never materializes every match. Fields of later calls break the ties of earlier ones.
+    #
+    # @example
+    #   players.mongory.c.where(status: 'online').order_by(score: :desc, name: :asc).limit(50).to_a
+    #
+    # @param fields [Array<String, Symbol, Hash>] fields sorted ascending, or Hashes of fields to `:asc`/`:desc`
+    # @return [CQueryBuilder] a new builder instance
+    # @see CMatcher#sort
+    def order_by(*fields)
+      order = fields.flat_map do |field|
+        field.is_a?(Hash) ? field.map { |key, direction| [key.to_s, direction] } : [[field.to_s, :asc]]
+      end
+      raise ArgumentError, 'no sort fields given' if order.empty?
+
+      dup_instance_exec do
+        @order = [*@order, *order]
+      end
+    end
+
+    # Groups the matching records by fields, accumulating every group in the same C pass as the matching.
+    #
+    # @example
+    #   orders.mongory.c.where(:total.gt => 0).group(:status).sum(:total) #=> { 'paid' => 12430.5, ... }
+    #
+    # @param fields [Array<String, Symbol>] the dotted fields to group by
+    # @return [CGrouping]
+    # @raise [ArgumentError] if no field is given
+    def group(*fields)
+      raise ArgumentError, 'no group fields given' if fields.empty?
+
+      fields = fields.map(&:to_s)
+      CGrouping.new { |value_field| grouped_matches(fields, value_field) }
+    end
+
     def explain
+      print_index_lookup
       @matcher.match?(@records.first)
       @matcher.explain
     end
 
+    # Matches every record with a traced matcher of its own, printing the trace and yielding the matches.
+    #
+    # @yieldparam record [Object] each matching record
+    # @return [Enumerator, void]
     def trace
       return to_enum(:trace) unless block_given?
 
-      @matcher.enable_trace
-      @records.each do |record|
-        @context.current_record = record
-        yield record if @matcher.match?(record)
+      matcher = private_matcher
+      matcher.enable_trace
+      candidate_records.each do |record|
+        matcher.context.current_record = record
+        yield record if matcher.match?(record)
       end
     ensure
-      @matcher.print_trace
-      @matcher.disable_trace
+      matcher&.print_trace
+      matcher&.disable_trace
+    end
+
+    def c
+      self
     end
 
     private
 
+    # @private
+    # Trace and profile modes are state of a matcher, and a {CMatcher.cache} shares one matcher with
+    # every builder of its condition, in every thread, so {#trace} and {#profile} compile their own.
+    #
+    # @return [CMatcher]
+    def private_matcher
+      CMatcher.new(@matcher.condition, context: @context, native_regex: @matcher.native_regex?)
+    end
+
+    alias_method :profiled_matcher, :private_matcher
+
+    # @private
+    # Applies the pending window before the condition changes,
+    # so chaining after `limit`/`offset` behaves like QueryBuilder.
+    # The matcher comes from {CMatcher.cache} when one is set.
+    #
+    # @param condition [Hash] the condition to build the matcher from
+    # @return [void]
     def set_matcher(condition = {})
-      @matcher = CMatcher.new(condition, context: @context)
+      apply_window!
+      cache = CMatcher.cache
+      @matcher = cache ? cache.fetch(condition, context: @context) : CMatcher.new(condition, context: @context)
+    end
+
+    # @private
+    # Materializes the pending window into records.
+    #
+    # @return [void]
+    def apply_window!
+      return unless @limit || @offset
+
+      @records = scan(@limit)
+      @indexes = nil
+      @limit = nil
+      @offset = nil
+    end
+
+    # @private
+    # Narrows the current limit with the given count.
+    #
+    # @param count [Integer, nil]
+    # @return [Integer, nil]
+    def window_limit(count)
+      [@limit, count].compact.min
+    end
+
+    # @private
+    # Collects matching records within the window, stopping after `limit` records.
+    #
+    # @param limit [Integer, nil] the maximum number of records to collect
+    # @param records [Enumerable] the records to scan, the index candidates by default
+    # @return [Array<Object>]
+    def scan(limit, records = candidate_records)
+      return sorted_scan(limit, records) if @order
+      return @matcher.filter(records, offset: @offset, limit: limit) if scannable?(records)
+
+      result = []
+      each_in_window(limit) { |record| result << record }
+      result
+    end
+
+    # @private
+    # Reads fields of the matches within the window with {CMatcher#pluck} or {CMatcher#project}.
+    #
+    # @param method [Symbol] `:pluck` or `:project`
+    # @param fields [Array<String>]
+    # @return [Array<Object>]
+    def project_matches(method, fields)
+      args = method == :pluck ? fields : [fields]
+      records = candidate_records
+      return @matcher.public_send(method, sorted_scan(@limit, records, fields, load: false), *args) if @order
+      return @matcher.public_send(method, records, *args, offset: @offset, limit: @limit) if scannable?(records)
+
+      projected = []
+      return projected if @limit&.zero?
+
+      batches = record_batches(relation_stream(fields))
+      each_matched_batch(batches, @limit, method, *args) { |matched| projected.concat(matched) }
+      projected
+    end
+
+    # @private
+    # Sorts the matches within the window with {CMatcher#sort}. Batches of non-Array records are sorted
+    # together with the best matches kept so far, so a limited sort holds at most `offset + limit` of them.
+    #
+    # @param limit [Integer, nil] the maximum number of records to return
+    # @param records [Enumerable] the records to scan
+    # @param fields [Array<String>] fields read from the sorted records besides the sort fields
+    # @param load [Boolean] whether the sorted rows of a relation stream are loaded as records
+    # @return [Array<Object>]
+    def sorted_scan(limit, records, fields = [], load: true)
+      return @matcher.sort(records, @order, offset: @offset, limit: limit) if scannable?(records)
+      return [] if limit&.zero?
+
+      stream = relation_stream(@order.map(&:first) | fields)
+      top = limit && @offset.to_i + limit
+      sorted = record_batches(stream).reduce([]) do |kept, batch|
+        batch = match_batch(batch) if ndjson_stream?
+        top ? @matcher.sort(kept + batch, @order, limit: top) : kept.concat(@matcher.filter(batch))
+      end
+      sorted = @matcher.sort(sorted, @order) unless top
+      sorted = sorted.drop(@offset.to_i)
+      load && stream&.rows? ? stream.load(sorted) : sorted
+    end
+
+    # @private
+    # Groups the matches within the window with {CMatcher#group}. Batches of non-Array records
+    # are grouped one by one and the groups of equal keys merged, unless a window limits the matches.
+    #
+    # @param fields [Array<String>] the group fields
+    # @param value_field [String, nil] the reduced field
+    # @return [Array<CGrouping::Group>]
+    def grouped_matches(fields, value_field)
+      read = [*fields, *value_field]
+      if @order && (@limit || @offset)
+        return @matcher.group(sorted_scan(@limit, candidate_records, read, load: false), fields, value_field)
+      end
+
+      records = candidate_records
+      return @matcher.group(records, fields, value_field, offset: @offset, limit: @limit) if scannable?(records)
+
+      batches = record_batches(relation_stream(read))
+      if @limit || @offset
+        matches = []
+        each_matched_batch(batches, @limit) { |matched| matches.concat(matched) }
+        return @matcher.group(matches, fields, value_field)
+      end
+
+      groups = {}
+      batches.each do |batch|
+        batch = match_batch(batch) if ndjson_stream?
+        @matcher.group(batch, fields, value_field).each do |group|
+          key = fields.size > 1 ? group.key.map { |value| group_merge_key(value) } : group_merge_key(group.key)
+          groups[key] = groups.key?(key) ? groups[key].merge(group) : group
+        end
+      end
+      groups.values
+    end
+
+    # @private
+    # Normalizes a group key value like the C group table compares it, so the groups of
+    # `1` and `1.0`, or `:paid` and `'paid'`, merge across batches too.
+    #
+    # @param value [Object] the value of one group field
+    # @return [Object]
+    def group_merge_key(value)
+      case value
+      when ::Float
+        return Float::NAN if value.nan?
+
+        value.finite? && value.abs < 2**63 && value == value.floor ? value.to_i : value
+      when ::Symbol
+        value.to_s
+      else
+        value
+      end
+    end
+
+    # @private
+    # Whether {#pluck} reads the records in C. Enumerables other than NDJSON streams and relation
+    # rows are not checked, that would read them ahead.
+    #
+    # @param records [Enumerable]
+    # @param fields [Array<String>] the plucked fields
+    # @return [Boolean]
+    def c_pluckable?(records, fields)
+      case records
+      when Array, CDataset then records.all?(::Hash)
+      when Utils::NdjsonStream then true
+      else relation_stream(fields)&.rows? || false
+      end
+    end
+
+    # @private
+    # Whether the records can be scanned by the C batch methods.
+    #
+    # @param records [Enumerable]
+    # @return [Boolean]
+    def scannable?(records = @records)
+      records.is_a?(Array) || records.is_a?(CDataset)
+    end
+
+    # @private
+    # Iterates non-Array records batch by batch, honoring the window and stopping early.
+    #
+    # @param limit [Integer, nil] the maximum number of records to yield
+    # @yieldparam record [Object] each matching record
+    # @return [void]
+    def each_in_window(limit, &block)
+      return if limit&.zero?
+
+      stream = relation_stream
+      return each_streamed(stream, limit, &block) if stream&.rows?
+
+      each_matched_batch(record_batches(stream), limit) { |matched| matched.each(&block) }
+    end
+
+    # @private
+    # The batches of non-Array records: the rows of a stream that has them, the raw lines of an
+    # NDJSON stream, otherwise slices of the records.
+    #
+    # @param stream [Utils::RelationStream, nil] the relation stream of the records
+    # @return [Enumerator<Array>]
+    def record_batches(stream)
+      return stream.to_enum(:each_batch) if stream&.rows?
+      return @records.each_line_batch(batch_size) if ndjson_stream?
+
+      records = stream ? stream.to_enum(:each_record) : @records
+      records.each_slice(batch_size)
+    end
+
+    # @private
+    # Matches the raw rows of a relation stream batch by batch, honoring the window.
+    #
+    # @param stream [Utils::RelationStream]
+    # @param limit [Integer, nil] the maximum number of records to yield
+    # @yieldparam record [Object] each matching record
+    # @return [void]
+    def each_streamed(stream, limit, &block)
+      return if limit&.zero?
+
+      each_matched_batch(stream.to_enum(:each_batch), limit) { |matched| stream.load(matched).each(&block) }
+    end
+
+    # @private
+    # Filters every batch in C and yields the matches within the window, stopping once it is filled.
+    #
+    # @param batches [Enumerable<Array>] the batches of records
+    # @param limit [Integer, nil] the maximum number of records to yield
+    # @param method [Symbol] the CMatcher method matching a batch, `:filter`, `:pluck` or `:project`
+    # @param args [Array] the arguments of method after the batch
+    # @yieldparam matched [Array<Object>] the matches of one batch inside the window, as returned by method
+    # @return [void]
+    def each_matched_batch(batches, limit, method = :filter, *args)
+      skip = @offset.to_i
+      taken = 0
+      batches.each do |batch|
+        matched = match_batch(batch, method, *args)
+        skipped = [skip, matched.size].min
+        skip -= skipped
+        matched = matched.drop(skipped)
+        matched = matched.first(limit - taken) if limit
+        yield matched unless matched.empty?
+        taken += matched.size
+        break if taken == limit
+      end
+    end
+
+    # @private
+    # Runs a CMatcher method over one batch. The raw lines of an NDJSON stream are matched by
+    # {CMatcher#filter_json} first, so only the matching lines are parsed and read by method.
+    #
+    # @param batch [Array] records, or the lines of an NDJSON stream
+    # @param method [Symbol] the CMatcher method, `:filter`, `:pluck` or `:project`
+    # @param args [Array] the arguments of method after the batch
+    # @return [Array<Object>] the result of method
+    def match_batch(batch, method = :filter, *args)
+      return @matcher.public_send(method, batch, *args) unless ndjson_stream?
+
+      matched = @records.parse(@matcher.filter_json(batch))
+      method == :filter ? matched : @matcher.public_send(method, matched, *args)
+    end
+
+    # @private
+    # Whether the records are an NDJSON stream, read as raw lines by {#record_batches}.
+    #
+    # @return [Boolean]
+    def ndjson_stream?
+      @records.is_a?(Utils::NdjsonStream)
+    end
+
+    # @private
+    # @return [Integer] the records read per batch from streams, lazy Enumerators and Arrays walked by `each`
+    def batch_size
+      size = @context.config[:batch_size] if @context.config.is_a?(Hash)
+      size || Utils::RelationStream::DEFAULT_BATCH_SIZE
+    end
+
+    # @private
+    # Builds the relation stream of the records, reading the condition fields and the given ones.
+    #
+    # @param extra_fields [Array<String>] fields read besides the condition fields
+    # @return [Utils::RelationStream, nil] nil when the records are not a streamable relation
+    def relation_stream(extra_fields = [])
+      return if scannable? || @indexes
+
+      fields = Converters::FieldCollector.fields(@matcher.condition)
+      fields |= extra_fields if fields
+      Utils::RelationStream.for(@records, fields, batch_size: batch_size)
     end
   end
 end
@@ -6,3 +6,7 @@ require_relative 'converters/data_converter'
 require_relative 'converters/key_converter'
 require_relative 'converters/value_converter'
 require_relative 'converters/converted'
+require_relative 'converters/interval_optimizer'
+require_relative 'converters/column_planner'
+require_relative 'converters/field_collector'
+require_relative 'converters/index_planner'
@@ -0,0 +1,151 @@
+# frozen_string_literal: true
+
+module Mongory
+  module Converters
+    # ColumnPlanner turns a converted condition made of scalar comparisons into a column plan,
+    # which the C extension evaluates over the typed columns of a {Mongory::CDataset}.
+    #
+    # A plan is one of:
+    # - `[:and, [plan, ...]]` / `[:or, [plan, ...]]`
+    # - `[operator, key_path, operand]`, where operator is one of `:eq`, `:ne`, `:gt`, `:gte`, `:lt`, `:lte`,
+    #   key_path the frozen field segments and operand an Integer, a Float, or a Boolean for `:eq`/`:ne`
+    # - `[:batch, key_path, operator, condition]`, a field operator whose registered matcher defines
+    #   `match_batch?(values)`, called once per chunk of rows instead of `match?` once per row
+    #
+    # Conditions using anything else (other operators, String operands, regexes, ...) have no plan
+    # and are matched record by record as before.
+    #
+    # @example Plan a range on a nested field
+    #   ColumnPlanner.plan('age' => { '$gte' => 18 }, 'profile' => { 'vip' => true })
+    #   # => [:and, [[:gte, ['age'], 18], [:eq, ['profile', 'vip'], true]]]
+    #
+    # @see Mongory::CDataset
+    module ColumnPlanner
+      # @private
+      # Comparison operators that have a column kernel.
+      OPERATORS = {
+        '$eq' => :eq,
+        '$ne' => :ne,
+        '$gt' => :gt,
+        '$gte' => :gte,
+        '$lt' => :lt,
+        '$lte' => :lte
+      }.freeze
+
+      # @private
+      # Operators accepting a Boolean operand.
+      BOOLEAN_OPERATORS = %i(eq ne).freeze
+
+      # Builds the column plan of a converted condition.
+      #
+      # @param condition [Converted::Hash] the converted condition
+      # @return [Array, nil] the plan, or nil when the condition cannot be planned
+      def self.plan(condition)
+        plan_hash(condition, [].freeze)
+      end
+
+      # @private
+      # @param condition [Hash] a condition applied to the value under key_path
+      # @param key_path [Array<String>]
+      # @return [Array, nil]
+      def self.plan_hash(condition, key_path)
+        return unless condition.is_a?(::Hash) && !condition.empty?
+
+        plans = []
+        condition.each do |key, value|
+          plan = plan_entry(key, value, key_path)
+          return nil if plan.nil?
+
+          plans << plan
+        end
+        plans.size == 1 ? plans.first : [:and, plans]
+      end
+
+      # @private
+      # @param key [String] a field or an operator
+      # @param value [Object] the condition of the key
+      # @param key_path [Array<String>]
+      # @return [Array, nil]
+      def self.plan_entry(key, value, key_path)
+        case key
+        when '$and', '$or'
+          plan_list(key == '$and' ? :and : :or, value, key_path)
+        when '$intervals'
+          plan_intervals(value, key_path)
+        when *OPERATORS.keys
+          plan_leaf(OPERATORS[key], value, key_path)
+        when /\A\$/
+          plan_batch(key, value, key_path)
+        else
+          field_path = (key_path + [key]).freeze
+          value.is_a?(::Hash) ? plan_hash(value, field_path) : plan_leaf(:eq, value, field_path)
+        end
+      end
+
+      # @private
+      # @param operator [Symbol] :and or :or
+      # @param conditions [Array<Hash>]
+      # @param key_path [Array<String>]
+      # @return [Array, nil]
+      def self.plan_list(operator, conditions, key_path)
+        return unless conditions.is_a?(::Array) && !conditions.empty?
+
+        plans = conditions.map { |condition| plan_hash(condition, key_path) }
+        return if plans.include?(nil)
+
+        plans.size == 1 ? plans.first : [operator, plans]
+      end
+
+      # @private
+      # Expands `$intervals` back into range comparisons, an interval unbounded on both sides has no plan.
+      #
+      # @param intervals [Array<Array>] `[lower, lower_inclusive, upper, upper_inclusive]` tuples
+      # @param key_path [Array<String>]
+      # @return [Array, nil]
+      def self.plan_intervals(intervals, key_path)
+        return unless intervals.is_a?(::Array) && !intervals.empty?
+
+        plans = intervals.map do |lower, lower_inclusive, upper, upper_inclusive|
+          bounds = []
+          bounds << plan_leaf(lower_inclusive ? :gte : :gt, lower, key_path) unless lower.nil?
+          bounds << plan_leaf(upper_inclusive ? :lte : :lt, upper, key_path) unless upper.nil?
+          next if bounds.empty? || bounds.include?(nil)
+
+          bounds.size == 1 ? bounds.first : [:and, bounds]
+        end
+        return if plans.include?(nil)
+
+        plans.size == 1 ? plans.first : [:or, plans]
+      end
+
+      # @private
+      # Plans a custom operator of a field whose matcher answers `match_batch?`.
+      #
+      # @param operator [String] the operator, e.g. `'$geoWithin'`
+      # @param condition [Object] the condition of the operator
+      # @param key_path [Array<String>]
+      # @return [Array, nil]
+      def self.plan_batch(operator, condition, key_path)
+        return if key_path.empty?
+
+        klass = Matchers.lookup(operator)
+        return unless klass.is_a?(::Class) && klass.method_defined?(:match_batch?)
+
+        [:batch, key_path, operator, condition]
+      end
+
+      # @private
+      # @param operator [Symbol]
+      # @param operand [Object]
+      # @param key_path [Array<String>]
+      # @return [Array, nil]
+      def self.plan_leaf(operator, operand, key_path)
+        return if key_path.empty?
+        return [operator, key_path, operand] if operand.is_a?(::Integer) || operand.is_a?(::Float)
+        return [operator, key_path, operand] if BOOLEAN_OPERATORS.include?(operator) && [true, false].include?(operand)
+
+        nil
+      end
+    end
+  end
+end
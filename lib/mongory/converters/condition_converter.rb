@@ -30,7 +30,7 @@ module Mongory
           result.deep_merge!(converted_pair)
         end
 
-        result
+        IntervalOptimizer.optimize(result)
       end
 
       # @note Singleton instance, not configurable after initialization
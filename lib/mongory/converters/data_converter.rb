@@ -9,12 +9,31 @@ module Mongory
     # - Time and DateTime objects are ISO8601-encoded
     # - Strings and Integers are passed through as-is
     #
+    # The predefined conversions are registered like user conversions, so a converter
+    # registered for one of these types takes priority over them.
+    #
     # @example Convert a symbol
     #   DataConverter.instance.convert(:status) #=> "status"
     #
     class DataConverter < AbstractConverter
       alias_method :super_convert, :convert
 
+      # @return [Hash{Class => Symbol}] the classes the C extension converts without calling {#convert}:
+      #   `:symbol`, `:date` and `:time` produce the same strings as the predefined conversions,
+      #   `:number` (Rational, and BigDecimal when loaded before Mongory) is matched as a Float.
+      #   Classes with a user registered converter are left out.
+      attr_reader :native_types
+
+      def initialize
+        super
+        register(Symbol) { to_s }
+        register(Date) { to_s }
+        register(DateTime) { iso8601 }
+        register(Time) { iso8601 }
+        @default_registries = @registries.dup
+        refresh_native_types
+      end
+
       # Converts a value into its standardized form based on its type.
       # Handles common primitive types with predefined conversion rules.
       #
@@ -24,14 +43,38 @@ module Mongory
         case target
         when String, Integer, Hash, Array
           target
-        when Symbol, Date
-          target.to_s
-        when Time, DateTime
-          target.iso8601
         else
           super_convert(target)
         end
       end
+
+      # Registers a conversion, see {AbstractConverter#register}.
+      #
+      # @return [void]
+      def register(klass, converter = nil, &block)
+        super
+        refresh_native_types if @default_registries
+      end
+
+      private
+
+      # @private
+      # Recomputes {#native_types} after a registration.
+      #
+      # @return [void]
+      def refresh_native_types
+        types = { Symbol => :symbol, Date => :date, Time => :time, Rational => :number }
+        types[::BigDecimal] = :number if defined?(::BigDecimal)
+        @native_types = types.select { |klass, _| default_conversion?(klass) }.freeze
+      end
+
+      # @private
+      # @param klass [Class]
+      # @return [Boolean] whether instances of klass get a predefined conversion or none
+      def default_conversion?(klass)
+        registry = @registries.find { |candidate| klass <= candidate.klass }
+        registry.nil? || @default_registries.include?(registry)
+      end
     end
   end
 end
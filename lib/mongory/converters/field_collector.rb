@@ -0,0 +1,53 @@
+# frozen_string_literal: true
+
+module Mongory
+  module Converters
+    # FieldCollector lists the top level fields a converted condition reads from a record,
+    # so a record source can load only those fields instead of whole records.
+    #
+    # Nested fields count as their top level field, `profile.city` reads `profile`.
+    # A record level operator other than `$and`, `$or` and `$not` matches the whole record,
+    # so conditions using one have no field set.
+    #
+    # @example
+    #   FieldCollector.fields(Mongory.condition_converter.convert(:age.gte => 18, 'profile.city' => 'Taipei'))
+    #   # => ['age', 'profile']
+    #
+    # @see Mongory::Utils::RelationStream
+    module FieldCollector
+      # @private
+      # Record level operators whose operands are conditions on the same record.
+      LIST_OPERATORS = %w($and $or).freeze
+
+      # Collects the fields of a converted condition.
+      #
+      # @param condition [Converted::Hash] the converted condition
+      # @return [Array<String>, nil] the field names, or nil when the whole record is needed
+      def self.fields(condition)
+        fields = []
+        collect(condition, fields) ? fields.uniq : nil
+      end
+
+      # @private
+      # @param condition [Hash] a record level condition
+      # @param fields [Array<String>] the collected fields
+      # @return [Boolean] false when the condition needs the whole record
+      def self.collect(condition, fields)
+        return false unless condition.is_a?(::Hash)
+
+        condition.all? do |key, value|
+          case key
+          when *LIST_OPERATORS
+            value.is_a?(::Array) && value.all? { |sub_condition| collect(sub_condition, fields) }
+          when '$not'
+            collect(value, fields)
+          when /\A\$/
+            false
+          else
+            fields << key
+          end
+        end
+      end
+    end
+  end
+end
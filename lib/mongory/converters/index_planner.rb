@@ -0,0 +1,64 @@
+# frozen_string_literal: true
+
+module Mongory
+  module Converters
+    # IndexPlanner picks the {Mongory::Index} lookup a query scans instead of all of its records.
+    #
+    # The conjuncts of a converted condition are its field comparisons joined by AND: the fields of
+    # the top level Hash, of nested field Hashes and of `$and` lists. Among the conjuncts an index
+    # answers (`$eq`, `$in`, `$gt`, `$gte`, `$lt`, `$lte` and `$intervals`), the one with the fewest
+    # candidates is picked. Conjuncts under `$or`, `$not`, `$elemMatch` and other operators are
+    # only matched on the candidates.
+    #
+    # @example
+    #   IndexPlanner.plan(Mongory.condition_converter.convert(status: 'vip', :age.gte => 18), indexes)
+    #   # => the status lookup when fewer records are vip than adults
+    #
+    # @see Mongory::Index
+    module IndexPlanner
+      # @private
+      # Field operators an index can answer.
+      OPERATORS = %w($eq $in $gt $gte $lt $lte $intervals).freeze
+
+      # Picks the most selective index lookup of a converted condition.
+      #
+      # @param condition [Converted::Hash] the converted condition
+      # @param indexes [Array<Mongory::Index>]
+      # @return [Mongory::Index::Lookup, nil] nil when no lookup narrows the records
+      def self.plan(condition, indexes)
+        return if indexes.nil? || indexes.empty?
+
+        by_path = indexes.to_h { |index| [index.key_path, index] }
+        lookups = conjuncts(condition, [].freeze, []).map do |key_path, operator, operand|
+          by_path[key_path]&.lookup(operator, operand)
+        end
+        lookup = lookups.compact.min_by(&:size)
+        lookup if lookup && lookup.size < lookup.index.size
+      end
+
+      # @private
+      # @param condition [Hash] a condition applied to the value under key_path
+      # @param key_path [Array<String>]
+      # @param found [Array<Array>] the collected `[key_path, operator, operand]` conjuncts
+      # @return [Array<Array>] found
+      def self.conjuncts(condition, key_path, found)
+        return found unless condition.is_a?(::Hash)
+
+        condition.each do |key, value|
+          case key
+          when '$and'
+            value.each { |sub_condition| conjuncts(sub_condition, key_path, found) } if value.is_a?(::Array)
+          when *OPERATORS
+            found << [key_path, key, value] unless key_path.empty?
+          when /\A\$/
+            next
+          else
+            field_path = (key_path + [key]).freeze
+            value.is_a?(::Hash) ? conjuncts(value, field_path, found) : found << [field_path, '$eq', value]
+          end
+        end
+        found
+      end
+    end
+  end
+end
@@ -0,0 +1,156 @@
+# frozen_string_literal: true
+
+module Mongory
+  module Converters
+    # IntervalOptimizer merges an `$or` of numeric range branches on one field
+    # into a single `$intervals` condition.
+    #
+    # Every branch must compare the same field with `$gt`, `$gte`, `$lt`, `$lte`
+    # or a numeric `$in` Range only. The ranges are intersected per branch, sorted,
+    # and overlapping or adjacent ranges are coalesced, so a value is checked
+    # with one binary search instead of one comparison chain per branch.
+    #
+    # Each interval is `[lower, lower_inclusive, upper, upper_inclusive]`,
+    # where a `nil` bound is unbounded.
+    #
+    # @example Merge time buckets
+    #   IntervalOptimizer.optimize(
+    #     '$or' => [
+    #       { 'ts' => { '$gte' => 0, '$lt' => 10 } },
+    #       { 'ts' => { '$gte' => 10, '$lt' => 20 } },
+    #       { 'ts' => { '$gt' => 30 } }
+    #     ]
+    #   )
+    #   # => { 'ts' => { '$intervals' => [[0, true, 20, false], [30, false, nil, false]] } }
+    #
+    # @see Matchers::IntervalMatcher
+    module IntervalOptimizer
+      # @private
+      # Lower bound operators and whether they are inclusive.
+      LOWER_OPERATORS = { '$gt' => false, '$gte' => true }.freeze
+
+      # @private
+      # Upper bound operators and whether they are inclusive.
+      UPPER_OPERATORS = { '$lt' => false, '$lte' => true }.freeze
+
+      # Rewrites the `$or` of a converted condition into `$intervals` when possible.
+      # Conditions that do not qualify are returned unchanged.
+      #
+      # @param condition [Converted::Hash] the converted condition
+      # @return [Converted::Hash] the optimized condition
+      def self.optimize(condition)
+        branches = condition['$or']
+        return condition unless branches.is_a?(::Array) && branches.size > 1
+
+        field = branch_field(branches.first)
+        return condition if field.nil? || condition.key?(field)
+        return condition unless branches.all? { |branch| branch_field(branch) == field }
+
+        intervals = branches.map { |branch| branch_interval(branch[field]) }
+        return condition if intervals.include?(nil)
+
+        result = condition.dup
+        result.delete('$or')
+        result[field] = Converted::Hash.new('$intervals' => coalesce(intervals.reject { |i| empty?(i) }))
+        result
+      end
+
+      # @private
+      # @param branch [Object] an `$or` branch
+      # @return [String, nil] the only field of the branch
+      def self.branch_field(branch)
+        return unless branch.is_a?(::Hash) && branch.size == 1
+
+        field = branch.keys.first
+        field if field.is_a?(String) && !field.start_with?('$')
+      end
+
+      # @private
+      # Intersects the operators of one branch into a single interval.
+      #
+      # @param operators [Object] the condition of the branch field
+      # @return [Array, nil] the interval, or nil when the branch does not qualify
+      def self.branch_interval(operators)
+        return unless operators.is_a?(::Hash) && !operators.empty?
+
+        lower = upper = nil
+        operators.each_pair do |operator, value|
+          bounds = operator_bounds(operator, value)
+          return if bounds.nil?
+
+          lower = tighter(lower, bounds[0], :>)
+          upper = tighter(upper, bounds[1], :<)
+        end
+
+        [lower&.first, lower ? lower.last : false, upper&.first, upper ? upper.last : false]
+      end
+
+      # @private
+      # @return [Array, nil] `[lower, upper]`, each `[value, inclusive]` or nil
+      def self.operator_bounds(operator, value)
+        if operator == '$in'
+          return unless value.is_a?(Range) && number?(value.begin) && number?(value.end)
+
+          head, tail = [value.begin, value.end].sort
+          [[head, true], [tail, !value.exclude_end?]]
+        elsif LOWER_OPERATORS.key?(operator)
+          [[value, LOWER_OPERATORS[operator]], nil] if number?(value)
+        elsif UPPER_OPERATORS.key?(operator)
+          [nil, [value, UPPER_OPERATORS[operator]]] if number?(value)
+        end
+      end
+
+      # @private
+      # Picks the bound that is further in the given direction, exclusive wins ties.
+      def self.tighter(current, other, direction)
+        return other if current.nil?
+        return current if other.nil?
+        return [current[0], current[1] && other[1]] if current[0] == other[0]
+
+        current[0].public_send(direction, other[0]) ? current : other
+      end
+
+      # @private
+      def self.number?(value)
+        value.is_a?(Numeric) && value.real? && !(value.is_a?(Float) && value.nan?)
+      end
+
+      # @private
+      def self.empty?(interval)
+        lower, lower_inclusive, upper, upper_inclusive = interval
+        return false if lower.nil? || upper.nil?
+
+        lower > upper || (lower == upper && !(lower_inclusive && upper_inclusive))
+      end
+
+      # @private
+      # Sorts the intervals by lower bound and merges overlapping or adjacent ones.
+      def self.coalesce(intervals)
+        sorted = intervals.sort_by { |lower, inclusive, *| [lower.nil? ? 0 : 1, lower || 0, inclusive ? 0 : 1] }
+        sorted.each_with_object([]) do |interval, merged|
+          last = merged.last
+          if last && connected?(last, interval)
+            merged[-1] = [last[0], last[1], *wider_upper(last, interval)]
+          else
+            merged << interval
+          end
+        end
+      end
+
+      # @private
+      def self.connected?(left, right)
+        return true if left[2].nil? || right[0].nil?
+
+        right[0] < left[2] || (right[0] == left[2] && (left[3] || right[1]))
+      end
+
+      # @private
+      def self.wider_upper(left, right)
+        return [nil, false] if left[2].nil? || right[2].nil?
+        return [left[2], left[3] || right[3]] if left[2] == right[2]
+
+        left[2] > right[2] ? left[2, 2] : right[2, 2]
+      end
+    end
+  end
+end
@@ -31,6 +31,15 @@ module Mongory
     class KeyConverter < AbstractConverter
       alias_method :super_convert, :convert
 
+      # The maximum number of key paths kept by the split cache.
+      KEY_PATH_CACHE_LIMIT = 1024
+
+      # Initializes the converter with an empty key path cache.
+      def initialize
+        super
+        @key_path_map = {}
+      end
+
       # Converts a key into its normalized form based on its type.
       # Handles strings, symbols, and QueryOperator instances.
       # Falls back to parent converter for other types.
@@ -65,15 +74,26 @@ module Mongory
       # @return [Hash] nested hash structure
       def convert_string_key(key, value)
         ret = {}
-        *sub_keys, last_key = key.split(/(?<!\\)\./)
+        *sub_keys, last_key = key_path(key)
         last_hash = sub_keys.reduce(ret) do |res, sub_key|
-          next_res = res[normalize_key(sub_key)] = {}
-          next_res
+          res[sub_key] = {}
         end
-        last_hash[normalize_key(last_key)] = value
+        last_hash[last_key] = value
         ret
       end
 
+      # Splits a dotted key into its normalized segments.
+      # The result is memoized, so a key is only split once.
+      #
+      # @param key [String] the dotted key string, e.g. "a.b.c"
+      # @return [Array<String>] the frozen segments, e.g. ["a", "b", "c"]
+      def key_path(key)
+        @key_path_map.fetch(key) do
+          @key_path_map.clear if @key_path_map.size >= KEY_PATH_CACHE_LIMIT
+          @key_path_map[key] = key.split(/(?<!\\)\./).map! { |sub_key| normalize_key(sub_key).freeze }.freeze
+        end
+      end
+
       # Normalizes a key by unescaping escaped dots.
       # This allows for literal dots in field names.
       #
@@ -0,0 +1,271 @@
+# frozen_string_literal: true
+
+module Mongory
+  # Mongory::Index is an in-memory secondary index of records on one field.
+  #
+  # Without an index every query scans all of the records. An index keeps the positions of
+  # the records in hash buckets keyed by the field value, for equality and `$in` lookups,
+  # and in sorted arrays of the numeric and String values, for `$gt`, `$gte`, `$lt`, `$lte`
+  # and `$intervals` lookups. A query builder given indexes picks the index lookup of its
+  # most selective indexed conjunct and matches the whole condition only on its candidates.
+  #
+  # Candidates are a superset of the matches: records whose field cannot be indexed, like
+  # a value of a custom class or an Array under the field path, are candidates of every lookup.
+  # The candidates keep the order of the records.
+  #
+  # The index is a snapshot: mutating a record after the index was built is not seen
+  # by the lookups until {#rebuild} is called.
+  #
+  # @example Indexing the records of a query
+  #   index = Mongory::Index.new(users, on: 'status')
+  #   users.mongory(indexes: [index]).where(status: 'active', :age.gte => 18).to_a
+  #
+  # @example Building the indexes with the query
+  #   users.mongory(indexes: %w(status age)).c.where(:age.gt => 65).explain
+  #
+  # @see Mongory::Converters::IndexPlanner
+  class Index
+    # Candidates of an index lookup
+    #
+    # @!attribute index
+    #   @return [Index] the index answering the lookup
+    # @!attribute operator
+    #   @return [String] the operator of the conjunct, e.g. `'$gte'`
+    # @!attribute operand
+    #   @return [Object] the operand of the conjunct
+    # @!attribute size
+    #   @return [Integer] the number of candidates, counting a record once per indexed value
+    # @!attribute slices
+    #   @return [Array<Array>] `[positions, from, to]` slices of the candidate positions
+    Lookup = Struct.new(:index, :operator, :operand, :size, :slices) do
+      # @return [Array<Object>] the candidate records, in the order of the indexed records
+      def records
+        positions = slices.flat_map { |positions_of, from, to| positions_of[from...to] }
+        positions.concat(index.unindexed)
+        positions.uniq!
+        positions.sort!
+        positions.map { |position| index.records[position] }
+      end
+
+      # @return [String] the lookup, as reported by `explain`
+      def to_s
+        "#{index.field} #{operator} #{operand.inspect} (#{size} of #{index.size} records)"
+      end
+    end
+
+    # @private
+    # Classes whose instances are not dug into, like in {Matchers::FieldMatcher}.
+    CLASSES_NOT_ALLOW_TO_DIG = Matchers::FieldMatcher::CLASSES_NOT_ALLOW_TO_DIG
+
+    # @private
+    # Comparison operators answered by the sorted values, as `[lower bound?, inclusive?]`.
+    RANGE_OPERATORS = {
+      '$gt' => [true, false],
+      '$gte' => [true, true],
+      '$lt' => [false, false],
+      '$lte' => [false, true]
+    }.freeze
+
+    # @private
+    # Positions of a value without bucket.
+    EMPTY_POSITIONS = [].freeze
+
+    # @return [String] the dotted field path of the index
+    attr_reader :field
+
+    # @return [Array<String>] the segments of the field path
+    attr_reader :key_path
+
+    # @return [Array<Object>] the indexed records
+    attr_reader :records
+
+    # @return [Array<Integer>] positions of the records whose field cannot be indexed
+    attr_reader :unindexed
+
+    # @param records [Enumerable] the records to index
+    # @param on [String, Symbol] the dotted field path to index
+    def initialize(records, on:)
+      @field = on.to_s.freeze
+      @key_path = Mongory.condition_converter.key_converter.key_path(@field)
+      rebuild(records)
+    end
+
+    # Indexes the records again, replacing the current entries.
+    #
+    # @param records [Enumerable] the records to index, defaults to the current records
+    # @return [Index] self
+    def rebuild(records = @records)
+      records = records.to_a.dup.freeze
+      buckets = {}
+      numbers = []
+      strings = []
+      unindexed = []
+
+      records.each_with_index do |record, position|
+        values = field_values(record)
+        if values.nil?
+          unindexed << position
+          next
+        end
+
+        values.each do |value|
+          if indexable?(value)
+            bucket = (buckets[normalize(value)] ||= [])
+            bucket << position unless bucket.last == position
+            numbers << [value, position] if numeric?(value)
+            strings << [value, position] if value.is_a?(::String)
+          elsif !value.nil? && unindexed.last != position
+            unindexed << position
+          end
+        end
+      end
+
+      @records = records
+      @buckets = buckets.each_value(&:freeze).freeze
+      @number_values, @number_positions = split_sorted(numbers)
+      @string_values, @string_positions = split_sorted(strings)
+      @unindexed = unindexed.freeze
+      self
+    end
+
+    # @return [Integer] the number of indexed records
+    def size
+      @records.size
+    end
+
+    # Looks up the candidates of a conjunct on the indexed field.
+    #
+    # @param operator [String] `'$eq'`, `'$in'`, a range operator or `'$intervals'`
+    # @param operand [Object] the converted operand
+    # @return [Lookup, nil] nil when the index cannot answer the conjunct
+    def lookup(operator, operand)
+      slices =
+        case operator
+        when '$eq'
+          equal_slices([operand])
+        when '$in'
+          equal_slices(operand) if operand.is_a?(::Array)
+        when '$intervals'
+          interval_slices(operand)
+        when *RANGE_OPERATORS.keys
+          lower, inclusive = RANGE_OPERATORS[operator]
+          slice = lower ? range_slice(operand, inclusive, nil, false) : range_slice(nil, false, operand, inclusive)
+          [slice] if slice
+        end
+      return if slices.nil?
+
+      Lookup.new(self, operator, operand, slices.sum { |_, from, to| to - from } + @unindexed.size, slices)
+    end
+
+    private
+
+    # @private
+    # Reads the field of a record like {Matchers::FieldMatcher}, converting every level.
+    #
+    # @param record [Object]
+    # @return [Array<Object>, nil] the converted values, nil when the field cannot be indexed
+    def field_values(record)
+      converter = Mongory.data_converter
+      value = @key_path.reduce(converter.convert(record)) do |current, key|
+        sub_record =
+          case current
+          when ::Hash
+            current.fetch(key) { current.fetch(key.to_sym, nil) }
+          when ::Array
+            return nil
+          when nil, *CLASSES_NOT_ALLOW_TO_DIG
+            return []
+          else
+            return nil unless current.respond_to?(:[])
+
+            current[key]
+          end
+        converter.convert(sub_record)
+      end
+      value.is_a?(::Array) ? value.map { |element| converter.convert(element) } : [value]
+    rescue StandardError
+      nil
+    end
+
+    # @private
+    # @param operands [Array<Object>]
+    # @return [Array<Array>, nil]
+    def equal_slices(operands)
+      return unless operands.all? { |operand| indexable?(operand) }
+
+      operands.map { |operand| normalize(operand) }.uniq.map do |key|
+        bucket = @buckets.fetch(key, EMPTY_POSITIONS)
+        [bucket, 0, bucket.size]
+      end
+    end
+
+    # @private
+    # @param intervals [Array<Array>] `[lower, lower_inclusive, upper, upper_inclusive]` tuples
+    # @return [Array<Array>, nil]
+    def interval_slices(intervals)
+      return unless intervals.is_a?(::Array)
+
+      slices = intervals.map do |lower, lower_inclusive, upper, upper_inclusive|
+        return nil unless [lower, upper].all? { |bound| bound.nil? || numeric?(bound) }
+        next [@number_positions, 0, @number_positions.size] if lower.nil? && upper.nil?
+
+        range_slice(lower, lower_inclusive, upper, upper_inclusive)
+      end
+      slices.include?(nil) ? nil : slices
+    end
+
+    # @private
+    # Slices the sorted values between two bounds, nil bounds are unbounded.
+    #
+    # @return [Array, nil] `[positions, from, to]`, nil when the bounds are neither numbers nor Strings
+    def range_slice(lower, lower_inclusive, upper, upper_inclusive)
+      values, positions =
+        if [lower, upper].compact.all? { |bound| numeric?(bound) }
+          [@number_values, @number_positions]
+        elsif [lower, upper].compact.all? { |bound| bound.is_a?(::String) }
+          [@string_values, @string_positions]
+        end
+      return if values.nil?
+
+      from = lower.nil? ? 0 : values.bsearch_index { |value| lower_inclusive ? value >= lower : value > lower }
+      to = upper.nil? ? values.size : values.bsearch_index { |value| upper_inclusive ? value > upper : value >= upper }
+      from ||= values.size
+      to ||= values.size
+      [positions, from, [from, to].max]
+    end
+
+    # @private
+    # @param pairs [Array<Array>] `[value, position]` pairs
+    # @return [Array<Array>] the frozen values and positions, sorted by value
+    def split_sorted(pairs)
+      pairs.sort_by!(&:first)
+      [pairs.map(&:first).freeze, pairs.map(&:last).freeze]
+    end
+
+    # @private
+    # @param value [Object]
+    # @return [Boolean] whether the value has an equality bucket
+    def indexable?(value)
+      case value
+      when ::String, ::Integer, ::Float, true, false then true
+      else false
+      end
+    end
+
+    # @private
+    # Integral Floats share the bucket of the equal Integer, like `1 == 1.0`.
+    #
+    # @param value [Object]
+    # @return [Object]
+    def normalize(value)
+      value.is_a?(::Float) && value.finite? && value == value.floor ? value.to_i : value
+    end
+
+    # @private
+    # @param value [Object]
+    # @return [Boolean]
+    def numeric?(value)
+      value.is_a?(::Integer) || (value.is_a?(::Float) && !value.nan?)
+    end
+  end
+end
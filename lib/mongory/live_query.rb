@@ -0,0 +1,199 @@
+# frozen_string_literal: true
+
+module Mongory
+  # Mongory::LiveQuery is a standing query over a changing collection.
+  #
+  # Re-running a query after a few records changed matches every record again. A live query
+  # keeps the records currently matching its condition and takes the changes one record at a
+  # time, matching only the changed record, then emits an event for every change of the result.
+  # One matcher is compiled for the lifetime of the query, a {CMatcher} when the C extension is
+  # loaded, so its converted condition and field key caches are reused by every change.
+  #
+  # Records are identified by object identity, or by the `key:` given, so an update can replace
+  # a record with a new object of the same key.
+  #
+  # Events:
+  # - `:added` a record starts matching
+  # - `:removed` a matching record stops matching or is deleted
+  # - `:updated` a matching record changed and still matches
+  #
+  # @example
+  #   live = Mongory::LiveQuery.new({ :status => 'online', :score.gte => 100 }, players, key: 'id')
+  #   live.on(:added) { |player| broadcast(:join, player) }
+  #   live.on(:removed) { |player| broadcast(:leave, player) }
+  #   live.update(player.merge('score' => 120))
+  #   live.delete(player)
+  #   live.to_a # the matching players, in the order they started matching
+  class LiveQuery
+    include ::Enumerable
+
+    # The events a listener can subscribe to
+    # @return [Array<Symbol>]
+    EVENTS = %i(added removed updated).freeze
+
+    # @return [CMatcher, QueryMatcher] the compiled matcher of the condition
+    attr_reader :matcher
+
+    # @param condition [Hash] the query condition
+    # @param records [Enumerable] the initial records, matched without emitting events
+    # @param key [String, Symbol, Proc, nil] the field, or a Proc, identifying a record;
+    #   nil compares records by identity
+    # @param context [Utils::Context]
+    def initialize(condition, records = [], key: nil, context: Utils::Context.new)
+      @key = key.is_a?(::Symbol) ? key.to_s : key
+      @context = context
+      @matcher = build_matcher(condition)
+      @listeners = EVENTS.to_h { |event| [event, []] }
+      @results = @key.nil? ? {}.compare_by_identity : {}
+      matching_records(records.to_a).each { |record| @results[key_of(record)] = record }
+    end
+
+    # Subscribes to an event.
+    #
+    # @param event [Symbol] one of {EVENTS}
+    # @yieldparam record [Object] the added, removed or updated record
+    # @return [LiveQuery] self
+    # @raise [ArgumentError] if the event is unknown
+    def on(event, &block)
+      raise ArgumentError, "unknown event: #{event.inspect}" unless EVENTS.include?(event)
+      raise ArgumentError, 'no block given' unless block
+
+      @listeners[event] << block
+      self
+    end
+
+    # Matches an inserted record. Inserting a record already in the result updates it.
+    #
+    # @param record [Object]
+    # @return [Boolean] whether the record matches
+    def insert(record)
+      rematch(record)
+    end
+
+    # Matches a changed record, emitting `:added`, `:removed` or `:updated` if the result changes.
+    #
+    # @param record [Object] the changed record, or a new object with the key of the old one
+    # @return [Boolean] whether the record matches
+    def update(record)
+      rematch(record)
+    end
+
+    # Matches many changed records at once, like calling {#update} for each of them.
+    # With the C extension the records are matched by one batch scan.
+    #
+    # @param records [Enumerable] the changed records
+    # @return [Integer] the number of given records that match
+    def update_all(records)
+      records = records.to_a
+      matched = {}.compare_by_identity
+      matching_records(records).each { |record| matched[record] = true }
+      records.count { |record| rematch(record, matched.key?(record)) }
+    end
+
+    # Removes a deleted record from the result, emitting `:removed` if it was matching.
+    #
+    # @param record [Object] the deleted record, or any object with its key
+    # @return [Boolean] whether the record was matching
+    def delete(record)
+      key = key_of(record)
+      return false unless @results.key?(key)
+
+      emit(:removed, @results.delete(key))
+      true
+    end
+
+    # @yieldparam record [Object] each matching record, in the order they started matching
+    # @return [Enumerator, LiveQuery]
+    def each(&block)
+      return to_enum(:each) unless block
+
+      @results.each_value(&block)
+      self
+    end
+
+    # @return [Array<Object>] the matching records
+    def to_a
+      @results.values
+    end
+
+    # @return [Integer] the number of matching records
+    def size
+      @results.size
+    end
+
+    # @param record [Object]
+    # @return [Boolean] whether a record with the key of the given one is matching
+    def include?(record)
+      @results.key?(key_of(record))
+    end
+
+    private
+
+    # @private
+    # @param condition [Hash]
+    # @return [CMatcher, QueryMatcher]
+    def build_matcher(condition)
+      return QueryMatcher.new(condition, context: @context).tap(&:prepare_query) unless defined?(Mongory::CMatcher)
+
+      cache = CMatcher.cache
+      cache ? cache.fetch(condition, context: @context) : CMatcher.new(condition, context: @context)
+    end
+
+    # @private
+    # @param records [Array<Object>]
+    # @return [Array<Object>] the matching records
+    def matching_records(records)
+      return @matcher.filter(records) if @matcher.respond_to?(:filter)
+
+      records.select { |record| match?(record) }
+    end
+
+    # @private
+    # @param record [Object]
+    # @param matching [Boolean] whether the record matches
+    # @return [Boolean] matching
+    def rematch(record, matching = match?(record))
+      key = key_of(record)
+      was_matching = @results.key?(key)
+
+      if matching
+        @results[key] = record
+        emit(was_matching ? :updated : :added, record)
+      elsif was_matching
+        emit(:removed, @results.delete(key))
+      end
+      matching
+    end
+
+    # @private
+    # @param record [Object]
+    # @return [Boolean]
+    def match?(record)
+      # A cached matcher keeps the context of the query that built it
+      @matcher.context.current_record = record
+      @matcher.match?(record)
+    end
+
+    # @private
+    # @param record [Object]
+    # @return [Object] the key identifying the record
+    def key_of(record)
+      case @key
+      when nil
+        record
+      when ::Proc
+        @key.call(record)
+      else
+        record.is_a?(::Hash) ? record.fetch(@key) { record[@key.to_sym] } : record[@key]
+      end
+    end
+
+    # @private
+    # @param event [Symbol]
+    # @param record [Object]
+    # @return [void]
+    def emit(event, record)
+      @listeners[event].each { |listener| listener.call(record) }
+    end
+  end
+end
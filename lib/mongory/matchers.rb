@@ -164,6 +164,7 @@ require_relative 'matchers/exists_matcher'
 require_relative 'matchers/gt_matcher'
 require_relative 'matchers/gte_matcher'
 require_relative 'matchers/in_matcher'
+require_relative 'matchers/interval_matcher'
 require_relative 'matchers/field_matcher'
 require_relative 'matchers/lt_matcher'
 require_relative 'matchers/lte_matcher'
@@ -40,6 +40,10 @@ module Mongory
       # @api private
       KEY_NOT_FOUND = SingletonBuilder.new('KEY_NOT_FOUND')
 
+      # Profile counters of one matcher, see {#profile_tree}
+      ProfileStat = Struct.new(:evals, :matches, :nanos)
+      private_constant :ProfileStat
+
       # Defines a lazily-evaluated matcher accessor with instance-level caching.
       # This is used to create cached accessors for submatcher instances.
       #
@@ -126,6 +130,52 @@ module Mongory
         end
       end
 
+      # Creates a profiling version of the matcher proc.
+      # It counts the evaluations and matches of this matcher and the time spent in it,
+      # sub-matchers included.
+      #
+      # @return [Proc] a profiling version of the matcher proc
+      # @see QueryMatcher#profile
+      def profile_proc
+        return @profile_proc if defined?(@profile_proc)
+
+        raw_proc = raw_proc()
+        stat = profile_stat
+        @profile_proc = Proc.new do |record|
+          started = Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+          result = raw_proc.call(record)
+          stat.matches += 1 if result
+          result
+        ensure
+          stat.evals += 1
+          stat.nanos += Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond) - started
+        end
+      end
+
+      # Returns the profile counters of this matcher and its sub-matchers.
+      #
+      # @return [Hash] `:matcher` the matcher type, its `:condition`, `:evals` evaluations, `:matches` that matched,
+      #   their time in `:nanos`, and the same for the `:children` sub-matchers
+      # @see QueryMatcher#profile
+      def profile_tree
+        {
+          matcher: matcher_name,
+          condition: @condition,
+          evals: profile_stat.evals,
+          matches: profile_stat.matches,
+          nanos: profile_stat.nanos,
+          children: profile_children.map(&:profile_tree)
+        }
+      end
+
+      # Resets the profile counters of this matcher and its sub-matchers.
+      #
+      # @return [void]
+      def reset_profile
+        profile_stat.evals = profile_stat.matches = profile_stat.nanos = 0
+        profile_children.each(&:reset_profile)
+      end
+
       # Creates a raw Proc from the match method.
       # This is used internally by to_proc and can be overridden by subclasses
       # to provide custom matching behavior.
@@ -172,10 +222,28 @@ module Mongory
       #
       # @return [String] a formatted title for tree display
       def tree_title
-        matcher_name = self.class.name.split('::').last.sub('Matcher', '')
         "#{matcher_name}: #{@condition.inspect}"
       end
 
+      # Returns the matcher type shown in trees, the class name without `Matcher`.
+      #
+      # @return [String]
+      def matcher_name
+        self.class.name.split('::').last.sub('Matcher', '')
+      end
+
+      # @return [ProfileStat] the profile counters of this matcher
+      def profile_stat
+        @profile_stat ||= ProfileStat.new(0, 0, 0)
+      end
+
+      # Returns the sub-matchers reported under this matcher by {#profile_tree}.
+      #
+      # @return [Array<AbstractMatcher>]
+      def profile_children
+        []
+      end
+
       # Normalizes the record before matching.
       #
       # If the record is the KEY_NOT_FOUND sentinel (representing a missing field),
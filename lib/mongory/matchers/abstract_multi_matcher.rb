@@ -13,6 +13,14 @@ module Mongory
     # Sub-matchers are cached using `define_instance_cache_method` to prevent
     # repeated construction.
     #
+    # Sub-matchers are ordered by their static `priority`. With the `adaptive` context config
+    # (`true` or a sample size), `$and` / `$or` style matchers instead measure the pass rate and
+    # cost of every sub-matcher over the first records, then reorder them once: `all?` matchers
+    # by `cost / (1 - pass rate)` and `any?` matchers by `cost / pass rate`.
+    #
+    # @example Adaptive ordering
+    #   records.mongory.with_context(adaptive: 500).where(name: /smith/i, status: 'vip')
+    #
     # @abstract
     # @see AbstractMatcher
     class AbstractMultiMatcher < AbstractMatcher
@@ -24,6 +32,14 @@ module Mongory
       # @return [Proc] A proc that always returns false
       FALSE_PROC = Proc.new { |_| false }
 
+      # Records sampled before an adaptive matcher reorders its sub-matchers, for `adaptive: true`
+      # @return [Integer]
+      ADAPTIVE_SAMPLE_SIZE = 256
+
+      # Runtime statistics of one sub-matcher while an adaptive matcher samples
+      AdaptiveStat = Struct.new(:matcher, :proc, :evals, :passes, :nanos)
+      private_constant :AdaptiveStat
+
       # Enables auto-unwrap logic.
       # When used, `.build` may unwrap to first matcher if only one is present.
       #
@@ -82,6 +98,110 @@ module Mongory
 
       private
 
+      # @return [Array<AbstractMatcher>] the sub-matchers, in their current order
+      def profile_children
+        matchers
+      end
+
+      # Sample size of the adaptive order, from the `adaptive` context config.
+      #
+      # @return [Integer, nil] nil when sub-matchers keep their static order
+      def adaptive_sample_size
+        adaptive = @context.config[:adaptive] if @context.config.is_a?(Hash)
+        return ADAPTIVE_SAMPLE_SIZE if adaptive == true
+
+        adaptive if adaptive.is_a?(Integer) && adaptive.positive?
+      end
+
+      # Combines the sub-matcher procs with AND logic, adaptively ordered when enabled.
+      #
+      # @return [Proc]
+      def combine_matchers_with_and
+        sample_size = adaptive_sample_size
+        return combine_procs_with_and(*matchers.map(&:to_proc)) if sample_size.nil? || matchers.size < 2
+
+        adaptive_proc(:and, sample_size)
+      end
+
+      # Combines the sub-matcher procs with OR logic, adaptively ordered when enabled.
+      #
+      # @return [Proc]
+      def combine_matchers_with_or
+        sample_size = adaptive_sample_size
+        return combine_procs_with_or(*matchers.map(&:to_proc)) if sample_size.nil? || matchers.size < 2
+
+        adaptive_proc(:or, sample_size)
+      end
+
+      # Builds a Proc that measures every sub-matcher over the first records,
+      # then reorders {#matchers} by rank and combines them like the static order does.
+      #
+      # @param operator [Symbol] :and or :or
+      # @param sample_size [Integer] the number of records to sample
+      # @return [Proc]
+      def adaptive_proc(operator, sample_size)
+        stats = matchers.map { |matcher| AdaptiveStat.new(matcher, matcher.to_proc, 0, 0, 0) }
+        samples = 0
+        combined = nil
+
+        Proc.new do |record|
+          next combined.call(record) if combined
+
+          result = adaptive_sample(stats, record, operator == :or)
+          samples += 1
+          if samples >= sample_size
+            ranked = stats.each_with_index.sort_by { |stat, index| [adaptive_rank(stat, operator), index] }
+            ordered = ranked.map(&:first)
+            @matchers = ordered.map(&:matcher)
+            procs = ordered.map(&:proc)
+            combined = operator == :and ? combine_procs_with_and(*procs) : combine_procs_with_or(*procs)
+          end
+          result
+        end
+      end
+
+      # Matches one record with every sub-matcher, recording pass counts and time.
+      # The result is decided in the current order like the static combination; sub-matchers
+      # evaluated only for their statistics never raise.
+      #
+      # @param stats [Array<AdaptiveStat>]
+      # @param record [Object]
+      # @param decisive [Boolean] the sub-matcher result that decides the match, true for OR
+      # @return [Boolean]
+      def adaptive_sample(stats, record, decisive)
+        result = nil
+        stats.each do |stat|
+          started = Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+          passed = if result.nil?
+                     stat.proc.call(record)
+                   else
+                     begin
+                       stat.proc.call(record)
+                     rescue StandardError
+                       false
+                     end
+                   end
+          stat.nanos += Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond) - started
+          stat.evals += 1
+          stat.passes += 1 if passed
+          result = decisive if result.nil? && !passed == !decisive
+        end
+        result.nil? ? !decisive : result
+      end
+
+      # Rank of a sampled sub-matcher, lower runs first. An AND sub-matcher that always passes
+      # and an OR sub-matcher that never passes cannot decide the match, so they run last.
+      #
+      # @param stat [AdaptiveStat]
+      # @param operator [Symbol] :and or :or
+      # @return [Float]
+      def adaptive_rank(stat, operator)
+        cost = stat.nanos.to_f / stat.evals
+        pass_rate = stat.passes.to_f / stat.evals
+        deciding_rate = operator == :and ? 1 - pass_rate : pass_rate
+        deciding_rate.zero? ? Float::INFINITY : cost / deciding_rate
+      end
+
       # Recursively combines multiple matcher procs with AND logic.
       # This method optimizes the combination of multiple matchers by building
       # a balanced tree of AND operations.
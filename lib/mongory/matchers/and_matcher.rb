@@ -36,7 +36,7 @@ module Mongory
       #
       # @return [Proc] a Proc that performs the AND operation
       def raw_proc
-        combine_procs_with_and(*matchers.map(&:to_proc))
+        combine_matchers_with_and
       end
 
       # Returns the flattened list of all matchers from each subcondition.
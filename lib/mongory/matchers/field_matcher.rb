@@ -84,6 +84,7 @@ module Mongory
       def raw_proc
         super_proc = super
         field = @field
+        symbol_field = field.is_a?(String) ? field.to_sym : field
         need_convert = @context.need_convert
         data_converter = Mongory.data_converter
 
@@ -92,7 +93,7 @@ module Mongory
             case record
             when Hash
               record.fetch(field) do
-                record.fetch(field.to_sym, KEY_NOT_FOUND)
+                record.fetch(symbol_field, KEY_NOT_FOUND)
               end
             when Array
               record.fetch(field, KEY_NOT_FOUND)
@@ -122,6 +123,13 @@ module Mongory
         super + "field:#{@field}"
       end
 
+      # Returns the profile counters of this matcher, including the field name.
+      #
+      # @return [Hash] see {AbstractMatcher#profile_tree}
+      def profile_tree
+        super.merge(field: @field)
+      end
+
       private
 
       # Returns a single-line summary of the field matcher including the field and condition.
@@ -32,7 +32,7 @@ module Mongory
       #
       # @return [Proc] a Proc that performs the hash condition matching operation
       def raw_proc
-        combine_procs_with_and(*matchers.map(&:to_proc))
+        combine_matchers_with_and
       end
 
       # Returns the list of matchers for each key-value pair in the condition.
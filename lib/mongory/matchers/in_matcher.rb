@@ -41,7 +41,7 @@ module Mongory
 
         Proc.new do |record|
           if record.is_a?(Array)
-            is_present?(condition & record)
+            record.any? { |value| condition.include?(value) }
           else
             condition.include?(record)
           end
@@ -0,0 +1,62 @@
+# frozen_string_literal: true
+
+module Mongory
+  module Matchers
+    # IntervalMatcher matches numeric values against a sorted set of disjoint intervals.
+    #
+    # The condition is produced by {Converters::IntervalOptimizer} from an `$or` of
+    # range branches on one field, each interval being
+    # `[lower, lower_inclusive, upper, upper_inclusive]` with `nil` as an unbounded side.
+    # A value is located with one binary search over the lower bounds.
+    #
+    # Non-numeric records never match, like the comparison operators they replace.
+    #
+    # @example
+    #   matcher = IntervalMatcher.build([[0, true, 10, false], [20, true, nil, false]])
+    #   matcher.match?(5)   #=> true
+    #   matcher.match?(10)  #=> false
+    #   matcher.match?(99)  #=> true
+    #
+    # @see Converters::IntervalOptimizer
+    class IntervalMatcher < AbstractMatcher
+      # Creates a raw Proc that performs the interval lookup.
+      #
+      # @return [Proc] a Proc that checks whether the record falls in any interval
+      def raw_proc
+        intervals = @condition
+
+        Proc.new do |record|
+          next false unless record.is_a?(Numeric) && record.real?
+          next false if record.is_a?(Float) && record.nan?
+
+          # First interval whose lower bound excludes the record, the candidate is the one before it
+          index = intervals.bsearch_index do |lower, lower_inclusive, *|
+            !lower.nil? && (lower_inclusive ? lower > record : lower >= record)
+          end || intervals.size
+          next false if index.zero?
+
+          _, _, upper, upper_inclusive = intervals[index - 1]
+          upper.nil? || (upper_inclusive ? record <= upper : record < upper)
+        rescue StandardError
+          false
+        end
+      end
+
+      def priority
+        2 + Math.log(@condition.size + 1, 2)
+      end
+
+      # Ensures the condition is an array of intervals.
+      #
+      # @raise [TypeError] if the condition is not an array of 4-element arrays
+      # @return [void]
+      def check_validity!
+        return if @condition.is_a?(Array) && @condition.all? { |interval| interval.is_a?(Array) && interval.size == 4 }
+
+        raise TypeError, '$intervals needs an array of [lower, lower_inclusive, upper, upper_inclusive]'
+      end
+    end
+
+    register(:intervals, '$intervals', IntervalMatcher)
+  end
+end
@@ -116,6 +116,13 @@ module Mongory
         target_matcher = @array_record_matcher || dispatched_matcher
         target_matcher.render_tree("#{prefix}#{is_last ? '   ' : '│  '}", is_last: true)
       end
+
+      private
+
+      # @return [Array<AbstractMatcher>] the condition matcher, and the collection matcher once used
+      def profile_children
+        [dispatched_matcher, @array_record_matcher].compact
+      end
     end
   end
 end
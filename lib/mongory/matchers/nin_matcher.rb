@@ -41,7 +41,7 @@ module Mongory
 
         Proc.new do |record|
           if record.is_a?(Array)
-            is_blank?(condition & record)
+            record.none? { |value| condition.include?(value) }
           else
             !condition.include?(record)
           end
@@ -35,7 +35,7 @@ module Mongory
       #
       # @return [Proc] a Proc that performs the or-matching operation
       def raw_proc
-        combine_procs_with_or(*matchers.map(&:to_proc))
+        combine_matchers_with_or
       end
 
       # Builds an array of matchers from the subconditions.
@@ -23,6 +23,11 @@ module Mongory
   #     .not(:age.lt => 18)
   #     .any_of({ :role => 'admin' }, { :role => 'moderator' })
   #     .pluck(:name, :email)
+  #
+  # @example Matching only the candidates of an index
+  #   records.mongory(indexes: %w(status)).where(status: 'active', :age.gte => 18).to_a
+  #
+  # @see Index
   class QueryBuilder
     include ::Enumerable
     include Utils
@@ -30,9 +35,12 @@ module Mongory
     # Initializes a new query builder with the given record set.
     #
     # @param records [Enumerable] the collection to query against
-    def initialize(records, context: Utils::Context.new)
+    # @param indexes [Array<Index, String, Symbol>, nil] indexes of the records, fields are indexed on the spot.
+    #   Queries match only the candidates of the most selective index lookup, see {Converters::IndexPlanner}.
+    def initialize(records, context: Utils::Context.new, indexes: nil)
       @records = records
       @context = context
+      @indexes = build_indexes(records, indexes)
       set_matcher
     end
 
@@ -46,7 +54,7 @@ module Mongory
       return to_enum(:each) unless block_given?
 
       @matcher.prepare_query
-      @records.each do |record|
+      candidate_records.each do |record|
         @context.current_record = record
         yield record if @matcher.match?(record)
       end
@@ -70,7 +78,7 @@ module Mongory
       @context.need_convert = false
       @matcher.prepare_query
       matcher_block = @matcher.to_proc
-      @records.each do |record|
+      candidate_records.each do |record|
         @context.current_record = record
         yield record if matcher_block.call(record)
       end
@@ -81,7 +89,7 @@ module Mongory
 
       Mongory.debugger.enable
       @matcher.prepare_query
-      @records.each do |record|
+      candidate_records.each do |record|
         @context.current_record = record
         matched = @matcher.match?(record)
         Mongory.debugger.display
@@ -92,6 +100,22 @@ module Mongory
       Mongory.debugger.disable
     end
 
+    # Matches every record and returns the profile tree of the query matcher,
+    # see {QueryMatcher#profile} and {CMatcher#profile}.
+    #
+    # @example
+    #   records.mongory.where(:$or => [{ name: /smith/i }, { :age.gt => 20 }]).profile
+    #
+    # @return [Hash] the evaluations, matches and time of every node
+    def profile
+      profiled_matcher.profile do |matcher|
+        candidate_records.each do |record|
+          matcher.context.current_record = record
+          matcher.match?(record)
+        end
+      end
+    end
+
     # Adds a condition to filter records using the given condition.
     # This is an alias for `and`.
     #
@@ -171,6 +195,18 @@ module Mongory
     def limit(count)
       dup_instance_exec do
         @records = take(count)
+        @indexes = nil
+      end
+    end
+
+    # Skips the first matching records of the query.
+    #
+    # @param count [Integer] the number of matching records to skip
+    # @return [QueryBuilder] a new builder instance
+    def offset(count)
+      dup_instance_exec do
+        @records = drop(count)
+        @indexes = nil
       end
     end
 
@@ -214,9 +250,11 @@ module Mongory
     # Prints the internal matcher tree structure for the current query.
     # Will output a human-readable visual tree of matchers.
     # This is useful for debugging and visualizing complex conditions.
+    # The index lookup of the query, if any, is printed first.
     #
     # @return [void]
     def explain
+      print_index_lookup
       @matcher.match?(@records.first)
       @matcher.render_tree
       nil
@@ -225,7 +263,7 @@ module Mongory
     def c
       return self unless defined?(Mongory::CMatcher)
 
-      c_builder = CQueryBuilder.new(@records, context: @context)
+      c_builder = CQueryBuilder.new(@records, context: @context, indexes: @indexes)
       c_builder.send(:set_matcher, @matcher.condition)
       c_builder
     end
@@ -242,6 +280,48 @@ module Mongory
       end
     end
 
+    # @private
+    # @param records [Enumerable]
+    # @param indexes [Array<Index, String, Symbol>, nil]
+    # @return [Array<Index>, nil]
+    def build_indexes(records, indexes)
+      return if indexes.nil? || indexes.empty?
+
+      indexes.map { |index| index.is_a?(Index) ? index : Index.new(records, on: index) }
+    end
+
+    # @private
+    # The index lookup picked for the current condition.
+    #
+    # @return [Index::Lookup, nil]
+    def index_lookup
+      Converters::IndexPlanner.plan(@matcher.condition, @indexes) if @indexes
+    end
+
+    # @private
+    # The matcher {#profile} switches to profile mode.
+    #
+    # @return [QueryMatcher]
+    def profiled_matcher
+      @matcher
+    end
+
+    # @private
+    # The records the matcher runs on: the candidates of the index lookup, or all of the records.
+    #
+    # @return [Enumerable]
+    def candidate_records
+      lookup = index_lookup
+      lookup ? lookup.records : @records
+    end
+
+    # @private
+    # @return [void]
+    def print_index_lookup
+      lookup = index_lookup
+      puts "Index: #{lookup}" if lookup
+    end
+
     # @private
     # Builds the internal matcher tree from a condition hash.
     # Used to eagerly parse conditions to improve inspect/debug visibility.
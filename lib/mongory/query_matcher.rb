@@ -76,6 +76,28 @@ module Mongory
       super
     end
 
+    # Profiles the matches made in the block, counting the evaluations, matches and time
+    # of every matcher in the tree.
+    #
+    # @example Find the slow branches of an `$or`
+    #   matcher = Mongory::QueryMatcher.new({ '$or' => [{ name: /smith/i }, { :age.gt => 20 }] })
+    #   matcher.profile { records.each { |record| matcher.match?(record) } }
+    #   #=> { matcher: 'Query', condition: { '$or' => [...] }, evals: 3, matches: 2, nanos: 48210, children: [...] }
+    #
+    # @yieldparam matcher [QueryMatcher] self
+    # @return [Hash] the profile tree, see {Matchers::AbstractMatcher#profile_tree}
+    # @note Like {Utils::Debugger#enable}, profiling switches `to_proc` of every matcher, so profile
+    #   one query at a time
+    def profile
+      prepare_query
+      reset_profile
+      Matchers::AbstractMatcher.alias_method :to_proc, :profile_proc
+      yield self
+      profile_tree
+    ensure
+      Matchers::AbstractMatcher.alias_method :to_proc, :cached_proc
+    end
+
     # Prepares the query for execution by ensuring all necessary matchers are initialized.
     # This is called before query execution to avoid premature matcher tree construction.
     #
@@ -4,6 +4,8 @@ require 'date'
 require_relative 'utils/singleton_builder'
 require_relative 'utils/debugger'
 require_relative 'utils/context'
+require_relative 'utils/relation_stream'
+require_relative 'utils/ndjson_stream'
 
 module Mongory
   # Utility helpers shared across Mongory internals.
@@ -1,5 +1,7 @@
 # frozen_string_literal: true
 
+require 'fiber'
+
 module Mongory
   module Utils
     # Context is a utility class that provides a stable but mutatable
@@ -11,11 +13,13 @@ module Mongory
     #   context.current_record = record
     #   context.config = new_config
     #
+    # The current record is kept per fiber, so threads sharing a matcher and its context,
+    # like a matcher of {Mongory::CMatcher.cache}, each read the record they are matching.
+    #
     # @attr [Config] config The configuration object for the context
-    # @attr [Record] current_record The current record being processed in the matcher tree
     # @attr [Boolean] need_convert Whether the record needs to be converted before matching
     class Context
-      attr_accessor :config, :current_record, :need_convert
+      attr_accessor :config, :need_convert
 
       # Initializes a new Context instance with the given configuration.
       #
@@ -23,8 +27,24 @@ module Mongory
       # @return [Context] A new Context instance.
       def initialize(config = {})
         @config = config
-        @current_record = nil
         @need_convert = true
+        @current_records = {}.compare_by_identity
+      end
+
+      # @return [Record, nil] the record the current fiber is processing in the matcher tree
+      def current_record
+        @current_records[Fiber.current]
+      end
+
+      # The records of dead fibers are dropped when a new fiber starts processing.
+      # The C extension sets the records of a scan in the same Hash.
+      #
+      # @param record [Record] the record the current fiber starts processing
+      # @return [Record]
+      def current_record=(record)
+        fiber = Fiber.current
+        prune_fibers unless @current_records.key?(fiber)
+        @current_records[fiber] = record
       end
 
       # Creates a duplicate of the context with its own configuration.
@@ -37,12 +57,29 @@ module Mongory
         new_context
       end
 
+      # @param source [Context]
+      # @return [void]
+      def initialize_copy(source)
+        super
+        @current_records = {}.compare_by_identity
+      end
+
       def to_hash
         {
           config: @config,
           need_convert: @need_convert
         }
       end
+
+      private
+
+      # @private
+      # Drops the records of dead fibers. Keys are read first, another thread may add its fiber meanwhile.
+      #
+      # @return [void]
+      def prune_fibers
+        @current_records.keys.each { |fiber| @current_records.delete(fiber) unless fiber.alive? }
+      end
     end
   end
 end
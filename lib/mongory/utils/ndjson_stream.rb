@@ -0,0 +1,150 @@
+# frozen_string_literal: true
+
+require 'json'
+
+module Mongory
+  module Utils
+    # NdjsonStream enumerates the records of newline delimited JSON, one parsed line at a time.
+    #
+    # Only the current line is held in memory, so a query over the stream keeps constant memory
+    # whatever the size of the input. {Mongory::CQueryBuilder} reads the lines unparsed in batches of
+    # the `batch_size` context config, matches them with {Mongory::CMatcher#filter_json} and parses
+    # only the matching ones. Blank lines are skipped.
+    #
+    # An IO is read from its current position, and rewound by every later enumeration when it can be.
+    # A path is opened again by every enumeration.
+    #
+    # @example
+    #   File.open('audit.ndjson') do |io|
+    #     Mongory.stream(io).c.where(action: 'login', :latency.gt => 500).each { |event| puts event['id'] }
+    #   end
+    #
+    # @see Mongory.stream
+    class NdjsonStream
+      include ::Enumerable
+
+      # @param source [IO, #each_line, String] an IO or a path of a file
+      def initialize(source)
+        @source = source
+        @enumerated = false
+      end
+
+      # @yieldparam record [Object] each parsed line
+      # @return [Enumerator, NdjsonStream]
+      # @raise [Mongory::Error] if a line is not valid JSON
+      def each(&block)
+        return to_enum(:each) unless block
+
+        read { |io| each_record(io, &block) }
+        self
+      end
+
+      # Enumerates the lines unparsed, in batches, for {Mongory::CMatcher#filter_json} and
+      # {Mongory::CMatcher#count_json} to match without building a Hash per line.
+      #
+      # @param size [Integer] the lines per batch
+      # @yieldparam lines [Array<String>] the non-blank lines of one batch
+      # @return [Enumerator, NdjsonStream]
+      # @raise [Mongory::Error] with the line number, if the block rejects a line that is not valid JSON
+      def each_line_batch(size, &block)
+        return to_enum(:each_line_batch, size) unless block
+
+        read { |io| each_lines(io, size, &block) }
+        self
+      end
+
+      # Parses lines read by {#each_line_batch}.
+      #
+      # @param lines [Array<String>]
+      # @return [Array<Object>]
+      def parse(lines)
+        lines.map { |line| ::JSON.parse(line) }
+      end
+
+      private
+
+      # @private
+      # Yields the IO to read: a path is opened, an IO is rewound when enumerated again.
+      #
+      # @yieldparam io [#each_line]
+      # @return [void]
+      def read(&block)
+        return ::File.open(@source, &block) if @source.is_a?(::String)
+
+        rewind if @enumerated
+        @enumerated = true
+        yield @source
+      end
+
+      # @private
+      # @param io [#each_line]
+      # @yieldparam record [Object]
+      # @return [void]
+      def each_record(io)
+        io.each_line.with_index(1) do |line, lineno|
+          next if line.strip.empty?
+
+          yield parse_line(line, lineno)
+        end
+      end
+
+      # @private
+      # @param io [#each_line]
+      # @param size [Integer]
+      # @yieldparam lines [Array<String>]
+      # @return [void]
+      def each_lines(io, size, &block)
+        lines = []
+        linenos = []
+        io.each_line.with_index(1) do |line, lineno|
+          next if line.strip.empty?
+
+          lines << line
+          linenos << lineno
+          next if lines.size < size
+
+          yield_lines(lines, linenos, &block)
+          lines = []
+          linenos = []
+        end
+        yield_lines(lines, linenos, &block) unless lines.empty?
+      end
+
+      # @private
+      # Yields a batch of lines. The C matcher only reports that a document is invalid,
+      # so the batch is parsed again to find the line number.
+      #
+      # @param lines [Array<String>]
+      # @param linenos [Array<Integer>] the line number of every line
+      # @yieldparam lines [Array<String>]
+      # @return [void]
+      def yield_lines(lines, linenos)
+        yield lines
+      rescue Mongory::Error
+        lines.each_with_index { |line, i| parse_line(line, linenos[i]) }
+        raise
+      end
+
+      # @private
+      # @param line [String]
+      # @param lineno [Integer]
+      # @return [Object]
+      # @raise [Mongory::Error] if the line is not valid JSON
+      def parse_line(line, lineno)
+        ::JSON.parse(line)
+      rescue ::JSON::ParserError => e
+        raise Mongory::Error, "invalid JSON at line #{lineno}: #{e.message}"
+      end
+
+      # @private
+      # Rewinds the IO before enumerating it again, pipes stay where they are.
+      #
+      # @return [void]
+      def rewind
+        @source.rewind if @source.respond_to?(:rewind)
+      rescue ::Errno::ESPIPE
+        nil
+      end
+    end
+  end
+end
@@ -0,0 +1,181 @@
+# frozen_string_literal: true
+
+module Mongory
+  module Utils
+    # RelationStream reads an ORM relation batch by batch for {Mongory::CQueryBuilder}.
+    #
+    # When every field a condition reads is a stored column, the stream plucks only those
+    # columns (and the primary key) as raw attribute Hashes, so the C matcher filters them
+    # without instantiating a model per record; only the matching records are loaded.
+    # Otherwise it still streams models in batches instead of loading the whole relation.
+    #
+    # Streams are built for unloaded ActiveRecord relations without an explicit order, offset,
+    # limit, grouping or distinct, read in primary key order, and for Mongoid criteria without
+    # sort, skip or limit. Any other relation is iterated as it is.
+    #
+    # @example
+    #   User.where(active: true).mongory.c.where(:age.gte => 18).count # plucks `id` and `age`
+    #   User.all.mongory.c.with_context(batch_size: 5000).where(name: /smith/i).to_a
+    #
+    # @abstract
+    # @see Mongory::Converters::FieldCollector
+    class RelationStream
+      # Records read per batch unless the `batch_size` context config is given
+      # @return [Integer]
+      DEFAULT_BATCH_SIZE = 1000
+
+      # Builds a stream for an ORM relation.
+      #
+      # @param records [Object] the records of a query
+      # @param fields [Array<String>, nil] the fields the query reads, nil when whole records are needed
+      # @param batch_size [Integer, nil]
+      # @return [RelationStream, nil] nil when the records are not a streamable relation
+      def self.for(records, fields, batch_size: nil)
+        stream_class = if defined?(::Mongoid::Criteria) && records.is_a?(::Mongoid::Criteria)
+                         MongoidStream
+                       elsif records.respond_to?(:in_batches) && records.respond_to?(:pluck)
+                         ActiveRecordStream
+                       end
+        return unless stream_class&.streamable?(records)
+
+        stream_class.new(records, fields, batch_size || DEFAULT_BATCH_SIZE)
+      end
+
+      # @return [Array<String>, nil] the loaded columns, the primary key first, nil when rows are unavailable
+      attr_reader :columns
+
+      # @param relation [Object] the relation to read
+      # @param fields [Array<String>, nil] the fields the query reads
+      # @param batch_size [Integer]
+      def initialize(relation, fields, batch_size)
+        @relation = relation
+        @batch_size = batch_size
+        @columns = resolve_columns(fields)
+      end
+
+      # @return [Boolean] whether {#each_batch} can read raw attribute rows
+      def rows?
+        !@columns.nil?
+      end
+
+      # Loads the records of matched rows.
+      #
+      # @param rows [Array<Hash>] rows yielded by {#each_batch}
+      # @return [Array<Object>] the records, in the order of the rows
+      def load(rows)
+        return [] if rows.empty?
+
+        key = @columns.first
+        records = find_records(rows.map { |row| row[key] }).to_h { |record| [record[key], record] }
+        rows.map { |row| records[row[key]] }.compact
+      end
+
+      private
+
+      # @private
+      # @param fields [Array<String>, nil]
+      # @param stored [Array<String>] the stored field names
+      # @param primary_key [Object]
+      # @return [Array<String>, nil]
+      def build_columns(fields, stored, primary_key)
+        return unless fields && primary_key.is_a?(String) && (fields - stored).empty?
+
+        [primary_key, *(fields - [primary_key])]
+      end
+    end
+
+    # ActiveRecord relations, read with `in_batches` and `pluck`
+    class ActiveRecordStream < RelationStream
+      # @param relation [ActiveRecord::Relation]
+      # @return [Boolean]
+      def self.streamable?(relation)
+        return false if relation.loaded? || relation.offset_value || relation.limit_value || relation.distinct_value
+
+        relation.order_values.empty? && relation.group_values.empty? && relation.having_clause.empty?
+      end
+
+      # @yieldparam rows [Array<Hash{String => Object}>] the plucked columns of one batch
+      # @return [void]
+      def each_batch
+        @relation.in_batches(of: @batch_size) do |batch|
+          values = batch.pluck(*@columns)
+          values = values.map { |value| [value] } if @columns.size == 1
+          yield values.map { |row| @columns.zip(row).to_h }
+        end
+      end
+
+      # @yieldparam record [ActiveRecord::Base]
+      # @return [void]
+      def each_record(&block)
+        @relation.find_each(batch_size: @batch_size, &block)
+      end
+
+      private
+
+      # @private
+      # @param fields [Array<String>, nil]
+      # @return [Array<String>, nil]
+      def resolve_columns(fields)
+        model = @relation.klass
+        build_columns(fields, model.column_names, model.primary_key)
+      end
+
+      # @private
+      # @param keys [Array<Object>] primary keys
+      # @return [Array<ActiveRecord::Base>]
+      def find_records(keys)
+        @relation.unscope(:offset, :limit).where(@columns.first => keys).to_a
+      end
+    end
+
+    # Mongoid criteria, read as raw documents projected to the fields and demongoized by the field types
+    class MongoidStream < RelationStream
+      # @param criteria [Mongoid::Criteria]
+      # @return [Boolean]
+      def self.streamable?(criteria)
+        (criteria.options.keys.map(&:to_sym) & %i(sort skip limit)).empty?
+      end
+
+      # @yieldparam rows [Array<Hash{String => Object}>] the projected fields of one batch, as the model reads them
+      # @return [void]
+      def each_batch
+        projection = @columns.to_h { |column| [column, 1] }
+        view = @relation.collection.find(@relation.selector, projection: projection).batch_size(@batch_size)
+        view.each_slice(@batch_size) { |documents| yield documents.map { |document| demongoize(document) } }
+      end
+
+      # @yieldparam record [Mongoid::Document]
+      # @return [void]
+      def each_record(&block)
+        @relation.batch_size(@batch_size).each(&block)
+      end
+
+      private
+
+      # @private
+      # @param fields [Array<String>, nil]
+      # @return [Array<String>, nil]
+      def resolve_columns(fields)
+        build_columns(fields, @relation.klass.fields.keys, '_id')
+      end
+
+      # @private
+      # Raw BSON values differ from the model's (a Date field is stored as a UTC Time), so each
+      # projected value goes through its field's `demongoize` before the matcher sees it.
+      #
+      # @param document [BSON::Document]
+      # @return [Hash{String => Object}]
+      def demongoize(document)
+        fields = @relation.klass.fields
+        document.to_h { |name, value| [name, fields.key?(name) ? fields[name].demongoize(value) : value] }
+      end
+
+      # @private
+      # @param keys [Array<BSON::ObjectId>] document ids
+      # @return [Array<Mongoid::Document>]
+      def find_records(keys)
+        @relation.in(_id: keys).to_a
+      end
+    end
+  end
+end
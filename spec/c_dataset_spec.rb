@@ -0,0 +1,236 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+class WithinMatcher < Mongory::Matchers::AbstractMatcher
+  class << self
+    attr_accessor :matches, :batches, :batch_values
+  end
+
+  def match(subject)
+    self.class.matches += 1
+    subject.is_a?(Numeric) && subject.abs <= @condition
+  end
+
+  def match_batch?(values)
+    self.class.batches += 1
+    self.class.batch_values += values.size
+    raise 'batch failure' if values.include?(-1)
+
+    values.map { |value| value.is_a?(Numeric) && value.abs <= @condition }
+  end
+end
+
+Mongory::Matchers.register(:within, '$within', WithinMatcher)
+
+RSpec.describe Mongory::CDataset, type: :model do
+  subject { described_class.new(records) }
+
+  let(:records) do
+    [
+      { 'name' => 'Jack', 'age' => 18, 'profile' => { 'city' => 'Taipei' } },
+      { 'name' => 'Jill', 'age' => 15, 'profile' => { 'city' => 'Tokyo' } },
+      { name: 'Bob', age: 21, profile: { city: 'Taipei' }, born: Date.new(2000, 1, 1) },
+      { 'name' => 'Tom' }
+    ]
+  end
+
+  let(:adult) { Mongory::CMatcher.new({ :age.gte => 18 }) }
+  let(:taipei) { Mongory::CMatcher.new({ 'profile.city' => 'Taipei' }) }
+
+  describe 'scanning' do
+    it { expect(adult.filter(subject)).to eq(adult.filter(records)) }
+    it { expect(adult.count(subject)).to eq(2) }
+    it { expect(adult.first(subject)).to equal(records[0]) }
+    it { expect(adult.match_indices(subject, offset: 1)).to eq([2]) }
+    it { expect(taipei.filter(subject)).to eq([records[0], records[2]]) }
+    it { expect(Mongory::CMatcher.new({ born: '2000-01-01' }).filter(subject)).to eq([records[2]]) }
+    it { expect(adult.filter(described_class.new([]))).to eq([]) }
+  end
+
+  describe 'projection' do
+    subject { described_class.new(records, fields: %w(age profile.city)) }
+
+    it { expect(subject.fields).to eq(%w(age profile.city)) }
+    it { expect(adult.filter(subject)).to eq([records[0], records[2]]) }
+    it { expect(taipei.count(subject)).to eq(2) }
+    it { expect(Mongory::CMatcher.new({ name: 'Jack' }).count(subject)).to eq(0) }
+    it { expect(Mongory::CMatcher.new({ age: { '$exists' => false } }).filter(subject)).to eq([records[3]]) }
+  end
+
+  describe 'column kernels' do
+    subject { described_class.new(mixed) }
+
+    let(:mixed) do
+      [
+        { 'age' => 18, 'score' => 1.5, 'vip' => true },
+        { 'age' => 17.5, 'score' => 3, 'vip' => false },
+        { age: 30, score: nil, vip: 1 },
+        { 'age' => [10, 20], 'score' => 'high' },
+        { 'age' => '40', 'profile' => nil },
+        { 'profile' => { 'level' => 3 } },
+        {}
+      ]
+    end
+
+    [
+      { :age.gte => 18 },
+      { :age.ne => 18 },
+      { 'age' => 17.5, 'vip' => false },
+      { 'vip' => { '$ne' => true } },
+      { 'profile.level' => { '$gt' => 2 } },
+      { '$or' => [{ :age.lt => 18 }, { :score.gte => 2 }] },
+      { '$or' => [{ :age.lt => 18 }, { :age.gte => 25 }] }
+    ].each do |condition|
+      it "matches #{condition.inspect} like the record path" do
+        matcher = Mongory::CMatcher.new(condition)
+
+        expect(matcher.column_plan).not_to be_nil
+        expect(matcher.filter(subject)).to eq(matcher.filter(mixed))
+        expect(matcher.count(subject, offset: 1)).to eq([matcher.count(mixed) - 1, 0].max)
+      end
+    end
+  end
+
+  describe 'batch custom matchers' do
+    subject { described_class.new(large) }
+
+    let(:large) do
+      Array.new(2500) do |i|
+        case i % 10
+        when 0 then { 'dist' => [i % 7] }
+        when 1 then { 'age' => 30 }
+        else { 'dist' => i % 9, 'age' => i % 40 }
+        end
+      end
+    end
+
+    before do
+      WithinMatcher.matches = 0
+      WithinMatcher.batches = 0
+      WithinMatcher.batch_values = 0
+    end
+
+    it 'calls match_batch? once per chunk and match? only for rows it cannot take' do
+      matcher = Mongory::CMatcher.new({ 'dist' => { '$within' => 4 } })
+      expected = large.select(&Mongory::QueryMatcher.new({ 'dist' => { '$within' => 4 } }))
+      WithinMatcher.matches = 0
+
+      filtered = nil
+
+      expect(matcher.column_plan).to eq([:batch, ['dist'], '$within', 4])
+      expect { filtered = matcher.filter(subject, threads: 4) }.to output(/match_batch\?/).to_stderr
+      expect(filtered).to eq(expected)
+      expect(WithinMatcher.batches).to eq(3)
+      expect(WithinMatcher.batch_values).to eq(2000)
+      expect(WithinMatcher.matches).to be <= 500
+    end
+
+    it 'only passes the rows the column kernels leave open' do
+      matcher = Mongory::CMatcher.new({ :age.gte => 30, 'dist' => { '$within' => 4 } })
+
+      expect(matcher.filter(subject)).to eq(matcher.filter(large))
+      open_rows = large.count { |record| record['dist'].is_a?(Integer) && record['age'].to_i >= 30 }
+      expect(WithinMatcher.batch_values).to eq(open_rows)
+    end
+
+    it 'matches the chunk row by row when match_batch? raises' do
+      rows = [{ 'dist' => -1 }, { 'dist' => 3 }, { 'dist' => 9 }]
+      matcher = Mongory::CMatcher.new({ 'dist' => { '$within' => 4 } })
+
+      expect(matcher.filter(described_class.new(rows))).to eq(rows.first(2))
+      expect(WithinMatcher.batches).to eq(1)
+    end
+  end
+
+  describe 'parallel scanning' do
+    subject { described_class.new(large) }
+
+    let(:large) do
+      Array.new(5000) do |i|
+        i % 7 == 0 ? { 'age' => i.to_s } : { 'age' => i % 60, 'vip' => i.even? }
+      end
+    end
+
+    let(:matcher) { Mongory::CMatcher.new({ :age.gte => 18, 'vip' => true }) }
+
+    it { expect(matcher.filter(subject, threads: 4)).to eq(matcher.filter(large)) }
+    it { expect(matcher.count(subject, threads: 3)).to eq(matcher.count(large)) }
+    it 'keeps the offset / limit window in record order' do
+      expected = matcher.match_indices(large).drop(3).first(5)
+      expect(matcher.match_indices(subject, threads: 4, offset: 3, limit: 5)).to eq(expected)
+    end
+    it { expect { matcher.filter(large, threads: 4) }.to output(/ignored for an Array/).to_stderr }
+    it { expect { Mongory::CMatcher.new({ name: 'Jack' }).count(subject, threads: 2) }.to output(/no column plan/).to_stderr }
+    it { expect { matcher.filter(subject, threads: 0) }.to raise_error(ArgumentError) }
+
+    it 'reuses the pool threads across scans' do
+      2.times { matcher.filter(subject, threads: 4) }
+
+      expect(Thread.list.count { |thread| thread.name == 'mongory-scan' }).to eq(3)
+    end
+  end
+
+  describe '#invalidate' do
+    before { subject.invalidate }
+
+    it { is_expected.not_to be_valid }
+    it { expect { adult.filter(subject) }.to raise_error(Mongory::Error, /invalidated/) }
+
+    it 'is scannable again after rebuild' do
+      expect(adult.count(subject.rebuild)).to eq(2)
+    end
+  end
+
+  describe '#rebuild' do
+    it 'sees records mutated before the rebuild' do
+      dataset = subject
+      records[1]['age'] = 30
+      expect(adult.count(dataset)).to eq(2)
+      expect(adult.count(dataset.rebuild(records))).to eq(3)
+    end
+
+    it 'refuses to run while the dataset is being scanned' do
+      dataset = subject
+      errors = []
+      probe = Class.new(Mongory::Matchers::AbstractMatcher) do
+        define_method(:match) do |_record|
+          dataset.rebuild
+        rescue Mongory::Error => e
+          errors << e.message
+          false
+        end
+      end
+      Mongory::Matchers.register(:rebuild_probe, '$rebuildProbe', probe)
+
+      expect(Mongory::CMatcher.new({ '$rebuildProbe' => true }).count(dataset)).to eq(0)
+      expect(errors).to eq(['dataset is being scanned'] * records.size)
+      expect(dataset.rebuild).to be_valid
+    end
+  end
+
+  describe 'GC integration' do
+    before { require 'objspace' }
+
+    it { expect(ObjectSpace.memsize_of(described_class.new(records * 500))).to be > ObjectSpace.memsize_of(subject) }
+
+    it 'scans after the heap is compacted', if: GC.respond_to?(:verify_compaction_references) do
+      GC.verify_compaction_references(expand_heap: true, toward: :empty)
+
+      expect(Mongory::CMatcher.new({ :age.gte => 18 }).filter(subject).to_a).to eq([records[0], records[2]])
+    end
+  end
+
+  describe 'Enumerable' do
+    it { expect(subject.to_a).to eq(records) }
+    it { expect(subject.size).to eq(4) }
+    it { expect(subject.map { |record| record['name'] }.compact).to eq(%w(Jack Jill Tom)) }
+  end
+
+  describe '#mongory' do
+    it { expect(subject.mongory.c.where(:age.gte => 18).to_a).to eq([records[0], records[2]]) }
+    it { expect(subject.mongory.c.where(:age.gte => 18).limit(1).to_a).to eq([records[0]]) }
+    it { expect(subject.mongory.c.where(:age.gte => 18).count).to eq(2) }
+    it { expect(subject.mongory.where(:age.gte => 18).to_a).to eq([records[0], records[2]]) }
+  end
+end
@@ -0,0 +1,54 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+RSpec.describe Mongory::CGrouping, type: :model do
+  let(:orders) do
+    [
+      { 'status' => 'paid', 'currency' => 'EUR', 'total' => 10 },
+      { 'status' => 'pending', 'currency' => 'EUR', 'total' => 2.5 },
+      { 'status' => 'paid', 'currency' => 'USD', 'total' => 30 },
+      { 'status' => 'paid', 'currency' => 'EUR', 'total' => 'n/a' },
+      { status: 'void', currency: 'USD' },
+      { 'currency' => 'EUR', 'total' => 4 }
+    ]
+  end
+  let(:query) { orders.mongory.c.where(:currency.in => %w(EUR USD)) }
+
+  it { expect(query.group(:status).count).to eq('paid' => 3, 'pending' => 1, 'void' => 1, nil => 1) }
+  it { expect(query.group(:status).sum(:total)).to eq('paid' => 40, 'pending' => 2.5, 'void' => 0, nil => 4) }
+  it { expect(query.group(:status).avg(:total)).to eq('paid' => 20.0, 'pending' => 2.5, 'void' => nil, nil => 4.0) }
+  it { expect(query.group(:status).min(:total)).to include('paid' => 10, 'void' => nil) }
+  it { expect(query.group(:status).max(:total)).to include('paid' => 30, 'pending' => 2.5) }
+  it { expect(query.where(status: 'paid').group(:status, :currency).count).to eq(%w(paid EUR) => 2, %w(paid USD) => 1) }
+  it { expect(query.limit(2).group(:currency).count).to eq('EUR' => 2) }
+
+  it 'groups 1 and 1.0 together, keyed by the first match' do
+    records = [{ 'n' => 1 }, { 'n' => 1.0 }, { 'n' => 1.5 }]
+
+    expect(records.mongory.c.group(:n).count).to eq(1 => 2, 1.5 => 1)
+  end
+
+  it 'merges the groups of lazy records batch by batch' do
+    lazy = Mongory::CQueryBuilder.new(orders.lazy).with_context(batch_size: 2).where(:currency.in => %w(EUR USD))
+
+    expect(lazy.group(:status).sum(:total)).to eq(query.group(:status).sum(:total))
+  end
+
+  it 'merges equal keys of different types from different batches' do
+    records = [{ 'n' => 1, 's' => :paid }, { 'n' => 2, 's' => 'paid' }, { 'n' => 1.0, 's' => 'paid' }]
+    lazy = Mongory::CQueryBuilder.new(records.lazy).with_context(batch_size: 1)
+
+    expect(lazy.group(:n).count).to eq(1 => 2, 2 => 1)
+    expect(lazy.group(:s).count.transform_keys(&:to_s)).to eq('paid' => 3)
+    expect(lazy.group(:n, :s).count.map { |(n, s), count| [n, s.to_s, count] }).to eq([[1, 'paid', 2], [2, 'paid', 1]])
+  end
+
+  it 'switches an overflowing Integer sum to Float' do
+    records = [{ 'n' => 2**62 }, { 'n' => 2**62 }]
+
+    expect(records.mongory.c.group(:missing).sum(:n)).to eq(nil => 2.0**63)
+  end
+
+  it { expect { query.group }.to raise_error(ArgumentError) }
+end
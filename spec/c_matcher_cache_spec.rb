@@ -0,0 +1,133 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+# Checks the value against the record the context is matching, letting other threads run first
+class CurrentRecordMatcher < Mongory::Matchers::AbstractMatcher
+  def match(subject)
+    Thread.pass
+    @context.current_record['id'] == subject
+  end
+end
+
+RSpec.describe Mongory::CMatcherCache, type: :model do
+  subject { described_class.new(max_size: 2) }
+
+  let(:records) do
+    [
+      { 'name' => 'Jack', 'age' => 18 },
+      { 'name' => 'Jill', 'age' => 15 },
+      { name: 'Bob', age: 21 }
+    ]
+  end
+
+  describe '#fetch' do
+    it 'returns the same matcher for an equivalent condition' do
+      matcher = subject.fetch({ age: { '$gte' => 18 }, name: 'Jack' })
+
+      expect(subject.fetch({ 'name' => 'Jack', 'age' => { '$gte' => 18 } })).to equal(matcher)
+      expect(matcher.filter(records)).to eq([records[0]])
+      expect(subject.stats).to include(hits: 1, misses: 1, size: 1)
+    end
+
+    it 'keys by context config' do
+      matcher = subject.fetch({ age: 18 })
+      context = Mongory::Utils::Context.new(strict: true)
+
+      expect(subject.fetch({ age: 18 }, context: context)).not_to equal(matcher)
+    end
+
+    it 'is not affected by later changes to the condition' do
+      condition = { 'name' => 'Jack' }
+      matcher = subject.fetch(condition)
+      condition['name'] = 'Jill'
+
+      expect(subject.fetch(condition)).not_to equal(matcher)
+      expect(subject.fetch({ 'name' => 'Jack' })).to equal(matcher)
+    end
+
+    it 'evicts the least recently used matcher' do
+      first = subject.fetch({ age: 1 })
+      subject.fetch({ age: 2 })
+      subject.fetch({ age: 1 })
+      subject.fetch({ age: 3 })
+
+      expect(subject.fetch({ age: 1 })).to equal(first)
+      expect(subject.stats).to include(evictions: 1, size: 2)
+    end
+  end
+
+  describe 'byte bound' do
+    subject { described_class.new(max_bytes: 1500) }
+
+    it 'evicts until the estimated bytes fit' do
+      subject.fetch({ age: 1 })
+      subject.fetch({ name: 'x' * 600 })
+
+      expect(subject.size).to eq(1)
+      expect(subject.bytes).to be > 1500
+      expect(subject.stats[:evictions]).to eq(1)
+    end
+  end
+
+  describe '#clear' do
+    it 'drops the matchers and keeps the counters' do
+      subject.fetch({ age: 1 })
+      subject.clear
+
+      expect(subject.stats).to eq(hits: 0, misses: 1, evictions: 0, size: 0, bytes: 0)
+    end
+  end
+
+  describe 'CQueryBuilder' do
+    around do |example|
+      Mongory::CMatcher.cache = subject
+      example.run
+    ensure
+      Mongory::CMatcher.cache = nil
+    end
+
+    it 'reuses cached matchers' do
+      expect(records.mongory.c.where(:age.gte => 18).to_a).to eq([records[0], records[2]])
+      misses = subject.stats[:misses]
+
+      expect(records.mongory.c.where(:age.gte => 18).to_a).to eq([records[0], records[2]])
+      expect(subject.stats[:misses]).to eq(misses)
+    end
+
+    context 'when threads share a cached matcher' do
+      let(:rows) { Array.new(200) { |i| { 'id' => i, 'age' => i % 90 } } }
+
+      before(:all) { Mongory::Matchers.register(:current_record, '$currentRecord', CurrentRecordMatcher) }
+
+      after(:all) { unregister_matcher(:current_record, '$currentRecord') }
+
+      it 'gives every thread the record it is matching' do
+        threads = Array.new(4) do |i|
+          Thread.new do
+            Array.new(3) do
+              query = rows.mongory.c.where(id: { '$currentRecord' => true })
+              i.even? ? query.count : query.to_a.size
+            end
+          end
+        end
+
+        expect(threads.flat_map(&:value).uniq).to eq([rows.size])
+        expect(subject.stats[:size]).to eq(1)
+      end
+
+      it 'traces and profiles on a matcher of their own' do
+        query = rows.mongory.c.where(:age.gte => 80)
+        cached = query.instance_variable_get(:@matcher)
+        expect(cached).not_to receive(:enable_trace)
+        expect(cached).not_to receive(:profile)
+
+        expect { expect(query.trace.count).to eq(20) }.to output.to_stdout
+        expect(query.profile).to be_a(Hash)
+        expect(cached.filter(rows).size).to eq(20)
+      end
+    end
+  end
+
+  it { expect { described_class.new(max_size: 0) }.to raise_error(ArgumentError) }
+end
@@ -3,10 +3,669 @@
 require 'spec_helper'
 require_relative 'shared_matcher_spec'
 
+# Lets other threads, or other fibers, run in the middle of a match
+class YieldingMatcher < Mongory::Matchers::AbstractMatcher
+  class << self
+    attr_accessor :fibers
+  end
+
+  def match(_subject)
+    self.class.fibers ? Fiber.yield : Thread.pass
+    true
+  end
+end
+
+# Matches its value by matching another record with the outer matcher
+class NestedMatcher < Mongory::Matchers::AbstractMatcher
+  class << self
+    attr_accessor :outer
+  end
+
+  def match(subject)
+    subject == 'inner' || self.class.outer.match?({ 'name' => 'inner', 'age' => 50 })
+  end
+end
+
 RSpec.describe Mongory::CMatcher, type: :model do
   describe '#match?' do
     subject { described_class.new(condition) }
 
     it_behaves_like 'matcher behavior'
   end
+
+  describe 'batch matching' do
+    subject { described_class.new({ :age.gte => 18 }) }
+
+    let(:records) do
+      [
+        { 'name' => 'Jack', 'age' => 18 },
+        { 'name' => 'Jill', 'age' => 15 },
+        { name: 'Bob', age: 21 },
+        { 'name' => 'Tom' }
+      ]
+    end
+
+    describe '#filter' do
+      it { expect(subject.filter(records)).to eq([records[0], records[2]]) }
+      it { expect(subject.filter([])).to eq([]) }
+      it { expect { subject.filter(nil) }.to raise_error(TypeError) }
+    end
+
+    describe '#count' do
+      it { expect(subject.count(records)).to eq(2) }
+    end
+
+    describe '#first' do
+      it { expect(subject.first(records)).to eq(records[0]) }
+      it { expect(subject.first(records, 1)).to eq([records[0]]) }
+      it { expect(subject.first(records, 5)).to eq([records[0], records[2]]) }
+      it { expect(subject.first(records, 0)).to eq([]) }
+      it { expect(subject.first(records.last(1))).to be_nil }
+    end
+
+    describe '#match_indices' do
+      it { expect(subject.match_indices(records)).to eq([0, 2]) }
+    end
+
+    it 'tracks the current record on the context' do
+      context = Mongory::Utils::Context.new
+      matcher = described_class.new({ :age.gte => 18 }, context: context)
+      matcher.filter(records)
+      expect(context.current_record).to eq(records.last)
+    end
+  end
+
+  describe 'field key lookup' do
+    subject { described_class.new({ 'profile.address.city' => 'Taipei', 'profile.age' => 30 }) }
+
+    let(:records) do
+      [
+        { 'profile' => { 'address' => { 'city' => 'Taipei' }, 'age' => 30 } },
+        { profile: { address: { city: 'Taipei' }, age: 30 } },
+        { 'profile' => { address: { 'city' => 'Taipei' }, 'age' => 30 } },
+        { profile: { 'address' => { city: 'Tainan' }, age: 30 } },
+        { 'profile' => { 'age' => 30 } }
+      ]
+    end
+
+    it 'resolves nested paths with mixed String and Symbol keys' do
+      expect(subject.match_indices(records)).to eq([0, 1, 2])
+    end
+
+    it 'does not reuse lookups across records' do
+      record = { 'profile' => { 'address' => { 'city' => 'Taipei' }, 'age' => 30 } }
+      expect(subject.match?(record)).to be true
+      record['profile']['address']['city'] = 'Tainan'
+      expect(subject.match?(record)).to be false
+    end
+  end
+
+  describe 'native_regex' do
+    let(:messages) do
+      [
+        { 'message' => 'GET /users 200' },
+        { 'message' => "boot\nGET /health 200" },
+        { 'message' => 'POST /users 201' },
+        { 'message' => 'café GET /menu 200' },
+        { 'message' => 'get /users 200' },
+        { 'message' => nil }
+      ]
+    end
+
+    [
+      /GET/, /^GET/, /\AGET/, /200\z/, /20\d$/, /get/i, /caf./, '^POST', 'users 20[01]'
+    ].each do |pattern|
+      it "matches #{pattern.inspect} like Regexp#match?" do
+        ruby = described_class.new({ message: { '$regex' => pattern } })
+        native = described_class.new({ message: { '$regex' => pattern } }, native_regex: true)
+
+        expect(native.match_indices(messages)).to eq(ruby.match_indices(messages))
+      end
+    end
+
+    it 'keeps the String pattern in the condition' do
+      matcher = described_class.new({ message: { '$regex' => '^GET' } }, native_regex: true)
+      expect(matcher.condition).to eq('message' => { '$regex' => '^GET' })
+    end
+
+    it 'leaves strings of other encodings to Regexp#match?' do
+      matcher = described_class.new({ message: /GET/ }, native_regex: true)
+      expect(matcher.match?(message: 'GET'.b)).to be true
+    end
+  end
+
+  describe 'large $in / $nin lists' do
+    let(:ids) { (1..100).map { |i| i * 3 } }
+    let(:names) { (1..100).map { |i| "user-#{i}" } }
+    let(:records) do
+      [
+        { 'id' => 3, 'name' => 'user-1' },
+        { 'id' => 4, 'name' => 'user-0' },
+        { 'id' => 300, 'name' => 'user-100' },
+        { 'id' => [1, 2, 9], 'name' => %w(x user-7) },
+        { 'id' => nil },
+        {}
+      ]
+    end
+
+    it 'matches integer ids like the Ruby engine' do
+      expect(described_class.new({ id: { '$in' => ids } }).match_indices(records)).to eq([0, 2, 3])
+      expect(described_class.new({ id: { '$nin' => ids } }).match_indices(records)).to eq([1, 4, 5])
+    end
+
+    it 'matches string values' do
+      expect(described_class.new({ name: { '$in' => names } }).match_indices(records)).to eq([0, 2, 3])
+    end
+
+    it 'keeps the original condition' do
+      expect(described_class.new({ id: { '$in' => ids } }).condition).to eq('id' => { '$in' => ids })
+    end
+
+    it 'falls back to the core $in when the list holds other types' do
+      matcher = described_class.new({ id: { '$in' => ids + [nil] } })
+      expect(matcher.match_indices(records.first(4))).to eq([0, 2, 3])
+    end
+  end
+
+  describe '$or over numeric ranges' do
+    let(:condition) do
+      { '$or' => [{ ts: { '$gte' => 0, '$lt' => 10 } }, { ts: { '$gte' => 10, '$lt' => 20 } }, { ts: { '$gt' => 30 } }] }
+    end
+    let(:records) { [-1, 0, 9.5, 10, 20, 30, 31, 2**70, nil, '15'].map { |ts| { ts: ts } } }
+
+    it 'matches like the Ruby engine' do
+      expected = records.each_index.select { |i| Mongory::QueryMatcher.new(condition).match?(records[i]) }
+      expect(described_class.new(condition).match_indices(records)).to eq(expected)
+    end
+  end
+
+  describe 'native data conversion' do
+    let(:records) do
+      [
+        { at: Time.utc(2024, 1, 1, 12), on: Date.new(2024, 1, 1), ratio: Rational(1, 3) },
+        { at: Time.new(2024, 6, 1, 8, 0, 0, '+08:00'), on: Date.new(2023, 12, 31), ratio: Rational(3, 2) },
+        { at: '2024-03-01T00:00:00Z', on: '2024-02-01', ratio: 1 },
+        { at: Time.new(12_000, 1, 1), on: nil, ratio: Rational(4, 2) }
+      ]
+    end
+    let(:fillers) { (1..20).map { |i| "filler-#{i}" } }
+
+    [
+      { :at.gte => Time.utc(2024, 1, 1), :at.lt => Time.utc(2024, 7, 1) },
+      { at: Time.new(2024, 6, 1, 8, 0, 0, '+08:00') },
+      { :on.gt => Date.new(2023, 12, 31) },
+      { :ratio.gte => 1 },
+      { ratio: Rational(3, 2) },
+      { at: /^2024-0[16]/ },
+      { on: { '$regex' => '-01$' } },
+      { '$or' => [{ :at.lt => Time.utc(2024, 2, 1) }, { :at.gte => Time.utc(2024, 5, 1) }] },
+      { '$or' => [{ :on.lt => Date.new(2024, 1, 1) }, { :on.gte => Date.new(2024, 2, 1) }] },
+      { '$or' => [{ ratio: { '$gte' => 0, '$lt' => 1 } }, { ratio: { '$gt' => 1.5 } }] }
+    ].each do |condition|
+      it "matches #{condition.inspect} like the Ruby engine" do
+        expected = records.each_index.select { |i| Mongory::QueryMatcher.new(condition).match?(records[i]) }
+        expect(described_class.new(condition).match_indices(records)).to eq(expected)
+      end
+    end
+
+    it 'matches large $in lists like the Ruby engine' do
+      [
+        { at: { '$in' => [Mongory.data_converter.convert(Time.utc(2024, 1, 1, 12)), *fillers] } },
+        { on: { '$in' => ['2024-01-01', *fillers] } },
+        { on: { '$nin' => ['2023-12-31', *fillers] } },
+        { ratio: { '$in' => [2, *(10..30)] } }
+      ].each do |condition|
+        expected = records.each_index.select { |i| Mongory::QueryMatcher.new(condition).match?(records[i]) }
+        expect(described_class.new(condition).match_indices(records)).to eq(expected), condition.inspect
+      end
+    end
+  end
+
+  describe 'raw JSON documents' do
+    let(:records) do
+      [
+        { 'name' => 'Jack', 'age' => 18, 'tags' => %w(admin ops), 'profile' => { 'city' => 'Taipei' } },
+        { 'name' => 'Jill', 'age' => 15.5, 'tags' => [], 'profile' => { 'city' => 'Tokyo' } },
+        { 'name' => 'Böb "the" builder', 'age' => 2**40, 'tags' => ['ops'] },
+        { 'name' => nil, 'active' => true, 'age' => -3 }
+      ]
+    end
+    let(:jsons) { records.map(&:to_json) }
+
+    [
+      { :age.gte => 18 },
+      { 'profile.city' => 'Taipei' },
+      { tags: 'ops' },
+      { name: /builder$/ },
+      { name: nil },
+      { active: true },
+      { tags: { '$size' => 2 } },
+      { id: { '$in' => (1..20).to_a + [18] } },
+      { age: { '$in' => (1..20).to_a } },
+      { '$or' => [{ :age.lt => 0 }, { :age.gt => 10, :age.lte => 20 }] }
+    ].each do |condition|
+      it "matches #{condition.inspect} like the records" do
+        matcher = described_class.new(condition)
+        expect(matcher.filter_json(jsons)).to eq(jsons.values_at(*matcher.match_indices(records)))
+        expect(matcher.count_json(jsons)).to eq(matcher.count(records))
+      end
+    end
+
+    it 'matches one document' do
+      expect(described_class.new({ 'profile.city' => 'Tokyo' }).match_json?(jsons[1])).to be(true)
+    end
+
+    it 'honors offset and limit' do
+      expect(described_class.new({ :age.lt => 100 }).filter_json(jsons, offset: 1, limit: 1)).to eq([jsons[1]])
+    end
+
+    it 'reads the last of duplicate keys, like JSON.parse' do
+      expect(described_class.new({ age: 2 }).match_json?('{"age": 1, "age": 2}')).to be(true)
+    end
+
+    it 'raises on invalid JSON' do
+      expect { described_class.new({ age: 1 }).filter_json(['{"age": 1,}']) }.to raise_error(Mongory::Error)
+    end
+
+    it { expect { described_class.new({ age: 1 }).filter_json([{ age: 1 }]) }.to raise_error(TypeError) }
+  end
+
+  describe '#pluck / #project' do
+    subject(:matcher) { described_class.new({ :age.gte => 18 }) }
+    let(:records) do
+      [
+        { 'name' => 'Jack', 'age' => 18, 'tags' => %w(admin ops), 'profile' => { 'city' => 'Taipei' } },
+        { 'name' => 'Jill', 'age' => 15 },
+        { name: 'Bob', age: 21, profile: { city: 'Tokyo' } }
+      ]
+    end
+
+    it { expect(matcher.pluck(records, :name)).to eq(%w(Jack Bob)) }
+    it { expect(matcher.pluck(records, :name, 'profile.city')).to eq([%w(Jack Taipei), %w(Bob Tokyo)]) }
+    it { expect(matcher.pluck(records, 'tags.0', :missing)).to eq([['admin', nil], [nil, nil]]) }
+    it { expect(matcher.pluck(records, :name, :age, offset: 1, limit: 1)).to eq([['Bob', 21]]) }
+
+    it 'projects nested Hashes without the missing fields' do
+      expect(matcher.project(records, [:name, 'profile.city'])).to eq([
+        { 'name' => 'Jack', 'profile' => { 'city' => 'Taipei' } },
+        { 'name' => 'Bob', 'profile' => { 'city' => 'Tokyo' } }
+      ])
+    end
+
+    it 'projects the records of a dataset' do
+      dataset = Mongory::CDataset.new(records)
+      expect(matcher.pluck(dataset, :name)).to eq(%w(Jack Bob))
+    end
+
+    it { expect { matcher.pluck(records) }.to raise_error(ArgumentError) }
+    it { expect { matcher.project(records, %w(profile profile.city)) }.to raise_error(ArgumentError) }
+  end
+
+  describe '#sort' do
+    subject(:matcher) { described_class.new({ :age.gte => 18 }) }
+    let(:records) do
+      [
+        { 'name' => 'Jack', 'age' => 18, 'score' => 7 },
+        { 'name' => 'Jill', 'age' => 15, 'score' => 9 },
+        { 'name' => 'Bob', 'age' => 21, 'score' => 7.5 },
+        { 'name' => 'Anna', 'age' => 30, 'score' => 7 },
+        { name: 'Dave', age: 40 }
+      ]
+    end
+
+    def names(sorted)
+      sorted.map { |record| record['name'] || record[:name] }
+    end
+
+    it { expect(names(matcher.sort(records, { score: :desc, name: :asc }))).to eq(%w(Bob Anna Jack Dave)) }
+    it { expect(names(matcher.sort(records, { 'score' => 1 }))).to eq(%w(Dave Jack Anna Bob)) }
+    it { expect(names(matcher.sort(records, { score: :desc }, limit: 2))).to eq(%w(Bob Jack)) }
+    it { expect(names(matcher.sort(records, { age: :asc }, offset: 1, limit: 2))).to eq(%w(Bob Anna)) }
+    it { expect(names(matcher.sort(Mongory::CDataset.new(records), { age: :desc }, limit: 1))).to eq(%w(Dave)) }
+
+    it 'ranks values by type like a MongoDB sort' do
+      values = [true, 'b', [1], 2.5, nil, { 'x' => 1 }, 1]
+      sorted = described_class.new({}).sort(values.map { |value| { 'v' => value } }, { v: :asc })
+      expect(sorted.map { |record| record['v'] }).to eq([nil, 1, 2.5, 'b', { 'x' => 1 }, [1], true])
+    end
+
+    it 'keeps only the top matches of a large scan' do
+      many = Array.new(5000) { |i| { 'age' => 18 + (i * 7919 % 5000) } }
+      expect(matcher.sort(many, { age: :desc }, limit: 3).map { |record| record['age'] }).to eq([5017, 5016, 5015])
+    end
+
+    it { expect { matcher.sort(records, {}) }.to raise_error(ArgumentError) }
+    it { expect { matcher.sort(records, { age: :up }) }.to raise_error(ArgumentError) }
+  end
+
+  describe '#group' do
+    subject(:matcher) { described_class.new({ :age.gte => 18 }) }
+    let(:records) do
+      [
+        { 'city' => 'Taipei', 'age' => 18 },
+        { 'city' => 'Tokyo', 'age' => 15 },
+        { city: 'Taipei', age: 21.5 },
+        { 'city' => 'Tokyo', 'age' => 30 }
+      ]
+    end
+
+    it 'accumulates every group in record order' do
+      groups = matcher.group(records, %w(city), 'age')
+
+      expect(groups.map(&:to_a)).to eq([['Taipei', 2, 2, 39.5, 18, 21.5], ['Tokyo', 1, 1, 30, 30, 30]])
+    end
+
+    it { expect(matcher.group(Mongory::CDataset.new(records), [:city]).map(&:count)).to eq([2, 1]) }
+    it { expect(matcher.group(records, [:city], offset: 1).map(&:key)).to eq(%w(Taipei Tokyo)) }
+    it { expect { matcher.group(records, []) }.to raise_error(ArgumentError) }
+  end
+
+  describe '.prepare' do
+    subject do
+      described_class.prepare({ status: described_class.slot(:status), :age.gte => described_class.slot(:age) })
+    end
+
+    let(:records) do
+      [
+        { 'status' => 'active', 'age' => 18 },
+        { 'status' => 'banned', 'age' => 30 },
+        { status: 'active', age: 40 }
+      ]
+    end
+
+    it { expect(subject.slots).to eq(%i(status age)) }
+    it { expect { subject.filter(records) }.to raise_error(Mongory::Error, /unbound/) }
+
+    it 'matches the bound values' do
+      expect(subject.bind(status: 'active', age: 20).filter(records)).to eq([records[2]])
+      expect(subject.bind('status' => 'banned', 'age' => 18).filter(records)).to eq([records[1]])
+      expect(subject.condition).to eq('status' => 'banned', 'age' => { '$gte' => 18 })
+    end
+
+    it 'refreshes the column plan on bind' do
+      matcher = described_class.prepare({ :age.lt => described_class.slot(:max) })
+      dataset = Mongory::CDataset.new(records)
+
+      expect(matcher.bind(max: 20).filter(dataset)).to eq([records[0]])
+      expect(matcher.bind(max: 35).column_plan).to eq([:lt, ['age'], 35])
+      expect(matcher.filter(dataset)).to eq(records.first(2))
+    end
+
+    it 'keeps the previous values when a bind fails' do
+      subject.bind(status: 'active', age: 20)
+
+      expect { subject.bind(status: 'active') }.to raise_error(ArgumentError, /:age/)
+      expect { subject.bind(status: 'active', age: 1, role: 'x') }.to raise_error(ArgumentError, /:role/)
+      expect { subject.bind(status: nil, age: 1) }.to raise_error(Mongory::TypeError)
+      expect(subject.count(records)).to eq(1)
+    end
+
+    it 'refuses slots under other operators' do
+      template = { tags: { '$in' => described_class.slot(:tags) } }
+      expect { described_class.prepare(template) }.to raise_error(Mongory::TypeError, /\$in/)
+    end
+
+    it { expect { described_class.new({ name: 'Bob' }).bind({}) }.to raise_error(Mongory::Error, /no slots/) }
+  end
+
+  describe '#dump / .load' do
+    let(:condition) { { :age.gte => 18, :name.regex => /^b/i, 'tags' => { '$in' => [1..3, 'x'] }, 'on' => nil } }
+    let(:records) do
+      [
+        { 'name' => 'Bob', 'age' => 20, 'tags' => %w(x y), 'on' => nil },
+        { 'name' => 'bea', 'age' => 30, 'tags' => ['x'] },
+        { 'name' => 'Ann', 'age' => 40, 'tags' => ['x'] },
+        { 'name' => 'Ben', 'age' => 10, 'tags' => [1] }
+      ]
+    end
+
+    it 'loads a matcher of the same condition' do
+      matcher = described_class.new(condition)
+      loaded = described_class.load(matcher.dump)
+
+      expect(loaded.condition).to eq(matcher.condition)
+      expect(loaded.filter(records)).to eq(records.first(2))
+    end
+
+    it 'keeps the native_regex flag' do
+      expect(described_class.load(described_class.new(condition, native_regex: true).dump)).to be_native_regex
+      expect(described_class.load(described_class.new(condition).dump)).not_to be_native_regex
+    end
+
+    it 'dumps the bound condition of a prepared matcher' do
+      matcher = described_class.prepare({ :age.gte => described_class.slot(:age) })
+
+      expect { matcher.dump }.to raise_error(Mongory::Error, /unbound/)
+      expect(described_class.load(matcher.bind(age: 30).dump).count(records)).to eq(2)
+    end
+
+    it 'refuses invalid bytes' do
+      bytes = described_class.new(condition).dump
+
+      expect(bytes.encoding).to eq(Encoding::BINARY)
+      expect { described_class.load('MGRX') }.to raise_error(Mongory::Error, /truncated/)
+      expect { described_class.load("XXXX#{bytes[4..]}") }.to raise_error(Mongory::Error, /not a matcher dump/)
+      expect { described_class.load(bytes[0...-1]) }.to raise_error(Mongory::Error, /truncated/)
+      expect { described_class.load(bytes.dup.tap { |b| b.setbyte(4, 99) }) }.to raise_error(Mongory::Error, /version/)
+    end
+
+    it 'refuses corrupt values' do
+      dump = lambda do |tag, *value|
+        payload = [9, 1, 6, 0, 1].pack('CVCCV') + 'n' + [tag].pack('C') + value.join.b
+        "MGRY\x01\x00\x00\x00".b + [payload.bytesize].pack('V') + payload
+      end
+
+      expect { described_class.load(dump.call(4, [3].pack('V'), '12x')) }.to raise_error(Mongory::Error, /invalid/)
+      expect { described_class.load(dump.call(7, [2].pack('V'), "\xFF\xFE".b)) }.to raise_error(Mongory::Error)
+      expect { described_class.load(dump.call(10, [0, 0, 1].pack('VCV'), '(')) }.to raise_error(Mongory::Error)
+    end
+
+    it 'loads mutated payload bytes or raises Mongory::Error' do
+      bytes = described_class.new(condition).dump
+      random = Random.new(20_261_015)
+
+      300.times do
+        mutated = bytes.dup
+        random.rand(1..3).times { mutated.setbyte(random.rand(12...bytes.bytesize), random.rand(256)) }
+        begin
+          expect(described_class.load(mutated)).to be_a(described_class)
+        rescue Mongory::Error
+          next
+        end
+      end
+    end
+
+    it { expect { described_class.new({ a: Object.new }).dump }.to raise_error(Mongory::TypeError) }
+  end
+
+  describe '#stats' do
+    subject { described_class.new({ name: 'Bob' }) }
+
+    it 'starts without lookups' do
+      expect(subject.stats).to eq(key_hits: 0, key_misses: 0, key_hit_rate: 0.0)
+    end
+
+    it 'predicts the key style of the previous record' do
+      subject.filter([{ name: 'Bob' }, { name: 'Jack' }, { name: 'Bob' }, { name: 'Tom' }])
+      expect(subject.stats).to include(key_hits: 3, key_misses: 1, key_hit_rate: 0.75)
+    end
+
+    it 'switches back when the record shape changes' do
+      subject.filter([{ name: 'Bob' }, { 'name' => 'Bob' }, { 'name' => 'Bob' }])
+      expect(subject.stats).to include(key_hits: 1, key_misses: 2)
+    end
+  end
+
+  describe 'sampled tracing' do
+    subject { described_class.new({ :age.gte => 5 }) }
+
+    let(:records) { Array.new(10) { |i| { 'age' => i } } }
+
+    after { subject.disable_trace }
+
+    it 'keeps the latest traces in a ring buffer' do
+      subject.enable_trace(sample: 1.0, capacity: 3)
+      expect(subject.filter(records).size).to eq(5)
+
+      traces = subject.traces
+      expect(traces.map(&:record)).to eq(records.last(3))
+      expect(traces.map(&:matched)).to all(be(true))
+      expect(traces.map(&:nanos)).to all(be_a(Integer))
+    end
+
+    it 'passes every trace to the sink' do
+      sink = []
+      subject.enable_trace(sample: 1.0, sink: ->(trace) { sink << trace })
+      records.each { |record| subject.match?(record) }
+
+      expect(sink.map(&:record)).to eq(records)
+    end
+
+    it 'traces about the sampled share of records' do
+      subject.enable_trace(sample: 0.5, capacity: 10_000)
+      subject.count(Array.new(4000) { |i| { 'age' => i } })
+
+      expect(subject.traces.size).to be_within(300).of(2000)
+    end
+
+    it 'clears the traces when disabled' do
+      subject.enable_trace(sample: 1.0)
+      subject.match?(records.first)
+      subject.disable_trace
+
+      expect(subject.traces).to be_empty
+    end
+
+    it { expect { subject.enable_trace(sample: 0) }.to raise_error(ArgumentError) }
+    it { expect { subject.enable_trace(sink: $stdout) }.to raise_error(ArgumentError) }
+    it { expect { subject.enable_trace(sample: 0.1, sink: 1) }.to raise_error(ArgumentError) }
+  end
+
+  describe '#profile' do
+    subject { described_class.new({ '$or' => [{ name: /smith/i }, { age: { '$gt' => 20, '$lt' => 40 } }] }) }
+
+    let(:records) { Array.new(10) { |i| { 'name' => i.even? ? 'Smith' : 'Bob', 'age' => i * 5 } } }
+
+    it 'counts every node of the condition in short-circuit order' do
+      profile = subject.profile { subject.filter(records) }
+
+      expect(profile).to include(evals: 10, matches: 7)
+      expect(profile[:children].map { |node| node.values_at(:evals, :matches) }).to eq([[10, 5], [5, 2]])
+      expect(profile[:children].last[:children].map { |node| node.values_at(:evals, :matches) }).to eq([[5, 3], [3, 2]])
+      expect(profile[:children].map { |node| node[:nanos] }).to all(be_an(Integer))
+    end
+
+    it 'profiles every record of a dataset' do
+      matcher = described_class.new({ age: { '$gte' => 20 } })
+      profile = matcher.profile { matcher.count(Mongory::CDataset.new(records)) }
+
+      expect(profile).to include(evals: 10, matches: 6, children: [])
+    end
+
+    it 'stops counting after the block' do
+      subject.profile { subject.filter(records) }
+
+      expect(subject.filter(records).size).to eq(7)
+      expect(subject.profile { nil }).to include(evals: 0, matches: 0)
+    end
+  end
+
+  describe '#memory_stats' do
+    it 'trims the scratch memory after a large record' do
+      matcher = described_class.new({ tags: 'x' })
+      matcher.match?({ 'tags' => Array.new(100_000) { |i| "t#{i}" } })
+      stats = matcher.memory_stats
+
+      expect(stats[:peak_bytes]).to be > stats[:retained_bytes]
+      expect(stats[:reserved_bytes]).to be <= stats[:retained_bytes]
+      expect(stats[:in_use_bytes]).to eq(0)
+    end
+
+    it 'uses the retained size set when the matcher is built' do
+      retained = described_class.scratch_retained_bytes
+      described_class.scratch_retained_bytes = 1024
+      expect(described_class.new({ name: 'Bob' }).memory_stats[:retained_bytes]).to eq(1024)
+    ensure
+      described_class.scratch_retained_bytes = retained
+    end
+
+    it { expect { described_class.scratch_retained_bytes = -1 }.to raise_error(ArgumentError) }
+  end
+
+  describe 'concurrent matching' do
+    subject(:matcher) { described_class.new({ :age.gte => 30, 'name' => { '$yielding' => true } }) }
+    let(:records) { Array.new(200) { |i| { 'name' => "user#{i}", 'age' => i % 90 } } }
+    let(:expected) { records.count { |record| record['age'] >= 30 } }
+
+    before(:all) do
+      Mongory::Matchers.register(:yielding, '$yielding', YieldingMatcher)
+      Mongory::Matchers.register(:nested, '$nested', NestedMatcher)
+    end
+
+    after(:all) do
+      unregister_matcher(:yielding, '$yielding')
+      unregister_matcher(:nested, '$nested')
+    end
+
+    it 'shares one matcher between threads' do
+      threads = Array.new(6) do |i|
+        Thread.new { Array.new(5) { i.even? ? records.count { |r| matcher.match?(r) } : matcher.filter(records).size } }
+      end
+      counts = threads.flat_map(&:value)
+
+      expect(counts.uniq).to eq([expected])
+      expect(matcher.memory_stats[:scratches]).to be_between(1, 6)
+    end
+
+    it 'matches interleaved fibers with a scratch each' do
+      YieldingMatcher.fibers = true
+      fibers = Array.new(3) { Fiber.new { records.count { |record| matcher.match?(record) } } }
+      counts = []
+      fibers.each_with_index { |fiber, i| counts[i] = fiber.resume if fiber.alive? } while fibers.any?(&:alive?)
+
+      expect(counts).to eq([expected] * 3)
+      expect(matcher.memory_stats[:scratches]).to eq(3)
+    ensure
+      YieldingMatcher.fibers = nil
+    end
+
+    it 'gives a nested match of the same fiber a scratch of its own' do
+      matcher = described_class.new({ :age.gte => 18, 'name' => { '$nested' => true } })
+      NestedMatcher.outer = matcher
+      plucked = records[18, 22].map { |record| record.values_at('name', 'age') }
+
+      expect(matcher.pluck(records.first(40), :name, :age)).to eq(plucked)
+      expect(matcher.memory_stats[:scratches]).to eq(2)
+    ensure
+      NestedMatcher.outer = nil
+    end
+
+    it 'reuses the scratch left by a raise' do
+      matcher = described_class.new({ name: 'Bob' })
+
+      expect { matcher.match_json?('{') }.to raise_error(Mongory::Error)
+      expect(matcher.match_json?('{"name":"Bob"}')).to be(true)
+      expect(matcher.memory_stats[:scratches]).to eq(1)
+    end
+  end
+
+  describe 'GC integration' do
+    before { require 'objspace' }
+
+    it 'reports the pool bytes to ObjectSpace.memsize_of' do
+      small = described_class.new({ name: 'Bob' })
+      large = described_class.new({ '$or' => Array.new(500) { |i| { "field#{i}" => "value#{i}" } } })
+
+      expect(ObjectSpace.memsize_of(large)).to be > ObjectSpace.memsize_of(small)
+    end
+
+    it 'matches after the heap is compacted', if: GC.respond_to?(:verify_compaction_references) do
+      matcher = described_class.new({ name: 'Jack', age: { '$gte' => 18 }, tags: { '$in' => %w(a b) } })
+      GC.verify_compaction_references(expand_heap: true, toward: :empty)
+
+      expect(matcher.match?({ 'name' => 'Jack', 'age' => 20, 'tags' => 'a' })).to be(true)
+      expect(matcher.match?({ name: 'Jill', age: 20, tags: 'a' })).to be(false)
+      expect(matcher.condition).to eq('name' => 'Jack', 'age' => { '$gte' => 18 }, 'tags' => { '$in' => %w(a b) })
+    end
+  end
 end
@@ -1,7 +1,79 @@
 # frozen_string_literal: true
 
+require 'stringio'
 require 'spec_helper'
 
+# Stands in for an ActiveRecord relation over rows of `users`, counting the models it instantiates
+class StreamedRelation
+  include Enumerable
+
+  Model = Struct.new(:column_names, :primary_key)
+
+  class << self
+    attr_accessor :instantiated
+  end
+
+  attr_reader :order_values, :limit_value
+
+  def initialize(rows, order_values: [], limit_value: nil)
+    @rows = rows
+    @order_values = order_values
+    @limit_value = limit_value
+  end
+
+  def offset_value; end
+
+  def distinct_value
+    false
+  end
+
+  def group_values
+    []
+  end
+
+  def having_clause
+    []
+  end
+
+  def unscope(*)
+    self.class.new(@rows)
+  end
+
+  def klass
+    Model.new(%w(id name age), 'id')
+  end
+
+  def loaded?
+    false
+  end
+
+  def each(&block)
+    to_a.each(&block)
+  end
+
+  def to_a
+    self.class.instantiated += @rows.size
+    @rows.map(&:dup)
+  end
+
+  def in_batches(of:)
+    @rows.each_slice(of) { |rows| yield self.class.new(rows) }
+  end
+
+  def find_each(batch_size:, &block)
+    in_batches(of: batch_size) { |batch| batch.each(&block) }
+  end
+
+  def pluck(*columns)
+    @rows.map { |row| columns.size == 1 ? row[columns.first] : row.values_at(*columns) }
+  end
+
+  def where(condition)
+    key, values = condition.first
+    self.class.new(@rows.select { |row| values.include?(row[key]) })
+  end
+end
+
 RSpec.describe Mongory::CQueryBuilder do
   describe 'method chaining' do
     subject do
@@ -53,6 +125,20 @@ RSpec.describe Mongory::CQueryBuilder do
       expect(names).to contain_exactly('Alice', 'Carol')
       expect(names).not_to contain_exactly('Bob')
     end
+
+    context 'when records span several batches' do
+      subject { described_class.new(users).with_context(batch_size: 4).where(:age.gt => 28) }
+      let(:users) { Array.new(10) { |i| { name: "u#{i}", age: 29 + i } } }
+
+      it 'stops scanning after the batch the block leaves' do
+        expect(subject.instance_variable_get(:@matcher)).to receive(:filter).once.and_call_original
+        expect(subject.find { |user| user[:age] > 30 }).to eq(users[2])
+      end
+
+      it 'yields the window across batches' do
+        expect(subject.offset(3).limit(3).map { |user| user[:name] }).to eq(%w(u3 u4 u5))
+      end
+    end
   end
 
   describe '#where' do
@@ -307,6 +393,57 @@ RSpec.describe Mongory::CQueryBuilder do
     end
   end
 
+  describe '#offset' do
+    subject { described_class.new(records).where(:age.gte => 25) }
+    let(:records) do
+      [
+        { 'name' => 'Alice', 'age' => 30 },
+        { 'name' => 'Bob', 'age' => 25 },
+        { 'name' => 'Carol', 'age' => 35 },
+        { 'name' => 'Dave', 'age' => 20 }
+      ]
+    end
+
+    it { expect(subject.offset(1).pluck('name')).to eq(['Bob', 'Carol']) }
+    it { expect(subject.offset(1).limit(1).pluck('name')).to eq(['Bob']) }
+    it { expect(subject.limit(2).offset(1).pluck('name')).to eq(['Bob']) }
+    it { expect(subject.offset(5).to_a).to eq([]) }
+    it { expect(subject.offset(1).count).to eq(2) }
+    it { expect { subject.offset(-1) }.to raise_error(ArgumentError) }
+
+    it 'applies the window before chaining more conditions' do
+      expect(subject.limit(2).where(:age.gt => 28).pluck('name')).to eq(['Alice'])
+    end
+
+    it 'works with non-array records' do
+      expect(described_class.new(records.each).where(:age.gte => 25).offset(1).limit(1).pluck('name')).to eq(['Bob'])
+    end
+  end
+
+  describe 'short-circuit queries' do
+    subject { described_class.new(records).where(:age.gte => 25) }
+    let(:records) do
+      [
+        { 'name' => 'Alice', 'age' => 30 },
+        { 'name' => 'Bob', 'age' => 25 },
+        { 'name' => 'Dave', 'age' => 20 }
+      ]
+    end
+
+    it { expect(subject.first).to eq(records[0]) }
+    it { expect(subject.first(5)).to eq(records.first(2)) }
+    it { expect(subject.offset(1).first).to eq(records[1]) }
+    it { expect(subject.limit(0).first).to be_nil }
+    it { expect(subject.count).to eq(2) }
+    it { expect(subject.count(records[0])).to eq(1) }
+    it { expect(subject).to be_any }
+    it { expect(subject).to be_exists }
+    it { expect(subject).not_to be_none }
+    it { expect(subject.where(name: 'Zoe')).to be_none }
+    it { expect(subject.where(name: 'Zoe')).not_to be_any }
+    it { expect(subject.any? { |r| r['name'] == 'Bob' }).to be(true) }
+  end
+
   describe '#pluck' do
     subject { described_class.new(records).pluck(*fields) }
     let(:records) do
@@ -356,5 +493,155 @@ RSpec.describe Mongory::CQueryBuilder do
         ])
       end
     end
+
+    context 'when records are not Hashes' do
+      let(:records) { [Struct.new(:name, :age).new('Alice', 30), Struct.new(:name).new('Bob')] }
+      let(:fields) { [:name] }
+
+      it { is_expected.to eq(['Alice', 'Bob']) }
+    end
+
+    context 'when a key contains a dot' do
+      let(:records) { [{ 'a.b' => 1, 'a' => { 'b' => 2 } }, { 'a.b' => 3 }] }
+      let(:fields) { ['a.b'] }
+
+      it { is_expected.to eq([2, nil]) }
+    end
+
+    context 'when a value has a registered converter' do
+      let(:records) { [{ 'id' => FakeBsonId.new('64a1') }] }
+      let(:fields) { ['id'] }
+
+      it { is_expected.to eq(['64a1']) }
+    end
+  end
+
+  describe '#project' do
+    subject { described_class.new(records) }
+    let(:records) do
+      [
+        { name: 'Alice', age: 30, address: { city: 'Taipei' } },
+        { name: 'Bob', age: 25 },
+        { name: 'Carol', age: 35, address: { city: 'Tokyo' } }
+      ]
+    end
+
+    it 'projects the matching records' do
+      expect(subject.where(:age.gt => 26).project(:name, 'address.city')).to eq([
+        { 'name' => 'Alice', 'address' => { 'city' => 'Taipei' } },
+        { 'name' => 'Carol', 'address' => { 'city' => 'Tokyo' } }
+      ])
+    end
+
+    it { expect(subject.offset(1).pluck('address.city')).to eq([nil, 'Tokyo']) }
+    it { expect(described_class.new(records.lazy).limit(1).project(:age)).to eq([{ 'age' => 30 }]) }
+  end
+
+  describe '#order_by' do
+    subject { described_class.new(records).where(:age.gte => 20) }
+    let(:records) do
+      [
+        { name: 'Alice', age: 30, score: 8 },
+        { name: 'Bob', age: 25, score: 9 },
+        { name: 'Carol', age: 35, score: 8 },
+        { name: 'Dave', age: 19, score: 10 }
+      ]
+    end
+
+    it { expect(subject.order_by(score: :desc, name: :asc).pluck(:name)).to eq(%w(Bob Alice Carol)) }
+    it { expect(subject.order_by(score: :asc).order_by(age: :desc).pluck(:name)).to eq(%w(Carol Alice Bob)) }
+    it { expect(subject.order_by(:age).offset(1).limit(1).to_a).to eq([records[0]]) }
+    it { expect(subject.order_by(age: :desc).first).to eq(records[2]) }
+    it { expect(subject.limit(2).order_by(age: :desc).to_a).to eq([records[2], records[0]]) }
+
+    it 'keeps the top matches of lazy records batch by batch' do
+      query = described_class.new(records.lazy).with_context(batch_size: 1).where(:age.gte => 20)
+
+      expect(query.order_by(age: :desc).limit(2).pluck(:name)).to eq(%w(Carol Alice))
+    end
+  end
+
+  describe 'relation streaming' do
+    subject { described_class.new(relation).with_context(batch_size: 4) }
+
+    let(:relation) { StreamedRelation.new(rows) }
+    let(:rows) { Array.new(10) { |i| { 'id' => i + 1, 'name' => "user#{i}", 'age' => 15 + i, 'nickname' => "u#{i}" } } }
+
+    before { StreamedRelation.instantiated = 0 }
+
+    it 'counts the plucked rows without loading records' do
+      expect(subject.where(:age.gte => 20).count).to eq(5)
+      expect(subject.where(:age.gte => 20).offset(1).limit(3).count).to eq(3)
+      expect(StreamedRelation.instantiated).to eq(0)
+    end
+
+    it 'loads only the matching records' do
+      expect(subject.where(:age.gte => 20).offset(1).limit(3).to_a).to eq(rows[6, 3])
+      expect(StreamedRelation.instantiated).to eq(3)
+    end
+
+    it 'plucks the fields without loading records' do
+      expect(subject.where(:age.lt => 17).pluck(:name, :age)).to eq([['user0', 15], ['user1', 16]])
+      expect(StreamedRelation.instantiated).to eq(0)
+    end
+
+    it 'streams records in batches when a field is not a column' do
+      expect(subject.where(nickname: 'u3').to_a).to eq([rows[3]])
+      expect(StreamedRelation.instantiated).to eq(10)
+    end
+
+    it 'keeps an ordered relation as it is' do
+      ordered = described_class.new(StreamedRelation.new(rows.reverse, order_values: [:age]))
+
+      expect(ordered.where(:age.gte => 23).pluck('id')).to eq([10, 9])
+    end
+
+    it 'keeps a limited relation as it is' do
+      limited = described_class.new(StreamedRelation.new(rows.first(3), limit_value: 3)).with_context(batch_size: 2)
+
+      expect(limited.where(:age.gte => 16).to_a).to eq(rows[1, 2])
+      expect(StreamedRelation.instantiated).to eq(3)
+    end
+  end
+
+  describe 'lazy records' do
+    let(:numbers) { (1..Float::INFINITY).lazy.map { |n| { 'n' => n } } }
+
+    it 'matches an endless Enumerator batch by batch' do
+      query = described_class.new(numbers).with_context(batch_size: 16)
+
+      expect(query.where(:n.gt => 10).offset(2).first(3)).to eq([{ 'n' => 13 }, { 'n' => 14 }, { 'n' => 15 }])
+    end
+
+    it 'stops counting an endless Enumerator once the window is filled' do
+      query = described_class.new(numbers).with_context(batch_size: 16)
+
+      expect(query.where(:n.gt => 10).offset(2).limit(30).count).to eq(30)
+    end
+
+    it 'filters an NDJSON stream in C' do
+      io = StringIO.new(Array.new(100) { |i| JSON.generate('id' => i, 'ok' => i.even?) }.join("\n"))
+      query = Mongory.stream(io).c.with_context(batch_size: 7).where(ok: true, :id.gte => 90)
+
+      expect(query.count).to eq(5)
+      expect(query.to_a.map { |event| event['id'] }).to eq([90, 92, 94, 96, 98])
+    end
+
+    it 'parses only the matching lines of an NDJSON stream' do
+      io = StringIO.new(Array.new(100) { |i| JSON.generate('id' => i, 'ok' => i.even?) }.join("\n"))
+      query = Mongory.stream(io).c.with_context(batch_size: 7).where(ok: true, :id.gte => 90)
+      allow(JSON).to receive(:parse).and_call_original
+
+      expect(query.count).to eq(5)
+      expect(JSON).not_to have_received(:parse)
+      expect(query.offset(1).limit(2).pluck('id')).to eq([92, 94])
+      expect(JSON).to have_received(:parse).exactly(4).times
+    end
+
+    it 'reports the line of invalid JSON in an NDJSON stream' do
+      query = Mongory.stream(StringIO.new("{}\n\nnot json\n")).c.where(ok: true)
+
+      expect { query.to_a }.to raise_error(Mongory::Error, /line 3/)
+    end
   end
 end
@@ -0,0 +1,91 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+class PlannedBatchMatcher < Mongory::Matchers::AbstractMatcher
+  def match_batch?(values)
+    values.map { |value| match?(value) }
+  end
+end
+
+Mongory::Matchers.register(:planned_batch, '$plannedBatch', PlannedBatchMatcher)
+
+RSpec.describe Mongory::Converters::ColumnPlanner do
+  describe '.plan' do
+    subject(:plan) { described_class.plan(Mongory.condition_converter.convert(input)) }
+
+    context 'when the condition compares one field' do
+      let(:input) { { 'age' => { '$gte' => 18 } } }
+
+      it { is_expected.to eq([:gte, ['age'], 18]) }
+    end
+
+    context 'when a field has a literal operand' do
+      let(:input) { { 'profile.vip' => true } }
+
+      it { is_expected.to eq([:eq, %w(profile vip), true]) }
+    end
+
+    context 'when fields and operators are combined' do
+      let(:input) do
+        {
+          'age' => { '$gte' => 18, '$lt' => 65.5 },
+          '$or' => [{ 'score' => { '$ne' => 0 } }, { 'vip' => false }]
+        }
+      end
+
+      it 'nests $and and $or plans' do
+        expect(plan).to eq(
+          [:and, [
+            [:and, [[:gte, ['age'], 18], [:lt, ['age'], 65.5]]],
+            [:or, [[:ne, ['score'], 0], [:eq, ['vip'], false]]]
+          ]]
+        )
+      end
+    end
+
+    context 'when $or ranges were merged into $intervals' do
+      let(:input) { { '$or' => [{ 'ts' => { '$lt' => 10 } }, { 'ts' => { '$gte' => 20, '$lte' => 30 } }] } }
+
+      it 'expands the intervals back into comparisons' do
+        expect(plan).to eq([:or, [[:lt, ['ts'], 10], [:and, [[:gte, ['ts'], 20], [:lte, ['ts'], 30]]]]])
+      end
+    end
+
+    context 'when an operand is not a number or a boolean' do
+      let(:input) { { 'name' => 'Jack' } }
+
+      it { is_expected.to be_nil }
+    end
+
+    context 'when a boolean is compared by order' do
+      let(:input) { { 'vip' => { '$gt' => true } } }
+
+      it { is_expected.to be_nil }
+    end
+
+    context 'when any part has no kernel' do
+      let(:input) { { 'age' => { '$gte' => 18 }, 'tags' => { '$in' => %w(a b) } } }
+
+      it { is_expected.to be_nil }
+    end
+
+    context 'when a field operator answers match_batch?' do
+      let(:input) { { 'loc' => { '$plannedBatch' => [1, 2] }, 'age' => { '$gte' => 18 } } }
+
+      it { is_expected.to eq([:and, [[:batch, ['loc'], '$plannedBatch', [1, 2]], [:gte, ['age'], 18]]]) }
+    end
+
+    context 'when a batch operator applies to the whole record' do
+      let(:input) { { '$plannedBatch' => [1, 2] } }
+
+      it { is_expected.to be_nil }
+    end
+
+    context 'when the condition is empty' do
+      let(:input) { {} }
+
+      it { is_expected.to be_nil }
+    end
+  end
+end
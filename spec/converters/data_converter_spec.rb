@@ -40,6 +40,26 @@ RSpec.describe Mongory::Converters::DataConverter do
     end
   end
 
+  describe '#native_types' do
+    subject { described_class.send(:new) }
+
+    it { expect(subject.native_types).to include(Symbol => :symbol, Date => :date, Time => :time, Rational => :number) }
+
+    it 'leaves out types with a registered converter' do
+      subject.register(Time, :to_i)
+
+      expect(subject.native_types).not_to include(Time)
+      expect(subject.convert(Time.at(5))).to eq(5)
+    end
+
+    it 'leaves out types covered by a registered superclass' do
+      subject.register(Numeric, :to_f)
+
+      expect(subject.native_types).not_to include(Rational)
+      expect(subject.native_types).to include(Time => :time)
+    end
+  end
+
   describe '#register and override behavior' do
     let(:klass) { Struct.new(:val) }
 
@@ -0,0 +1,33 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+RSpec.describe Mongory::Converters::FieldCollector do
+  describe '.fields' do
+    subject { described_class.fields(Mongory.condition_converter.convert(input)) }
+
+    context 'when fields are compared' do
+      let(:input) { { :age.gte => 18, 'profile.city' => 'Taipei', name: /J/ } }
+
+      it { is_expected.to eq(%w(age profile name)) }
+    end
+
+    context 'when fields sit under $and, $or and $not' do
+      let(:input) { { '$or' => [{ name: 'Bob' }, { age: 20 }], '$not' => { vip: true }, '$and' => [{ age: 1 }] } }
+
+      it { is_expected.to eq(%w(name age vip)) }
+    end
+
+    context 'when an operator matches the whole record' do
+      let(:input) { { '$or' => [{ name: 'Bob' }, { '$present' => true }] } }
+
+      it { is_expected.to be_nil }
+    end
+
+    context 'when the condition is empty' do
+      let(:input) { {} }
+
+      it { is_expected.to eq([]) }
+    end
+  end
+end
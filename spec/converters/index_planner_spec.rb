@@ -0,0 +1,38 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+RSpec.describe Mongory::Converters::IndexPlanner do
+  let(:records) do
+    Array.new(10) { |i| { 'age' => i, 'status' => i.zero? ? 'vip' : 'member', 'profile' => { 'vip' => i < 3 } } }
+  end
+  let(:indexes) { %w(age status profile.vip).map { |field| Mongory::Index.new(records, on: field) } }
+
+  describe '.plan' do
+    subject { described_class.plan(Mongory.condition_converter.convert(input), indexes)&.to_s }
+
+    context 'when several conjuncts are indexed' do
+      let(:input) { { :age.gte => 2, status: 'vip' } }
+
+      it { is_expected.to eq('status $eq "vip" (1 of 10 records)') }
+    end
+
+    context 'when conjuncts sit under $and and nested fields' do
+      let(:input) { { '$and' => [{ :age.lt => 8 }, { 'profile.vip' => true }] } }
+
+      it { is_expected.to eq('profile.vip $eq true (3 of 10 records)') }
+    end
+
+    context 'when the indexed fields are under $or or $not' do
+      let(:input) { { '$or' => [{ status: 'vip' }, { name: 'Bob' }], '$not' => { age: 1 } } }
+
+      it { is_expected.to be_nil }
+    end
+
+    context 'when no lookup narrows the records' do
+      let(:input) { { status: { '$in' => %w(vip member) } } }
+
+      it { is_expected.to be_nil }
+    end
+  end
+end
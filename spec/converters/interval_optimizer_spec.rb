@@ -0,0 +1,86 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+RSpec.describe Mongory::Converters::IntervalOptimizer do
+  describe '.optimize' do
+    subject(:result) { Mongory.condition_converter.convert(input) }
+
+    context 'when $or branches are ranges on one field' do
+      let(:input) do
+        {
+          '$or' => [
+            { 'ts' => { '$gte' => 20, '$lt' => 30 } },
+            { 'ts' => { '$gte' => 0, '$lt' => 10 } },
+            { 'ts' => { '$gte' => 10, '$lt' => 15 } },
+            { ts: { '$gt' => 40 } }
+          ]
+        }
+      end
+
+      it 'sorts and coalesces adjacent ranges' do
+        expect(result).to eq(
+          'ts' => { '$intervals' => [[0, true, 15, false], [20, true, 30, false], [40, false, nil, false]] }
+        )
+      end
+    end
+
+    context 'when ranges overlap' do
+      let(:input) { { '$or' => [{ 'ts' => { '$lte' => 5 } }, { 'ts' => { '$in' => 3..8 } }] } }
+
+      it 'merges them into one interval' do
+        expect(result).to eq('ts' => { '$intervals' => [[nil, false, 8, true]] })
+      end
+    end
+
+    context 'when a branch is empty' do
+      let(:input) { { '$or' => [{ 'ts' => { '$gt' => 5, '$lt' => 5 } }, { 'ts' => { '$gte' => 1, '$lte' => 2 } }] } }
+
+      it 'drops it' do
+        expect(result).to eq('ts' => { '$intervals' => [[1, true, 2, true]] })
+      end
+    end
+
+    context 'when other keys are present' do
+      let(:input) { { 'name' => 'job', '$or' => [{ 'ts' => { '$lt' => 1 } }, { 'ts' => { '$gt' => 2 } }] } }
+
+      it 'keeps them' do
+        expect(result).to eq(
+          'name' => 'job',
+          'ts' => { '$intervals' => [[nil, false, 1, false], [2, false, nil, false]] }
+        )
+      end
+    end
+
+    context 'when branches use different fields' do
+      let(:input) { { '$or' => [{ 'ts' => { '$lt' => 1 } }, { 'at' => { '$gt' => 2 } }] } }
+
+      it { is_expected.to eq(input) }
+    end
+
+    context 'when a branch compares non-numeric values' do
+      let(:input) { { '$or' => [{ 'ts' => { '$lt' => 'b' } }, { 'ts' => { '$gt' => 2 } }] } }
+
+      it { is_expected.to eq(input) }
+    end
+
+    context 'when the field already has a condition' do
+      let(:input) do
+        { 'ts' => { '$exists' => true }, '$or' => [{ 'ts' => { '$lt' => 1 } }, { 'ts' => { '$gt' => 2 } }] }
+      end
+
+      it { is_expected.to eq(input) }
+    end
+  end
+
+  describe 'matching' do
+    let(:condition) do
+      { '$or' => [{ 'ts' => { '$gte' => 0, '$lt' => 10 } }, { 'ts' => { '$gt' => 20, '$lte' => 30 } }] }
+    end
+    let(:records) { [-1, 0, 5, 10, 20, 25, 30, 31, nil, 'x'].map { |ts| { 'ts' => ts } } }
+
+    it 'matches like the $or it replaces' do
+      expect(records.select(&Mongory::QueryMatcher.new(condition))).to eq(records.values_at(1, 2, 5, 6))
+    end
+  end
+end
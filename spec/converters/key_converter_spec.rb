@@ -89,5 +89,26 @@ RSpec.describe Mongory::Converters::KeyConverter do
         expect(result).to eq('a.b.c' => value)
       end
     end
+
+    context 'when the same key is converted twice' do
+      let(:key) { 'a.b' }
+
+      it 'returns a fresh nested hash each time' do
+        first = described_class.instance.convert_string_key(key, value)
+        first['a']['b'] = 'changed'
+
+        expect(result).to eq('a' => { 'b' => value })
+      end
+    end
+  end
+
+  describe '#key_path' do
+    it 'splits and normalizes the key once' do
+      path = described_class.instance.key_path('user\.name.age')
+
+      expect(path).to eq(['user.name', 'age'])
+      expect(path).to be_frozen
+      expect(described_class.instance.key_path('user\.name.age')).to equal(path)
+    end
   end
 end
@@ -0,0 +1,126 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+RSpec.describe Mongory::Index, type: :model do
+  let(:records) do
+    [
+      { 'name' => 'Jack', 'age' => 18, 'status' => 'active', 'profile' => { 'city' => 'Taipei' } },
+      { 'name' => 'Jill', 'age' => 15.0, 'status' => :inactive, 'profile' => { 'city' => 'Tokyo' } },
+      { name: 'Bob', age: 21, status: 'active', profile: [{ city: 'Taipei' }] },
+      { 'name' => 'Tom', 'age' => [30, 40], 'status' => 'vip' },
+      { 'name' => 'Ann', 'age' => Rational(31, 2) }
+    ]
+  end
+
+  def names(lookup)
+    lookup.records.map { |record| record['name'] || record[:name] }
+  end
+
+  describe '#lookup' do
+    subject { described_class.new(records, on: 'age') }
+
+    it 'finds equal values, Floats sharing the bucket of equal Integers' do
+      expect(names(subject.lookup('$eq', 15))).to eq(%w(Jill Ann))
+      expect(names(subject.lookup('$in', [18.0, 40]))).to eq(%w(Jack Tom Ann))
+    end
+
+    it 'finds ranges and intervals, keeping the order of the records' do
+      expect(names(subject.lookup('$gte', 21))).to eq(%w(Bob Tom Ann))
+      expect(names(subject.lookup('$lt', 18))).to eq(%w(Jill Ann))
+      expect(names(subject.lookup('$intervals', [[nil, false, 16, false], [35, true, nil, false]])))
+        .to eq(%w(Jill Tom Ann))
+    end
+
+    it 'reports the number of candidates' do
+      expect(subject.lookup('$gt', 18).size).to eq(4)
+    end
+
+    it 'cannot answer operands without an order or a bucket' do
+      expect(subject.lookup('$eq', nil)).to be_nil
+      expect(subject.lookup('$gt', true)).to be_nil
+      expect(subject.lookup('$in', [/J/])).to be_nil
+      expect(subject.lookup('$ne', 18)).to be_nil
+    end
+
+    context 'with a nested field' do
+      subject { described_class.new(records, on: 'profile.city') }
+
+      it 'keeps records with an Array under the path as candidates' do
+        expect(names(subject.lookup('$eq', 'Taipei'))).to eq(%w(Jack Bob))
+      end
+    end
+
+    it 'converts the values of the records' do
+      index = described_class.new(records, on: :status)
+
+      expect(names(index.lookup('$eq', 'inactive'))).to eq(%w(Jill))
+      expect(names(index.lookup('$gt', 'b'))).to eq(%w(Jill Tom))
+    end
+  end
+
+  describe '#rebuild' do
+    it 'indexes mutated records again' do
+      index = described_class.new(records, on: 'status')
+      records.first['status'] = 'vip'
+
+      expect(names(index.lookup('$eq', 'vip'))).to eq(%w(Tom))
+      expect(names(index.rebuild.lookup('$eq', 'vip'))).to eq(%w(Jack Tom))
+    end
+  end
+
+  describe 'query builders with indexes' do
+    let(:conditions) do
+      [
+        { status: 'active', :age.gte => 18 },
+        { '$or' => [{ :age.lt => 16 }, { :age.gt => 35 }] },
+        { '$and' => [{ 'profile.city' => 'Taipei' }, { :status.in => %w(active vip) }] },
+        { :age.gt => 18, :name.regex => /o/ }
+      ]
+    end
+
+    it 'matches like a full scan' do
+      conditions.each do |condition|
+        expected = records.mongory.where(condition).to_a
+
+        expect(records.mongory(indexes: %w(age status profile.city)).where(condition).to_a).to eq(expected)
+      end
+    end
+
+    it 'matches only the candidates of the most selective lookup' do
+      query = records.mongory(indexes: %w(age status)).where(status: 'vip', :age.gte => 18)
+      matched = []
+      allow(query.instance_variable_get(:@matcher)).to receive(:match?).and_wrap_original do |method, record|
+        matched << record
+        method.call(record)
+      end
+
+      expect(query.to_a).to eq([records[3]])
+      expect(matched).to eq([records[3]])
+    end
+
+    it 'reports the lookup in explain' do
+      query = records.mongory(indexes: [described_class.new(records, on: 'status')]).where(status: 'vip')
+
+      expect { query.explain }.to output(/\AIndex: status \$eq "vip" \(1 of 5 records\)\n/).to_stdout
+    end
+
+    it 'scans every record when no lookup narrows them' do
+      query = records.mongory(indexes: %w(age)).where(:age.gt => 0)
+
+      expect { query.explain }.not_to output(/Index:/).to_stdout
+      expect(query.count).to eq(4)
+    end
+
+    if defined?(Mongory::CMatcher)
+      it 'scans the candidates in C' do
+        query = records.mongory(indexes: %w(age status)).c
+
+        conditions.each do |condition|
+          expect(query.where(condition).to_a).to eq(records.mongory.where(condition).to_a)
+        end
+        expect(query.where(status: 'active').offset(1).count).to eq(1)
+      end
+    end
+  end
+end
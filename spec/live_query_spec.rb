@@ -0,0 +1,108 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+# Reads the record from the matching context instead of the matched value
+class OnlineRecordMatcher < Mongory::Matchers::AbstractMatcher
+  def match(_subject)
+    @context.current_record['status'] == 'online'
+  end
+end
+
+RSpec.describe Mongory::LiveQuery, type: :model do
+  subject(:live) { described_class.new({ :status => 'online', :score.gte => 100 }, players, key: 'id') }
+
+  let(:players) { Array.new(6) { |i| { 'id' => i, 'status' => i.even? ? 'online' : 'away', 'score' => i * 50 } } }
+  let(:events) { [] }
+
+  before do
+    described_class::EVENTS.each do |event|
+      live.on(event) { |player| events << [event, player['id']] }
+    end
+  end
+
+  def ids
+    live.map { |player| player['id'] }
+  end
+
+  it 'matches the initial records without events' do
+    expect(ids).to eq([2, 4])
+    expect(events).to be_empty
+  end
+
+  it 'emits added, updated and removed as records change' do
+    expect(live.update(players[3].merge('status' => 'online'))).to be(true)
+    expect(live.update(players[2].merge('score' => 150))).to be(true)
+    expect(live.update(players[4].merge('status' => 'away'))).to be(false)
+    expect(live.update(players[1])).to be(false)
+
+    expect(events).to eq([[:added, 3], [:updated, 2], [:removed, 4]])
+    expect(ids).to eq([2, 3])
+  end
+
+  it 'inserts and deletes records' do
+    expect(live.insert({ 'id' => 9, 'status' => 'online', 'score' => 500 })).to be(true)
+    expect(live.delete({ 'id' => 2 })).to be(true)
+    expect(live.delete({ 'id' => 1 })).to be(false)
+
+    expect(events).to eq([[:added, 9], [:removed, 2]])
+    expect(live.size).to eq(2)
+    expect(live).to include({ 'id' => 9 })
+  end
+
+  it 'matches many changes at once' do
+    changes = [{ 'id' => 1, 'status' => 'online', 'score' => 100 }, { 'id' => 2, 'status' => 'away' }]
+
+    expect(live.update_all(changes)).to eq(1)
+    expect(events).to eq([[:added, 1], [:removed, 2]])
+    expect(ids).to eq([4, 1])
+  end
+
+  it 'compares records by identity without a key' do
+    record = { 'status' => 'online', 'score' => 100 }
+    query = described_class.new({ status: 'online' })
+    query.insert(record)
+    record['status'] = 'away'
+
+    expect(query.insert(record.dup)).to be(false)
+    expect(query.size).to eq(1)
+    expect(query.update(record)).to be(false)
+    expect(query.size).to eq(0)
+  end
+
+  it 'keeps one compiled matcher' do
+    matcher = live.matcher
+    live.update(players[1].merge('status' => 'online', 'score' => 100))
+
+    expect(live.matcher).to be(matcher)
+    expect(matcher).to be_a(defined?(Mongory::CMatcher) ? Mongory::CMatcher : Mongory::QueryMatcher)
+  end
+
+  it 'rejects unknown events' do
+    expect { live.on(:changed) { nil } }.to raise_error(ArgumentError, /unknown event/)
+  end
+
+  context 'with the CMatcher cache', if: defined?(Mongory::CMatcher) do
+    let(:condition) { { 'id' => { '$onlineRecord' => true } } }
+
+    before(:all) { Mongory::Matchers.register(:online_record, '$onlineRecord', OnlineRecordMatcher) }
+
+    after(:all) { unregister_matcher(:online_record, '$onlineRecord') }
+
+    around do |example|
+      Mongory::CMatcher.cache = Mongory::CMatcherCache.new
+      example.run
+    ensure
+      Mongory::CMatcher.cache = nil
+    end
+
+    it 'sets the current record on the context of the shared matcher' do
+      other = described_class.new(condition, players, key: 'id')
+      query = described_class.new(condition, key: 'id')
+
+      expect(query.matcher).to be(other.matcher)
+      expect(query.insert(players[3].merge('status' => 'online'))).to be(true)
+      expect(query.insert(players[0].merge('status' => 'away'))).to be(false)
+    end
+  end
+end
@@ -24,11 +24,30 @@ class UnwrappedMatcher < MockMultiMatcher
   enable_unwrap!
 end
 
+class CountingMatcher < Mongory::Matchers::AbstractMatcher
+  class << self
+    attr_accessor :calls
+  end
+
+  def match(_record)
+    self.class.calls += 1
+    true
+  end
+
+  def priority
+    1
+  end
+end
+
 RSpec.describe Mongory::Matchers::AbstractMultiMatcher do
+  before(:all) { Mongory::Matchers.register(:counting, '$counting', CountingMatcher) }
+
   after(:all) do
+    unregister_matcher(:counting, '$counting')
     Object.send(:remove_const, :MockMultiMatcher)
     Object.send(:remove_const, :SimpleMatcher)
     Object.send(:remove_const, :UnwrappedMatcher)
+    Object.send(:remove_const, :CountingMatcher)
   end
 
   describe '#match' do
@@ -53,4 +72,38 @@ RSpec.describe Mongory::Matchers::AbstractMultiMatcher do
       expect(result).to be_a(SimpleMatcher)
     end
   end
+
+  describe 'adaptive ordering' do
+    subject { Mongory::Matchers::HashConditionMatcher.new(condition, context: context) }
+
+    let(:condition) { { 'tag' => { '$counting' => true }, 'vip' => true } }
+    let(:context) { Mongory::Utils::Context.new(adaptive: 10) }
+    let(:records) { Array.new(100) { |i| { 'tag' => 'x', 'vip' => (i % 10).zero? } } }
+
+    before { CountingMatcher.calls = 0 }
+
+    it 'keeps the static order without the adaptive config' do
+      matcher = Mongory::Matchers::HashConditionMatcher.new(condition)
+      records.each { |record| matcher.match?(record) }
+
+      expect(CountingMatcher.calls).to eq(100)
+      expect(matcher.matchers.first.condition).to eq('$counting' => true)
+    end
+
+    it 'runs the selective matcher first after sampling' do
+      expect(records.select { |record| subject.match?(record) }).to eq(records.select { |record| record['vip'] })
+      expect(subject.matchers.first.condition).to be(true)
+      expect(CountingMatcher.calls).to eq(10 + 9)
+    end
+
+    context 'with $or' do
+      subject { Mongory::Matchers::OrMatcher.new([{ 'vip' => 'never' }, { 'tag' => 'x' }], context: context) }
+
+      it 'moves the matcher that never passes last after sampling' do
+        expect(subject.matchers.first.condition).to eq('never')
+        expect(records.count { |record| subject.match?(record) }).to eq(100)
+        expect(subject.matchers.first.condition).to eq('x')
+      end
+    end
+  end
 end
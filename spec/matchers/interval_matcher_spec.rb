@@ -0,0 +1,52 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+RSpec.describe Mongory::Matchers::IntervalMatcher do
+  describe '#match?' do
+    subject { described_class.new(condition) }
+
+    context 'when condition has bounded intervals' do
+      let(:condition) { [[0, true, 10, false], [20, false, 30, true]] }
+
+      it { is_expected.to be_match(0) }
+      it { is_expected.to be_match(9.5) }
+      it { is_expected.not_to be_match(10) }
+      it { is_expected.not_to be_match(20) }
+      it { is_expected.to be_match(30) }
+      it { is_expected.not_to be_match(31) }
+      it { is_expected.not_to be_match(-1) }
+    end
+
+    context 'when condition has unbounded sides' do
+      let(:condition) { [[nil, false, -5, true], [5, true, nil, false]] }
+
+      it { is_expected.to be_match(-Float::INFINITY) }
+      it { is_expected.to be_match(-5) }
+      it { is_expected.not_to be_match(0) }
+      it { is_expected.to be_match(5) }
+      it { is_expected.to be_match(10**30) }
+    end
+
+    context 'when record is not a number' do
+      let(:condition) { [[nil, false, nil, false]] }
+
+      it { is_expected.not_to be_match(nil) }
+      it { is_expected.not_to be_match('5') }
+      it { is_expected.not_to be_match([5]) }
+      it { is_expected.not_to be_match(Float::NAN) }
+    end
+
+    context 'when condition is empty' do
+      let(:condition) { [] }
+
+      it { is_expected.not_to be_match(1) }
+    end
+  end
+
+  describe '#check_validity!' do
+    it 'raises when the condition is not a list of intervals' do
+      expect { described_class.new([1, 2]).check_validity! }.to raise_error(TypeError)
+    end
+  end
+end
@@ -1,5 +1,7 @@
 # frozen_string_literal: true
 
+require 'stringio'
+require 'tempfile'
 require 'spec_helper'
 
 RSpec.describe Mongory do
@@ -7,6 +9,36 @@ RSpec.describe Mongory do
     expect(Mongory::VERSION).not_to be nil
   end
 
+  describe '.stream' do
+    let(:lines) { ['{"id":1,"level":"info"}', '', '{"id":2,"level":"error"}', '{"id":3,"level":"error"}'] }
+
+    it 'queries the parsed lines of an NDJSON IO' do
+      query = described_class.stream(StringIO.new(lines.join("\n")))
+
+      expect(query.where(level: 'error').map { |event| event['id'] }).to eq([2, 3])
+      expect(query.where(:id.lt => 3).count).to eq(2)
+    end
+
+    it 'opens a path on every enumeration' do
+      Tempfile.create(%w(events .ndjson)) do |file|
+        file.write(lines.join("\n"))
+        file.close
+
+        expect(described_class.stream(file.path).where(id: 3).to_a).to eq([{ 'id' => 3, 'level' => 'error' }])
+      end
+    end
+
+    it 'reports the line of invalid JSON' do
+      query = described_class.stream(StringIO.new("{}\nnot json\n"))
+
+      expect { query.to_a }.to raise_error(Mongory::Error, /line 2/)
+    end
+
+    it 'rejects unknown formats' do
+      expect { described_class.stream(StringIO.new, format: :csv) }.to raise_error(ArgumentError)
+    end
+  end
+
   # it 'does something useful' do
   #   expect(false).to eq(true)
   # end
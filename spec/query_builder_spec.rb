@@ -307,6 +307,34 @@ RSpec.describe Mongory::QueryBuilder do
     end
   end
 
+  describe '#offset' do
+    subject { described_class.new(records).where(:age.gte => 25).offset(offset_size) }
+    let(:records) do
+      [
+        { 'name' => 'Alice', 'age' => 30 },
+        { 'name' => 'Bob', 'age' => 25 },
+        { 'name' => 'Carol', 'age' => 35 },
+        { 'name' => 'Dave', 'age' => 20 }
+      ]
+    end
+
+    context 'when offset is 1' do
+      let(:offset_size) { 1 }
+
+      it 'skips the first matching record' do
+        expect(subject.pluck('name')).to eq(['Bob', 'Carol'])
+      end
+    end
+
+    context 'when offset is greater than matching records' do
+      let(:offset_size) { 5 }
+
+      it 'returns an empty result' do
+        expect(subject.count).to eq 0
+      end
+    end
+  end
+
   describe '#pluck' do
     subject { described_class.new(records).pluck(*fields) }
     let(:records) do
@@ -24,4 +24,28 @@ RSpec.describe Mongory::QueryMatcher, type: :model do
 
     it_behaves_like 'matcher behavior'
   end
+
+  describe '#profile' do
+    subject { described_class.new({ '$or' => [{ name: /smith/i }, { age: { '$gt' => 20 } }] }) }
+
+    let(:records) { Array.new(10) { |i| { 'name' => i.even? ? 'Smith' : 'Bob', 'age' => i * 5 } } }
+
+    it 'counts every matcher of the tree' do
+      profile = subject.profile { records.each { |record| subject.match?(record) } }
+
+      expect(profile).to include(matcher: 'Query', evals: 10, matches: 8)
+      or_node = profile[:children].first
+      expect(or_node).to include(matcher: 'Or', evals: 10, matches: 8)
+      expect(or_node[:children].map { |node| node.values_at(:field, :evals, :matches) }).to eq(
+        [['age', 10, 5], ['name', 5, 3]]
+      )
+    end
+
+    it 'resets the counters and restores to_proc' do
+      subject.profile { records.each { |record| subject.match?(record) } }
+
+      expect(subject.profile { subject.match?(records.first) }).to include(evals: 1, matches: 1)
+      expect(subject.to_proc).to equal(subject.cached_proc)
+    end
+  end
 end
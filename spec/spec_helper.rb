@@ -6,6 +6,15 @@ require_relative 'matchers/shared_spec'
 DummyModel = Struct.new(:as_json)
 FakeBsonId = Struct.new(:to_s)
 
+# Undoes Mongory::Matchers.register for matchers that only a spec registers
+module MatcherRegistration
+  def unregister_matcher(method_sym, operator)
+    Mongory::Matchers.instance_variable_get(:@operator_mapping).delete(operator)
+    Mongory::Matchers.instance_variable_get(:@registries).delete_if { |registry| registry.operator == operator }
+    Symbol.send(:remove_method, method_sym) if Symbol.method_defined?(method_sym)
+  end
+end
+
 RSpec.configure do |config|
   # Enable flags like --only-failures and --next-failure
   config.example_status_persistence_file_path = '.rspec_status'
@@ -17,6 +26,8 @@ RSpec.configure do |config|
     c.syntax = :expect
   end
 
+  config.include MatcherRegistration
+
   Mongory.enable_symbol_snippets!
   Mongory.register(Array)
 